@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2017 Daniel Koch, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file baud_rate.h
+ *
+ * Baud rate upgrade handshake, shared by the firmware and mavrosflight.
+ *
+ * Both ends start at the configured baud rate. Once the companion computer has heard a heartbeat, it proposes the
+ * highest rate it supports in a NAMED_VALUE_INT named MAVLINK_BAUD_RATE_NAME. The firmware answers with the same
+ * message, carrying the highest rate from the table below that both ends support, and switches right after sending
+ * it; an answer that isn't above the configured rate declines. From then on each end has to hear the other's
+ * heartbeats within MAVLINK_BAUD_RATE_TIMEOUT_MS, and falls back to the configured rate when it doesn't. A rate that
+ * one end or the adapter between them can't actually do therefore costs a few seconds, after which the companion
+ * computer proposes the next lower one.
+ */
+
+#ifndef ROSFLIGHT_MAVLINK_BAUD_RATE_H
+#define ROSFLIGHT_MAVLINK_BAUD_RATE_H
+
+#include <stdint.h>
+
+#define MAVLINK_BAUD_RATE_NAME "BAUD_RATE"
+#define MAVLINK_BAUD_RATE_TIMEOUT_MS 3000
+
+/**
+ * \brief Pick the rate to switch to from the table of rates both ends may propose
+ * \param limit Highest acceptable rate
+ * \param configured Rate the link was started at
+ * \return The highest rate in the table that is at most limit and above configured, or configured if there is none
+ */
+static inline uint32_t mavlink_baud_rate_select(uint32_t limit, uint32_t configured)
+{
+  static const uint32_t rates[] = { 3000000, 2000000, 1500000, 1000000 };
+  for (unsigned i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+  {
+    if (rates[i] <= limit && rates[i] > configured)
+      return rates[i];
+  }
+  return configured;
+}
+
+#endif // ROSFLIGHT_MAVLINK_BAUD_RATE_H
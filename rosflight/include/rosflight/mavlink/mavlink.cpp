@@ -29,6 +29,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <cstdint>
+#include <cstring>
 
 #include "board.h"
 
@@ -39,11 +40,15 @@ namespace rosflight_firmware
 
 Mavlink::Mavlink(Board& board) :
   board_(board)
-{}
+{
+  mavlink2_parser_init(&parser_);
+}
 
 void Mavlink::init(uint32_t baud_rate)
 {
   board_.serial_init(baud_rate);
+  configured_baud_rate_ = baud_rate;
+  baud_rate_ = baud_rate;
   initialized_ = true;
 }
 
@@ -51,9 +56,27 @@ void Mavlink::receive(void)
 {
   while (board_.serial_bytes_available())
   {
-    if (mavlink_parse_char(MAVLINK_COMM_0, board_.serial_read(), &in_buf_, &status_))
+    if (mavlink2_parse_char(&parser_, board_.serial_read(), &in_buf_))
+    {
+      if (parser_.version == 2)
+      {
+        tx_mavlink2_ = true;
+        last_mavlink2_rx_ms_ = board_.clock_millis();
+      }
+      if (in_buf_.msgid == MAVLINK_MSG_ID_HEARTBEAT)
+        last_heartbeat_rx_ms_ = board_.clock_millis();
       handle_mavlink_message();
+    }
   }
+
+  // the companion computer sends v2 heartbeats once it has switched, so silence means it went back to v1
+  if (tx_mavlink2_ && board_.clock_millis() - last_mavlink2_rx_ms_ > MAVLINK2_TIMEOUT_MS)
+    tx_mavlink2_ = false;
+
+  // after an upgrade, silence means the companion computer couldn't follow, or went back to the configured rate
+  if (baud_rate_ != configured_baud_rate_
+      && board_.clock_millis() - last_heartbeat_rx_ms_ > MAVLINK_BAUD_RATE_TIMEOUT_MS)
+    set_baud_rate(configured_baud_rate_);
 }
 
 void Mavlink::send_total_torque(uint8_t system_id,
@@ -319,12 +342,22 @@ void Mavlink::send_message(const mavlink_message_t &msg)
 {
   if (initialized_)
   {
-    uint8_t data[MAVLINK_MAX_PACKET_LEN];
-    uint16_t len = mavlink_msg_to_send_buffer(data, &msg);
+    uint8_t data[MAVLINK2_MAX_PACKET_LEN];
+    uint16_t len = mavlink2_encode(data, &msg, tx_mavlink2_);
     board_.serial_write(data, len);
   }
 }
 
+void Mavlink::set_baud_rate(uint32_t baud_rate)
+{
+  // let what was written at the old rate go out first
+  board_.serial_flush();
+  board_.serial_init(baud_rate);
+  baud_rate_ = baud_rate;
+  mavlink2_parser_init(&parser_);
+  last_heartbeat_rx_ms_ = board_.clock_millis();
+}
+
 void Mavlink::handle_msg_param_request_list(const mavlink_message_t *const msg)
 {
   mavlink_param_request_list_t list;
@@ -362,6 +395,28 @@ void Mavlink::handle_msg_param_set(const mavlink_message_t *const msg)
   }
 }
 
+void Mavlink::handle_msg_named_value_int(const mavlink_message_t *const msg)
+{
+  mavlink_named_value_int_t named_value;
+  mavlink_msg_named_value_int_decode(msg, &named_value);
+
+  // the only named value the companion computer sends is a baud rate proposal
+  if (strncmp(named_value.name, MAVLINK_BAUD_RATE_NAME, sizeof(named_value.name)) != 0 || named_value.value <= 0)
+    return;
+
+  uint32_t proposed = named_value.value;
+  uint32_t limit = proposed < MAVLINK_MAX_BAUD_RATE ? proposed : MAVLINK_MAX_BAUD_RATE;
+  uint32_t baud_rate = mavlink_baud_rate_select(limit, configured_baud_rate_);
+
+  mavlink_message_t out_msg;
+  mavlink_msg_named_value_int_pack(msg->sysid, compid_, &out_msg, board_.clock_millis(), MAVLINK_BAUD_RATE_NAME,
+                                   baud_rate);
+  send_message(out_msg);
+
+  if (baud_rate != baud_rate_)
+    set_baud_rate(baud_rate);
+}
+
 void Mavlink::handle_msg_rosflight_cmd(const mavlink_message_t *const msg)
 {
   mavlink_rosflight_cmd_t cmd;
@@ -486,6 +541,9 @@ void Mavlink::handle_mavlink_message(void)
   case MAVLINK_MSG_ID_PARAM_SET:
     handle_msg_param_set(&in_buf_);
     break;
+  case MAVLINK_MSG_ID_NAMED_VALUE_INT:
+    handle_msg_named_value_int(&in_buf_);
+    break;
   case MAVLINK_MSG_ID_ROSFLIGHT_CMD:
     handle_msg_rosflight_cmd(&in_buf_);
     break;
@@ -39,8 +39,16 @@
 #include "v1.0/rosflight/mavlink.h"
 # pragma GCC diagnostic pop
 
+#include "mavlink2.h"
+#include "baud_rate.h"
+
 #include "comm_link.h"
 
+// highest baud rate the board's serial port can run at, for the upgrade handshake in baud_rate.h
+#ifndef MAVLINK_MAX_BAUD_RATE
+#define MAVLINK_MAX_BAUD_RATE 3000000
+#endif
+
 namespace rosflight_firmware
 {
 
@@ -99,10 +107,12 @@ public:
 
 private:
   void send_message(const mavlink_message_t &msg);
+  void set_baud_rate(uint32_t baud_rate);
 
   void handle_msg_param_request_list(const mavlink_message_t *const msg);
   void handle_msg_param_request_read(const mavlink_message_t *const msg);
   void handle_msg_param_set(const mavlink_message_t *const msg);
+  void handle_msg_named_value_int(const mavlink_message_t *const msg);
   void handle_msg_offboard_control(const mavlink_message_t *const msg);
   void handle_msg_rosflight_cmd(const mavlink_message_t *const msg);
   void handle_msg_timesync(const mavlink_message_t *const msg);
@@ -113,8 +123,18 @@ private:
 
   uint32_t compid_ = 250;
   mavlink_message_t in_buf_;
-  mavlink_status_t status_;
+  mavlink2_parser_t parser_;
   bool initialized_ = false;
+
+  // MAVLink 2 framing is used once the companion computer has sent a v2 frame, and dropped if it stops doing so
+  static constexpr uint32_t MAVLINK2_TIMEOUT_MS = 3000;
+  bool tx_mavlink2_ = false;
+  uint32_t last_mavlink2_rx_ms_ = 0;
+
+  // the serial port runs above the configured baud rate only while the companion computer's heartbeats keep arriving
+  uint32_t configured_baud_rate_ = 0;
+  uint32_t baud_rate_ = 0;
+  uint32_t last_heartbeat_rx_ms_ = 0;
 };
 
 } // namespace rosflight_firmware
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink2.h
+ *
+ * MAVLink 2 framing for the messages of the v1.0 dialect headers, shared by the firmware and mavrosflight.
+ *
+ * Only the framing is version 2: message IDs stay below 256 and payloads keep their v1.0 layout, so a v2 frame
+ * carries exactly the bytes of the v1 frame minus the trailing zeros of the payload, behind a header that is four
+ * bytes longer. Receivers accept either framing on every frame. Signed frames and any other incompatibility flags are
+ * rejected.
+ */
+
+#ifndef ROSFLIGHT_MAVLINK2_H
+#define ROSFLIGHT_MAVLINK2_H
+
+#include "v1.0/rosflight/mavlink.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MAVLINK2_STX 253
+#define MAVLINK2_CORE_HEADER_LEN 9 //!< header bytes after the start byte
+#define MAVLINK2_NUM_HEADER_BYTES (MAVLINK2_CORE_HEADER_LEN + 1)
+#define MAVLINK2_NUM_NON_PAYLOAD_BYTES (MAVLINK2_NUM_HEADER_BYTES + MAVLINK_NUM_CHECKSUM_BYTES)
+#define MAVLINK2_SIGNATURE_BLOCK_LEN 13
+#define MAVLINK2_MAX_PACKET_LEN (MAVLINK_MAX_PAYLOAD_LEN + MAVLINK2_NUM_NON_PAYLOAD_BYTES + MAVLINK2_SIGNATURE_BLOCK_LEN)
+
+//! extra bytes of a v2 header over a v1 header; truncation has to save more than this for v2 framing to pay off
+#define MAVLINK2_HEADER_OVERHEAD (MAVLINK2_NUM_HEADER_BYTES - MAVLINK_NUM_HEADER_BYTES)
+
+/**
+ * \brief Get the CRC seed byte of a message ID
+ */
+static inline uint8_t mavlink2_crc_extra(uint8_t msgid)
+{
+  static const uint8_t crc_extra[256] = MAVLINK_MESSAGE_CRCS;
+  return crc_extra[msgid];
+}
+
+/**
+ * \brief Get the full (untruncated) payload length of a message ID, or 0 if the dialect doesn't define it
+ */
+static inline uint8_t mavlink2_payload_len(uint8_t msgid)
+{
+  static const uint8_t lengths[256] = MAVLINK_MESSAGE_LENGTHS;
+  return lengths[msgid];
+}
+
+/**
+ * \brief Get the number of header bytes, including the start byte, needed before mavlink2_frame_len() can be called
+ * \param stx Start byte of the frame; MAVLINK_STX or MAVLINK2_STX
+ */
+static inline uint16_t mavlink2_header_len(uint8_t stx)
+{
+  return stx == MAVLINK2_STX ? MAVLINK2_NUM_HEADER_BYTES : MAVLINK_NUM_HEADER_BYTES;
+}
+
+/**
+ * \brief Get the total length of a frame from its header
+ * \return Length in bytes, or 0 if the frame can't be handled (unknown start byte, incompatibility flags set, or a
+ * message ID that doesn't fit the v1.0 dialect)
+ */
+static inline uint16_t mavlink2_frame_len(const uint8_t *frame)
+{
+  if (frame[0] == MAVLINK_STX)
+    return frame[1] + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+
+  if (frame[0] != MAVLINK2_STX || frame[2] != 0 || frame[8] != 0 || frame[9] != 0)
+    return 0;
+
+  return frame[1] + MAVLINK2_NUM_NON_PAYLOAD_BYTES;
+}
+
+static inline uint8_t mavlink2_frame_version(const uint8_t *frame) { return frame[0] == MAVLINK2_STX ? 2 : 1; }
+static inline uint8_t mavlink2_frame_seq(const uint8_t *frame) { return frame[0] == MAVLINK2_STX ? frame[4] : frame[2]; }
+static inline uint8_t mavlink2_frame_sysid(const uint8_t *frame) { return frame[0] == MAVLINK2_STX ? frame[5] : frame[3]; }
+static inline uint8_t mavlink2_frame_compid(const uint8_t *frame) { return frame[0] == MAVLINK2_STX ? frame[6] : frame[4]; }
+static inline uint8_t mavlink2_frame_msgid(const uint8_t *frame) { return frame[0] == MAVLINK2_STX ? frame[7] : frame[5]; }
+
+/**
+ * \brief Get the length the frame would have had with v1 framing and an untruncated payload
+ */
+static inline uint16_t mavlink2_frame_v1_len(const uint8_t *frame)
+{
+  uint8_t full_len = mavlink2_payload_len(mavlink2_frame_msgid(frame));
+  return (frame[1] > full_len ? frame[1] : full_len) + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+}
+
+/**
+ * \brief Check the CRC of a complete frame whose length has been validated with mavlink2_frame_len()
+ */
+static inline bool mavlink2_frame_check(const uint8_t *frame)
+{
+  uint16_t header_len = mavlink2_header_len(frame[0]);
+  uint16_t crc;
+  crc_init(&crc);
+  crc_accumulate_buffer(&crc, (const char*) frame + 1, header_len - 1 + frame[1]);
+  crc_accumulate(mavlink2_crc_extra(mavlink2_frame_msgid(frame)), &crc);
+
+  const uint8_t *ck = frame + header_len + frame[1];
+  return ck[0] == (crc & 0xFF) && ck[1] == (crc >> 8);
+}
+
+/**
+ * \brief Copy a checked frame of either version into a message
+ *
+ * A truncated payload is padded with zeros to the full length, so the result decodes like the v1 frame would have.
+ */
+static inline void mavlink2_frame_decode(const uint8_t *frame, mavlink_message_t *msg)
+{
+  uint16_t header_len = mavlink2_header_len(frame[0]);
+  uint8_t payload_len = frame[1];
+  uint8_t full_len = mavlink2_payload_len(mavlink2_frame_msgid(frame));
+
+  msg->magic = MAVLINK_STX;
+  msg->len = payload_len > full_len ? payload_len : full_len;
+  msg->seq = mavlink2_frame_seq(frame);
+  msg->sysid = mavlink2_frame_sysid(frame);
+  msg->compid = mavlink2_frame_compid(frame);
+  msg->msgid = mavlink2_frame_msgid(frame);
+  msg->checksum = frame[header_len + payload_len] | (frame[header_len + payload_len + 1] << 8);
+  memcpy(_MAV_PAYLOAD_NON_CONST(msg), frame + header_len, payload_len);
+  memset(_MAV_PAYLOAD_NON_CONST(msg) + payload_len, 0, msg->len - payload_len);
+}
+
+/**
+ * \brief Get the payload length of a message with its trailing zeros removed
+ *
+ * The first payload byte is always kept, as the protocol requires.
+ */
+static inline uint8_t mavlink2_truncated_len(const mavlink_message_t *msg)
+{
+  const char *payload = _MAV_PAYLOAD(msg);
+  uint8_t len = msg->len;
+  while (len > 1 && payload[len - 1] == 0)
+    len--;
+  return len;
+}
+
+/**
+ * \brief Encode a finalized message as a v2 frame with a truncated payload
+ * \param buf Buffer of at least MAVLINK2_MAX_PACKET_LEN bytes
+ * \param msg Message packed with the v1.0 helpers
+ * \return Length of the frame
+ */
+static inline uint16_t mavlink2_msg_to_send_buffer(uint8_t *buf, const mavlink_message_t *msg)
+{
+  uint8_t len = mavlink2_truncated_len(msg);
+
+  buf[0] = MAVLINK2_STX;
+  buf[1] = len;
+  buf[2] = 0; // incompatibility flags
+  buf[3] = 0; // compatibility flags
+  buf[4] = msg->seq;
+  buf[5] = msg->sysid;
+  buf[6] = msg->compid;
+  buf[7] = msg->msgid;
+  buf[8] = 0;
+  buf[9] = 0;
+  memcpy(buf + MAVLINK2_NUM_HEADER_BYTES, _MAV_PAYLOAD(msg), len);
+
+  uint16_t crc;
+  crc_init(&crc);
+  crc_accumulate_buffer(&crc, (const char*) buf + 1, MAVLINK2_CORE_HEADER_LEN + len);
+  crc_accumulate(mavlink2_crc_extra(msg->msgid), &crc);
+  buf[MAVLINK2_NUM_HEADER_BYTES + len] = crc & 0xFF;
+  buf[MAVLINK2_NUM_HEADER_BYTES + len + 1] = crc >> 8;
+
+  return len + MAVLINK2_NUM_NON_PAYLOAD_BYTES;
+}
+
+/**
+ * \brief Encode a finalized message with whichever framing is shorter
+ *
+ * HEARTBEAT always goes out with the newest framing allowed, since the peer takes its framing as the announcement
+ * of what this side understands; everything else only uses v2 framing if truncation saves more than the longer
+ * header costs.
+ *
+ * \param buf Buffer of at least MAVLINK2_MAX_PACKET_LEN bytes
+ * \param msg Message packed with the v1.0 helpers
+ * \param allow_v2 Whether the peer is known to accept v2 frames
+ * \return Length of the frame
+ */
+static inline uint16_t mavlink2_encode(uint8_t *buf, const mavlink_message_t *msg, bool allow_v2)
+{
+  if (allow_v2 && (msg->msgid == MAVLINK_MSG_ID_HEARTBEAT
+                   || msg->len - mavlink2_truncated_len(msg) > MAVLINK2_HEADER_OVERHEAD))
+    return mavlink2_msg_to_send_buffer(buf, msg);
+
+  return mavlink_msg_to_send_buffer(buf, msg);
+}
+
+/**
+ * \brief State of a byte-at-a-time parser for frames of either version
+ */
+typedef struct __mavlink2_parser
+{
+  uint8_t buf[MAVLINK2_MAX_PACKET_LEN]; //!< bytes of the frame being received
+  uint16_t idx; //!< number of bytes in buf
+  uint16_t frame_len; //!< total length of the frame being received, or 0 until the header is complete
+  uint8_t version; //!< framing of the frame most recently returned by mavlink2_parse_char()
+  uint16_t parse_errors; //!< frames rejected for their header or CRC
+} mavlink2_parser_t;
+
+static inline void mavlink2_parser_init(mavlink2_parser_t *parser)
+{
+  parser->idx = 0;
+  parser->frame_len = 0;
+  parser->version = 1;
+  parser->parse_errors = 0;
+}
+
+/**
+ * \brief Feed one received byte to the parser
+ * \param parser Parser state, set up with mavlink2_parser_init()
+ * \param c The byte
+ * \param msg Message to decode a completed frame into
+ * \return 1 if a frame was completed and decoded into msg, 0 otherwise
+ */
+static inline uint8_t mavlink2_parse_char(mavlink2_parser_t *parser, uint8_t c, mavlink_message_t *msg)
+{
+  if (parser->idx == 0)
+  {
+    if (c != MAVLINK_STX && c != MAVLINK2_STX)
+      return 0;
+    parser->frame_len = 0;
+  }
+
+  parser->buf[parser->idx++] = c;
+
+  if (parser->frame_len == 0)
+  {
+    if (parser->idx < mavlink2_header_len(parser->buf[0]))
+      return 0;
+
+    parser->frame_len = mavlink2_frame_len(parser->buf);
+    if (parser->frame_len == 0)
+    {
+      parser->parse_errors++;
+      parser->idx = 0;
+      return 0;
+    }
+  }
+
+  if (parser->idx < parser->frame_len)
+    return 0;
+
+  parser->idx = 0;
+  if (!mavlink2_frame_check(parser->buf))
+  {
+    parser->parse_errors++;
+    return 0;
+  }
+
+  mavlink2_frame_decode(parser->buf, msg);
+  parser->version = mavlink2_frame_version(parser->buf);
+  return 1;
+}
+
+#endif // ROSFLIGHT_MAVLINK2_H
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file frame_scanner.h
+ */
+
+#ifndef MAVROSFLIGHT_FRAME_SCANNER_H
+#define MAVROSFLIGHT_FRAME_SCANNER_H
+
+#include <rosflight/mavrosflight/mavlink_bridge.h>
+
+#include <boost/asio/buffer.hpp>
+
+#include <vector>
+
+#include <stdint.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Extracts complete mavlink frames from a received byte stream
+ *
+ * Bytes are read directly into the scanner's receive buffer (see prepare() and commit()). Frames are located by
+ * searching for the start byte, checked for length and CRC where they lie in the buffer, and only frames that pass
+ * are copied into a mavlink_message_t, and only if the caller asks for them. Bytes belonging to an incomplete frame at the end of a read are kept and
+ * moved to the front of the buffer before the next read.
+ *
+ * Both v1 and v2 framing are accepted, frame by frame; see mavlink2.h.
+ */
+class FrameScanner
+{
+public:
+
+  /**
+   * \brief Allocates the receive buffer
+   * \param read_size Maximum number of bytes handed out for a single read
+   */
+  explicit FrameScanner(size_t read_size);
+
+  /**
+   * \brief Change the maximum number of bytes handed out for a single read, discarding any buffered bytes
+   */
+  void resize(size_t read_size);
+
+  /**
+   * \brief Get the free space that the next read should fill
+   */
+  boost::asio::mutable_buffers_1 prepare();
+
+  /**
+   * \brief Make bytes written into the buffer returned by prepare() available for scanning
+   * \param bytes_transferred Number of bytes received
+   */
+  void commit(size_t bytes_transferred);
+
+  /**
+   * \brief Locate the next valid frame in the buffered bytes
+   *
+   * The frame is only checked, not copied; use decode() to copy it into a message.
+   *
+   * \return True if a frame was found, false if more bytes are needed
+   */
+  bool next_frame();
+
+  /**
+   * \brief Copy the frame most recently found by next_frame() into a message
+   * \param msg Message to decode the frame into
+   */
+  void decode(mavlink_message_t *msg) const;
+
+  /**
+   * \brief Get the message ID of the frame most recently found by next_frame()
+   */
+  uint8_t frame_msgid() const { return mavlink2_frame_msgid(frame_data_); }
+  uint8_t frame_sysid() const { return mavlink2_frame_sysid(frame_data_); }
+  uint8_t frame_seq() const { return mavlink2_frame_seq(frame_data_); }
+
+  /**
+   * \brief Get the framing of the frame most recently found by next_frame(): 1 or 2
+   */
+  uint8_t frame_version() const { return mavlink2_frame_version(frame_data_); }
+
+  /**
+   * \brief Get the raw bytes of the frame most recently found by next_frame()
+   *
+   * The pointer stays valid until the next call to prepare().
+   */
+  const uint8_t * frame_data() const { return frame_data_; }
+  size_t frame_len() const { return frame_len_; }
+
+  /**
+   * \brief Get the number of buffered bytes that follow the frame most recently found by next_frame()
+   *
+   * Right after a read, these are the bytes that arrived after the frame did.
+   */
+  size_t bytes_after_frame() const { return tail_ - head_; }
+
+  uint64_t frames_received() const { return frames_received_; }
+  uint64_t v2_frames_received() const { return v2_frames_received_; }
+  uint64_t crc_errors() const { return crc_errors_; }
+  uint64_t bytes_dropped() const { return bytes_dropped_; }
+
+  /**
+   * \brief Compute the X.25 CRC used by mavlink over a block of bytes
+   * \param crc CRC accumulated so far (start with X25_INIT_CRC)
+   * \param data Pointer to the bytes
+   * \param len Number of bytes
+   * \return The updated CRC
+   */
+  static uint16_t crc_calculate(uint16_t crc, const uint8_t *data, size_t len);
+
+private:
+
+  std::vector<uint8_t> buffer_; //!< receive buffer; [head_, tail_) holds bytes that haven't been scanned yet
+  size_t read_size_;
+  size_t head_;
+  size_t tail_;
+
+  const uint8_t *frame_data_;
+  size_t frame_len_;
+
+  uint64_t frames_received_;
+  uint64_t v2_frames_received_;
+  uint64_t crc_errors_;
+  uint64_t bytes_dropped_;
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_FRAME_SCANNER_H
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file handler_allocator.h
+ */
+
+#ifndef MAVROSFLIGHT_HANDLER_ALLOCATOR_H
+#define MAVROSFLIGHT_HANDLER_ALLOCATOR_H
+
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+#define MAVROSFLIGHT_HANDLER_MEMORY_SIZE 1024 //!< large enough for a write operation, which holds a copy of the WriteBufferSequence
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Storage for the state asio keeps while an asynchronous operation is in flight
+ *
+ * Each chain of operations that is never more than one deep (the read loop, the write loop, a timer) owns one of
+ * these, so starting an operation reuses the block freed by the one before instead of going to the heap. If the
+ * block is still taken or too small, the request falls back to the heap.
+ *
+ * The blocks of one object can share a counter of the operations allocated from them, heap fallbacks included. asio
+ * frees an operation just before calling its handler, so once the counter reads zero on the thread that runs the
+ * handlers, none of them is left to run.
+ */
+class HandlerMemory : private boost::noncopyable
+{
+public:
+  HandlerMemory(std::atomic<size_t> *outstanding = NULL) : in_use_(false), outstanding_(outstanding) {}
+
+  void* allocate(std::size_t size)
+  {
+    if (outstanding_ != NULL)
+      outstanding_->fetch_add(1, std::memory_order_relaxed);
+
+    if (!in_use_ && size <= sizeof(storage_))
+    {
+      in_use_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+
+  void deallocate(void *pointer)
+  {
+    if (pointer == &storage_)
+      in_use_ = false;
+    else
+      ::operator delete(pointer);
+
+    if (outstanding_ != NULL)
+      outstanding_->fetch_sub(1, std::memory_order_release);
+  }
+
+private:
+  boost::aligned_storage<MAVROSFLIGHT_HANDLER_MEMORY_SIZE>::type storage_;
+  bool in_use_;
+  std::atomic<size_t> *outstanding_; //!< counter shared with the owner's other blocks, or NULL
+};
+
+/**
+ * \brief Allocator handing out a HandlerMemory block, for use as the associated allocator of a completion handler
+ */
+template <typename T>
+class HandlerAllocator
+{
+public:
+  typedef T value_type;
+
+  explicit HandlerAllocator(HandlerMemory &memory) : memory_(&memory) {}
+
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U> &other) : memory_(&other.memory()) {}
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(memory_->allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T *pointer, std::size_t n)
+  {
+    memory_->deallocate(pointer);
+  }
+
+  HandlerMemory& memory() const { return *memory_; }
+
+  template <typename U>
+  bool operator==(const HandlerAllocator<U> &other) const { return memory_ == &other.memory(); }
+
+  template <typename U>
+  bool operator!=(const HandlerAllocator<U> &other) const { return memory_ != &other.memory(); }
+
+private:
+  HandlerMemory *memory_;
+};
+
+/**
+ * \brief Wraps a completion handler so that asio allocates the operation from a HandlerMemory block
+ *
+ * Provides the block through asio's associated allocator (Boost 1.66 and later) rather than the
+ * asio_handler_allocate/asio_handler_deallocate hooks, which are deprecated and ignored from Boost 1.79 on.
+ */
+template <typename Handler>
+class AllocHandler
+{
+public:
+  typedef HandlerAllocator<void> allocator_type;
+
+  AllocHandler(HandlerMemory &memory, const Handler &handler) : memory_(&memory), handler_(handler) {}
+
+  void operator()()
+  {
+    handler_();
+  }
+
+  template <typename Arg1>
+  void operator()(const Arg1 &arg1)
+  {
+    handler_(arg1);
+  }
+
+  template <typename Arg1, typename Arg2>
+  void operator()(const Arg1 &arg1, const Arg2 &arg2)
+  {
+    handler_(arg1, arg2);
+  }
+
+  HandlerMemory& memory() const { return *memory_; }
+
+  allocator_type get_allocator() const { return allocator_type(*memory_); }
+
+private:
+  HandlerMemory *memory_;
+  Handler handler_;
+};
+
+/**
+ * \brief Convenience function for wrapping a handler in an AllocHandler
+ */
+template <typename Handler>
+inline AllocHandler<Handler> make_alloc_handler(HandlerMemory &memory, const Handler &handler)
+{
+  return AllocHandler<Handler>(memory, handler);
+}
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_HANDLER_ALLOCATOR_H
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file handoff_queue.h
+ */
+
+#ifndef MAVROSFLIGHT_HANDOFF_QUEUE_H
+#define MAVROSFLIGHT_HANDOFF_QUEUE_H
+
+#include <rosflight/mavrosflight/mavlink_bridge.h>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include <stdint.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Bounded single-producer, single-consumer handoff of received messages from the io thread to a worker
+ *
+ * Each message ID has a drop policy that decides what happens when the worker falls behind:
+ *  - DROP_NEWEST messages share a preallocated ring and are delivered in order; when the ring is full, the incoming
+ *    message is dropped.
+ *  - KEEP_LATEST messages each get a single slot holding the most recent undelivered message, which is replaced by
+ *    every newer one.
+ *  - NEVER_DROP messages get their own ring, which the worker drains first. It is sized for a worker that has stalled
+ *    for seconds, not for one that merely falls behind; should it fill up anyway, the message is dropped and counted
+ *    separately, so that push() keeps its guarantees.
+ *
+ * push() never blocks and never allocates. pop() sleeps on a condition variable when there is nothing to deliver; the
+ * producer only touches the mutex when the consumer is actually asleep.
+ */
+class HandoffQueue
+{
+public:
+
+  enum DropPolicy
+  {
+    DROP_NEWEST,
+    KEEP_LATEST,
+    NEVER_DROP
+  };
+
+  struct Stats
+  {
+    size_t depth; //!< messages currently waiting
+    size_t high_water_mark; //!< largest number of messages waiting at once
+    uint64_t pushed; //!< messages handed to push()
+    uint64_t dropped; //!< DROP_NEWEST messages dropped because the ring was full
+    uint64_t replaced; //!< KEEP_LATEST messages replaced by a newer one before they were delivered
+    uint64_t lost; //!< NEVER_DROP messages dropped because their ring was full
+  };
+
+  /**
+   * \brief Allocates the rings
+   * \param capacity Minimum number of DROP_NEWEST messages that can wait at once (rounded up to a power of two)
+   */
+  explicit HandoffQueue(size_t capacity);
+
+  ~HandoffQueue();
+
+  /**
+   * \brief Set the drop policy for a message ID (only before the first push())
+   */
+  void set_policy(uint32_t msgid, DropPolicy policy);
+
+  DropPolicy get_policy(uint32_t msgid) const;
+
+  /**
+   * \brief Hand a message to the consumer (producer only)
+   * \param msg The message
+   * \param rx_ns Time at which the message arrived (see MavlinkComm::rx_time_ns()), passed on to the consumer
+   */
+  void push(const mavlink_message_t &msg, uint64_t rx_ns = 0);
+
+  /**
+   * \brief Take the next message, waiting for one if necessary (consumer only)
+   *
+   * NEVER_DROP messages are delivered first, then KEEP_LATEST, then DROP_NEWEST.
+   *
+   * \param msg Message to copy into
+   * \param timeout_ms Longest time to wait for a message
+   * \param rx_ns If not NULL, set to the arrival time the message was pushed with
+   * \return True if a message was taken, false on timeout or wake()
+   */
+  bool pop(mavlink_message_t *msg, uint32_t timeout_ms, uint64_t *rx_ns = NULL);
+
+  /**
+   * \brief Wake the consumer if it is waiting in pop(), e.g. to shut it down
+   */
+  void wake();
+
+  Stats get_stats() const;
+
+private:
+
+  /**
+   * \brief A message and its arrival time
+   */
+  struct Entry
+  {
+    mavlink_message_t msg;
+    uint64_t rx_ns;
+  };
+
+  /**
+   * \brief Preallocated single-producer, single-consumer ring of messages
+   */
+  class Ring
+  {
+  public:
+    explicit Ring(size_t capacity);
+    ~Ring();
+
+    bool push(const Entry &entry);
+    bool pop(Entry *entry);
+    size_t size() const;
+
+  private:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    Ring(const Ring&);
+    Ring& operator=(const Ring&);
+
+    Entry *slots_;
+    size_t mask_;
+
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<size_t> head_; //!< next position to read, owned by the consumer
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<size_t> tail_; //!< next position to write, owned by the producer
+    char pad2_[CACHE_LINE_SIZE];
+  };
+
+  /**
+   * \brief Most recent undelivered message for one KEEP_LATEST message ID
+   */
+  struct Mailbox
+  {
+    Mailbox() : locked(false), full(false) {}
+
+    std::atomic<bool> locked; //!< spinlock; held only while copying a message in or out
+    std::atomic<bool> full;
+    Entry entry;
+  };
+
+  static const uint32_t NUM_IDS = 256;
+
+  HandoffQueue(const HandoffQueue&);
+  HandoffQueue& operator=(const HandoffQueue&);
+
+  bool try_pop(Entry *entry);
+  bool take_mailbox(Mailbox *mailbox, Entry *entry);
+  void notify();
+
+  DropPolicy policy_[NUM_IDS];
+  Mailbox *mailboxes_[NUM_IDS]; //!< allocated for KEEP_LATEST message IDs only
+  std::vector<uint32_t> mailbox_ids_; //!< KEEP_LATEST message IDs, in the order they are scanned
+
+  Ring ring_; //!< DROP_NEWEST messages
+  Ring priority_ring_; //!< NEVER_DROP messages
+
+  std::atomic<size_t> mailboxes_full_; //!< number of mailboxes holding an undelivered message
+
+  boost::mutex wait_mutex_;
+  boost::condition_variable wait_cond_;
+  std::atomic<bool> consumer_waiting_;
+
+  std::atomic<size_t> high_water_;
+  std::atomic<uint64_t> pushed_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<uint64_t> replaced_;
+  std::atomic<uint64_t> lost_;
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_HANDOFF_QUEUE_H
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2017 Daniel Koch, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file io_service_pool.h
+ */
+
+#ifndef MAVROSFLIGHT_IO_SERVICE_POOL_H
+#define MAVROSFLIGHT_IO_SERVICE_POOL_H
+
+#include <rosflight/mavrosflight/mavlink_comm.h>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <vector>
+
+#include <stddef.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief A few io threads shared by many links, instead of one io thread per link
+ *
+ * Each thread runs its own io service, and each link is assigned to one of them when it is constructed. All of a
+ * link's handlers therefore still run on a single thread, one at a time, so the link needs no more locking than with
+ * a thread of its own; it just shares that thread with other links. A link that is busy delays the other links on
+ * its thread, so there should be enough threads that none of them runs near capacity. Reopening a failed port also
+ * runs on the link's thread; a TCP link resolves, connects and waits for a client without blocking it, and a UDP
+ * link resolves its hosts only when it is first opened.
+ *
+ * The links must be closed while the pool is running, and destroyed before the pool is; otherwise handlers that
+ * closing a link cancelled are left in the io service, and destroying them touches the destroyed link.
+ */
+class IoServicePool
+{
+public:
+
+  /**
+   * \brief Create the io services; no threads are started yet
+   * \param size Number of io threads
+   */
+  explicit IoServicePool(size_t size);
+
+  /**
+   * \brief Stops the threads
+   */
+  ~IoServicePool();
+
+  /**
+   * \brief Start one thread per io service
+   * \param options Scheduling options applied to every thread; see MavlinkComm::set_io_thread_options()
+   */
+  void start(const MavlinkComm::IoThreadOptions &options = MavlinkComm::IoThreadOptions());
+
+  /**
+   * \brief Stop the threads; handlers that are still queued are left to run once the pool is started again
+   */
+  void stop();
+
+  /**
+   * \brief Whether the threads are running
+   */
+  bool running() const { return running_; }
+
+  /**
+   * \brief Number of io threads
+   */
+  size_t size() const { return services_.size(); }
+
+  /**
+   * \brief Assign a link to one of the io services, taking them in turn
+   */
+  boost::asio::io_service& get_io_service();
+
+private:
+
+  IoServicePool(const IoServicePool&);
+  IoServicePool& operator=(const IoServicePool&);
+
+  std::vector<boost::shared_ptr<boost::asio::io_service> > services_;
+  std::vector<boost::shared_ptr<boost::asio::io_service::work> > work_; //!< keep the threads running without links
+  std::vector<boost::shared_ptr<boost::thread> > threads_;
+  size_t next_; //!< io service the next link is assigned to
+  std::atomic<bool> running_;
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_IO_SERVICE_POOL_H
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2017 Daniel Koch, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file link_impairment.h
+ */
+
+#ifndef MAVROSFLIGHT_LINK_IMPAIRMENT_H
+#define MAVROSFLIGHT_LINK_IMPAIRMENT_H
+
+#include <rosflight/mavrosflight/mavlink_bridge.h>
+
+#include <atomic>
+#include <random>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINK_IMPAIRMENT_MAX_FRAMES 4096
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Emulates one direction of a degraded link, such as a telemetry radio, frame by frame
+ *
+ * Frames go in with submit() and come out with read() once their delivery time has come, in the order they went in.
+ * On the way each frame may be held up by the bandwidth limit and its queue, delayed by a fixed and a random amount,
+ * lost in a burst, or have bits flipped. All randomness comes from a generator seeded from the options, so the same
+ * seed and the same traffic give the same impairments.
+ *
+ * Not thread safe, apart from get_stats(); MavlinkComm only uses it from its io thread.
+ */
+class LinkImpairment
+{
+public:
+
+  /**
+   * \brief Distributions of the random part of the delay
+   */
+  enum JitterDistribution
+  {
+    JITTER_UNIFORM, //!< uniform between 0 and twice the mean
+    JITTER_EXPONENTIAL, //!< exponential, for occasional long delays
+    JITTER_PARETO //!< Pareto (Lomax) with shape 2, for the heavy tail of a radio that retransmits
+  };
+
+  struct Options
+  {
+    uint32_t delay_us; //!< one-way delay every frame has, on top of its transmission time
+    uint32_t jitter_us; //!< mean of the random delay added to each frame
+    JitterDistribution jitter_distribution;
+    double loss_probability; //!< long-run fraction of frames lost
+    double loss_burst_length; //!< mean frames lost in a row, 1 for independent losses; raised if too short for it
+    double bit_error_rate; //!< probability of each bit being flipped
+    double bandwidth_bps; //!< rate at which frames go out, in bits per second; 0 for no limit
+    size_t queue_bytes; //!< bytes that may wait for the bandwidth limit before frames are dropped
+    uint32_t seed; //!< seed of the random generator
+
+    Options() :
+      delay_us(0),
+      jitter_us(0),
+      jitter_distribution(JITTER_UNIFORM),
+      loss_probability(0),
+      loss_burst_length(1),
+      bit_error_rate(0),
+      bandwidth_bps(0),
+      queue_bytes(4096),
+      seed(1)
+    {}
+
+    /**
+     * \brief Check whether any impairment is set
+     */
+    bool enabled() const
+    {
+      return delay_us > 0 || jitter_us > 0 || loss_probability > 0 || bit_error_rate > 0 || bandwidth_bps > 0;
+    }
+  };
+
+  struct Stats
+  {
+    uint64_t frames; //!< frames submitted
+    uint64_t lost; //!< frames lost
+    uint64_t corrupted; //!< frames delivered with at least one bit flipped
+    uint64_t dropped; //!< frames dropped because the bandwidth queue or the frame slots were full
+  };
+
+  /**
+   * \brief Create a disabled impairment, which passes nothing
+   */
+  LinkImpairment();
+
+  /**
+   * \brief Set the impairments and reseed the generator, discarding any frames in flight
+   *
+   * The emulation is enabled if any impairment is set; otherwise the frame slots are freed.
+   */
+  void configure(const Options &options);
+
+  bool enabled() const { return enabled_; }
+
+  /**
+   * \brief Check whether every frame slot is taken
+   */
+  bool full() const { return count_ == slots_.size(); }
+
+  /**
+   * \brief Put a frame on the link
+   * \param data The frame
+   * \param len Length of the frame; at most MAVLINK2_MAX_PACKET_LEN
+   * \param now_ns Current steady clock time
+   * \return False if the frame was dropped because every slot was taken
+   */
+  bool submit(const uint8_t *data, size_t len, uint64_t now_ns);
+
+  /**
+   * \brief Get the time at which the next frame is delivered
+   * \return Steady clock time in nanoseconds, or 0 if no frame is in flight
+   */
+  uint64_t next_delivery_ns() const;
+
+  /**
+   * \brief Take the bytes of the frames that have been delivered by now
+   *
+   * A frame that doesn't fit is split, and the rest of it is returned by the next call.
+   *
+   * \param now_ns Current steady clock time
+   * \param data Buffer to copy the bytes into
+   * \param len Size of the buffer
+   * \return Number of bytes copied
+   */
+  size_t read(uint64_t now_ns, uint8_t *data, size_t len);
+
+  /**
+   * \brief Get the impairment counters; safe to call from any thread
+   */
+  Stats get_stats() const;
+
+private:
+
+  struct Slot
+  {
+    uint64_t delivery_ns;
+    uint16_t len;
+    uint8_t data[MAVLINK2_MAX_PACKET_LEN];
+  };
+
+  /**
+   * \brief Draw the random part of a frame's delay
+   */
+  uint64_t jitter_ns();
+
+  /**
+   * \brief Flip the bits hit by errors in a frame
+   * \return True if any bit was flipped
+   */
+  bool corrupt(uint8_t *data, size_t len);
+
+  Options options_;
+  bool enabled_;
+
+  std::vector<Slot> slots_; //!< frames in flight, a ring of LINK_IMPAIRMENT_MAX_FRAMES
+  size_t head_; //!< slot of the oldest frame
+  size_t count_; //!< frames in flight
+  size_t head_pos_; //!< bytes of the oldest frame already read
+
+  uint64_t link_free_ns_; //!< time at which the bandwidth limit has sent everything submitted so far
+  uint64_t last_delivery_ns_; //!< delivery time of the newest frame, which the next may not precede
+
+  bool burst_; //!< whether the loss model is in a burst, where every frame is lost
+  double burst_start_probability_; //!< chance per frame of a burst starting
+  double burst_end_probability_; //!< chance per frame of a burst ending
+  uint64_t bits_to_error_; //!< correct bits left before the next flipped one
+
+  std::mt19937 random_;
+
+  std::atomic<uint64_t> frames_;
+  std::atomic<uint64_t> lost_;
+  std::atomic<uint64_t> corrupted_;
+  std::atomic<uint64_t> dropped_;
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_LINK_IMPAIRMENT_H
@@ -40,5 +40,6 @@
 #define MAVROSFLIGHT_MAVLINK_BRIDGE_H
 
 #include <rosflight/mavlink/v1.0/rosflight/mavlink.h>
+#include <rosflight/mavlink/mavlink2.h>
 
 #endif // MAVROSFLIGHT_MAVLINK_BRIDGE_H
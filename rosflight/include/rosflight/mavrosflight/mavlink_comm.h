@@ -37,14 +37,26 @@
 #ifndef MAVROSFLIGHT_MAVLINK_COMM_H
 #define MAVROSFLIGHT_MAVLINK_COMM_H
 
+#include <rosflight/mavrosflight/frame_scanner.h>
+#include <rosflight/mavrosflight/handler_allocator.h>
+#include <rosflight/mavrosflight/link_impairment.h>
 #include <rosflight/mavrosflight/mavlink_bridge.h>
+#include <rosflight/mavrosflight/mavlink_dispatcher.h>
 #include <rosflight/mavrosflight/mavlink_listener_interface.h>
+#include <rosflight/mavrosflight/mavlink_recorder.h>
+#include <rosflight/mavrosflight/token_bucket.h>
+#include <rosflight/mavrosflight/write_queue.h>
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/function.hpp>
 
-#include <list>
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -52,38 +64,234 @@
 #include <stdint.h>
 
 #define MAVLINK_SERIAL_READ_BUF_SIZE 256
+#define MAVLINK_WRITE_QUEUE_SIZE 512
+#define MAVLINK_PRIORITY_WRITE_QUEUE_SIZE 64
+#define MAVLINK_DEFAULT_WRITE_MTU 1472
+#define MAVLINK_WRITE_LATENCY_BUCKETS 16
+#define MAVLINK_DISPATCH_LATENCY_BUCKETS 16
+#define MAVLINK2_NEGOTIATION_PROBES 10
+#define MAVLINK_RECONNECT_MIN_BACKOFF_MS 5
+#define MAVLINK_RECONNECT_MAX_BACKOFF_MS 50
 
 namespace mavrosflight
 {
 
+class IoServicePool;
+
 class MavlinkComm
 {
 public:
 
   /**
-   * \brief Instantiates the class and begins communication on the specified serial port
-   * \param port Name of the serial port (e.g. "/dev/ttyUSB0")
-   * \param baud_rate Serial communication baud rate
+   * \brief Priority classes for outgoing frames, highest first
+   *
+   * Each class has its own queue. Every write takes frames from the highest non-empty class first, so a control frame
+   * never waits behind queued frames of a lower class; at most it waits for the write already in progress.
+   */
+  enum WritePriority
+  {
+    WRITE_PRIORITY_CONTROL, //!< setpoints; never held back for coalescing
+    WRITE_PRIORITY_SAFETY, //!< heartbeats and commands
+    WRITE_PRIORITY_TIMESYNC, //!< time synchronization requests
+    WRITE_PRIORITY_BULK, //!< parameter traffic and anything not otherwise classified
+    NUM_WRITE_PRIORITIES
+  };
+
+  /**
+   * \brief Outgoing frame statistics for one priority class
+   */
+  struct WriteStats
+  {
+    uint64_t frames; //!< frames written to the port
+    uint64_t dropped; //!< frames dropped because the queue was full
+    uint64_t replaced; //!< frames replaced by a newer frame with the same ID before they were written
+    size_t high_water_mark; //!< largest number of frames waiting at once
+    uint64_t total_delay_us; //!< sum over all written frames of the time from send_message() until written
+    uint64_t max_delay_us; //!< longest time from send_message() until a frame was written
+  };
+
+  /**
+   * \brief Callback for complete frames as they were received, before decoding
    */
-  MavlinkComm();
+  typedef boost::function<void(const uint8_t *frame, size_t len)> FrameCallback;
 
   /**
-   * \brief Stops communication and closes the serial port before the object is destroyed
+   * \brief Scheduling options for the io thread, which reads, parses and dispatches received messages and performs
+   * the writes
+   *
+   * Once the link is up, the io thread doesn't allocate from the heap as long as the subscribers don't, so with these
+   * options it can run undisturbed by the rest of the system.
+   */
+  struct IoThreadOptions
+  {
+    int sched_priority; //!< SCHED_FIFO priority (1-99), or 0 to keep the default scheduler
+    std::vector<int> cpus; //!< CPUs the thread may run on, or empty for any
+    bool lock_memory; //!< whether to lock the process's current and future pages into RAM with mlockall()
+
+    IoThreadOptions() : sched_priority(0), lock_memory(false) {}
+  };
+
+  /**
+   * \brief Snapshot of the link health counters, all totals since construction
+   */
+  struct LinkStats
+  {
+    uint64_t rx_bytes; //!< bytes received
+    uint64_t rx_frames; //!< frames that passed the CRC check
+    uint64_t rx_frames_v2; //!< received frames with MAVLink 2 framing
+    int64_t rx_bytes_saved; //!< bytes received fewer than with v1 framing and untruncated payloads
+    uint64_t rx_crc_errors; //!< candidate frames that failed the CRC check, on the port or on an emulated link
+    uint64_t rx_bytes_dropped; //!< bytes discarded while looking for the start of a frame, likewise
+    uint64_t rx_reads; //!< completed reads; rx_bytes / rx_reads shows how much the port batches bytes per wake-up
+    bool rx_sysid_seen[256]; //!< system IDs that frames have been received from
+    uint64_t rx_seq_gaps[256]; //!< frames missed from each system ID, detected from gaps in the sequence numbers
+
+    uint64_t tx_bytes; //!< bytes written
+    uint64_t tx_frames; //!< frames written
+    uint64_t tx_frames_v2; //!< frames encoded with MAVLink 2 framing
+    int64_t tx_bytes_saved; //!< bytes encoded fewer than with v1 framing and untruncated payloads
+    uint8_t mavlink_version; //!< framing the firmware has been found to accept: 1, or 2 once negotiated
+    uint64_t tx_dropped; //!< frames dropped because a write queue was full
+    uint64_t tx_replaced; //!< frames replaced by a newer frame with the same ID before they were written
+    size_t write_queue_depth; //!< frames currently waiting to be written, over all priority classes
+
+    //! number of frames by time from send_message() until written; see write_latency_bucket_limit_us()
+    uint64_t write_latency_histogram[MAVLINK_WRITE_LATENCY_BUCKETS];
+
+    //! number of dispatched messages by time from completion of the read until dispatched; see
+    //! dispatch_latency_bucket_limit_us()
+    uint64_t dispatch_latency_histogram[MAVLINK_DISPATCH_LATENCY_BUCKETS];
+
+    uint64_t tx_pacing_waits; //!< times the write sequence waited for the rate limit
+    uint64_t tx_pacing_wait_us; //!< total time spent waiting for the rate limit
+    uint64_t tx_pacing_wait_max_us; //!< longest single wait for the rate limit
+
+    bool link_up; //!< whether the port is open; false while a failed port is being reopened
+    uint64_t link_losses; //!< times the port failed and was closed
+    uint64_t reconnect_attempts; //!< attempts to reopen a failed port, successful or not
+    uint64_t last_outage_us; //!< time from the last failure until a frame was received again
+    uint64_t last_recovery_us; //!< time from reopening the port after the last failure until a frame was received
+    uint64_t max_outage_us; //!< longest time from a failure until a frame was received again
+  };
+
+  /**
+   * \brief Instantiates the comm layer; the transport is set up by the derived class, and nothing is sent or received
+   * until open()
+   * \param io_pool Pool whose io threads the link shares, or NULL for an io thread of its own
+   */
+  explicit MavlinkComm(IoServicePool *io_pool = NULL);
+
+  /**
+   * \brief Stops communication and closes the port before the object is destroyed
    */
   ~MavlinkComm();
 
   /**
    * \brief Opens the port and begins communication
+   * \param retry If the port can't be opened, report why and keep trying in the background, as after a failure,
+   * instead of throwing
    */
-  void open();
+  void open(bool retry = false);
 
   /**
    * \brief Stops communication and closes the port
+   *
+   * On a shared pool, the port is closed on the link's io thread, and close() waits until the handlers this cancels
+   * have run, so that none of them is left to run after the link is destroyed. It must therefore not be called from a
+   * callback.
    */
   void close();
 
   /**
-   * \brief Register a listener for mavlink messages
+   * \brief Set the maximum number of bytes requested from the port per read (call before open())
+   * \param size Read size in bytes; raised to MAVLINK2_MAX_PACKET_LEN if smaller
+   */
+  void set_read_buffer_size(size_t size);
+
+  /**
+   * \brief Allow MAVLink 2 framing on this link (call before open())
+   *
+   * Frames are sent with v1 framing until the firmware is found to understand v2. To find out, the first
+   * MAVLINK2_NEGOTIATION_PROBES heartbeats after the link comes up are each followed by a copy with v2 framing; a
+   * firmware that accepts it answers with v2 heartbeats. From then on, messages whose payloads end in enough zero
+   * bytes are sent truncated with v2 framing (see mavlink2_encode()). A v1 heartbeat from the firmware, for example
+   * after it was reflashed with an older version, falls back to v1 and starts probing again. Enabled by default.
+   */
+  void set_mavlink2(bool enabled);
+
+  /**
+   * \brief Set the scheduling options for the io thread (call before open())
+   *
+   * Options that can't be applied, usually for lack of privileges (CAP_SYS_NICE, CAP_IPC_LOCK), are reported on
+   * stderr and otherwise ignored. A link on a pool has no io thread of its own; the pool's threads get their options
+   * from IoServicePool::start().
+   */
+  void set_io_thread_options(const IoThreadOptions &options);
+
+  /**
+   * \brief Apply scheduling options to a thread; used for the io thread of a link and for the threads of a pool
+   */
+  static void apply_io_thread_options(boost::thread &io_thread, const IoThreadOptions &options);
+
+  /**
+   * \brief Reopen the port by itself when a read or write on it fails (call before open()); enabled by default
+   *
+   * The port is closed and reopened straight away, then after a backoff that doubles from
+   * MAVLINK_RECONNECT_MIN_BACKOFF_MS up to max_backoff_ms, until it opens again. A device that comes back is therefore
+   * found within max_backoff_ms. Subscriptions, listeners and queued frames carry over, so the parameter table and time
+   * offset kept above this class stay valid; only queued time sync requests are dropped, since their answers would be
+   * stale. A frame that was partly written when the port failed is sent again from its start.
+   *
+   * When disabled, a failed port is closed and stays closed.
+   */
+  void set_reconnect(bool enabled, uint32_t max_backoff_ms = MAVLINK_RECONNECT_MAX_BACKOFF_MS);
+
+  /**
+   * \brief Set the IDs this side of the link sends from (call before open()); 1 and 50 by default
+   *
+   * Used for the frames the link sends by itself, such as the serial baud rate handshake. The system ID is that of
+   * the vehicle, so it is also the one these frames are addressed to.
+   */
+  void set_system_id(uint8_t sysid, uint8_t compid);
+
+  uint8_t get_sysid() const { return sysid_; }
+  uint8_t get_compid() const { return compid_; }
+
+  /**
+   * \brief Subscribe to the decoded payload of one message type
+   *
+   * Safe to call at any time, including from a callback. Callbacks run on the io thread. Messages whose IDs have no
+   * subscribers are dropped as soon as their CRC has been checked.
+   *
+   * \param callback Function to call with each decoded payload, e.g.
+   *                 subscribe<mavlink_small_imu_t>(boost::bind(&Foo::handle_imu, this, _1))
+   * \return Handle to pass to unsubscribe()
+   */
+  template <typename T>
+  MavlinkDispatcher::SubscriptionId subscribe(const boost::function<void(const T&)> &callback)
+  {
+    return dispatcher_.subscribe<T>(callback);
+  }
+
+  /**
+   * \brief Subscribe to the undecoded messages with one message ID
+   * \param msgid The message ID
+   * \param callback Function to call with each message
+   * \return Handle to pass to unsubscribe()
+   */
+  MavlinkDispatcher::SubscriptionId subscribe_raw(uint32_t msgid, const MavlinkDispatcher::RawCallback &callback);
+
+  /**
+   * \brief Remove a subscription made with subscribe() or subscribe_raw()
+   *
+   * Waits for a callback already running on the io thread to return, see MavlinkDispatcher::unsubscribe().
+   *
+   * \param id Handle returned when subscribing
+   */
+  void unsubscribe(MavlinkDispatcher::SubscriptionId id);
+
+  /**
+   * \brief Register a listener for all mavlink messages
    * \param listener Pointer to an object that implements the MavlinkListenerInterface interface
    */
   void register_mavlink_listener(MavlinkListenerInterface * const listener);
@@ -95,47 +303,231 @@ public:
   void unregister_mavlink_listener(MavlinkListenerInterface * const listener);
 
   /**
-   * \brief Send a mavlink message
+   * \brief Get the estimated time at which the message being dispatched started to arrive
+   *
+   * The time is taken when the read that completed the frame returns, and moved back by the time the frame and the
+   * bytes read after it took on the wire, when the port knows its byte time (serial ports do, from the baud rate). So
+   * it leaves out parsing, dispatch and any queueing, and doesn't depend on where in a batch the frame was read. It
+   * still includes whatever delay the device and the driver add before handing bytes over, such as a USB-serial
+   * adapter's latency timer.
+   *
+   * Only meaningful from a subscriber callback or listener, which run on the io thread.
+   *
+   * \return Steady clock time in nanoseconds
+   */
+  uint64_t rx_time_ns() const { return dispatcher_.rx_time_ns(); }
+
+  /**
+   * \brief Send a mavlink message with the priority class configured for its message ID
+   *
+   * Safe to call from any thread; never blocks on the io thread. If the queue for the message's priority class is
+   * full the message is dropped and counted in get_write_stats().
+   *
    * \param msg The message to send
    */
   void send_message(const mavlink_message_t &msg);
 
-protected:
-  virtual bool is_open() = 0;
-  virtual void do_open() = 0;
-  virtual void do_close() = 0;
-  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler) = 0;
-  virtual void do_async_write(const boost::asio::const_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler) = 0;
+  /**
+   * \brief Send a mavlink message with an explicit priority class
+   * \param msg The message to send
+   * \param priority Priority class to queue the message in
+   */
+  void send_message(const mavlink_message_t &msg, WritePriority priority);
 
-  boost::asio::io_service io_service_; //!< boost io service provider
+  /**
+   * \brief Send an already encoded frame unchanged, with the priority class configured for its message ID
+   *
+   * Safe to call from any thread. The frame is queued like a message passed to send_message(), including replace
+   * mode for its message ID.
+   *
+   * \param frame Complete MAVLink frame of either version, including header and checksum
+   * \param len Length of the frame in bytes
+   * \return False if the frame is malformed or its queue is full
+   */
+  bool send_frame(const uint8_t *frame, size_t len);
 
-private:
+  /**
+   * \brief Set a function to be called with every frame that passes the CRC check, exactly as it was received
+   *
+   * The callback runs on the io thread before the frame is decoded and dispatched, so it must not block. Safe to call
+   * at any time except from the callback itself; once it returns, the previous callback is no longer running and
+   * won't be called again. Pass an empty function to remove the callback.
+   */
+  void set_frame_callback(const FrameCallback &callback);
 
-  //===========================================================================
-  // definitions
-  //===========================================================================
+  /**
+   * \brief Record every frame that passes the CRC check and every frame written to the port (call before open())
+   *
+   * Received frames are stamped with the time their read completed, sent frames with the time their write
+   * completed. The recorder is called from the io thread and must outlive the link, or be removed before open().
+   *
+   * \param recorder Recorder to append the frames to, or NULL to stop recording
+   */
+  void set_recorder(MavlinkRecorder *recorder);
+
+  /**
+   * \brief Set the priority class used by send_message() for a message ID
+   * \param msgid The message ID
+   * \param priority Priority class for frames with this ID
+   */
+  void set_write_priority(uint32_t msgid, WritePriority priority);
+
+  /**
+   * \brief Send only the most recent frame for a message ID (call before open())
+   *
+   * A frame with this ID replaces the previous one if that one hasn't been written yet, instead of queueing behind
+   * it. Meant for setpoint streams, where a stale value is worthless and a backlog only adds latency. Enabled by
+   * default for OFFBOARD_CONTROL, ROSFLIGHT_AUX_CMD, ADDED_TORQUE and EXTERNAL_ATTITUDE.
+   *
+   * \param msgid The message ID
+   * \param replace Whether frames with this ID replace older unsent ones
+   */
+  void set_write_replace(uint32_t msgid, bool replace);
+
+  /**
+   * \brief Limit the number of bytes of non-control frames in a single write
+   *
+   * This bounds how long a control frame can wait for the write in progress: at most the time to send this many
+   * bytes, or one frame if a single frame is larger.
+   *
+   * \param bytes Maximum number of bytes of non-control frames per write
+   */
+  void set_background_write_limit(size_t bytes);
+
+  /**
+   * \brief Configure how queued frames are combined into a single write
+   *
+   * All frames waiting in the queue are handed to the port in one gather write (serial) or one datagram (UDP), up to
+   * mtu bytes. If max_delay_us is nonzero, a write smaller than the MTU is held back for up to that long to let more
+   * frames accumulate, unless it contains a control frame, which is always sent immediately.
+   *
+   * \param mtu Maximum number of bytes per write
+   * \param max_delay_us Maximum time a frame may be held back waiting for more frames, in microseconds
+   */
+  void set_write_coalescing(size_t mtu, uint32_t max_delay_us);
+
+  /**
+   * \brief Limit the rate at which bytes are handed to the port
+   *
+   * Writes wait until the link has had time to drain what was written before, and each write is limited to the burst
+   * size, so that bursts queue up here, where control frames can still overtake them, rather than in the device.
+   * Should be called before the port is opened.
+   *
+   * \param bytes_per_sec Sustained rate; 0 disables the limit
+   * \param burst_bytes Number of bytes that may be written at once after the link has been idle
+   */
+  void set_write_rate_limit(double bytes_per_sec, size_t burst_bytes);
+
+  /**
+   * \brief Emulate a degraded link, such as a telemetry radio, between the port and this class (call before open())
+   *
+   * Received frames are taken apart from the port's byte stream and passed through rx; their bytes are scanned as
+   * usual once delivered, so flipped bits show up as CRC errors. Written frames go through tx, and the io thread
+   * writes them to the port as they are delivered; a write counts as complete once its frames are on the emulated
+   * link. Works with any port, and costs nothing when both directions are left disabled.
+   *
+   * \param rx Impairments of frames from the firmware
+   * \param tx Impairments of frames to the firmware
+   */
+  void set_link_impairment(const LinkImpairment::Options &rx, const LinkImpairment::Options &tx);
+
+  /**
+   * \brief Get the counters of the emulated link impairments; safe to call from any thread
+   */
+  void get_link_impairment_stats(LinkImpairment::Stats *rx, LinkImpairment::Stats *tx) const;
+
+  /**
+   * \brief Get the outgoing frame statistics for one priority class
+   */
+  WriteStats get_write_stats(WritePriority priority) const;
+
+  /**
+   * \brief Get a snapshot of the link health counters
+   *
+   * Safe to call from any thread; the counters are updated without locks, so the values may be a few frames apart.
+   */
+  void get_link_stats(LinkStats *stats) const;
+
+  /**
+   * \brief Get the upper limit of a write latency histogram bucket
+   * \param bucket Bucket index
+   * \return Exclusive upper limit in microseconds, or 0 for the last bucket, which has no upper limit
+   */
+  static uint32_t write_latency_bucket_limit_us(size_t bucket);
+
+  /**
+   * \brief Get the upper limit of a dispatch latency histogram bucket
+   * \param bucket Bucket index
+   * \return Exclusive upper limit in microseconds, or 0 for the last bucket, which has no upper limit
+   */
+  static uint32_t dispatch_latency_bucket_limit_us(size_t bucket);
+
+  /**
+   * \brief Get the largest number of frames that have been waiting in any write queue at once
+   */
+  size_t get_write_queue_high_water_mark() const;
 
   /**
-   * \brief Struct for buffering the contents of a mavlink message
+   * \brief Get the number of outgoing frames dropped because a write queue was full, over all priority classes
    */
-  struct WriteBuffer
+  uint64_t get_write_queue_drops() const;
+
+protected:
+
+  /**
+   * \brief Calls the MavlinkComm member function that handles the end of a read or write
+   */
+  struct IoCallback
   {
-    uint8_t data[MAVLINK_MAX_PACKET_LEN];
-    size_t len;
-    size_t pos;
+    typedef void (MavlinkComm::*Function)(const boost::system::error_code&, size_t);
 
-    WriteBuffer() : len(0), pos(0) {}
+    MavlinkComm *comm;
+    Function function;
 
-    WriteBuffer(const uint8_t * buf, uint16_t len) : len(len), pos(0)
+    void operator()(const boost::system::error_code &error, size_t bytes_transferred) const
     {
-      assert(len <= MAVLINK_MAX_PACKET_LEN); //! \todo Do something less catastrophic here
-      memcpy(data, buf, len);
+      (comm->*function)(error, bytes_transferred);
     }
+  };
 
-    const uint8_t * dpos() const { return data + pos; }
+  /**
+   * \brief Completion handler passed to the port for reads and writes
+   *
+   * asio takes the memory for the operation from a block owned by MavlinkComm, so that reads and writes don't
+   * allocate once the link is up.
+   */
+  typedef AllocHandler<IoCallback> IoHandler;
 
-    size_t nbytes() const { return len - pos; }
-  };
+  virtual bool is_open() = 0;
+  virtual void do_open() = 0;
+  virtual void do_close() = 0;
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler) = 0;
+  virtual void do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler) = 0;
+
+  /**
+   * \brief Reopen the port after a failure without holding up the io thread (io thread)
+   *
+   * The default calls do_open() and completes right away, which suits a port that opens quickly. A port whose opening
+   * can wait on the network overrides this to open asynchronously, since the io thread may be shared with other links.
+   * \param handler Called with the outcome once the port is open or opening it has failed
+   */
+  virtual void do_async_open(const IoHandler &handler);
+
+  /**
+   * \brief Set the time one byte takes on the wire, used to date frames back to when they started to arrive
+   * \param ns Nanoseconds per byte, or 0 if the port has no such delay
+   */
+  void set_rx_byte_time(uint32_t ns);
+
+  boost::scoped_ptr<boost::asio::io_service> own_io_service_; //!< io service of a link with its own io thread
+  boost::asio::io_service &io_service_; //!< boost io service provider; either own_io_service_ or one of a pool's
+  std::atomic<size_t> pending_ops_; //!< operations allocated from the link's HandlerMemory blocks, see close()
+
+private:
+
+  //===========================================================================
+  // definitions
+  //===========================================================================
 
   /**
    * \brief Convenience typedef for mutex lock
@@ -151,6 +543,55 @@ private:
    */
   void async_read();
 
+  /**
+   * \brief Take the link down after a failed read or write; the port is closed once the write sequence is idle
+   * \param error Error the operation failed with
+   */
+  void link_lost(const boost::system::error_code &error);
+
+  /**
+   * \brief Close the failed port and start reopening it; called by the owner of the write sequence
+   */
+  void close_failed_port();
+
+  /**
+   * \brief Close the port of a link on a shared pool (io thread)
+   * \param closed Set once the cancelled handlers have run, or NULL if the pool isn't running
+   */
+  void close_on_io_thread(boost::promise<void> *closed);
+
+  /**
+   * \brief Set closed once no operation of the link is left, or look again after the queued handlers have run
+   */
+  void close_drained(boost::promise<void> *closed);
+
+  /**
+   * \brief End a coalescing hold on behalf of a control frame queued by another thread
+   */
+  void write_hold_release();
+
+  /**
+   * \brief Try to reopen a failed port
+   * \param error Error code of the backoff wait
+   */
+  void reconnect(const boost::system::error_code &error);
+
+  /**
+   * \brief Bring the link back up once the port has been reopened, or wait for the next attempt
+   * \param error Error code of reopening the port
+   */
+  void reconnect_end(const boost::system::error_code &error, size_t);
+
+  /**
+   * \brief Wait before the next attempt to reopen a failed port
+   */
+  void schedule_reconnect();
+
+  /**
+   * \brief Count the recovery time once a frame arrives after the port was reopened
+   */
+  void link_recovered();
+
   /**
    * \brief Handler for end of asynchronous read operation
    * \param error Error code
@@ -158,11 +599,155 @@ private:
    */
   void async_read_end(const boost::system::error_code& error, size_t bytes_transferred);
 
+  /**
+   * \brief Check, decode and dispatch the frames in the bytes committed to scanner_
+   * \param read_ns Steady clock time at which the bytes were received
+   */
+  void process_frames(uint64_t read_ns);
+
+  /**
+   * \brief Publish the framing error counts, adding those of the real port to the emulated link's when it is impaired
+   */
+  void update_rx_error_counts();
+
+  /**
+   * \brief Wait for the next frame to come out of the emulated receive link
+   */
+  void schedule_rx_impairment();
+
+  /**
+   * \brief Scan the frames delivered by the emulated receive link
+   * \param error Error code of the wait
+   */
+  void rx_impairment_end(const boost::system::error_code& error);
+
+  /**
+   * \brief Put the frames of write_batch_ on the emulated transmit link, in place of writing them to the port
+   */
+  void impaired_write();
+
+  /**
+   * \brief Wait for the next frame to come out of the emulated transmit link
+   */
+  void schedule_tx_impairment();
+
+  /**
+   * \brief Write the frames delivered by the emulated transmit link to the port
+   * \param error Error code of the wait
+   */
+  void tx_impairment_end(const boost::system::error_code& error);
+
+  /**
+   * \brief Handler for the end of a write of frames delivered by the emulated transmit link
+   * \param error Error code
+   * \param bytes_transferred Number of bytes sent
+   */
+  void tx_impairment_write_end(const boost::system::error_code& error, size_t bytes_transferred);
+
+  /**
+   * \brief Queue an encoded frame for writing
+   * \return False if the frame's queue was full
+   */
+  bool enqueue_frame(const uint8_t *data, size_t len, uint32_t msgid, WritePriority priority);
+
+  /**
+   * \brief Follow the framing of heartbeats from the firmware, and count framing statistics, for a received frame
+   */
+  void track_version();
+
+  /**
+   * \brief Count the frames missed from a system, based on the sequence number of a frame received from it
+   */
+  void track_sequence(uint8_t sysid, uint8_t seq);
+
   /**
    * \brief Initialize an asynchronous write operation
    * \param check_write_state If true, only start another write operation if a write sequence is not already running
+   * \param allow_hold If true, a small write may be held back to coalesce it with frames queued later
+   */
+  void async_write(bool check_write_state, bool allow_hold = true);
+
+  /**
+   * \brief Stage of a coalescing hold
+   *
+   * The owner of the write sequence arms a hold; once it is active, the hold timer and a control frame race to end it,
+   * and only the one that does continues the write sequence.
+   */
+  enum WriteHoldState
+  {
+    WRITE_HOLD_NONE,
+    WRITE_HOLD_ARMING, //!< the owner is building the batch and arming the timer
+    WRITE_HOLD_RELEASED, //!< a control frame was queued while arming; the owner sends it instead of holding
+    WRITE_HOLD_ACTIVE //!< frames are being held back until the timer fires or a control frame is queued
+  };
+
+  /**
+   * \brief Latest-value slot for a message ID sent in replace mode
+   */
+  struct WriteMailbox
+  {
+    WriteMailbox() : locked(false), pending(false), ready(false) {}
+
+    std::atomic<bool> locked; //!< spinlock guarding frame and pending, held only while copying a frame
+    bool pending; //!< whether frame holds a value that the write sequence hasn't taken yet
+    WriteBuffer frame; //!< most recent frame from send_message()
+
+    WriteBuffer scratch; //!< frame taken for writing; only touched by the owner of the write sequence
+    bool ready; //!< whether scratch holds a frame that hasn't been completely written
+  };
+
+  /**
+   * \brief Where a frame in the current write came from
+   */
+  struct WriteBatchEntry
+  {
+    WriteBuffer *frame;
+    uint8_t priority;
+    WriteMailbox *mailbox; //!< mailbox holding the frame, or NULL if the frame is at the front of its queue
+  };
+
+  /**
+   * \brief Check whether there is nothing left to write
+   */
+  bool write_queues_empty() const;
+
+  /**
+   * \brief Check whether a frame still fits into write_batch_
+   */
+  bool write_batch_fits(int priority, size_t len, size_t background_bytes) const;
+
+  /**
+   * \brief Append a frame to write_batch_
+   */
+  void add_to_write_batch(const WriteBatchEntry &entry, size_t *background_bytes);
+
+  /**
+   * \brief Add the frame of a replace-mode message ID to write_batch_, if there is one and it fits
    */
-  void async_write(bool check_write_state);
+  void add_mailbox_to_write_batch(WriteMailbox *mailbox, int priority, size_t *background_bytes);
+
+  /**
+   * \brief Collect queued frames into write_batch_, highest priority first, up to the write MTU
+   * \return True if the batch contains a control frame
+   */
+  bool build_write_batch();
+
+  /**
+   * \brief Handler for the end of a coalescing hold; sends whatever has been queued
+   * \param error Error code
+   */
+  void write_hold_end(const boost::system::error_code& error);
+
+  /**
+   * \brief Handler for the end of a wait for the write rate limit
+   * \param error Error code
+   */
+  void write_pace_end(const boost::system::error_code& error);
+
+  /**
+   * \brief Get the maximum number of bytes per write, taking the rate limit into account
+   */
+  size_t write_limit() const;
 
   /**
    * \brief Handler for end of asynchronous write operation
@@ -175,21 +760,118 @@ private:
   // member variables
   //===========================================================================
 
-  std::vector<MavlinkListenerInterface*> listeners_; //!< listeners for mavlink messages
+  MavlinkDispatcher dispatcher_; //!< subscriptions for received messages
+  std::map<MavlinkListenerInterface*, MavlinkDispatcher::SubscriptionId> listeners_; //!< listeners for all messages
 
+  IoServicePool *io_pool_; //!< pool running io_service_, or NULL if the link runs it on io_thread_
   boost::thread io_thread_; //!< thread on which the io service runs
+  IoThreadOptions io_thread_options_;
   boost::recursive_mutex mutex_; //!< mutex for threadsafe operation
 
-  uint8_t sysid_;
-  uint8_t compid_;
-
-  uint8_t read_buf_raw_[MAVLINK_SERIAL_READ_BUF_SIZE];
+  uint8_t sysid_; //!< system ID of the vehicle, sent from and addressed to
+  uint8_t compid_; //!< component ID sent from
+
+  FrameScanner scanner_; //!< receive buffer and frame extractor
+  std::atomic<uint32_t> rx_byte_ns_; //!< time one byte takes on the wire, see set_rx_byte_time()
+
+  HandlerMemory read_handler_memory_; //!< operation memory for the read loop
+  HandlerMemory write_handler_memory_; //!< operation memory for the write loop
+  HandlerMemory write_hold_handler_memory_; //!< operation memory for the coalescing hold timer
+  HandlerMemory write_pace_handler_memory_; //!< operation memory for the rate limit timer
+  HandlerMemory reconnect_handler_memory_; //!< operation memory for the reconnect backoff timer, then for reopening the port
+  HandlerMemory close_handler_memory_; //!< operation memory for closing a failed port from the write sequence
+
+  boost::scoped_ptr<boost::asio::io_service::work> io_work_; //!< keeps the io thread running while the port is closed
+  bool reconnect_enabled_;
+  uint32_t reconnect_max_backoff_ms_;
+  uint32_t reconnect_backoff_ms_; //!< wait before the next attempt to reopen the port (io thread only)
+  boost::asio::steady_timer reconnect_timer_; //!< timer ending a reconnect backoff
+  std::atomic<bool> link_up_; //!< false from a failure until the port has been reopened
+  std::atomic<bool> closing_; //!< set by close(), so that cancelled handlers don't reopen the port or write to it
+  bool link_recovering_; //!< reopened after a failure, no frame received yet (io thread only)
+  uint64_t link_lost_ns_; //!< steady clock time of the last failure (io thread only)
+  uint64_t link_reopened_ns_; //!< steady clock time at which the port was last reopened (io thread only)
 
   mavlink_message_t msg_in_;
-  mavlink_status_t status_in_;
 
-  std::list<WriteBuffer*> write_queue_; //!< queue of buffers to be written to the serial port
-  bool write_in_progress_; //!< flag for whether async_write is already running
+  bool mavlink2_enabled_; //!< whether v2 framing may be negotiated
+  std::atomic<bool> peer_mavlink2_; //!< whether the firmware has answered with v2 heartbeats
+  std::atomic<int> mavlink2_probes_left_; //!< number of v2 heartbeat copies still to be sent
+
+  FrameCallback frame_callback_; //!< receives every valid frame
+  boost::mutex frame_callback_mutex_; //!< held while frame_callback_ is replaced or running
+  std::atomic<bool> has_frame_callback_; //!< lets the io thread skip taking the lock when there is no callback
+
+  MavlinkRecorder *recorder_; //!< capture of all frames, or NULL
+
+  WriteQueue *write_queues_[NUM_WRITE_PRIORITIES]; //!< preallocated queues of frames to be written, one per class
+  uint8_t write_priority_[256]; //!< priority class of each message ID
+  std::atomic<bool> write_in_progress_; //!< set by whichever thread currently owns the write sequence
+
+  WriteBufferSequence write_batch_; //!< frames handed to the port in the current write
+  WriteBatchEntry write_batch_entries_[MAVLINK_MAX_COALESCE_FRAMES]; //!< source of each frame in write_batch_
+  WriteBatchEntry partial_write_; //!< frame that was only partly written by the last write (frame is NULL if none)
+  std::atomic<size_t> write_scratch_ready_; //!< number of mailboxes whose scratch frame hasn't been completely written
+
+  WriteMailbox *write_mailboxes_[256]; //!< latest-value slots, allocated for replace-mode message IDs only
+  std::vector<uint32_t> write_mailbox_ids_; //!< replace-mode message IDs
+  std::atomic<size_t> write_mailboxes_pending_; //!< number of mailboxes holding a frame not yet taken for writing
+  size_t background_write_limit_; //!< maximum bytes of non-control frames per write
+  size_t write_mtu_; //!< maximum number of bytes per write
+  uint32_t write_coalesce_delay_us_; //!< maximum time a small write is held back for coalescing
+  boost::asio::steady_timer write_hold_timer_; //!< timer ending a coalescing hold
+  std::atomic<int> write_hold_state_; //!< WriteHoldState of the current coalescing hold
+  std::atomic<bool> write_hold_waiting_; //!< the hold timer has a wait whose handler hasn't run yet
+
+  TokenBucket write_pacer_; //!< write rate limit, in bytes; only touched by the owner of the write sequence
+  boost::asio::steady_timer write_pace_timer_; //!< timer ending a wait for the rate limit
+  uint64_t write_pace_start_ns_; //!< steady clock time at which the current wait started
+  bool write_pace_allow_hold_; //!< allow_hold argument of the async_write() call that is waiting
+
+  // emulated link impairments; only touched by the io thread
+  LinkImpairment rx_impairment_;
+  FrameScanner rx_impairment_scanner_; //!< takes received frames apart before they are impaired
+  boost::asio::steady_timer rx_impairment_timer_;
+  bool rx_impairment_waiting_; //!< whether rx_impairment_timer_ is running
+  HandlerMemory rx_impairment_handler_memory_;
+  LinkImpairment tx_impairment_;
+  boost::asio::steady_timer tx_impairment_timer_;
+  bool tx_impairment_waiting_; //!< whether tx_impairment_timer_ is running
+  bool tx_impairment_writing_; //!< whether delivered frames are being written to the port
+  bool tx_impairment_blocked_; //!< whether the write sequence waits for the emulated link to have room
+  uint8_t tx_impairment_buffer_[MAVLINK_DEFAULT_WRITE_MTU]; //!< delivered bytes being written to the port
+  WriteBufferSequence tx_impairment_write_; //!< the part of tx_impairment_buffer_ not written yet
+  HandlerMemory tx_impairment_handler_memory_;
+  HandlerMemory tx_impairment_write_memory_;
+
+  std::atomic<uint64_t> rx_bytes_;
+  std::atomic<uint64_t> rx_frames_;
+  std::atomic<uint64_t> rx_frames_v2_;
+  std::atomic<int64_t> rx_bytes_saved_;
+  std::atomic<uint64_t> rx_crc_errors_;
+  std::atomic<uint64_t> rx_bytes_dropped_;
+  std::atomic<uint64_t> rx_reads_;
+  std::atomic<uint64_t> dispatch_latency_histogram_[MAVLINK_DISPATCH_LATENCY_BUCKETS];
+  std::atomic<bool> rx_sysid_seen_[256];
+  std::atomic<uint64_t> rx_seq_gaps_[256];
+  uint8_t rx_last_seq_[256]; //!< sequence number of the last frame from each system (io thread only)
+
+  std::atomic<uint64_t> tx_bytes_;
+  std::atomic<uint64_t> tx_frames_v2_;
+  std::atomic<int64_t> tx_bytes_saved_;
+  std::atomic<uint64_t> write_latency_histogram_[MAVLINK_WRITE_LATENCY_BUCKETS];
+  std::atomic<uint64_t> tx_pacing_waits_;
+  std::atomic<uint64_t> tx_pacing_wait_us_;
+  std::atomic<uint64_t> tx_pacing_wait_max_us_;
+  std::atomic<uint64_t> write_frames_[NUM_WRITE_PRIORITIES];
+  std::atomic<uint64_t> write_replaced_[NUM_WRITE_PRIORITIES];
+  std::atomic<uint64_t> write_delay_total_us_[NUM_WRITE_PRIORITIES];
+  std::atomic<uint64_t> write_delay_max_us_[NUM_WRITE_PRIORITIES];
+  std::atomic<uint64_t> link_losses_;
+  std::atomic<uint64_t> reconnect_attempts_;
+  std::atomic<uint64_t> last_outage_us_;
+  std::atomic<uint64_t> last_recovery_us_;
+  std::atomic<uint64_t> max_outage_us_;
 };
 
 } // namespace mavrosflight
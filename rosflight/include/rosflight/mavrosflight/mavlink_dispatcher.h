@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_dispatcher.h
+ */
+
+#ifndef MAVROSFLIGHT_MAVLINK_DISPATCHER_H
+#define MAVROSFLIGHT_MAVLINK_DISPATCHER_H
+
+#include <rosflight/mavrosflight/mavlink_bridge.h>
+#include <rosflight/mavrosflight/message_traits.h>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Dispatches received mavlink messages to the callbacks subscribed to their message ID
+ *
+ * Typed subscriptions receive the decoded payload. Each message is decoded at most once, no matter how many typed
+ * callbacks are subscribed to it. Subscribing and unsubscribing are safe while another thread is dispatching: the
+ * table for a message ID is replaced as a whole rather than modified, so dispatching never waits for a lock, and
+ * unsubscribe() waits for a dispatch that may still be using the old table to finish. Messages are dispatched from
+ * one thread at a time.
+ */
+class MavlinkDispatcher
+{
+public:
+
+  typedef uint64_t SubscriptionId;
+  typedef boost::function<void(const mavlink_message_t&)> RawCallback;
+
+  MavlinkDispatcher();
+
+  /**
+   * \brief Subscribe to the decoded payload of one message type
+   * \param callback Function to call with each decoded payload
+   * \return Handle to pass to unsubscribe()
+   */
+  template <typename T>
+  SubscriptionId subscribe(const boost::function<void(const T&)> &callback);
+
+  /**
+   * \brief Subscribe to the undecoded messages with one message ID
+   * \param msgid The message ID
+   * \param callback Function to call with each message
+   * \return Handle to pass to unsubscribe()
+   */
+  SubscriptionId subscribe_raw(uint32_t msgid, const RawCallback &callback);
+
+  /**
+   * \brief Subscribe to every message, whatever its ID
+   * \param callback Function to call with each message
+   * \return Handle to pass to unsubscribe()
+   */
+  SubscriptionId subscribe_all(const RawCallback &callback);
+
+  /**
+   * \brief Remove a subscription
+   *
+   * Once this returns, the callback is not called again and whatever it uses can be destroyed. Called from a callback,
+   * it can't wait for the dispatch it is part of, which may therefore still call the removed callback.
+   *
+   * \param id Handle returned when subscribing
+   */
+  void unsubscribe(SubscriptionId id);
+
+  /**
+   * \brief Check whether anything is subscribed to a message ID (lock-free)
+   */
+  bool has_subscribers(uint32_t msgid) const;
+
+  /**
+   * \brief Call every callback subscribed to the message's ID
+   * \param msg The message
+   * \param rx_ns Steady clock time at which the message arrived, returned by rx_time_ns() while the callbacks run
+   */
+  void dispatch(const mavlink_message_t &msg, uint64_t rx_ns = 0) const;
+
+  /**
+   * \brief Get the arrival time passed to dispatch() for the message being dispatched
+   *
+   * Only meaningful from a callback, on the thread that calls dispatch().
+   *
+   * \return Steady clock time in nanoseconds, or 0 if it is unknown
+   */
+  uint64_t rx_time_ns() const { return rx_ns_; }
+
+private:
+
+  static const uint32_t NUM_IDS = 256;
+  static const uint32_t ALL_IDS = NUM_IDS; //!< pseudo message ID used for subscribe_all()
+
+  /**
+   * \brief Callbacks subscribed to one message ID
+   */
+  class Channel
+  {
+  public:
+    virtual ~Channel() {}
+    virtual Channel* clone() const { return new Channel(*this); }
+    virtual void dispatch(const mavlink_message_t &msg) const;
+    virtual bool remove(SubscriptionId id);
+    virtual bool empty() const { return raw_.empty(); }
+
+    std::vector<std::pair<SubscriptionId, RawCallback> > raw_;
+  };
+
+  /**
+   * \brief Callbacks subscribed to one message ID, including typed callbacks that share a single decode
+   */
+  template <typename T>
+  class TypedChannel : public Channel
+  {
+  public:
+    TypedChannel() {}
+    explicit TypedChannel(const Channel &other) : Channel(other) {}
+
+    virtual Channel* clone() const { return new TypedChannel<T>(*this); }
+
+    virtual void dispatch(const mavlink_message_t &msg) const
+    {
+      Channel::dispatch(msg);
+
+      if (!typed_.empty())
+      {
+        T payload;
+        MessageTraits<T>::decode(&msg, &payload);
+        for (size_t i = 0; i < typed_.size(); i++)
+        {
+          typed_[i].second(payload);
+        }
+      }
+    }
+
+    virtual bool remove(SubscriptionId id)
+    {
+      for (size_t i = 0; i < typed_.size(); i++)
+      {
+        if (typed_[i].first == id)
+        {
+          typed_.erase(typed_.begin() + i);
+          return true;
+        }
+      }
+      return Channel::remove(id);
+    }
+
+    virtual bool empty() const { return typed_.empty() && Channel::empty(); }
+
+    std::vector<std::pair<SubscriptionId, boost::function<void(const T&)> > > typed_;
+  };
+
+  typedef boost::shared_ptr<const Channel> ChannelPtr;
+  typedef boost::lock_guard<boost::mutex> mutex_lock;
+
+  /**
+   * \brief Marks a dispatch in progress on the current thread, for as long as it is in scope
+   */
+  struct DispatchScope
+  {
+    explicit DispatchScope(const MavlinkDispatcher *dispatcher);
+    ~DispatchScope();
+
+    const MavlinkDispatcher *dispatcher;
+    DispatchScope *outer; //!< dispatch that the current one was started from, if any
+  };
+
+  /**
+   * \brief Install a new table for a message ID (mutex_ must be held)
+   */
+  void replace_channel(uint32_t msgid, Channel *channel);
+
+  /**
+   * \brief Wait until no dispatch is using a table that was in place before this call
+   */
+  void wait_for_dispatch() const;
+
+  static thread_local DispatchScope *dispatching_; //!< innermost dispatch in progress on each thread
+
+  mutable boost::mutex mutex_; //!< serializes changes to the channels and guards the subscription bookkeeping
+  ChannelPtr channels_[NUM_IDS + 1]; //!< callbacks for each message ID, plus the subscribe_all() callbacks; swapped atomically
+  std::atomic<bool> subscribed_[NUM_IDS + 1]; //!< whether each entry of channels_ is non-empty
+  mutable std::atomic<uint64_t> dispatch_epoch_; //!< incremented as each dispatch starts and ends, so odd while one runs
+
+  SubscriptionId next_id_;
+  std::map<SubscriptionId, uint32_t> subscriptions_; //!< message ID of each live subscription
+
+  mutable uint64_t rx_ns_; //!< arrival time of the message being dispatched; only touched by the dispatching thread
+};
+
+template <typename T>
+MavlinkDispatcher::SubscriptionId MavlinkDispatcher::subscribe(const boost::function<void(const T&)> &callback)
+{
+  const uint32_t msgid = MessageTraits<T>::ID;
+
+  mutex_lock lock(mutex_);
+
+  TypedChannel<T> *channel;
+  if (!channels_[msgid])
+  {
+    channel = new TypedChannel<T>();
+  }
+  else if (const TypedChannel<T> *typed = dynamic_cast<const TypedChannel<T>*>(channels_[msgid].get()))
+  {
+    channel = new TypedChannel<T>(*typed);
+  }
+  else
+  {
+    // only raw callbacks so far; keep them and add support for typed ones
+    channel = new TypedChannel<T>(*channels_[msgid]);
+  }
+
+  SubscriptionId id = next_id_++;
+  channel->typed_.push_back(std::make_pair(id, callback));
+  subscriptions_[id] = msgid;
+  replace_channel(msgid, channel);
+
+  return id;
+}
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MAVLINK_DISPATCHER_H
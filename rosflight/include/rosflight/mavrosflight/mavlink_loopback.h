@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_loopback.h
+ */
+
+#ifndef MAVROSFLIGHT_MAVLINK_LOOPBACK_H
+#define MAVROSFLIGHT_MAVLINK_LOOPBACK_H
+
+#include <rosflight/mavrosflight/mavlink_comm.h>
+#include <rosflight/mavrosflight/shm_ring.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/thread.hpp>
+
+#include <string>
+
+#define MAVLINK_LOOPBACK_READ_BUF_SIZE 4096
+#define MAVLINK_LOOPBACK_WAIT_TIMEOUT_US 100000
+#define MAVLINK_LOOPBACK_WRITE_RETRY_US 200
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Link to a co-located SIL firmware through a pair of shared memory rings
+ *
+ * The other end is a rosflight_firmware::UDPBoard put in loopback mode with the same name, e.g. the SIL_Board of the
+ * Gazebo plugin. Bytes move with plain copies instead of socket calls. While the ring from the firmware is empty, a
+ * helper thread spins briefly and then sleeps on the ring's futex, and hands the read back to the io thread as soon as
+ * bytes arrive, so a frame reaches the listeners within microseconds of being written.
+ */
+class MavlinkLoopback : public MavlinkComm
+{
+public:
+
+  /**
+   * \brief Set up a loopback link
+   * \param name Name of the link, shared with the firmware side, e.g. "/rosflight"
+   * \param io_pool Pool whose io threads the link shares, or NULL for an io thread of its own
+   */
+  MavlinkLoopback(const std::string &name, IoServicePool *io_pool = NULL);
+
+  /**
+   * \brief Stops communication and unmaps the rings before the object is destroyed
+   */
+  ~MavlinkLoopback();
+
+private:
+
+  //===========================================================================
+  // methods
+  //===========================================================================
+
+  virtual bool is_open();
+  virtual void do_open();
+  virtual void do_close();
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler);
+  virtual void do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler);
+
+  /**
+   * \brief Complete the pending read with whatever is in the ring
+   * \return False if the ring was empty and the read is still pending
+   */
+  bool fill_read();
+
+  /**
+   * \brief Copy as much of the pending write into the ring as fits, or try again shortly if nothing does
+   */
+  void fill_write();
+
+  /**
+   * \brief Handler run on the io thread once the wait thread has seen bytes arrive
+   */
+  void read_ready();
+
+  /**
+   * \brief Handler for the end of a wait for space in the ring to the firmware
+   * \param error Error code
+   */
+  void write_retry_end(const boost::system::error_code &error);
+
+  /**
+   * \brief Body of the thread that waits for the firmware to write
+   */
+  void wait_thread();
+
+  //===========================================================================
+  // member variables
+  //===========================================================================
+
+  std::string name_;
+
+  ShmRing rx_ring_; //!< bytes from the firmware
+  ShmRing tx_ring_; //!< bytes to the firmware
+
+  boost::asio::mutable_buffers_1 read_buffer_; //!< buffer of the pending read
+  IoHandler read_handler_; //!< handler of the pending read
+  HandlerMemory read_ready_memory_;
+
+  WriteBufferSequence write_buffers_; //!< buffers of a write waiting for space in the ring
+  IoHandler write_handler_; //!< handler of a write waiting for space in the ring
+  boost::asio::steady_timer write_retry_timer_;
+  HandlerMemory write_retry_memory_;
+
+  boost::thread wait_thread_;
+  boost::mutex wait_mutex_;
+  boost::condition_variable wait_cond_;
+  bool read_armed_; //!< a read is pending on an empty ring; guarded by wait_mutex_
+  bool stop_; //!< guarded by wait_mutex_
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MAVLINK_LOOPBACK_H
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_recorder.h
+ */
+
+#ifndef MAVROSFLIGHT_MAVLINK_RECORDER_H
+#define MAVROSFLIGHT_MAVLINK_RECORDER_H
+
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAVLINK_RECORDER_BUFFER_SIZE (4 * 1024 * 1024)
+#define MAVLINK_RECORDER_PREALLOCATE_SIZE (16 * 1024 * 1024)
+#define MAVLINK_CAPTURE_MAGIC "RFCAPTUR"
+#define MAVLINK_CAPTURE_VERSION 1
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Start of a capture file
+ *
+ * The header is followed by one entry per frame, each a CaptureEntryHeader and then the frame itself.
+ */
+struct CaptureFileHeader
+{
+  char magic[8]; //!< MAVLINK_CAPTURE_MAGIC, without the terminating null
+  uint32_t version; //!< MAVLINK_CAPTURE_VERSION
+  uint32_t reserved;
+  uint64_t start_ns; //!< steady clock time at which the capture was started
+};
+
+/**
+ * \brief Header of one captured frame; stored unaligned, so copy it out before use
+ */
+struct CaptureEntryHeader
+{
+  uint64_t timestamp_ns; //!< steady clock time at which the frame was read, or written completely
+  uint16_t len; //!< length of the frame that follows
+  uint8_t direction; //!< MavlinkRecorder::Direction
+  uint8_t reserved[5];
+};
+
+/**
+ * \brief Appends received and sent frames to a capture file, without ever waiting for the disk
+ *
+ * record() only copies the entry into a preallocated, memory-mapped ring buffer whose pages are faulted in up front.
+ * A background thread drains the ring into the file every few milliseconds, keeping the file's blocks allocated
+ * ahead of it. If the ring fills up because the disk can't keep up, frames are dropped and counted rather than
+ * waited for.
+ */
+class MavlinkRecorder
+{
+public:
+
+  enum Direction
+  {
+    DIRECTION_RX = 1, //!< frame received from the flight controller
+    DIRECTION_TX = 2 //!< frame sent to the flight controller
+  };
+
+  struct Stats
+  {
+    uint64_t frames; //!< frames recorded
+    uint64_t bytes; //!< bytes recorded, including entry headers
+    uint64_t dropped; //!< frames dropped because the ring buffer was full
+    uint64_t written; //!< bytes written to the file so far
+  };
+
+  /**
+   * \brief Create the capture file and allocate the ring buffer
+   * \param filename Path of the file; an existing file is replaced
+   * \param buffer_size Size of the ring buffer in bytes; enough for the frames of a few hundred milliseconds
+   * \throws SerialException if the file can't be created or the buffer can't be allocated
+   */
+  MavlinkRecorder(const std::string &filename, size_t buffer_size = MAVLINK_RECORDER_BUFFER_SIZE);
+
+  /**
+   * \brief Write out what is left in the ring buffer and close the file
+   */
+  ~MavlinkRecorder();
+
+  /**
+   * \brief Append a frame to the capture
+   *
+   * Must only be called from one thread at a time; MavlinkComm calls it from its io thread.
+   */
+  void record(Direction direction, uint64_t timestamp_ns, const uint8_t *frame, size_t len);
+
+  /**
+   * \brief Get the recording counters; safe to call from any thread
+   */
+  Stats get_stats() const;
+
+private:
+
+  /**
+   * \brief Copy bytes into the ring at a position, wrapping around its end
+   */
+  void copy_in(uint64_t pos, const void *data, size_t len);
+
+  /**
+   * \brief Write everything recorded so far to the file
+   * \return False if writing failed
+   */
+  bool drain();
+
+  /**
+   * \brief Body of the background thread
+   */
+  void run();
+
+  int fd_;
+
+  uint8_t *buffer_; //!< ring buffer, anonymous memory mapped and faulted in by the constructor
+  size_t buffer_size_;
+  std::atomic<uint64_t> head_; //!< total bytes ever recorded into the ring; advanced by record()
+  std::atomic<uint64_t> tail_; //!< total bytes ever written out of the ring; advanced by the background thread
+
+  uint64_t file_offset_; //!< file offset at which the next drained byte goes
+  uint64_t allocated_; //!< file length allocated so far
+
+  boost::thread thread_;
+  boost::mutex mutex_;
+  boost::condition_variable cond_; //!< wakes the background thread to stop
+  bool stop_; //!< guarded by mutex_
+
+  std::atomic<uint64_t> frames_;
+  std::atomic<uint64_t> dropped_;
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MAVLINK_RECORDER_H
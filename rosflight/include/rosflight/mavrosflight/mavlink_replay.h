@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_replay.h
+ */
+
+#ifndef MAVROSFLIGHT_MAVLINK_REPLAY_H
+#define MAVROSFLIGHT_MAVLINK_REPLAY_H
+
+#include <rosflight/mavrosflight/mavlink_comm.h>
+#include <rosflight/mavrosflight/mavlink_recorder.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <atomic>
+#include <string>
+
+#define MAVLINK_REPLAY_READ_BUF_SIZE 4096
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Link that plays back the received frames of a capture file written by MavlinkRecorder
+ *
+ * The frames go through the same scanner, subscriptions and listeners as frames from a real port, spaced by their
+ * recorded receive times divided by the speed factor, or as fast as they can be handled. Frames recorded as sent are
+ * skipped, and anything sent on the link is discarded.
+ */
+class MavlinkReplay : public MavlinkComm
+{
+public:
+
+  /**
+   * \brief Set up playback of a capture file
+   * \param filename Path of the capture file
+   * \param speed Playback speed relative to the recording (1 for real time), or 0 for as fast as possible
+   */
+  MavlinkReplay(const std::string &filename, double speed);
+
+  /**
+   * \brief Stops playback and unmaps the file before the object is destroyed
+   */
+  ~MavlinkReplay();
+
+  /**
+   * \brief Check whether every frame in the capture has been handed to the scanner
+   */
+  bool finished() const { return finished_; }
+
+  /**
+   * \brief Get the number of received frames played back so far
+   */
+  uint64_t frames_played() const { return frames_played_; }
+
+private:
+
+  //===========================================================================
+  // methods
+  //===========================================================================
+
+  virtual bool is_open();
+  virtual void do_open();
+  virtual void do_close();
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler);
+  virtual void do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler);
+
+  /**
+   * \brief Copy the frames that are due into the pending read, or wait until the next one is
+   */
+  void fill_read();
+
+  /**
+   * \brief Handler for the end of a wait for the next frame to become due
+   * \param error Error code
+   */
+  void replay_timer_end(const boost::system::error_code &error);
+
+  /**
+   * \brief Move pos_ to the next received frame, skipping sent frames
+   * \param header Set to the header of that frame
+   * \return False at the end of the capture
+   */
+  bool next_entry(CaptureEntryHeader *header);
+
+  //===========================================================================
+  // member variables
+  //===========================================================================
+
+  std::string filename_;
+  double speed_;
+
+  const uint8_t *data_; //!< the capture file, mapped read-only
+  size_t size_;
+  size_t pos_; //!< offset of the next entry to play
+  bool open_;
+
+  uint64_t first_timestamp_ns_; //!< recorded time of the first received frame
+  uint64_t start_ns_; //!< steady clock time at which playback started
+
+  boost::asio::mutable_buffers_1 read_buffer_; //!< buffer of the read waiting for frames
+  IoHandler read_handler_; //!< handler of the read waiting for frames
+  boost::asio::steady_timer replay_timer_;
+  HandlerMemory replay_timer_memory_;
+
+  std::atomic<bool> finished_;
+  std::atomic<uint64_t> frames_played_;
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MAVLINK_REPLAY_H
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_router.h
+ */
+
+#ifndef MAVROSFLIGHT_MAVLINK_ROUTER_H
+#define MAVROSFLIGHT_MAVLINK_ROUTER_H
+
+#include <rosflight/mavrosflight/frame_scanner.h>
+#include <rosflight/mavrosflight/handler_allocator.h>
+#include <rosflight/mavrosflight/mavlink_comm.h>
+#include <rosflight/mavrosflight/token_bucket.h>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <bitset>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#define MAVLINK_ROUTER_READ_BUF_SIZE 65536
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Forwards frames between the flight controller link and UDP endpoints such as ground stations
+ *
+ * Every frame that passes the CRC check on the link is sent unchanged to each endpoint whose filter and rate limit
+ * allow it. Frames received from an endpoint are checked the same way and then queued for the flight controller with
+ * MavlinkComm::send_frame(), so they follow the same priority classes and replace rules as everything else.
+ */
+class MavlinkRouter
+{
+public:
+
+  /**
+   * \brief Settings for one UDP endpoint
+   */
+  struct EndpointConfig
+  {
+    std::string name; //!< name used in log messages
+    std::string bind_host; //!< local address to receive on
+    uint16_t bind_port; //!< local port to receive on, or 0 for any free port
+    std::string remote_host; //!< address frames are forwarded to
+    uint16_t remote_port; //!< port frames are forwarded to
+
+    std::vector<uint32_t> forward_ids; //!< message IDs forwarded to the endpoint; empty forwards all
+    std::vector<uint32_t> accept_ids; //!< message IDs accepted from the endpoint; empty accepts all
+
+    double forward_rate; //!< maximum bytes per second forwarded to the endpoint, or 0 for no limit
+    size_t forward_burst; //!< bytes that may be forwarded at once after a quiet period
+    double accept_rate; //!< maximum bytes per second accepted from the endpoint, or 0 for no limit
+    size_t accept_burst; //!< bytes that may be accepted at once after a quiet period
+
+    EndpointConfig() :
+      bind_host("0.0.0.0"),
+      bind_port(0),
+      remote_host("localhost"),
+      remote_port(14550),
+      forward_rate(0),
+      forward_burst(4096),
+      accept_rate(0),
+      accept_burst(1024)
+    {}
+  };
+
+  /**
+   * \brief Frame counters for one endpoint
+   */
+  struct EndpointStats
+  {
+    uint64_t forwarded; //!< frames sent to the endpoint
+    uint64_t forward_filtered; //!< frames not sent because of forward_ids
+    uint64_t forward_limited; //!< frames not sent because of the forward rate limit
+    uint64_t forward_errors; //!< frames the socket refused, e.g. because its send buffer was full
+    uint64_t received; //!< valid frames received from the endpoint
+    uint64_t injected; //!< frames queued for the flight controller
+    uint64_t accept_filtered; //!< frames dropped because of accept_ids
+    uint64_t accept_limited; //!< frames dropped because of the accept rate limit
+    uint64_t inject_dropped; //!< frames dropped because the write queue was full or the frame was malformed
+    uint64_t crc_errors; //!< candidate frames from the endpoint that failed the CRC check
+  };
+
+  /**
+   * \brief Create a router for a link
+   * \param comm Link to the flight controller; must outlive the router
+   */
+  MavlinkRouter(MavlinkComm &comm);
+
+  /**
+   * \brief Stop routing and close the endpoints
+   */
+  ~MavlinkRouter();
+
+  /**
+   * \brief Open a UDP endpoint (call before start())
+   * \throws SerialException if the socket can't be opened
+   */
+  void add_endpoint(const EndpointConfig &config);
+
+  /**
+   * \brief Start forwarding in both directions
+   */
+  void start();
+
+  /**
+   * \brief Stop forwarding in both directions
+   */
+  void stop();
+
+  size_t num_endpoints() const { return endpoints_.size(); }
+  const EndpointConfig& get_config(size_t endpoint) const { return endpoints_[endpoint]->config; }
+  EndpointStats get_stats(size_t endpoint) const;
+
+private:
+
+  struct Endpoint
+  {
+    Endpoint(boost::asio::io_service &io_service, const EndpointConfig &config);
+
+    EndpointConfig config;
+    boost::asio::ip::udp::socket socket;
+    boost::asio::ip::udp::endpoint remote;
+    boost::asio::ip::udp::endpoint sender; //!< source of the last datagram
+    std::bitset<256> forward_ids;
+    std::bitset<256> accept_ids;
+
+    TokenBucket forward_bucket; //!< only touched by the link's io thread
+    TokenBucket accept_bucket; //!< only touched by the router thread
+    FrameScanner scanner; //!< receive buffer and frame extractor for datagrams from the endpoint
+    HandlerMemory read_handler_memory;
+
+    std::atomic<uint64_t> forwarded;
+    std::atomic<uint64_t> forward_filtered;
+    std::atomic<uint64_t> forward_limited;
+    std::atomic<uint64_t> forward_errors;
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> injected;
+    std::atomic<uint64_t> accept_filtered;
+    std::atomic<uint64_t> accept_limited;
+    std::atomic<uint64_t> inject_dropped;
+    std::atomic<uint64_t> crc_errors;
+  };
+
+  /**
+   * \brief Forward a frame from the link to the endpoints; runs on the link's io thread
+   */
+  void handle_frame(const uint8_t *frame, size_t len);
+
+  void async_read(Endpoint *endpoint);
+  void async_read_end(Endpoint *endpoint, const boost::system::error_code &error, size_t bytes_transferred);
+
+  MavlinkComm &comm_;
+  boost::asio::io_service io_service_;
+  boost::thread thread_;
+  std::vector<Endpoint*> endpoints_;
+  bool started_;
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MAVLINK_ROUTER_H
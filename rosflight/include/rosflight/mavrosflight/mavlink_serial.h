@@ -40,10 +40,17 @@
 #include <rosflight/mavrosflight/mavlink_comm.h>
 
 #include <boost/asio.hpp>
-#include <boost/function.hpp>
+#include <boost/asio/steady_timer.hpp>
 
+#include <atomic>
 #include <string>
 
+#include <termios.h>
+
+#define MAVLINK_SERIAL_WAKE_TIMEOUT_US 1000
+#define MAVLINK_SERIAL_BAUD_PROPOSAL_TIMEOUT_MS 500
+#define MAVLINK_SERIAL_BAUD_PROPOSALS 3
+
 namespace mavrosflight
 {
 
@@ -51,20 +58,93 @@ class MavlinkSerial : public MavlinkComm
 {
 public:
 
+  /**
+   * \brief Settings for the low-latency mode
+   *
+   * The wake-up policy trades CPU for latency: by default a read completes as soon as a single byte has arrived.
+   * With wake_bytes above 1, the kernel holds bytes back until that many are waiting, so a high-rate stream costs
+   * fewer wake-ups; wake_timeout_us bounds how long a smaller remainder, such as the end of a burst, is held. Once
+   * the timeout has passed, the port stays readable from the first byte until the next read, so the first frame after
+   * a quiet period isn't held back at all.
+   */
+  struct LowLatencyOptions
+  {
+    LowLatencyOptions() :
+      hardware_flow_control(false),
+      wake_bytes(1),
+      wake_timeout_us(MAVLINK_SERIAL_WAKE_TIMEOUT_US)
+    {}
+
+    bool hardware_flow_control; //!< use RTS/CTS, so the adapter never overruns the flight controller's receive buffer
+    uint8_t wake_bytes; //!< number of bytes that must be waiting before a read completes (VMIN); 1 to 255
+    uint32_t wake_timeout_us; //!< longest time fewer than wake_bytes bytes are held back; unused if wake_bytes is 1
+  };
+
   /**
    * \brief Instantiates the class and begins communication on the specified serial port
    * \param port Name of the serial port (e.g. "/dev/ttyUSB0")
    * \param baud_rate Serial communication baud rate
+   * \param io_pool Pool whose io threads the link shares, or NULL for an io thread of its own
    */
-  MavlinkSerial(std::string port, int baud_rate);
+  MavlinkSerial(std::string port, int baud_rate, IoServicePool *io_pool = NULL);
 
   /**
    * \brief Stops communication and closes the serial port before the object is destroyed
    */
   ~MavlinkSerial();
 
+  /**
+   * \brief Pace writes so that they don't outrun the serial line
+   *
+   * The write rate is limited to a fraction of the line rate derived from the baud rate (10 bits per byte for 8N1),
+   * so that bursts wait in the priority queues instead of the USB-serial adapter's buffer.
+   *
+   * \param utilization Fraction of the line rate to use; 0 disables pacing
+   * \param burst_bytes Number of bytes that may be written at once after the line has been idle
+   */
+  void set_tx_pacing(double utilization, size_t burst_bytes);
+
+  /**
+   * \brief Enable the low-latency mode (call before open())
+   *
+   * Sets ASYNC_LOW_LATENCY on the port, which makes USB-serial drivers such as ftdi_sio pass received bytes on after
+   * 1 ms instead of their default of up to 16 ms, and switches the tty to the given wake-up policy. Drivers that
+   * don't support ASYNC_LOW_LATENCY are left as they are, with a warning.
+   */
+  void set_low_latency(const LowLatencyOptions &options);
+
+  /**
+   * \brief Negotiate a faster baud rate with the firmware each time the link comes up (call before open())
+   *
+   * The port opens at the rate given to the constructor. After the first heartbeat, the highest rate up to
+   * max_baud_rate that is in the table of rosflight/mavlink/baud_rate.h is proposed to the firmware, and both ends
+   * switch to the rate it answers with. If no firmware heartbeat arrives at the new rate within
+   * MAVLINK_BAUD_RATE_TIMEOUT_MS, both ends fall back and the next lower rate is tried. A firmware that doesn't answer
+   * MAVLINK_SERIAL_BAUD_PROPOSALS proposals is left at the constructor's rate. Once upgraded, losing the heartbeats for
+   * as long also falls back and starts over, so a firmware that was reset is found again.
+   *
+   * Frames in flight while the rates change are lost. Write pacing stays at the rate set for the constructor's rate.
+   *
+   * \param max_baud_rate Highest rate to propose; the upgrade is disabled if it isn't above the constructor's rate
+   */
+  void set_baud_upgrade(int max_baud_rate);
+
+  /**
+   * \brief Get the baud rate the port is currently running at; safe to call from any thread
+   */
+  int get_baud_rate() const;
+
 private:
 
+  enum BaudUpgradeState
+  {
+    BAUD_UPGRADE_OFF, //!< disabled, or settled at the constructor's rate
+    BAUD_UPGRADE_WAITING, //!< waiting for a heartbeat at the constructor's rate before proposing
+    BAUD_UPGRADE_PROPOSED, //!< waiting for the firmware's answer to a proposal
+    BAUD_UPGRADE_VERIFYING, //!< switched, waiting for the first heartbeat at the new rate
+    BAUD_UPGRADE_UPGRADED //!< running at the new rate while heartbeats keep arriving
+  };
+
   //===========================================================================
   // methods
   //===========================================================================
@@ -76,13 +156,63 @@ private:
   /**
    * \brief Initiate an asynchronous read operation
    */
-  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler);
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler);
+
+  /**
+   * \brief Initialize an asynchronous gather write of all frames in the batch
+   */
+  virtual void do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler);
+
+  /**
+   * \brief Apply ASYNC_LOW_LATENCY and the wake-up policy to the open port
+   * \throws SerialException if the tty settings can't be changed
+   */
+  void configure_low_latency();
+
+  /**
+   * \brief Set the number of bytes that must be waiting before the port is readable
+   */
+  bool set_wake_bytes(uint8_t bytes);
+
+  /**
+   * \brief Make the pending read complete with fewer than wake_bytes bytes, if it is still the one it was armed for
+   */
+  void wake_timeout(const boost::system::error_code &error, uint64_t read_sequence);
+
+  /**
+   * \brief Advance the upgrade handshake on a firmware heartbeat
+   */
+  void handle_baud_heartbeat(const mavlink_message_t &msg);
+
+  /**
+   * \brief Switch to the rate the firmware answered a proposal with
+   */
+  void handle_baud_answer(const mavlink_message_t &msg);
+
+  /**
+   * \brief Propose the highest rate that hasn't failed yet, or settle if there is none
+   */
+  void propose_baud_rate();
+
+  /**
+   * \brief Handle a proposal that went unanswered, or heartbeats that stopped at the new rate
+   */
+  void baud_timeout(const boost::system::error_code &error, uint64_t timer_sequence);
+
+  /**
+   * \brief Go back to the constructor's rate and wait for a heartbeat there
+   */
+  void fall_back_baud_rate();
+
+  /**
+   * \brief Change the rate of the open port
+   */
+  void set_port_baud_rate(int baud_rate);
 
   /**
-   * \brief Initialize an asynchronous write operation
-   * \param check_write_state If true, only start another write operation if a write sequence is not already running
+   * \brief (Re)arm the handshake timer
    */
-  virtual void do_async_write(const boost::asio::const_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler);
+  void start_baud_timer(uint32_t ms);
 
   //===========================================================================
   // member variables
@@ -91,7 +221,29 @@ private:
   boost::asio::serial_port serial_port_; //!< boost serial port object
 
   std::string port_;
-  int baud_rate_;
+  int baud_rate_; //!< rate the port is opened at
+
+  bool low_latency_;
+  LowLatencyOptions low_latency_options_;
+  struct termios tty_; //!< tty settings after configure_low_latency(), so VMIN can be changed with a single call
+
+  boost::asio::steady_timer wake_timer_; //!< ends the wait for wake_bytes bytes after wake_timeout_us
+  HandlerMemory wake_handler_memory_[2]; //!< used alternately, since a cancelled wait is freed after its successor starts
+  uint64_t read_sequence_; //!< number of reads started, identifying the one wake_timer_ is armed for (io thread only)
+  bool wake_lowered_; //!< VMIN has been lowered to 1 by a wake timeout and must be restored (io thread only)
+
+  // upgrade handshake; apart from the current rate, only touched on the io thread once the port is open
+  int max_baud_rate_; //!< highest rate to propose
+  std::atomic<int> current_baud_rate_; //!< rate the port is running at
+  BaudUpgradeState baud_state_;
+  int baud_limit_; //!< highest rate to propose next; lowered below each rate that fails
+  int proposed_baud_rate_;
+  int baud_proposals_left_;
+  MavlinkDispatcher::SubscriptionId heartbeat_sub_;
+  MavlinkDispatcher::SubscriptionId named_value_sub_;
+  boost::asio::steady_timer baud_timer_;
+  HandlerMemory baud_handler_memory_[2]; //!< used alternately, since a cancelled wait is freed after its successor starts
+  uint64_t baud_timer_sequence_; //!< number of times baud_timer_ was armed, identifying the current wait
 };
 
 } // namespace mavrosflight
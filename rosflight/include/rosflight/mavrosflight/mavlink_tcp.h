@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_tcp.h
+ */
+
+#ifndef MAVROSFLIGHT_MAVLINK_TCP_H
+#define MAVROSFLIGHT_MAVLINK_TCP_H
+
+#include <rosflight/mavrosflight/mavlink_comm.h>
+
+#include <boost/asio.hpp>
+
+#include <string>
+
+#define MAVLINK_TCP_READ_BUF_SIZE 4096
+#define MAVLINK_TCP_CONNECT_TIMEOUT_MS 1000
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Link over a TCP connection, e.g. to a serial-to-network bridge such as ser2net
+ *
+ * As a client, the link connects to host:port; as a server, it listens on host:port and takes the first connection.
+ * Reconnecting resolves, connects and waits for a client asynchronously, so it never holds up a shared io thread; a
+ * server that is reconnecting waits for the next client for as long as it takes.
+ * Nagle's algorithm is disabled, so each write goes out as soon as it is made; use set_write_coalescing() to gather
+ * small frames into fewer segments within a latency budget instead. Keepalive probes and a send timeout let a peer
+ * that vanished without closing the connection be noticed, after which the link reconnects like any other.
+ */
+class MavlinkTCP : public MavlinkComm
+{
+public:
+
+  struct Options
+  {
+    int send_buffer_size; //!< SO_SNDBUF in bytes, or 0 for the system default; small keeps stale frames out of it
+    int receive_buffer_size; //!< SO_RCVBUF in bytes, or 0 for the system default
+    uint32_t connect_timeout_ms; //!< longest wait for the connection to be made, or for a client to connect to open()
+    uint32_t dead_peer_timeout_ms; //!< time after which an unresponsive peer is given up on, or 0 to wait forever
+
+    Options() :
+      send_buffer_size(0),
+      receive_buffer_size(0),
+      connect_timeout_ms(MAVLINK_TCP_CONNECT_TIMEOUT_MS),
+      dead_peer_timeout_ms(3000)
+    {}
+  };
+
+  /**
+   * \brief Set up a TCP link
+   * \param host Host to connect to, or as a server the address to listen on (e.g. "0.0.0.0")
+   * \param port Port to connect to or listen on
+   * \param server Whether to listen for a connection instead of making one
+   * \param options Socket options
+   * \param io_pool Pool whose io threads the link shares, or NULL for an io thread of its own
+   */
+  MavlinkTCP(std::string host, uint16_t port, bool server, const Options &options = Options(),
+             IoServicePool *io_pool = NULL);
+
+  /**
+   * \brief Stops communication and closes the sockets before the object is destroyed
+   */
+  ~MavlinkTCP();
+
+private:
+
+  //===========================================================================
+  // methods
+  //===========================================================================
+
+  virtual bool is_open();
+  virtual void do_open();
+  virtual void do_close();
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler);
+  virtual void do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler);
+  virtual void do_async_open(const IoHandler &handler);
+
+  /**
+   * \brief Make the connection as a client, giving up after the connect timeout
+   */
+  void connect();
+
+  /**
+   * \brief Take a connection as a server, giving up after the connect timeout
+   */
+  void accept();
+
+  /**
+   * \brief Open the listening socket; it is left closed if this fails
+   */
+  void listen(const boost::asio::ip::tcp::endpoint &endpoint);
+
+  /**
+   * \brief Handler for the end of resolving the host when reopening; goes on to connect, or to listen and accept
+   */
+  void async_resolve_end(const boost::system::error_code &error, boost::asio::ip::tcp::resolver::iterator endpoint,
+                         IoHandler handler);
+
+  /**
+   * \brief Wait for a client when reopening as a server
+   */
+  void async_accept(const IoHandler &handler);
+
+  /**
+   * \brief Handler for the end of connecting when reopening as a client
+   */
+  void async_connect_end(const boost::system::error_code &error, IoHandler handler);
+
+  /**
+   * \brief Give up on a connect that has taken longer than the connect timeout
+   */
+  void async_connect_timeout(const boost::system::error_code &error);
+
+  /**
+   * \brief Set up the new connection and report the outcome of reopening
+   */
+  void async_open_end(const boost::system::error_code &error, IoHandler handler);
+
+  /**
+   * \brief Wait for a socket to become ready
+   * \return False on timeout
+   */
+  bool wait_ready(int fd, short events);
+
+  /**
+   * \brief Apply the latency and dead peer options to the connected socket
+   */
+  void set_socket_options();
+
+  //===========================================================================
+  // member variables
+  //===========================================================================
+
+  std::string host_;
+  uint16_t port_;
+  bool server_;
+  Options options_;
+
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::ip::tcp::acceptor acceptor_; //!< listening socket in server mode, kept open across reconnects
+
+  boost::asio::ip::tcp::resolver resolver_; //!< resolves the host when reopening
+  boost::asio::steady_timer connect_timer_; //!< ends a connect that takes longer than the connect timeout
+  bool connecting_; //!< a connect is in progress when reopening (io thread only)
+  bool connect_timed_out_; //!< the connect timeout closed the socket under the connect (io thread only)
+  HandlerMemory open_handler_memory_; //!< operation memory for resolving, connecting and accepting when reopening
+  HandlerMemory connect_timer_memory_; //!< operation memory for the connect timeout
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MAVLINK_TCP_H
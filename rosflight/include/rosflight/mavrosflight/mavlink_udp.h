@@ -40,25 +40,54 @@
 #include <rosflight/mavrosflight/mavlink_comm.h>
 
 #include <boost/asio.hpp>
-#include <boost/function.hpp>
 
 #include <string>
 
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MAVLINK_UDP_READ_BUF_SIZE 65536
+#define MAVLINK_UDP_MAX_RECEIVE_BATCH 16
+#define MAVLINK_UDP_MIN_DATAGRAM_SLOT 2048
+
 namespace mavrosflight
 {
 
+/**
+ * \brief Link over UDP, e.g. to the SIL firmware
+ *
+ * Reads take every datagram that is waiting, up to a batch, with a single recvmmsg call, and the datagrams are
+ * handed on back to back, so that any number of frames per datagram is fine. Writes need no batching here: all
+ * queued frames already go out in a single datagram, up to the write MTU (see set_write_coalescing()).
+ */
 class MavlinkUDP : public MavlinkComm
 {
 public:
 
+  struct Options
+  {
+    int send_buffer_size; //!< SO_SNDBUF in bytes, or 0 for the system default
+    int receive_buffer_size; //!< SO_RCVBUF in bytes, or 0 for the system default
+    size_t receive_batch; //!< most datagrams taken per read, 1 to MAVLINK_UDP_MAX_RECEIVE_BATCH
+
+    Options() :
+      send_buffer_size(1000*MAVLINK_MAX_PACKET_LEN),
+      receive_buffer_size(1000*MAVLINK_SERIAL_READ_BUF_SIZE),
+      receive_batch(MAVLINK_UDP_MAX_RECEIVE_BATCH)
+    {}
+  };
+
   /**
    * \brief Instantiates the class and begins communication on the specified serial port
    * \param bind_host Host where this node is running
    * \param bind_port Port number for this node
    * \param remote_host Host where the other node is running
    * \param remote_port Port number for the other node
+   * \param options Socket options
+   * \param io_pool Pool whose io threads the link shares, or NULL for an io thread of its own
    */
-  MavlinkUDP(std::string bind_host, uint16_t bind_port, std::string remote_host, uint16_t remote_port);
+  MavlinkUDP(std::string bind_host, uint16_t bind_port, std::string remote_host, uint16_t remote_port,
+             const Options &options = Options(), IoServicePool *io_pool = NULL);
 
   /**
    * \brief Stops communication and closes the serial port before the object is destroyed
@@ -74,8 +103,29 @@ private:
   virtual bool is_open();
   virtual void do_open();
   virtual void do_close();
-  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler);
-  virtual void do_async_write(const boost::asio::const_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler);
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler);
+  virtual void do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler);
+
+  /**
+   * \brief Take the waiting datagrams into the buffer, back to back, without blocking
+   * \param buffer Buffer to fill; split into equal slots, one per datagram
+   * \param bytes_transferred Set to the number of bytes taken
+   * \param error Set if the socket reported an error
+   * \return False if no datagram was waiting
+   */
+  bool receive_batch(const boost::asio::mutable_buffers_1 &buffer, size_t *bytes_transferred,
+                     boost::system::error_code *error);
+
+  /**
+   * \brief Handler for the socket becoming readable while a read is pending
+   */
+  void read_ready(const boost::system::error_code &error, const boost::asio::mutable_buffers_1 &buffer,
+                  const IoHandler &handler);
+
+  /**
+   * \brief Wait for the socket to become readable, then complete the read
+   */
+  void wait_readable(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler);
 
   //===========================================================================
   // member variables
@@ -90,6 +140,16 @@ private:
   boost::asio::ip::udp::socket socket_;
   boost::asio::ip::udp::endpoint bind_endpoint_;
   boost::asio::ip::udp::endpoint remote_endpoint_;
+  bool resolved_; //!< the endpoints have been resolved and are reused when reopening
+
+  Options options_;
+  struct mmsghdr rx_msgs_[MAVLINK_UDP_MAX_RECEIVE_BATCH];
+  struct iovec rx_iov_[MAVLINK_UDP_MAX_RECEIVE_BATCH];
+  struct sockaddr_in rx_sender_; //!< written by the kernel for every datagram, so it ends up holding the last sender
+  bool rx_truncation_reported_;
+
+  HandlerMemory read_wait_memory_; //!< operation memory for the wait for the socket to become readable
+  HandlerMemory read_post_memory_; //!< operation memory for completing a read that found datagrams waiting
 };
 
 } // namespace mavrosflight
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2017 Daniel Koch, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_unix.h
+ */
+
+#ifndef MAVROSFLIGHT_MAVLINK_UNIX_H
+#define MAVROSFLIGHT_MAVLINK_UNIX_H
+
+#include <rosflight/mavrosflight/mavlink_comm.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/generic/seq_packet_protocol.hpp>
+
+#include <string>
+
+#define MAVLINK_UNIX_READ_BUF_SIZE 65536
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Link to a co-located firmware over a SOCK_SEQPACKET unix domain socket
+ *
+ * The other end is a rosflight_firmware::UDPBoard listening on the same path, e.g. the SIL_Board of the Gazebo plugin.
+ * Unlike UDP over loopback, the kernel keeps packet boundaries without checksums or routing, and a full receiver
+ * makes the sender wait instead of losing packets. The connection closing when the firmware exits is noticed at once,
+ * and the link reconnects like a serial port that was unplugged.
+ */
+class MavlinkUnix : public MavlinkComm
+{
+public:
+
+  /**
+   * \brief Set up a unix domain socket link
+   * \param path Path of the socket the firmware listens on; a leading '@' names a socket in the abstract namespace
+   * \param io_pool Pool whose io threads the link shares, or NULL for an io thread of its own
+   */
+  MavlinkUnix(std::string path, IoServicePool *io_pool = NULL);
+
+  /**
+   * \brief Stops communication and closes the socket before the object is destroyed
+   */
+  ~MavlinkUnix();
+
+private:
+
+  //===========================================================================
+  // methods
+  //===========================================================================
+
+  virtual bool is_open();
+  virtual void do_open();
+  virtual void do_close();
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler);
+  virtual void do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler);
+
+  /**
+   * \brief Handler for the end of a receive, reporting an empty packet as the end of the connection
+   */
+  void read_end(const boost::system::error_code &error, size_t bytes_transferred, const IoHandler &handler);
+
+  //===========================================================================
+  // member variables
+  //===========================================================================
+
+  std::string path_;
+
+  boost::asio::generic::seq_packet_protocol::socket socket_;
+  boost::asio::socket_base::message_flags read_flags_; //!< flags of the last packet received
+  HandlerMemory read_memory_; //!< operation memory for a receive, which wraps the handler given to do_async_read()
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MAVLINK_UNIX_H
@@ -60,7 +60,8 @@ public:
   /**
    * \brief Instantiates the class and begins communication on the specified serial port
    * \param mavlink_comm Reference to a MavlinkComm object (serial or UDP)
-   * \param baud_rate Serial communication baud rate
+   * \param sysid System ID of the vehicle; messages are sent from it and addressed to it
+   * \param compid Component ID messages are sent from
    */
   MavROSflight(MavlinkComm& mavlink_comm, uint8_t sysid = 1, uint8_t compid = 50);
 
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file message_traits.h
+ *
+ * Compile-time mapping from decoded mavlink payload structs to their message IDs and decode functions, used for
+ * typed subscriptions.
+ */
+
+#ifndef MAVROSFLIGHT_MESSAGE_TRAITS_H
+#define MAVROSFLIGHT_MESSAGE_TRAITS_H
+
+#include <rosflight/mavrosflight/mavlink_bridge.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Traits for a decoded mavlink payload type; specialized for each supported message below
+ */
+template <typename T>
+struct MessageTraits;
+
+#define MAVROSFLIGHT_MESSAGE_TRAITS(name, NAME) \
+  template <> \
+  struct MessageTraits<mavlink_##name##_t> \
+  { \
+    enum { ID = MAVLINK_MSG_ID_##NAME }; \
+    static void decode(const mavlink_message_t *msg, mavlink_##name##_t *payload) \
+    { \
+      mavlink_msg_##name##_decode(msg, payload); \
+    } \
+  };
+
+MAVROSFLIGHT_MESSAGE_TRAITS(attitude_quaternion, ATTITUDE_QUATERNION)
+MAVROSFLIGHT_MESSAGE_TRAITS(diff_pressure, DIFF_PRESSURE)
+MAVROSFLIGHT_MESSAGE_TRAITS(heartbeat, HEARTBEAT)
+MAVROSFLIGHT_MESSAGE_TRAITS(named_command_struct, NAMED_COMMAND_STRUCT)
+MAVROSFLIGHT_MESSAGE_TRAITS(named_value_float, NAMED_VALUE_FLOAT)
+MAVROSFLIGHT_MESSAGE_TRAITS(named_value_int, NAMED_VALUE_INT)
+MAVROSFLIGHT_MESSAGE_TRAITS(param_value, PARAM_VALUE)
+MAVROSFLIGHT_MESSAGE_TRAITS(pid_torque, PID_TORQUE)
+MAVROSFLIGHT_MESSAGE_TRAITS(rc_channels, RC_CHANNELS)
+MAVROSFLIGHT_MESSAGE_TRAITS(rosflight_cmd_ack, ROSFLIGHT_CMD_ACK)
+MAVROSFLIGHT_MESSAGE_TRAITS(rosflight_gnss, ROSFLIGHT_GNSS)
+MAVROSFLIGHT_MESSAGE_TRAITS(rosflight_gnss_raw, ROSFLIGHT_GNSS_RAW)
+MAVROSFLIGHT_MESSAGE_TRAITS(rosflight_hard_error, ROSFLIGHT_HARD_ERROR)
+MAVROSFLIGHT_MESSAGE_TRAITS(rosflight_output_raw, ROSFLIGHT_OUTPUT_RAW)
+MAVROSFLIGHT_MESSAGE_TRAITS(rosflight_status, ROSFLIGHT_STATUS)
+MAVROSFLIGHT_MESSAGE_TRAITS(rosflight_version, ROSFLIGHT_VERSION)
+MAVROSFLIGHT_MESSAGE_TRAITS(small_baro, SMALL_BARO)
+MAVROSFLIGHT_MESSAGE_TRAITS(small_imu, SMALL_IMU)
+MAVROSFLIGHT_MESSAGE_TRAITS(small_mag, SMALL_MAG)
+MAVROSFLIGHT_MESSAGE_TRAITS(small_range, SMALL_RANGE)
+MAVROSFLIGHT_MESSAGE_TRAITS(statustext, STATUSTEXT)
+MAVROSFLIGHT_MESSAGE_TRAITS(timesync, TIMESYNC)
+MAVROSFLIGHT_MESSAGE_TRAITS(total_torque, TOTAL_TORQUE)
+
+#undef MAVROSFLIGHT_MESSAGE_TRAITS
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_MESSAGE_TRAITS_H
@@ -60,7 +60,7 @@ public:
   MAV_PARAM_TYPE getType() const;
   double getValue() const;
 
-  void requestSet(double value, mavlink_message_t *msg);
+  void requestSet(double value, uint8_t sysid, uint8_t compid, mavlink_message_t *msg);
   bool handleUpdate(const mavlink_param_value_t &msg);
 
 private:
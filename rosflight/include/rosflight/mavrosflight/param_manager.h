@@ -39,7 +39,6 @@
 
 #include <rosflight/mavrosflight/mavlink_bridge.h>
 #include <rosflight/mavrosflight/mavlink_comm.h>
-#include <rosflight/mavrosflight/mavlink_listener_interface.h>
 #include <rosflight/mavrosflight/param.h>
 #include <rosflight/mavrosflight/param_listener_interface.h>
 
@@ -53,14 +52,12 @@
 namespace mavrosflight
 {
 
-class ParamManager : public MavlinkListenerInterface
+class ParamManager
 {
 public:
-  ParamManager(MavlinkComm * const comm);
+  ParamManager(MavlinkComm * const comm, uint8_t sysid = 1, uint8_t compid = 50);
   ~ParamManager();
 
-  virtual void handle_mavlink_message(const mavlink_message_t &msg);
-
   bool unsaved_changes();
 
   bool get_param_value(std::string name, double *value);
@@ -84,14 +81,18 @@ private:
   void request_param_list();
   void request_param(int index);
 
-  void handle_param_value_msg(const mavlink_message_t &msg);
-  void handle_command_ack_msg(const mavlink_message_t &msg);
+  void handle_param_value_msg(const mavlink_param_value_t &param);
+  void handle_command_ack_msg(const mavlink_rosflight_cmd_ack_t &ack);
 
   bool is_param_id(std::string name);
 
   std::vector<ParamListenerInterface*> listeners_;
 
   MavlinkComm *comm_;
+  uint8_t sysid_; //!< system ID of the vehicle, sent from and addressed to
+  uint8_t compid_; //!< component ID sent from
+  MavlinkDispatcher::SubscriptionId param_value_sub_;
+  MavlinkDispatcher::SubscriptionId command_ack_sub_;
   std::map<std::string, Param> params_;
 
   bool unsaved_changes_;
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file shm_ring.h
+ */
+
+#ifndef MAVROSFLIGHT_SHM_RING_H
+#define MAVROSFLIGHT_SHM_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_RING_DEFAULT_CAPACITY (64 * 1024)
+#define SHM_RING_SPIN_ITERATIONS 2000
+
+// a loopback link named "/name" is made of the rings "/name_fc_to_host" and "/name_host_to_fc"
+#define SHM_RING_FC_TO_HOST_SUFFIX "_fc_to_host"
+#define SHM_RING_HOST_TO_FC_SUFFIX "_host_to_fc"
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Single-producer, single-consumer byte ring in POSIX shared memory
+ *
+ * Both ends open the ring by name, so they can live in one process or in two. Reads and writes are plain copies with
+ * an acquire/release handoff of the indices, so moving bytes takes no system call. A consumer with nothing to read
+ * can block in wait_readable(), which spins briefly and then sleeps on a futex in the shared block; the producer only
+ * makes the wake-up call when a consumer is actually asleep.
+ *
+ * The shared memory object is left in place when the ring is closed, so either end can be restarted and find the
+ * other again. Bytes written while the consumer was away are still read by it afterwards.
+ */
+class ShmRing : private boost::noncopyable
+{
+public:
+
+  ShmRing() :
+    control_(NULL), data_(NULL), capacity_(0), map_size_(0), cached_head_(0), cached_tail_(0), spin_iterations_(0)
+  {}
+
+  ~ShmRing() { close(); }
+
+  /**
+   * \brief Open the ring with the given name, creating it if neither end has yet
+   * \param name Name of the shared memory object, e.g. "/rosflight_fc_to_host"
+   * \param capacity Size of the ring in bytes for a newly created ring; an existing ring keeps its size
+   * \throws boost::system::system_error if the shared memory object can't be created or mapped
+   */
+  void open(const std::string &name, size_t capacity = SHM_RING_DEFAULT_CAPACITY)
+  {
+    close();
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+      throw_errno("shm_open " + name);
+
+    // the lock keeps both ends from sizing a new object at the same time
+    flock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, sizeof(Control) + capacity) != 0)
+        || fstat(fd, &st) != 0)
+    {
+      int error = errno;
+      ::close(fd);
+      errno = error;
+      throw_errno("sizing " + name);
+    }
+    flock(fd, LOCK_UN);
+
+    if ((size_t) st.st_size <= sizeof(Control))
+    {
+      ::close(fd);
+      errno = EINVAL;
+      throw_errno(name + " is not a ring");
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+      throw_errno("mmap " + name);
+
+    map_size_ = st.st_size;
+    control_ = (Control*) map;
+    data_ = (uint8_t*) map + sizeof(Control);
+    capacity_ = map_size_ - sizeof(Control);
+    cached_head_ = control_->head.load(std::memory_order_acquire);
+    cached_tail_ = control_->tail.load(std::memory_order_acquire);
+
+    // spinning only helps if the producer can run at the same time
+    spin_iterations_ = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_RING_SPIN_ITERATIONS : 0;
+  }
+
+  void close()
+  {
+    if (control_ != NULL)
+    {
+      munmap(control_, map_size_);
+      control_ = NULL;
+      data_ = NULL;
+    }
+  }
+
+  bool is_open() const { return control_ != NULL; }
+
+  size_t capacity() const { return capacity_; }
+
+  /**
+   * \brief Number of bytes that can be written without overwriting unread ones; producer only
+   */
+  size_t writable()
+  {
+    cached_tail_ = control_->tail.load(std::memory_order_acquire);
+    return capacity_ - (control_->head.load(std::memory_order_relaxed) - cached_tail_);
+  }
+
+  /**
+   * \brief Copy as many bytes as fit into the ring; producer only
+   * \return Number of bytes written
+   */
+  size_t write(const uint8_t *src, size_t len)
+  {
+    uint64_t head = control_->head.load(std::memory_order_relaxed);
+    if (capacity_ - (head - cached_tail_) < len)
+      cached_tail_ = control_->tail.load(std::memory_order_acquire);
+    len = std::min(len, (size_t) (capacity_ - (head - cached_tail_)));
+    if (len == 0)
+      return 0;
+
+    size_t offset = head % capacity_;
+    size_t first = std::min(len, capacity_ - offset);
+    memcpy(data_ + offset, src, first);
+    memcpy(data_, src + first, len - first);
+
+    // sequentially consistent, so that either the consumer sees the new head or we see that it went to sleep
+    control_->head.store(head + len, std::memory_order_seq_cst);
+    if (control_->reader_waiting.load(std::memory_order_seq_cst))
+    {
+      control_->wakeups.fetch_add(1, std::memory_order_seq_cst);
+      futex(FUTEX_WAKE, 1, NULL);
+    }
+    return len;
+  }
+
+  /**
+   * \brief Copy a whole message into the ring, or nothing if it doesn't fit; producer only
+   */
+  bool write_all(const uint8_t *src, size_t len)
+  {
+    uint64_t head = control_->head.load(std::memory_order_relaxed);
+    if (capacity_ - (head - cached_tail_) < len && writable() < len)
+      return false;
+    write(src, len);
+    return true;
+  }
+
+  /**
+   * \brief Number of bytes waiting to be read, as of the last time the ring was seen empty; consumer only
+   */
+  size_t readable()
+  {
+    uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    if (cached_head_ == tail)
+      cached_head_ = control_->head.load(std::memory_order_acquire);
+    return cached_head_ - tail;
+  }
+
+  /**
+   * \brief Copy up to len bytes out of the ring; consumer only
+   * \return Number of bytes read
+   */
+  size_t read(uint8_t *dst, size_t len)
+  {
+    uint64_t tail = control_->tail.load(std::memory_order_relaxed);
+    if (cached_head_ - tail < len)
+      cached_head_ = control_->head.load(std::memory_order_acquire);
+    len = std::min(len, (size_t) (cached_head_ - tail));
+    if (len == 0)
+      return 0;
+
+    size_t offset = tail % capacity_;
+    size_t first = std::min(len, capacity_ - offset);
+    memcpy(dst, data_ + offset, first);
+    memcpy(dst + first, data_, len - first);
+
+    control_->tail.store(tail + len, std::memory_order_release);
+    return len;
+  }
+
+  /**
+   * \brief Block until there is something to read, the timeout expires or wake() is called; consumer only
+   * \return True if there is something to read
+   */
+  bool wait_readable(uint32_t timeout_us)
+  {
+    for (int i = 0; i < spin_iterations_; i++)
+    {
+      if (readable() > 0)
+        return true;
+      cpu_relax();
+    }
+
+    uint32_t wakeups = control_->wakeups.load(std::memory_order_seq_cst);
+    control_->reader_waiting.store(1, std::memory_order_seq_cst);
+    if (readable() == 0)
+    {
+      struct timespec timeout;
+      timeout.tv_sec = timeout_us / 1000000;
+      timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+      futex(FUTEX_WAIT, wakeups, &timeout);
+    }
+    control_->reader_waiting.store(0, std::memory_order_relaxed);
+
+    return readable() > 0;
+  }
+
+  /**
+   * \brief Wake a consumer blocked in wait_readable(), e.g. to shut it down; callable from any thread
+   */
+  void wake()
+  {
+    control_->wakeups.fetch_add(1, std::memory_order_seq_cst);
+    futex(FUTEX_WAKE, 1, NULL);
+  }
+
+private:
+
+  /**
+   * \brief Shared state at the start of the mapping; a newly sized object is all zeros, which is an empty ring
+   */
+  struct Control
+  {
+    alignas(64) std::atomic<uint64_t> head; //!< total bytes ever written
+    alignas(64) std::atomic<uint64_t> tail; //!< total bytes ever read
+    alignas(64) std::atomic<uint32_t> wakeups; //!< futex word, bumped on every wake-up
+    std::atomic<uint32_t> reader_waiting; //!< set while the consumer may be asleep on the futex
+  };
+
+  static void cpu_relax()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  long futex(int op, uint32_t value, const struct timespec *timeout)
+  {
+    // not FUTEX_PRIVATE_FLAG, because the other end may be in another process
+    return syscall(SYS_futex, &control_->wakeups, op, value, timeout, NULL, 0);
+  }
+
+  static void throw_errno(const std::string &what)
+  {
+    throw boost::system::system_error(errno, boost::system::system_category(), what);
+  }
+
+  Control *control_;
+  uint8_t *data_;
+  size_t capacity_;
+  size_t map_size_;
+
+  uint64_t cached_head_; //!< consumer's last view of head, so most reads don't touch the producer's cache line
+  uint64_t cached_tail_; //!< producer's last view of tail, so most writes don't touch the consumer's cache line
+  int spin_iterations_; //!< polls of the ring before wait_readable() goes to sleep
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_SHM_RING_H
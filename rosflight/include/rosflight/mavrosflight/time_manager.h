@@ -39,37 +39,49 @@
 
 #include <rosflight/mavrosflight/mavlink_bridge.h>
 #include <rosflight/mavrosflight/mavlink_comm.h>
-#include <rosflight/mavrosflight/mavlink_listener_interface.h>
 
 #include <ros/ros.h>
 
+#include <atomic>
 #include <cstdlib>
 #include <stdint.h>
 
 namespace mavrosflight
 {
 
-class TimeManager : MavlinkListenerInterface
+class TimeManager
 {
 public:
-  TimeManager(MavlinkComm *comm);
-
-  virtual void handle_mavlink_message(const mavlink_message_t &msg);
+  TimeManager(MavlinkComm *comm, uint8_t sysid = 1, uint8_t compid = 50);
+  ~TimeManager();
 
   ros::Time get_ros_time_ms(uint32_t boot_ms);
   ros::Time get_ros_time_us(uint64_t boot_us);
 
+  /**
+   * \brief Convert a steady clock arrival time, such as MavlinkComm::rx_time_ns(), to ROS time
+   *
+   * Under simulated time, which doesn't advance with the steady clock, this is just the current time.
+   * \param rx_ns Steady clock time in nanoseconds; 0 gives the current time
+   */
+  ros::Time get_ros_time_rx(uint64_t rx_ns);
+
 private:
+  void handle_timesync_msg(const mavlink_timesync_t &tsync);
+
   MavlinkComm *comm_;
+  uint8_t sysid_; //!< system ID of the vehicle, sent from
+  uint8_t compid_; //!< component ID sent from
+  MavlinkDispatcher::SubscriptionId timesync_sub_;
 
   ros::Timer time_sync_timer_;
   void timer_callback(const ros::TimerEvent &event);
 
   double offset_alpha_;
-  int64_t offset_ns_;
+  std::atomic<int64_t> offset_ns_; //!< written on the io thread, read by whichever thread converts a time stamp
   ros::Duration offset_;
 
-  bool initialized_;
+  std::atomic<bool> initialized_; //!< set on the io thread once offset_ns_ holds a measured offset
 };
 
 } // namespace mavrosflight
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file token_bucket.h
+ */
+
+#ifndef MAVROSFLIGHT_TOKEN_BUCKET_H
+#define MAVROSFLIGHT_TOKEN_BUCKET_H
+
+#include <stdint.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Token bucket rate limiter
+ *
+ * Tokens accumulate at a fixed rate up to the capacity of the bucket. The caller passes the current time in
+ * nanoseconds from a monotonic clock. Consuming may take the bucket into debt, which later requests have to wait
+ * out. Not thread safe; the owner is expected to serialize access.
+ */
+class TokenBucket
+{
+public:
+
+  /**
+   * \brief Create a disabled bucket, which never limits
+   */
+  TokenBucket() : rate_(0), capacity_(0), tokens_(0), last_ns_(0) {}
+
+  /**
+   * \brief Create a bucket, initially full
+   * \param rate Tokens added per second; 0 disables limiting
+   * \param capacity Maximum number of tokens that can accumulate
+   */
+  TokenBucket(double rate, double capacity) : rate_(0), capacity_(0), tokens_(0), last_ns_(0)
+  {
+    configure(rate, capacity);
+  }
+
+  /**
+   * \brief Change the rate and capacity, and refill the bucket
+   * \param rate Tokens added per second; 0 disables limiting
+   * \param capacity Maximum number of tokens that can accumulate
+   */
+  void configure(double rate, double capacity)
+  {
+    rate_ = rate > 0 ? rate : 0;
+    capacity_ = capacity > 0 ? capacity : 0;
+    tokens_ = capacity_;
+    last_ns_ = 0;
+  }
+
+  bool enabled() const { return rate_ > 0; }
+  double rate() const { return rate_; }
+  double capacity() const { return capacity_; }
+
+  /**
+   * \brief Get the number of tokens currently available (negative while in debt)
+   */
+  double available(uint64_t now_ns)
+  {
+    refill(now_ns);
+    return tokens_;
+  }
+
+  /**
+   * \brief Get the time until the given number of tokens is available
+   * \param n Number of tokens; requests larger than the capacity only wait for a full bucket
+   * \return Wait time in nanoseconds, 0 if the tokens are available now
+   */
+  uint64_t wait_ns(double n, uint64_t now_ns)
+  {
+    if (!enabled())
+      return 0;
+
+    refill(now_ns);
+    if (n > capacity_)
+      n = capacity_;
+    if (tokens_ >= n)
+      return 0;
+    return (uint64_t) ((n - tokens_) / rate_ * 1e9) + 1;
+  }
+
+  /**
+   * \brief Take tokens if they are available
+   * \return True if the tokens were taken
+   */
+  bool try_consume(double n, uint64_t now_ns)
+  {
+    if (!enabled())
+      return true;
+
+    refill(now_ns);
+    if (tokens_ < n)
+      return false;
+    tokens_ -= n;
+    return true;
+  }
+
+  /**
+   * \brief Take tokens unconditionally, going into debt if there aren't enough
+   */
+  void consume(double n, uint64_t now_ns)
+  {
+    if (!enabled())
+      return;
+
+    refill(now_ns);
+    tokens_ -= n;
+  }
+
+private:
+
+  void refill(uint64_t now_ns)
+  {
+    if (last_ns_ != 0 && now_ns > last_ns_)
+    {
+      tokens_ += (now_ns - last_ns_) * 1e-9 * rate_;
+      if (tokens_ > capacity_)
+        tokens_ = capacity_;
+    }
+    if (now_ns > last_ns_)
+      last_ns_ = now_ns;
+  }
+
+  double rate_; //!< tokens per second
+  double capacity_; //!< maximum number of tokens
+  double tokens_; //!< tokens currently available
+  uint64_t last_ns_; //!< time of the last refill, 0 before the first one
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_TOKEN_BUCKET_H
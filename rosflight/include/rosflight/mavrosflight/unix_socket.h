@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file unix_socket.h
+ */
+
+#ifndef MAVROSFLIGHT_UNIX_SOCKET_H
+#define MAVROSFLIGHT_UNIX_SOCKET_H
+
+#include <string>
+
+#include <boost/asio/generic/seq_packet_protocol.hpp>
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Address of the SOCK_SEQPACKET unix domain socket between rosflight_io and a co-located firmware
+ *
+ * The firmware end listens and rosflight_io connects, the way it would open a serial port. A path starting with '@'
+ * names a socket in the abstract namespace, which leaves no file behind.
+ *
+ * \param path Socket path, e.g. "/tmp/rosflight.sock" or "@rosflight"
+ * \param endpoint Set to the address
+ * \return False if the path is empty or too long for a socket address
+ */
+inline bool unix_socket_endpoint(const std::string &path, boost::asio::generic::seq_packet_protocol::endpoint *endpoint)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path))
+    return false;
+
+  memcpy(address.sun_path, path.data(), path.size());
+  if (path[0] == '@')
+    address.sun_path[0] = '\0';
+
+  // an abstract name is exactly as long as given, without a terminating null
+  size_t length = offsetof(struct sockaddr_un, sun_path) + path.size() + (path[0] == '@' ? 0 : 1);
+  *endpoint = boost::asio::generic::seq_packet_protocol::endpoint(&address, length);
+  return true;
+}
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_UNIX_SOCKET_H
@@ -39,8 +39,12 @@
 
 #include <rosflight/mavrosflight/mavlink_bridge.h>
 
+#include <boost/asio/buffer.hpp>
+
 #include <stdint.h>
 
+#define MAVLINK_MAX_COALESCE_FRAMES 32
+
 namespace mavrosflight
 {
 
@@ -49,21 +53,52 @@ namespace mavrosflight
  */
 struct WriteBuffer
 {
-  uint8_t data[MAVLINK_MAX_PACKET_LEN];
+  uint8_t data[MAVLINK2_MAX_PACKET_LEN];
   size_t len;
   size_t pos;
+  uint32_t msgid;
+  uint64_t enqueue_ns; //!< steady clock time at which the frame was queued
 
-  WriteBuffer() : len(0), pos(0) {}
+  WriteBuffer() : len(0), pos(0), msgid(0), enqueue_ns(0) {}
 
-  WriteBuffer(const uint8_t * buf, uint16_t len) : len(len), pos(0)
+  WriteBuffer(const uint8_t * buf, uint16_t len) : len(len), pos(0), msgid(0), enqueue_ns(0)
   {
-    assert(len <= MAVLINK_MAX_PACKET_LEN); //! \todo Do something less catastrophic here
+    assert(len <= MAVLINK2_MAX_PACKET_LEN); //! \todo Do something less catastrophic here
     memcpy(data, buf, len);
   }
 
-  uint8_t * dpos() { return data + pos; }
+  const uint8_t * dpos() const { return data + pos; }
+
+  size_t nbytes() const { return len - pos; }
+};
+
+/**
+ * \brief Fixed-capacity buffer sequence for handing several queued frames to a single gather write
+ *
+ * Copying it (as asio does when it starts an operation) never allocates, unlike a std::vector of buffers.
+ */
+struct WriteBufferSequence
+{
+  typedef boost::asio::const_buffer value_type;
+  typedef const boost::asio::const_buffer * const_iterator;
+
+  boost::asio::const_buffer buffers[MAVLINK_MAX_COALESCE_FRAMES];
+  size_t count;
+  size_t bytes;
+
+  WriteBufferSequence() : count(0), bytes(0) {}
+
+  void clear() { count = 0; bytes = 0; }
+  bool full() const { return count >= MAVLINK_MAX_COALESCE_FRAMES; }
+
+  void push_back(const uint8_t * data, size_t len)
+  {
+    buffers[count++] = boost::asio::const_buffer(data, len);
+    bytes += len;
+  }
 
-  size_t nbytes() { return len - pos; }
+  const_iterator begin() const { return buffers; }
+  const_iterator end() const { return buffers + count; }
 };
 
 } // namespace mavrosflight
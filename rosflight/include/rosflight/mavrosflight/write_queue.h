@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file write_queue.h
+ */
+
+#ifndef MAVROSFLIGHT_WRITE_QUEUE_H
+#define MAVROSFLIGHT_WRITE_QUEUE_H
+
+#include <rosflight/mavrosflight/write_buffer.h>
+
+#include <atomic>
+#include <cstddef>
+
+#include <stdint.h>
+
+namespace mavrosflight
+{
+
+/**
+ * \brief Bounded multi-producer, single-consumer queue of preallocated write buffers
+ *
+ * All slots are allocated when the queue is constructed, so pushing and popping frames never touches the heap.
+ * Any number of threads may call push() concurrently without taking a lock. front() and pop() must only be called
+ * by the single consumer that currently owns the write sequence.
+ */
+class WriteQueue
+{
+public:
+
+  /**
+   * \brief Allocates the queue slots
+   * \param capacity Minimum number of frames the queue can hold (rounded up to a power of two)
+   */
+  explicit WriteQueue(size_t capacity);
+
+  ~WriteQueue();
+
+  /**
+   * \brief Copy a serialized frame into the next free slot
+   * \param data Pointer to the serialized frame
+   * \param len Length of the frame in bytes
+   * \param msgid Message ID of the frame
+   * \return True if the frame was queued, false if the queue was full and the frame was dropped
+   */
+  bool push(const uint8_t *data, size_t len, uint32_t msgid);
+
+  /**
+   * \brief Get the oldest queued buffer without removing it (consumer only)
+   * \return Pointer to the buffer, or NULL if no complete frame is queued
+   */
+  WriteBuffer* front() { return peek(0); }
+
+  /**
+   * \brief Get a queued buffer without removing it (consumer only)
+   * \param index Position in the queue, where 0 is the oldest frame
+   * \return Pointer to the buffer, or NULL if there is no complete frame at that position
+   */
+  WriteBuffer* peek(size_t index);
+
+  /**
+   * \brief Release the oldest queued buffer back to the producers (consumer only)
+   */
+  void pop();
+
+  /**
+   * \brief Check whether a complete frame is waiting at the front of the queue
+   */
+  bool empty() const;
+
+  size_t size() const;
+  size_t capacity() const { return mask_ + 1; }
+
+  size_t high_water_mark() const { return high_water_.load(std::memory_order_relaxed); }
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    WriteBuffer buffer;
+  };
+
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  WriteQueue(const WriteQueue&);
+  WriteQueue& operator=(const WriteQueue&);
+
+  Slot *slots_;
+  size_t mask_;
+
+  char pad0_[CACHE_LINE_SIZE];
+  std::atomic<size_t> enqueue_pos_; //!< next position to be claimed by a producer
+  char pad1_[CACHE_LINE_SIZE];
+  std::atomic<size_t> dequeue_pos_; //!< position of the oldest frame, owned by the consumer
+  char pad2_[CACHE_LINE_SIZE];
+
+  std::atomic<size_t> high_water_; //!< largest queue depth observed
+  std::atomic<uint64_t> dropped_; //!< frames rejected because the queue was full
+};
+
+} // namespace mavrosflight
+
+#endif // MAVROSFLIGHT_WRITE_QUEUE_H
@@ -37,8 +37,10 @@
 #ifndef ROSFLIGHT_IO_MAVROSFLIGHT_ROS_H
 #define ROSFLIGHT_IO_MAVROSFLIGHT_ROS_H
 
+#include <atomic>
 #include <map>
 #include <string>
+#include <vector>
 
 #include <ros/ros.h>
 
@@ -71,16 +73,25 @@
 #include <rosflight_msgs/GNSSRaw.h>
 #include <rosflight_msgs/GNSS.h>
 #include <rosflight_msgs/AddedTorque.h>
+#include <rosflight_msgs/LinkStats.h>
 
 #include <rosflight_msgs/ParamFile.h>
 #include <rosflight_msgs/ParamGet.h>
 #include <rosflight_msgs/ParamSet.h>
 
 #include <rosflight/mavrosflight/mavrosflight.h>
+#include <rosflight/mavrosflight/handoff_queue.h>
+#include <rosflight/mavrosflight/io_service_pool.h>
 #include <rosflight/mavrosflight/mavlink_comm.h>
-#include <rosflight/mavrosflight/mavlink_listener_interface.h>
+#include <rosflight/mavrosflight/mavlink_dispatcher.h>
+#include <rosflight/mavrosflight/mavlink_recorder.h>
+#include <rosflight/mavrosflight/mavlink_router.h>
 #include <rosflight/mavrosflight/param_listener_interface.h>
 
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
 #include <geometry_msgs/Quaternion.h>
 #include <geometry_msgs/Vector3Stamped.h>
 
@@ -88,14 +99,24 @@ namespace rosflight_io
 {
 
 class rosflightIO :
-  public mavrosflight::MavlinkListenerInterface,
   public mavrosflight::ParamListenerInterface
 {
 public:
-  rosflightIO();
+
+  /**
+   * \brief Connect to a flight controller and advertise its topics and services
+   * \param nh Namespace of the topics and services
+   * \param nh_private Namespace of the parameters
+   * \param io_pool Pool whose io threads the link shares with other vehicles, or NULL for an io thread of its own
+   */
+  rosflightIO(ros::NodeHandle nh = ros::NodeHandle(), ros::NodeHandle nh_private = ros::NodeHandle("~"),
+              mavrosflight::IoServicePool *io_pool = NULL);
   ~rosflightIO();
 
-  virtual void handle_mavlink_message(const mavlink_message_t &msg);
+  /**
+   * \brief Read the io thread scheduling options from the io_thread_priority, io_thread_cpus and lock_memory parameters
+   */
+  static mavrosflight::MavlinkComm::IoThreadOptions io_thread_options(ros::NodeHandle &nh_private);
 
   virtual void on_new_param_received(std::string name, double value);
   virtual void on_param_value_updated(std::string name, double value);
@@ -108,27 +129,69 @@ public:
 private:
 
   // handle mavlink messages
-  void handle_heartbeat_msg(const mavlink_message_t &msg);
-  void handle_status_msg(const mavlink_message_t &msg);
-  void handle_command_ack_msg(const mavlink_message_t &msg);
-  void handle_statustext_msg(const mavlink_message_t &msg);
-  void handle_attitude_quaternion_msg(const mavlink_message_t &msg);
-  void handle_small_imu_msg(const mavlink_message_t &msg);
-  void handle_rosflight_output_raw_msg(const mavlink_message_t &msg);
-  void handle_rc_channels_raw_msg(const mavlink_message_t &msg);
-  void handle_diff_pressure_msg(const mavlink_message_t &msg);
-  void handle_small_baro_msg(const mavlink_message_t &msg);
-  void handle_small_mag_msg(const mavlink_message_t &msg);
-  void handle_rosflight_gnss_msg(const mavlink_message_t &msg);
-  void handle_rosflight_gnss_raw_msg(const mavlink_message_t &msg);
-  void handle_named_value_int_msg(const mavlink_message_t &msg);
-  void handle_named_value_float_msg(const mavlink_message_t &msg);
-  void handle_named_command_struct_msg(const mavlink_message_t &msg);
-  void handle_small_range_msg(const mavlink_message_t &msg);
-  void handle_version_msg(const mavlink_message_t &msg);
-  void handle_total_torque_msg(const mavlink_message_t &msg);
-  void handle_pid_torque_msg(const mavlink_message_t &msg);
-  void handle_hard_error_msg(const mavlink_message_t &msg);
+  void handle_heartbeat_msg(const mavlink_heartbeat_t &heartbeat);
+  void handle_status_msg(const mavlink_rosflight_status_t &status_msg);
+  void handle_command_ack_msg(const mavlink_rosflight_cmd_ack_t &ack);
+  void handle_statustext_msg(const mavlink_statustext_t &status);
+  void handle_attitude_quaternion_msg(const mavlink_attitude_quaternion_t &attitude);
+  void handle_small_imu_msg(const mavlink_small_imu_t &imu);
+  void handle_rosflight_output_raw_msg(const mavlink_rosflight_output_raw_t &servo);
+  void handle_rc_channels_msg(const mavlink_rc_channels_t &rc);
+  void handle_diff_pressure_msg(const mavlink_diff_pressure_t &diff);
+  void handle_small_baro_msg(const mavlink_small_baro_t &baro);
+  void handle_small_mag_msg(const mavlink_small_mag_t &mag);
+  void handle_rosflight_gnss_msg(const mavlink_rosflight_gnss_t &gnss);
+  void handle_rosflight_gnss_raw_msg(const mavlink_rosflight_gnss_raw_t &raw);
+  void handle_named_value_int_msg(const mavlink_named_value_int_t &val);
+  void handle_named_value_float_msg(const mavlink_named_value_float_t &val);
+  void handle_named_command_struct_msg(const mavlink_named_command_struct_t &command);
+  void handle_small_range_msg(const mavlink_small_range_t &range);
+  void handle_version_msg(const mavlink_rosflight_version_t &version);
+  void handle_total_torque_msg(const mavlink_total_torque_t &outTotalTorqueMsg);
+  void handle_pid_torque_msg(const mavlink_pid_torque_t &outPIDTorqueMsg);
+  void handle_hard_error_msg(const mavlink_rosflight_hard_error_t &error);
+
+  /**
+   * \brief Subscribe one of the handlers above to the mavlink message it takes
+   *
+   * With a dispatch thread, the io thread only copies the message into the handoff queue and the handler runs on the
+   * dispatch thread; otherwise the handler runs directly on the io thread.
+   */
+  template <typename T>
+  void subscribe(void (rosflightIO::*handler)(const T&))
+  {
+    boost::function<void(const T&)> callback = boost::bind(handler, this, _1);
+    if (handoff_ == NULL)
+    {
+      mavlink_subscriptions_.push_back(mavrosflight_->comm.subscribe<T>(callback));
+    }
+    else
+    {
+      dispatcher_.subscribe<T>(callback);
+      mavlink_subscriptions_.push_back(mavrosflight_->comm.subscribe_raw(
+            mavrosflight::MessageTraits<T>::ID, boost::bind(&rosflightIO::hand_off, this, _1)));
+    }
+  }
+
+  /**
+   * \brief Pass a message to the dispatch thread along with its arrival time (io thread)
+   */
+  void hand_off(const mavlink_message_t &msg);
+
+  void dispatch_loop();
+
+  /**
+   * \brief Get the time at which the message being handled started to arrive, for messages without an FCU timestamp
+   *
+   * Unlike the time the handler runs at, this leaves out parsing, dispatch and queueing; see
+   * MavlinkComm::rx_time_ns().
+   */
+  ros::Time rx_stamp() const;
+
+  /**
+   * \brief Set up forwarding to the UDP endpoints in the router_endpoints parameter, if there are any
+   */
+  void init_router(ros::NodeHandle &nh_private);
 
   // ROS message callbacks
   void commandCallback(rosflight_msgs::Command::ConstPtr msg);
@@ -153,6 +216,7 @@ private:
   void paramTimerCallback(const ros::TimerEvent &e);
   void versionTimerCallback(const ros::TimerEvent &e);
   void heartbeatTimerCallback(const ros::TimerEvent &e);
+  void linkStatsTimerCallback(const ros::TimerEvent &e);
 
   // helpers
   void request_version();
@@ -195,6 +259,7 @@ private:
   ros::Publisher error_pub_;
   ros::Publisher torque_pub_;
   ros::Publisher pid_torque_pub_;
+  ros::Publisher link_stats_pub_;
 
   std::map<std::string, ros::Publisher> named_value_int_pubs_;
   std::map<std::string, ros::Publisher> named_value_float_pubs_;
@@ -216,6 +281,7 @@ private:
   ros::Timer param_timer_;
   ros::Timer version_timer_;
   ros::Timer heartbeat_timer_;
+  ros::Timer link_stats_timer_;
 
   geometry_msgs::Quaternion attitude_quat_;
   mavlink_rosflight_status_t prev_status_;
@@ -224,6 +290,20 @@ private:
 
   mavrosflight::MavlinkComm *mavlink_comm_;
   mavrosflight::MavROSflight *mavrosflight_;
+  uint8_t sysid_; //!< system ID of the vehicle, which commands are sent from and addressed to
+  uint8_t compid_; //!< component ID commands are sent from
+  std::vector<mavrosflight::MavlinkDispatcher::SubscriptionId> mavlink_subscriptions_;
+
+  mavrosflight::HandoffQueue *handoff_; //!< messages waiting for the dispatch thread, or NULL to handle them inline
+  mavrosflight::MavlinkRouter *router_; //!< forwards frames to ground stations, or NULL if none are configured
+  mavrosflight::MavlinkRecorder *recorder_; //!< capture of all frames on the link, or NULL if not recording
+  mavrosflight::MavlinkDispatcher dispatcher_; //!< handlers run on the dispatch thread
+  boost::thread dispatch_thread_;
+  std::atomic<bool> dispatch_running_;
+  mavrosflight::HandoffQueue::Stats prev_handoff_stats_;
+
+  mavrosflight::MavlinkComm::LinkStats prev_link_stats_; //!< counters at the last link_stats message, for rates
+  ros::Time prev_link_stats_time_;
 };
 
 } // namespace rosflight_io
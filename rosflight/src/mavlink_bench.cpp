@@ -0,0 +1,1526 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_bench.cpp
+ *
+ * Entry point for the mavlink_bench executable, which measures the throughput of the mavrosflight comm layer
+ * without a flight controller attached.
+ *
+ * Usage: rosrun rosflight mavlink_bench parse [megabytes] [read_size]
+ *        rosrun rosflight mavlink_bench alloc [seconds]
+ *        rosrun rosflight mavlink_bench udp [seconds]
+ *        rosrun rosflight mavlink_bench handlers [operations]
+ *        rosrun rosflight mavlink_bench capture <file> [megabytes]
+ *        rosrun rosflight mavlink_bench replay <file> [speed]
+ *        rosrun rosflight mavlink_bench latency [pings]
+ *        rosrun rosflight mavlink_bench serial [seconds] [imu_rate] [attitude_rate] [ping_rate]
+ *        rosrun rosflight mavlink_bench baud [seconds]
+ *        rosrun rosflight mavlink_bench links [links] [seconds] [rate] [io_threads]
+ */
+
+#include <rosflight/mavlink/baud_rate.h>
+#include <rosflight/mavrosflight/frame_scanner.h>
+#include <rosflight/mavrosflight/handoff_queue.h>
+#include <rosflight/mavrosflight/io_service_pool.h>
+#include <rosflight/mavrosflight/mavlink_bridge.h>
+#include <rosflight/mavrosflight/mavlink_comm.h>
+#include <rosflight/mavrosflight/mavlink_loopback.h>
+#include <rosflight/mavrosflight/mavlink_recorder.h>
+#include <rosflight/mavrosflight/mavlink_replay.h>
+#include <rosflight/mavrosflight/mavlink_serial.h>
+#include <rosflight/mavrosflight/mavlink_tcp.h>
+#include <rosflight/mavrosflight/mavlink_udp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+
+std::atomic<bool> g_count_allocations(false); //!< whether allocations on marked threads are being counted
+std::atomic<uint64_t> g_allocations(0); //!< heap allocations counted on marked threads
+thread_local bool t_count_allocations = false; //!< whether this thread is marked for counting
+
+} // namespace
+
+// count heap allocations on selected threads, to check that the io thread doesn't allocate once the link is up
+void* operator new(size_t size)
+{
+  if (t_count_allocations && g_count_allocations.load(std::memory_order_relaxed))
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+
+  void *p = malloc(size ? size : 1);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+namespace
+{
+
+const uint8_t MESSAGE_LENGTHS[256] = MAVLINK_MESSAGE_LENGTHS;
+const uint8_t MESSAGE_CRCS[256] = MAVLINK_MESSAGE_CRCS;
+
+/**
+ * \brief Build a stream of valid frames cycling through every message defined in the dialect
+ */
+std::vector<uint8_t> build_stream(size_t bytes, size_t *num_frames)
+{
+  std::vector<uint8_t> stream;
+  stream.reserve(bytes + MAVLINK_MAX_PACKET_LEN);
+  *num_frames = 0;
+
+  srand(0);
+  mavlink_message_t msg;
+  uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+  for (int id = 0; stream.size() < bytes; id = (id + 1) % 256)
+  {
+    if (MESSAGE_LENGTHS[id] == 0)
+      continue;
+
+    msg.msgid = id;
+    for (int i = 0; i < MESSAGE_LENGTHS[id]; i++)
+    {
+      _MAV_PAYLOAD_NON_CONST(&msg)[i] = (char) rand();
+    }
+    mavlink_finalize_message(&msg, 1, 1, MESSAGE_LENGTHS[id], MESSAGE_CRCS[id]);
+
+    uint16_t len = mavlink_msg_to_send_buffer(frame, &msg);
+    stream.insert(stream.end(), frame, frame + len);
+    (*num_frames)++;
+  }
+
+  return stream;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const char *name, size_t bytes, size_t frames, double seconds)
+{
+  printf("%-20s %10.1f MB/s %12.0f frames/s  (%zu frames)\n", name, bytes / seconds / 1e6, frames / seconds, frames);
+}
+
+int bench_parse(size_t megabytes, size_t chunk)
+{
+  size_t expected_frames;
+  std::vector<uint8_t> stream = build_stream(megabytes * 1000000, &expected_frames);
+
+  // byte-at-a-time state machine from the mavlink library
+  mavlink_message_t msg;
+  mavlink_status_t status;
+  memset(&status, 0, sizeof(status));
+  size_t frames = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < stream.size(); i++)
+  {
+    if (mavlink_parse_char(MAVLINK_COMM_0, stream[i], &msg, &status))
+      frames++;
+  }
+  report("mavlink_parse_char", stream.size(), frames, seconds_since(start));
+
+  // bulk scanner, fed in chunks the size of a serial read
+  mavrosflight::FrameScanner scanner(chunk);
+  frames = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t offset = 0; offset < stream.size();)
+  {
+    boost::asio::mutable_buffers_1 buffer = scanner.prepare();
+    size_t n = std::min(boost::asio::buffer_size(buffer), stream.size() - offset);
+    memcpy(boost::asio::buffer_cast<uint8_t*>(buffer), &stream[offset], n);
+    scanner.commit(n);
+    offset += n;
+
+    while (scanner.next_frame())
+    {
+      scanner.decode(&msg);
+      frames++;
+    }
+  }
+  report("FrameScanner", stream.size(), frames, seconds_since(start));
+
+  if (frames != expected_frames)
+  {
+    fprintf(stderr, "FrameScanner extracted %zu of %zu frames\n", frames, expected_frames);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * \brief Comm layer whose port is a recorded stream replayed from memory and a sink for writes
+ */
+class MemoryComm : public mavrosflight::MavlinkComm
+{
+public:
+  MemoryComm(const std::vector<uint8_t> &stream) : stream_(stream), offset_(0), open_(false) {}
+  ~MemoryComm() { close(); }
+
+  /**
+   * \brief Mark the io thread for allocation counting
+   *
+   * Done by posting to the io thread, which itself allocates, so this has to happen before counting starts.
+   */
+  void mark_io_thread()
+  {
+    io_service_.post(&MemoryComm::mark_thread);
+  }
+
+private:
+  static void mark_thread() { t_count_allocations = true; }
+
+  virtual bool is_open() { return open_; }
+  virtual void do_open() { open_ = true; }
+  virtual void do_close() { open_ = false; }
+
+  virtual void do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
+  {
+    size_t n = std::min(boost::asio::buffer_size(buffer), stream_.size() - offset_);
+    memcpy(boost::asio::buffer_cast<uint8_t*>(buffer), &stream_[offset_], n);
+    offset_ = (offset_ + n) % stream_.size();
+    io_service_.post(mavrosflight::make_alloc_handler(handler.memory(),
+                                                      boost::bind<void>(handler, boost::system::error_code(), n)));
+  }
+
+  virtual void do_async_write(const mavrosflight::WriteBufferSequence &buffers, const IoHandler &handler)
+  {
+    io_service_.post(mavrosflight::make_alloc_handler(handler.memory(),
+                                                      boost::bind<void>(handler, boost::system::error_code(),
+                                                                        buffers.bytes)));
+  }
+
+  const std::vector<uint8_t> &stream_;
+  size_t offset_;
+  bool open_;
+};
+
+void count_message(const mavlink_message_t &msg, std::atomic<uint64_t> *count)
+{
+  count->fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * \brief UDP link whose io thread can be marked for allocation counting
+ */
+class BenchUDP : public mavrosflight::MavlinkUDP
+{
+public:
+  BenchUDP(uint16_t bind_port, uint16_t remote_port) :
+    MavlinkUDP("127.0.0.1", bind_port, "127.0.0.1", remote_port)
+  {}
+
+  void mark_io_thread()
+  {
+    io_service_.post(&BenchUDP::mark_thread);
+  }
+
+private:
+  static void mark_thread() { t_count_allocations = true; }
+};
+
+/**
+ * \brief Other end of the UDP link, sending one frame per datagram as fast as the socket allows
+ */
+void udp_sender(boost::asio::ip::udp::socket *socket, uint16_t remote_port, std::atomic<bool> *running)
+{
+  boost::asio::ip::udp::endpoint remote(boost::asio::ip::address_v4::loopback(), remote_port);
+
+  mavlink_message_t msg;
+  uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+  mavlink_msg_heartbeat_pack(1, 1, &msg, 0, 0, 0, 0, 0);
+  size_t len = mavlink_msg_to_send_buffer(frame, &msg);
+
+  boost::system::error_code error;
+  while (*running)
+  {
+    socket->send_to(boost::asio::buffer(frame, len), remote, 0, error);
+  }
+}
+
+/**
+ * \brief Other end of the UDP link, counting the datagrams (write operations) it receives
+ */
+void udp_receiver(boost::asio::ip::udp::socket *socket, std::atomic<bool> *running, std::atomic<uint64_t> *datagrams)
+{
+  uint8_t buffer[65536];
+  boost::system::error_code error;
+  while (*running)
+  {
+    socket->receive(boost::asio::buffer(buffer), 0, error);
+    datagrams->fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * \brief Measure read and write operations per second on a loopback UDP link, and the io thread allocations per
+ * operation
+ */
+int bench_udp(double seconds)
+{
+  const uint16_t comm_port = 14600;
+  const uint16_t peer_port = 14601;
+
+  std::atomic<uint64_t> received(0);
+  BenchUDP comm(comm_port, peer_port);
+  comm.subscribe_raw(MAVLINK_MSG_ID_HEARTBEAT, boost::bind(&count_message, _1, &received));
+  comm.open();
+  comm.mark_io_thread();
+
+  boost::asio::io_service peer_io_service;
+  boost::asio::ip::udp::socket peer(peer_io_service,
+                                    boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), peer_port));
+  std::atomic<bool> running(true);
+  std::atomic<uint64_t> datagrams(0);
+  boost::thread sender(boost::bind(&udp_sender, &peer, comm_port, &running));
+  boost::thread receiver(boost::bind(&udp_receiver, &peer, &running, &datagrams));
+
+  // keep the write queue full
+  mavlink_message_t msg;
+  mavlink_msg_param_request_list_pack(1, 50, &msg, 1, MAV_COMP_ID_ALL);
+  mavrosflight::MavlinkComm::LinkStats start_stats;
+  uint64_t start_datagrams = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point count_start;
+  bool counting = false;
+  while (seconds_since(start) < seconds + 0.5)
+  {
+    if (!counting && seconds_since(start) > 0.5)
+    {
+      comm.get_link_stats(&start_stats);
+      start_datagrams = datagrams;
+      count_start = std::chrono::steady_clock::now();
+      g_count_allocations = true;
+      counting = true;
+    }
+
+    // frames that don't fit in the write queue are dropped, which doesn't matter here
+    comm.send_message(msg);
+  }
+  g_count_allocations = false;
+  double counted_seconds = seconds_since(count_start);
+
+  mavrosflight::MavlinkComm::LinkStats stats;
+  comm.get_link_stats(&stats);
+  uint64_t writes = datagrams - start_datagrams;
+  comm.close();
+  running = false;
+  sender.join();
+  peer.send_to(boost::asio::buffer(&msg, 1), peer.local_endpoint()); // wake the receiver
+  receiver.join();
+
+  // the sender puts one frame in each datagram; a read takes a batch of datagrams
+  uint64_t datagrams_in = stats.rx_frames - start_stats.rx_frames;
+  uint64_t reads = stats.rx_reads - start_stats.rx_reads;
+  printf("%-20s %12.0f datagrams/s\n", "received", datagrams_in / counted_seconds);
+  printf("%-20s %12.0f ops/s  (%.1f datagrams per read)\n", "reads", reads / counted_seconds,
+         (double) datagrams_in / std::max<uint64_t>(reads, 1));
+  printf("%-20s %12.0f ops/s\n", "writes", writes / counted_seconds);
+  printf("%-20s %12.3f per op  (%lu in %.1f s)\n", "io thread allocations",
+         (double) g_allocations / std::max<uint64_t>(reads + writes, 1), (unsigned long) g_allocations, counted_seconds);
+  return 0;
+}
+
+void hand_off(const mavlink_message_t &msg, const mavrosflight::MavlinkComm *comm, mavrosflight::HandoffQueue *queue)
+{
+  queue->push(msg, comm->rx_time_ns());
+}
+
+void consume_handoff(mavrosflight::HandoffQueue *queue, std::atomic<bool> *running, std::atomic<bool> *stalled,
+                     std::atomic<uint64_t> *count)
+{
+  mavlink_message_t msg;
+  while (*running)
+  {
+    if (*stalled)
+      usleep(1000);
+    else if (queue->pop(&msg, 10))
+      count->fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * \brief Run a steady stream through MavlinkComm in both directions and count heap allocations on the io thread
+ */
+int bench_alloc(double seconds)
+{
+  size_t num_frames;
+  std::vector<uint8_t> stream = build_stream(1000000, &num_frames);
+
+  std::atomic<uint64_t> handled(0);
+  std::atomic<bool> running(true);
+  std::atomic<bool> stalled(false);
+  mavrosflight::HandoffQueue handoff(256);
+
+  // the drop policies rosflight_io sets
+  const uint8_t keep_latest[] = { MAVLINK_MSG_ID_ATTITUDE_QUATERNION, MAVLINK_MSG_ID_ROSFLIGHT_OUTPUT_RAW,
+                                  MAVLINK_MSG_ID_RC_CHANNELS, MAVLINK_MSG_ID_TOTAL_TORQUE,
+                                  MAVLINK_MSG_ID_PID_TORQUE };
+  const uint8_t never_drop[] = { MAVLINK_MSG_ID_ROSFLIGHT_STATUS, MAVLINK_MSG_ID_ROSFLIGHT_CMD_ACK,
+                                 MAVLINK_MSG_ID_STATUSTEXT, MAVLINK_MSG_ID_ROSFLIGHT_HARD_ERROR,
+                                 MAVLINK_MSG_ID_ROSFLIGHT_VERSION };
+  for (size_t i = 0; i < sizeof(keep_latest); i++)
+  {
+    handoff.set_policy(keep_latest[i], mavrosflight::HandoffQueue::KEEP_LATEST);
+  }
+  for (size_t i = 0; i < sizeof(never_drop); i++)
+  {
+    handoff.set_policy(never_drop[i], mavrosflight::HandoffQueue::NEVER_DROP);
+  }
+  boost::thread consumer(boost::bind(&consume_handoff, &handoff, &running, &stalled, &handled));
+
+  // subscribe the way rosflight_io does, handing the messages to a dispatch thread
+  MemoryComm comm(stream);
+  const uint8_t subscribed[] = { MAVLINK_MSG_ID_SMALL_IMU, MAVLINK_MSG_ID_HEARTBEAT };
+  for (size_t i = 0; i < sizeof(subscribed); i++)
+  {
+    comm.subscribe_raw(subscribed[i], boost::bind(&hand_off, _1, &comm, &handoff));
+  }
+  for (size_t i = 0; i < sizeof(keep_latest); i++)
+  {
+    comm.subscribe_raw(keep_latest[i], boost::bind(&hand_off, _1, &comm, &handoff));
+  }
+  for (size_t i = 0; i < sizeof(never_drop); i++)
+  {
+    comm.subscribe_raw(never_drop[i], boost::bind(&hand_off, _1, &comm, &handoff));
+  }
+  std::atomic<uint64_t> raw_count(0);
+  comm.subscribe_raw(MAVLINK_MSG_ID_TIMESYNC, boost::bind(&count_message, _1, &raw_count));
+  comm.open();
+  comm.mark_io_thread();
+
+  // commands at a typical rate, with a heartbeat and a burst of bulk frames now and then
+  mavlink_message_t msg;
+  char param_id[MAVLINK_MSG_PARAM_VALUE_FIELD_PARAM_ID_LEN] = "";
+  bool counting = false;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point count_start;
+  for (unsigned i = 0; seconds_since(start) < seconds + 0.5; i++)
+  {
+    if (!counting && seconds_since(start) > 0.5)
+    {
+      g_count_allocations = true;
+      count_start = std::chrono::steady_clock::now();
+      counting = true;
+    }
+
+    // stall the consumer for the middle of the run, so that every ring of the handoff queue overflows
+    stalled = std::fabs(seconds_since(start) - 0.5 - seconds / 2) < 0.5;
+
+    mavlink_msg_offboard_control_pack(1, 50, &msg, 0, 0, 0.0f, 0.0f, 0.0f, 0.0f);
+    comm.send_message(msg);
+    if (i % 100 == 0)
+    {
+      mavlink_msg_heartbeat_pack(1, 50, &msg, 0, 0, 0, 0, 0);
+      comm.send_message(msg);
+    }
+    if (i % 200 == 0)
+    {
+      for (int j = 0; j < 50; j++)
+      {
+        mavlink_msg_param_request_read_pack(1, 50, &msg, 1, MAV_COMP_ID_ALL, param_id, j);
+        comm.send_message(msg);
+      }
+    }
+    usleep(1000);
+  }
+  g_count_allocations = false;
+  double counted_seconds = seconds_since(count_start);
+
+  mavrosflight::MavlinkComm::LinkStats stats;
+  comm.get_link_stats(&stats);
+  comm.close();
+  running = false;
+  consumer.join();
+
+  mavrosflight::HandoffQueue::Stats handoff_stats = handoff.get_stats();
+  report("received", stats.rx_bytes, stats.rx_frames, seconds_since(start));
+  printf("%-20s %10lu handed off %10lu raw\n", "dispatched", (unsigned long) handled, (unsigned long) raw_count);
+  printf("%-20s %10lu dropped %10lu replaced %10lu lost (consumer stalled for 1 s)\n", "handoff",
+         (unsigned long) handoff_stats.dropped, (unsigned long) handoff_stats.replaced,
+         (unsigned long) handoff_stats.lost);
+  printf("%-20s %10lu frames\n", "written", (unsigned long) stats.tx_frames);
+  printf("%-20s %10lu in %.1f s of steady state\n", "io thread allocations", (unsigned long) g_allocations,
+         counted_seconds);
+
+  return g_allocations > 0 ? 1 : 0;
+}
+
+/**
+ * \brief Chain of asynchronous operations, each started from the completion of the one before
+ */
+class HandlerChain
+{
+public:
+  HandlerChain(size_t operations) : remaining_(operations) {}
+
+  void run_function()
+  {
+    start_function();
+    io_service_.run();
+  }
+
+  void run_alloc_handler()
+  {
+    start_alloc_handler();
+    io_service_.run();
+  }
+
+private:
+  struct Callback
+  {
+    HandlerChain *chain;
+    void operator()(const boost::system::error_code &error, size_t bytes_transferred) const
+    {
+      chain->end_alloc_handler(error, bytes_transferred);
+    }
+  };
+
+  // completion handler type-erased in a boost::function, with the operation memory left to asio
+  void start_function()
+  {
+    boost::function<void(const boost::system::error_code&, size_t)> handler =
+        boost::bind(&HandlerChain::end_function, this, _1, _2);
+    io_service_.post(boost::bind(handler, boost::system::error_code(), 0));
+  }
+
+  void end_function(const boost::system::error_code &error, size_t bytes_transferred)
+  {
+    if (--remaining_ > 0)
+      start_function();
+  }
+
+  // concrete completion handler with its operation memory in a HandlerMemory block
+  void start_alloc_handler()
+  {
+    Callback callback = { this };
+    mavrosflight::AllocHandler<Callback> handler = mavrosflight::make_alloc_handler(memory_, callback);
+    io_service_.post(mavrosflight::make_alloc_handler(memory_,
+                                                      boost::bind<void>(handler, boost::system::error_code(), 0)));
+  }
+
+  void end_alloc_handler(const boost::system::error_code &error, size_t bytes_transferred)
+  {
+    if (--remaining_ > 0)
+      start_alloc_handler();
+  }
+
+  boost::asio::io_service io_service_;
+  mavrosflight::HandlerMemory memory_;
+  size_t remaining_;
+};
+
+/**
+ * \brief Compare the cost of completion handlers wrapped in boost::function against AllocHandler
+ */
+int bench_handlers(size_t operations)
+{
+  t_count_allocations = true;
+
+  for (int variant = 0; variant < 2; variant++)
+  {
+    HandlerChain chain(operations);
+    g_allocations = 0;
+    g_count_allocations = true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (variant == 0)
+      chain.run_function();
+    else
+      chain.run_alloc_handler();
+    double seconds = seconds_since(start);
+    g_count_allocations = false;
+
+    printf("%-20s %12.0f ops/s %8.3f allocations/op\n", variant == 0 ? "boost::function" : "AllocHandler",
+           operations / seconds, (double) g_allocations / operations);
+  }
+
+  t_count_allocations = false;
+  return 0;
+}
+
+/**
+ * \brief Record a generated stream with MavlinkRecorder, timing each call as the io thread would see it
+ */
+int bench_capture(const char *filename, size_t megabytes)
+{
+  size_t num_frames;
+  std::vector<uint8_t> stream = build_stream(megabytes * 1000000, &num_frames);
+
+  mavrosflight::MavlinkRecorder recorder(filename);
+  mavrosflight::FrameScanner scanner(stream.size());
+  boost::asio::mutable_buffers_1 buffer = scanner.prepare();
+  memcpy(boost::asio::buffer_cast<uint8_t*>(buffer), &stream[0], stream.size());
+  scanner.commit(stream.size());
+
+  uint64_t max_ns = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while (scanner.next_frame())
+  {
+    std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+    recorder.record(mavrosflight::MavlinkRecorder::DIRECTION_RX,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(before.time_since_epoch()).count(),
+                    scanner.frame_data(), scanner.frame_len());
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before).count();
+    max_ns = std::max(max_ns, ns);
+  }
+  double seconds = seconds_since(start);
+
+  mavrosflight::MavlinkRecorder::Stats stats = recorder.get_stats();
+  report("MavlinkRecorder", stats.bytes, stats.frames, seconds);
+  printf("%-20s %10lu dropped, slowest record() %lu ns\n", "", (unsigned long) stats.dropped, (unsigned long) max_ns);
+  return 0;
+}
+
+/**
+ * \brief Counts the messages that reach the listeners
+ */
+class CountingListener : public mavrosflight::MavlinkListenerInterface
+{
+public:
+  CountingListener() : count(0) {}
+  virtual void handle_mavlink_message(const mavlink_message_t &msg) { count.fetch_add(1, std::memory_order_relaxed); }
+  std::atomic<uint64_t> count;
+};
+
+/**
+ * \brief Play a capture back through the listener path and report how fast it was handled
+ */
+int bench_replay(const char *filename, double speed)
+{
+  mavrosflight::MavlinkReplay replay(filename, speed);
+  CountingListener listener;
+  replay.register_mavlink_listener(&listener);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  replay.open();
+  while (!replay.finished() || listener.count < replay.frames_played())
+  {
+    usleep(1000);
+  }
+  double seconds = seconds_since(start);
+
+  mavrosflight::MavlinkComm::LinkStats stats;
+  replay.get_link_stats(&stats);
+  replay.close();
+
+  report("MavlinkReplay", stats.rx_bytes, listener.count, seconds);
+  return 0;
+}
+
+/**
+ * \brief Print the median, 90th and 99th percentile and maximum of a set of latencies
+ * \param latencies Latencies in nanoseconds; sorted in place
+ */
+void report_percentiles(const char *name, std::vector<uint64_t> *latencies)
+{
+  if (latencies->empty())
+  {
+    printf("%-20s no samples\n", name);
+    return;
+  }
+
+  std::sort(latencies->begin(), latencies->end());
+  size_t n = latencies->size();
+  printf("%-20s median %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us  (%lu frames)\n", name,
+         (*latencies)[n / 2] / 1e3, (*latencies)[n * 90 / 100] / 1e3, (*latencies)[n * 99 / 100] / 1e3,
+         latencies->back() / 1e3, (unsigned long) n);
+}
+
+/**
+ * \brief Time single frames from the firmware end of a link until they reach a subscriber, one at a time
+ * \param send Writes one frame at the firmware end
+ */
+void report_latency(const char *name, mavrosflight::MavlinkComm &comm, const boost::function<void()> &send,
+                    size_t pings)
+{
+  std::atomic<uint64_t> received(0);
+  mavrosflight::MavlinkDispatcher::SubscriptionId id =
+      comm.subscribe_raw(MAVLINK_MSG_ID_HEARTBEAT, boost::bind(&count_message, _1, &received));
+
+  std::vector<uint64_t> latencies;
+  latencies.reserve(pings);
+  for (size_t i = 0; i < pings; i++)
+  {
+    uint64_t expected = received + 1;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    send();
+    while (received < expected)
+    {
+      if (seconds_since(start) > 1.0)
+      {
+        fprintf(stderr, "%s: frame lost\n", name);
+        comm.unsubscribe(id);
+        return;
+      }
+    }
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+  }
+  comm.unsubscribe(id);
+
+  report_percentiles(name, &latencies);
+}
+
+void send_loopback(mavrosflight::ShmRing *ring, const uint8_t *frame, size_t len)
+{
+  ring->write_all(frame, len);
+}
+
+void send_udp(boost::asio::ip::udp::socket *socket, uint16_t remote_port, const uint8_t *frame, size_t len)
+{
+  socket->send_to(boost::asio::buffer(frame, len),
+                  boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), remote_port));
+}
+
+void accept_tcp(boost::asio::ip::tcp::acceptor *acceptor, boost::asio::ip::tcp::socket *socket)
+{
+  acceptor->accept(*socket);
+}
+
+void send_tcp(boost::asio::ip::tcp::socket *socket, const uint8_t *frame, size_t len)
+{
+  boost::asio::write(*socket, boost::asio::buffer(frame, len));
+}
+
+/**
+ * \brief Compare the frame latency of the shared memory loopback, UDP and TCP links on this machine
+ */
+int bench_latency(size_t pings)
+{
+  if (pings == 0)
+    return 1;
+
+  mavlink_message_t msg;
+  uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+  mavlink_msg_heartbeat_pack(1, 1, &msg, 0, 0, 0, 0, 0);
+  size_t len = mavlink_msg_to_send_buffer(frame, &msg);
+
+  std::string name = "/mavlink_bench_" + std::to_string(getpid());
+  {
+    mavrosflight::MavlinkLoopback comm(name);
+    comm.open();
+    mavrosflight::ShmRing fc_tx;
+    fc_tx.open(name + SHM_RING_FC_TO_HOST_SUFFIX);
+    report_latency("MavlinkLoopback", comm, boost::bind(&send_loopback, &fc_tx, frame, len), pings);
+    comm.close();
+  }
+  shm_unlink((name + SHM_RING_FC_TO_HOST_SUFFIX).c_str());
+  shm_unlink((name + SHM_RING_HOST_TO_FC_SUFFIX).c_str());
+
+  const uint16_t comm_port = 14600;
+  const uint16_t peer_port = 14601;
+  mavrosflight::MavlinkUDP comm("127.0.0.1", comm_port, "127.0.0.1", peer_port);
+  comm.open();
+  boost::asio::io_service peer_io_service;
+  boost::asio::ip::udp::socket peer(peer_io_service,
+                                    boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), peer_port));
+  report_latency("MavlinkUDP", comm, boost::bind(&send_udp, &peer, comm_port, frame, len), pings);
+  comm.close();
+
+  // the firmware end stands in for a serial-to-TCP bridge such as ser2net
+  boost::asio::ip::tcp::acceptor bridge(peer_io_service,
+                                        boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+  boost::asio::ip::tcp::socket bridge_socket(peer_io_service);
+  mavrosflight::MavlinkTCP tcp_comm("127.0.0.1", bridge.local_endpoint().port(), false);
+  boost::thread accept_thread(boost::bind(&accept_tcp, &bridge, &bridge_socket));
+  tcp_comm.open();
+  accept_thread.join();
+  report_latency("MavlinkTCP", tcp_comm, boost::bind(&send_tcp, &bridge_socket, frame, len), pings);
+  tcp_comm.close();
+  return 0;
+}
+
+uint64_t steady_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * \brief Serial link whose io thread's CPU time can be read
+ */
+class BenchSerial : public mavrosflight::MavlinkSerial
+{
+public:
+  BenchSerial(const std::string &port) : MavlinkSerial(port, 921600), io_clock_found_(false) {}
+
+  /**
+   * \brief Look up the io thread's CPU clock, from the io thread itself
+   */
+  void find_io_clock()
+  {
+    io_service_.post(boost::bind(&BenchSerial::get_io_clock, this));
+  }
+
+  /**
+   * \brief Get the CPU time the io thread has used, or 0 if its clock hasn't been found yet
+   */
+  double io_cpu_seconds() const
+  {
+    struct timespec t;
+    if (!io_clock_found_ || clock_gettime(io_clock_, &t) != 0)
+      return 0;
+    return t.tv_sec + t.tv_nsec * 1e-9;
+  }
+
+private:
+  void get_io_clock()
+  {
+    if (pthread_getcpuclockid(pthread_self(), &io_clock_) == 0)
+      io_clock_found_ = true;
+  }
+
+  clockid_t io_clock_;
+  std::atomic<bool> io_clock_found_;
+};
+
+/**
+ * \brief Scripted flight controller on the master end of a pseudo-terminal
+ *
+ * Streams SMALL_IMU and ATTITUDE_QUATERNION at fixed rates, each stamped with the steady clock time at which it was
+ * written, and answers time sync requests the way the firmware does. Frames that the pty can't take because the host
+ * isn't reading are dropped and counted, as a UART would overrun.
+ */
+class FakeFlightController
+{
+public:
+  FakeFlightController(int fd, double imu_rate, double attitude_rate) :
+    fd_(fd),
+    imu_period_ns_(imu_rate > 0 ? 1e9 / imu_rate : 0),
+    attitude_period_ns_(attitude_rate > 0 ? 1e9 / attitude_rate : 0),
+    scanner_(MAVLINK_SERIAL_READ_BUF_SIZE),
+    running_(true),
+    frames_sent_(0),
+    frames_dropped_(0),
+    requests_answered_(0)
+  {
+    thread_ = boost::thread(boost::bind(&FakeFlightController::run, this));
+  }
+
+  ~FakeFlightController()
+  {
+    running_ = false;
+    thread_.join();
+  }
+
+  uint64_t frames_sent() const { return frames_sent_; }
+  uint64_t frames_dropped() const { return frames_dropped_; }
+  uint64_t requests_answered() const { return requests_answered_; }
+
+private:
+  void run()
+  {
+    uint64_t next_imu_ns = steady_ns();
+    uint64_t next_attitude_ns = next_imu_ns;
+    mavlink_message_t msg;
+
+    while (running_)
+    {
+      uint64_t now_ns = steady_ns();
+      if (imu_period_ns_ > 0 && now_ns >= next_imu_ns)
+      {
+        mavlink_msg_small_imu_pack(1, 1, &msg, now_ns / 1000, 0.0f, 0.0f, -9.81f, 0.0f, 0.0f, 0.0f, 25.0f);
+        write_message(msg);
+        next_imu_ns += imu_period_ns_;
+      }
+      if (attitude_period_ns_ > 0 && now_ns >= next_attitude_ns)
+      {
+        mavlink_msg_attitude_quaternion_pack(1, 1, &msg, now_ns / 1000000, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f);
+        write_message(msg);
+        next_attitude_ns += attitude_period_ns_;
+      }
+
+      // sleep until the next stream frame is due, waking early for requests from the host
+      uint64_t next_ns = std::min(imu_period_ns_ > 0 ? next_imu_ns : UINT64_MAX,
+                                  attitude_period_ns_ > 0 ? next_attitude_ns : UINT64_MAX);
+      uint64_t wait_ns = std::min<uint64_t>(next_ns > now_ns ? next_ns - now_ns : 0, 10000000);
+      struct timespec timeout = { 0, (long) wait_ns };
+      struct pollfd pfd = { fd_, POLLIN, 0 };
+      if (ppoll(&pfd, 1, &timeout, NULL) > 0 && (pfd.revents & POLLIN))
+        read_requests();
+    }
+  }
+
+  void read_requests()
+  {
+    boost::asio::mutable_buffers_1 buffer = scanner_.prepare();
+    ssize_t n = read(fd_, boost::asio::buffer_cast<uint8_t*>(buffer), boost::asio::buffer_size(buffer));
+    if (n <= 0)
+      return;
+    scanner_.commit(n);
+
+    mavlink_message_t msg;
+    while (scanner_.next_frame())
+    {
+      if (scanner_.frame_msgid() != MAVLINK_MSG_ID_TIMESYNC)
+        continue;
+
+      scanner_.decode(&msg);
+      if (mavlink_msg_timesync_get_tc1(&msg) != 0)
+        continue;
+
+      int64_t ts1 = mavlink_msg_timesync_get_ts1(&msg);
+      mavlink_msg_timesync_pack(1, 1, &msg, steady_ns(), ts1);
+      write_message(msg);
+      requests_answered_++;
+    }
+  }
+
+  void write_message(const mavlink_message_t &msg)
+  {
+    uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+    size_t len = mavlink_msg_to_send_buffer(frame, &msg);
+    if (write(fd_, frame, len) == (ssize_t) len)
+      frames_sent_++;
+    else
+      frames_dropped_++;
+  }
+
+  int fd_;
+  uint64_t imu_period_ns_;
+  uint64_t attitude_period_ns_;
+  mavrosflight::FrameScanner scanner_;
+  boost::thread thread_;
+  std::atomic<bool> running_;
+  std::atomic<uint64_t> frames_sent_;
+  std::atomic<uint64_t> frames_dropped_;
+  std::atomic<uint64_t> requests_answered_;
+};
+
+void record_imu_latency(const mavlink_message_t &msg, const std::atomic<uint64_t> *from_ns,
+                        std::vector<uint64_t> *latencies)
+{
+  uint64_t stamp_ns = mavlink_msg_small_imu_get_time_boot_us(&msg) * 1000;
+  if (stamp_ns >= *from_ns && latencies->size() < latencies->capacity())
+    latencies->push_back(steady_ns() - stamp_ns);
+}
+
+void record_round_trip(const mavlink_message_t &msg, std::vector<uint64_t> *latencies)
+{
+  if (mavlink_msg_timesync_get_tc1(&msg) != 0 && latencies->size() < latencies->capacity())
+    latencies->push_back(steady_ns() - mavlink_msg_timesync_get_ts1(&msg));
+}
+
+/**
+ * \brief Run MavlinkSerial against a scripted flight controller on a pseudo-terminal, and report throughput, the io
+ * thread's CPU cost and the latency of the stream and of time sync round trips
+ *
+ * A pty has no baud rate, so the latencies leave out the time on the wire; they are what the host adds.
+ */
+int bench_serial(double seconds, double imu_rate, double attitude_rate, double ping_rate)
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+  {
+    perror("Failed to create a pseudo-terminal");
+    return 1;
+  }
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+  // the callbacks run on the io thread and only fill the space reserved here, so they don't allocate
+  std::vector<uint64_t> imu_latencies;
+  std::vector<uint64_t> round_trips;
+  imu_latencies.reserve(seconds * imu_rate + 1000);
+  round_trips.reserve(seconds * ping_rate + 1000);
+
+  // frames stamped before this are part of the stream settling, and aren't counted
+  std::atomic<uint64_t> record_from_ns(UINT64_MAX);
+
+  BenchSerial comm(ptsname(master));
+  comm.subscribe_raw(MAVLINK_MSG_ID_SMALL_IMU,
+                     boost::bind(&record_imu_latency, _1, &record_from_ns, &imu_latencies));
+  comm.subscribe_raw(MAVLINK_MSG_ID_TIMESYNC, boost::bind(&record_round_trip, _1, &round_trips));
+  comm.open();
+  comm.find_io_clock();
+
+  double cpu_start;
+  mavrosflight::MavlinkComm::LinkStats start_stats;
+  std::chrono::steady_clock::time_point start;
+  mavlink_message_t msg;
+  {
+    FakeFlightController fc(master, imu_rate, attitude_rate);
+
+    usleep(200000);
+    record_from_ns = steady_ns();
+    comm.get_link_stats(&start_stats);
+    cpu_start = comm.io_cpu_seconds();
+    start = std::chrono::steady_clock::now();
+
+    uint64_t ping_period_ns = ping_rate > 0 ? 1e9 / ping_rate : 0;
+    uint64_t next_ping_ns = steady_ns();
+    while (seconds_since(start) < seconds)
+    {
+      if (ping_period_ns > 0 && steady_ns() >= next_ping_ns)
+      {
+        mavlink_msg_timesync_pack(1, 50, &msg, 0, steady_ns());
+        comm.send_message(msg);
+        next_ping_ns += ping_period_ns;
+      }
+      usleep(100);
+    }
+
+    double counted_seconds = seconds_since(start);
+    double cpu_seconds = comm.io_cpu_seconds() - cpu_start;
+    mavrosflight::MavlinkComm::LinkStats stats;
+    comm.get_link_stats(&stats);
+    comm.close();
+
+    uint64_t frames = stats.rx_frames - start_stats.rx_frames;
+    printf("%-20s %.1f s, SMALL_IMU %.0f Hz, ATTITUDE_QUATERNION %.0f Hz, TIMESYNC %.0f Hz\n", "pty", counted_seconds,
+           imu_rate, attitude_rate, ping_rate);
+    report("received", stats.rx_bytes - start_stats.rx_bytes, frames, counted_seconds);
+    printf("%-20s %10lu CRC errors, %lu bytes dropped, %lu frames dropped by the flight controller\n", "",
+           (unsigned long) (stats.rx_crc_errors - start_stats.rx_crc_errors),
+           (unsigned long) (stats.rx_bytes_dropped - start_stats.rx_bytes_dropped), (unsigned long) fc.frames_dropped());
+    printf("%-20s %10.1f bytes per read\n", "",
+           (double) (stats.rx_bytes - start_stats.rx_bytes) / std::max<uint64_t>(stats.rx_reads - start_stats.rx_reads, 1));
+    printf("%-20s %10.2f %% of a CPU, %.0f ns per frame\n", "io thread", 100 * cpu_seconds / counted_seconds,
+           frames > 0 ? cpu_seconds * 1e9 / frames : 0.0);
+  }
+  close(master);
+
+  report_percentiles("SMALL_IMU latency", &imu_latencies);
+  report_percentiles("TIMESYNC round trip", &round_trips);
+  return 0;
+}
+
+/**
+ * \brief Get the baud rate the slave end of a pseudo-terminal is set to, as seen from the master end
+ */
+int pty_baud_rate(int master)
+{
+  static const struct { speed_t speed; int rate; } rates[] = {
+    { B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 }, { B921600, 921600 }, { B1000000, 1000000 },
+    { B1500000, 1500000 }, { B2000000, 2000000 }, { B3000000, 3000000 }
+  };
+
+  struct termios tty;
+  if (tcgetattr(master, &tty) != 0)
+    return 0;
+  speed_t speed = cfgetospeed(&tty);
+  for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+  {
+    if (rates[i].speed == speed)
+      return rates[i].rate;
+  }
+  return 0;
+}
+
+/**
+ * \brief Scripted firmware side of the baud rate upgrade handshake, on the master end of a pseudo-terminal
+ *
+ * Follows rosflight/mavlink/baud_rate.h the way the firmware does: it sends heartbeats, answers a proposal with the
+ * rate it picks and switches right away, and goes back to the configured rate when the host's heartbeats stop. A pty
+ * carries bytes whatever the rates, so frames in either direction are dropped unless the host's end is set to the
+ * rate the firmware is running at, and a broken rate drops them even then, as an adapter that can't do it would.
+ */
+class ScriptedBaudFirmware
+{
+public:
+  ScriptedBaudFirmware(int fd, int configured_rate, int max_rate, int broken_rate, bool answer) :
+    fd_(fd),
+    configured_rate_(configured_rate),
+    max_rate_(max_rate),
+    broken_rate_(broken_rate),
+    answer_(answer),
+    scanner_(MAVLINK_SERIAL_READ_BUF_SIZE),
+    rate_(configured_rate),
+    last_heartbeat_rx_ns_(0),
+    running_(true),
+    proposals_(0),
+    switches_(0)
+  {
+    thread_ = boost::thread(boost::bind(&ScriptedBaudFirmware::run, this));
+  }
+
+  ~ScriptedBaudFirmware()
+  {
+    running_ = false;
+    thread_.join();
+  }
+
+  int rate() const { return rate_; }
+  uint64_t proposals() const { return proposals_; }
+  uint64_t switches() const { return switches_; }
+
+private:
+  void run()
+  {
+    uint64_t next_heartbeat_ns = steady_ns();
+    mavlink_message_t msg;
+
+    while (running_)
+    {
+      uint64_t now_ns = steady_ns();
+      if (now_ns >= next_heartbeat_ns)
+      {
+        mavlink_msg_heartbeat_pack(1, 1, &msg, 0, 0, 0, 0, 0);
+        write_message(msg);
+        next_heartbeat_ns += 100000000ULL;
+      }
+
+      if (rate_ != configured_rate_ && now_ns - last_heartbeat_rx_ns_ > MAVLINK_BAUD_RATE_TIMEOUT_MS * 1000000ULL)
+        switch_rate(configured_rate_);
+
+      struct pollfd pfd = { fd_, POLLIN, 0 };
+      if (poll(&pfd, 1, 1) > 0 && (pfd.revents & POLLIN))
+        read_messages();
+    }
+  }
+
+  bool link_works() const
+  {
+    return rate_ != broken_rate_ && pty_baud_rate(fd_) == rate_;
+  }
+
+  void read_messages()
+  {
+    boost::asio::mutable_buffers_1 buffer = scanner_.prepare();
+    ssize_t n = read(fd_, boost::asio::buffer_cast<uint8_t*>(buffer), boost::asio::buffer_size(buffer));
+    if (n <= 0 || !link_works())
+      return;
+    scanner_.commit(n);
+
+    mavlink_message_t msg;
+    while (scanner_.next_frame())
+    {
+      if (scanner_.frame_msgid() == MAVLINK_MSG_ID_HEARTBEAT)
+      {
+        last_heartbeat_rx_ns_ = steady_ns();
+      }
+      else if (scanner_.frame_msgid() == MAVLINK_MSG_ID_NAMED_VALUE_INT)
+      {
+        scanner_.decode(&msg);
+        mavlink_named_value_int_t named_value;
+        mavlink_msg_named_value_int_decode(&msg, &named_value);
+        if (strncmp(named_value.name, MAVLINK_BAUD_RATE_NAME, sizeof(named_value.name)) != 0)
+          continue;
+
+        proposals_++;
+        if (!answer_)
+          continue;
+
+        uint32_t limit = std::min<uint32_t>(named_value.value, max_rate_);
+        int rate = mavlink_baud_rate_select(limit, configured_rate_);
+        mavlink_msg_named_value_int_pack(1, 1, &msg, 0, MAVLINK_BAUD_RATE_NAME, rate);
+        write_message(msg);
+        switch_rate(rate);
+      }
+    }
+  }
+
+  void switch_rate(int rate)
+  {
+    if (rate == rate_)
+      return;
+    rate_ = rate;
+    last_heartbeat_rx_ns_ = steady_ns();
+    switches_++;
+  }
+
+  void write_message(const mavlink_message_t &msg)
+  {
+    if (!link_works())
+      return;
+
+    uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+    size_t len = mavlink_msg_to_send_buffer(frame, &msg);
+    if (write(fd_, frame, len) != (ssize_t) len)
+      perror("Failed to write to the pseudo-terminal");
+  }
+
+  int fd_;
+  int configured_rate_;
+  int max_rate_;
+  int broken_rate_; //!< rate at which nothing gets through, or 0
+  bool answer_; //!< whether proposals are answered, or ignored as by firmware without the handshake
+  mavrosflight::FrameScanner scanner_;
+  std::atomic<int> rate_;
+  uint64_t last_heartbeat_rx_ns_;
+  boost::thread thread_;
+  std::atomic<bool> running_;
+  std::atomic<uint64_t> proposals_;
+  std::atomic<uint64_t> switches_;
+};
+
+/**
+ * \brief Run one baud rate upgrade scenario against the scripted firmware, and check the rate both ends settle at
+ * \return Whether both ends ended up at expected_rate with heartbeats still getting through
+ */
+bool run_baud_scenario(const char *name, double seconds, int max_rate, int broken_rate, bool answer, int expected_rate)
+{
+  const int configured_rate = 921600;
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+  {
+    perror("Failed to create a pseudo-terminal");
+    return false;
+  }
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+  std::atomic<uint64_t> heartbeats(0);
+  mavrosflight::MavlinkSerial comm(ptsname(master), configured_rate);
+  comm.set_baud_upgrade(max_rate);
+  comm.subscribe_raw(MAVLINK_MSG_ID_HEARTBEAT, boost::bind(&count_message, _1, &heartbeats));
+
+  bool passed;
+  {
+    ScriptedBaudFirmware firmware(master, configured_rate, max_rate, broken_rate, answer);
+    comm.open();
+
+    // the host sends heartbeats at the rate rosflight_io does, and the last rate change is timed
+    mavlink_message_t msg;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t next_heartbeat_ns = steady_ns();
+    int rate = configured_rate;
+    double settled_seconds = 0;
+    uint64_t heartbeats_before_end = 0;
+    bool counting = false;
+    while (seconds_since(start) < seconds)
+    {
+      if (steady_ns() >= next_heartbeat_ns)
+      {
+        mavlink_msg_heartbeat_pack(1, 50, &msg, 0, 0, 0, 0, 0);
+        comm.send_message(msg);
+        next_heartbeat_ns += 1000000000ULL;
+      }
+      if (comm.get_baud_rate() != rate)
+      {
+        rate = comm.get_baud_rate();
+        settled_seconds = seconds_since(start);
+      }
+      if (!counting && seconds_since(start) >= seconds - 1)
+      {
+        heartbeats_before_end = heartbeats;
+        counting = true;
+      }
+      usleep(1000);
+    }
+    uint64_t recent_heartbeats = heartbeats - heartbeats_before_end;
+    comm.close();
+
+    passed = rate == expected_rate && firmware.rate() == expected_rate && recent_heartbeats > 0;
+    printf("%-20s %s: host %d baud, firmware %d baud, expected %d; settled after %.2f s, %lu proposals, "
+           "%lu firmware switches, %lu heartbeats in the last second\n", name, passed ? "ok" : "FAILED", rate,
+           firmware.rate(), expected_rate, settled_seconds, (unsigned long) firmware.proposals(),
+           (unsigned long) firmware.switches(), (unsigned long) recent_heartbeats);
+  }
+  close(master);
+  return passed;
+}
+
+/**
+ * \brief Run the baud rate upgrade handshake of MavlinkSerial against a scripted firmware on a pseudo-terminal
+ *
+ * Checks that the upgrade succeeds, that a rate whose heartbeats never arrive falls back and the next lower rate is
+ * accepted instead, and that firmware which doesn't answer leaves the link at the configured rate.
+ */
+int bench_baud(double seconds)
+{
+  bool passed = run_baud_scenario("upgrade", seconds, 3000000, 0, true, 3000000);
+  passed &= run_baud_scenario("broken rate", seconds, 3000000, 3000000, true, 2000000);
+  passed &= run_baud_scenario("no answer", seconds, 3000000, 0, false, 921600);
+  return passed ? 0 : 1;
+}
+
+/**
+ * \brief Resources used by the whole process
+ */
+struct ProcessUsage
+{
+  double cpu_seconds; //!< user and system time of all threads so far
+  long threads;
+  long rss_kb; //!< resident memory
+};
+
+ProcessUsage process_usage()
+{
+  ProcessUsage usage = { 0, 0, 0 };
+
+  struct rusage rusage;
+  if (getrusage(RUSAGE_SELF, &rusage) == 0)
+  {
+    usage.cpu_seconds = rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec * 1e-6
+                        + rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec * 1e-6;
+  }
+
+  FILE *status = fopen("/proc/self/status", "r");
+  if (status != NULL)
+  {
+    char line[256];
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+      sscanf(line, "Threads: %ld", &usage.threads);
+      sscanf(line, "VmRSS: %ld", &usage.rss_kb);
+    }
+    fclose(status);
+  }
+
+  return usage;
+}
+
+double thread_cpu_seconds(boost::thread &thread)
+{
+  clockid_t clock;
+  struct timespec t;
+  if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 || clock_gettime(clock, &t) != 0)
+    return 0;
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * \brief Stand-in for a fleet of flight controllers, sending SMALL_IMU to every link at a fixed rate
+ */
+void links_sender(size_t links, uint16_t first_port, double rate, std::atomic<bool> *running)
+{
+  boost::asio::io_service io_service;
+  boost::asio::ip::udp::socket socket(io_service, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 0));
+
+  mavlink_message_t msg;
+  uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+  mavlink_msg_small_imu_pack(1, 1, &msg, 0, 0.0f, 0.0f, -9.81f, 0.0f, 0.0f, 0.0f, 25.0f);
+  size_t len = mavlink_msg_to_send_buffer(frame, &msg);
+
+  std::chrono::nanoseconds period((uint64_t) (1e9 / rate));
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+  boost::system::error_code error;
+  while (*running)
+  {
+    for (size_t i = 0; i < links; i++)
+    {
+      boost::asio::ip::udp::endpoint remote(boost::asio::ip::address_v4::loopback(), first_port + i);
+      socket.send_to(boost::asio::buffer(frame, len), remote, 0, error);
+    }
+
+    next += period;
+    std::chrono::nanoseconds wait = next - std::chrono::steady_clock::now();
+    if (wait.count() > 0)
+    {
+      struct timespec t = { (time_t) (wait.count() / 1000000000), (long) (wait.count() % 1000000000) };
+      nanosleep(&t, NULL);
+    }
+  }
+}
+
+/**
+ * \brief Run many UDP links at a telemetry rate and report what they cost the process
+ * \param io_threads Threads of a shared pool, or 0 for an io service and thread per link
+ */
+int bench_links_run(size_t links, double seconds, double rate, int io_threads)
+{
+  const uint16_t first_port = 14700;
+  const uint16_t peer_port = 14699;
+
+  ProcessUsage before = process_usage();
+
+  boost::scoped_ptr<mavrosflight::IoServicePool> io_pool;
+  if (io_threads > 0)
+  {
+    io_pool.reset(new mavrosflight::IoServicePool(io_threads));
+    io_pool->start();
+  }
+
+  std::atomic<uint64_t> received(0);
+  std::vector<mavrosflight::MavlinkUDP*> comms;
+  for (size_t i = 0; i < links; i++)
+  {
+    comms.push_back(new mavrosflight::MavlinkUDP("127.0.0.1", first_port + i, "127.0.0.1", peer_port,
+                                                 mavrosflight::MavlinkUDP::Options(), io_pool.get()));
+    comms.back()->subscribe_raw(MAVLINK_MSG_ID_SMALL_IMU, boost::bind(&count_message, _1, &received));
+    comms.back()->open();
+  }
+
+  std::atomic<bool> running(true);
+  boost::thread sender(boost::bind(&links_sender, links, first_port, rate, &running));
+
+  usleep(500000);
+  ProcessUsage start = process_usage();
+  double sender_start = thread_cpu_seconds(sender);
+  uint64_t received_start = received;
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+  usleep(seconds * 1e6);
+
+  double counted_seconds = seconds_since(start_time);
+  ProcessUsage end = process_usage();
+  double sender_seconds = thread_cpu_seconds(sender) - sender_start;
+  uint64_t frames = received - received_start;
+
+  running = false;
+  sender.join();
+  for (size_t i = 0; i < links; i++)
+  {
+    delete comms[i];
+  }
+  if (io_pool)
+    io_pool->stop();
+
+  // everything but the sender and this thread, which only sleeps, is the links' cost
+  double cpu_seconds = end.cpu_seconds - start.cpu_seconds - sender_seconds;
+  char name[32];
+  snprintf(name, sizeof(name), io_threads > 0 ? "pool of %d" : "thread per link", io_threads);
+  printf("%-20s %10.0f frames/s (%.1f %% of sent), %.2f %% of a CPU, %ld threads, +%ld kB resident\n",
+         name, frames / counted_seconds, 100 * frames / (counted_seconds * rate * links),
+         100 * cpu_seconds / counted_seconds, end.threads, end.rss_kb - before.rss_kb);
+  return 0;
+}
+
+/**
+ * \brief Compare running many links each on an io thread of its own with running them on a shared pool
+ *
+ * Each variant runs in a fresh process, so that neither sees the memory the other freed.
+ */
+int bench_links(size_t links, double seconds, double rate, int io_threads)
+{
+  printf("%-20s %lu UDP links, SMALL_IMU at %.0f Hz each, %.1f s\n", "links", (unsigned long) links, rate, seconds);
+
+  int variants[] = { 0, std::max(io_threads, 1) };
+  for (int i = 0; i < 2; i++)
+  {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+      perror("Failed to fork");
+      return 1;
+    }
+    if (pid == 0)
+    {
+      int result = bench_links_run(links, seconds, rate, variants[i]);
+      fflush(stdout);
+      _exit(result);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+void usage()
+{
+  fprintf(stderr, "usage: mavlink_bench parse [megabytes] [read_size]\n"
+                  "       mavlink_bench alloc [seconds]\n"
+                  "       mavlink_bench udp [seconds]\n"
+                  "       mavlink_bench handlers [operations]\n"
+                  "       mavlink_bench capture <file> [megabytes]\n"
+                  "       mavlink_bench replay <file> [speed]\n"
+                  "       mavlink_bench latency [pings]\n"
+                  "       mavlink_bench serial [seconds] [imu_rate] [attitude_rate] [ping_rate]\n"
+                  "       mavlink_bench baud [seconds]\n"
+                  "       mavlink_bench links [links] [seconds] [rate] [io_threads]\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 1;
+  }
+
+  std::string mode(argv[1]);
+  if (mode == "parse")
+  {
+    return bench_parse(argc > 2 ? atoi(argv[2]) : 100, argc > 3 ? atoi(argv[3]) : MAVLINK_SERIAL_READ_BUF_SIZE);
+  }
+  else if (mode == "alloc")
+  {
+    return bench_alloc(argc > 2 ? atof(argv[2]) : 5.0);
+  }
+  else if (mode == "udp")
+  {
+    return bench_udp(argc > 2 ? atof(argv[2]) : 5.0);
+  }
+  else if (mode == "handlers")
+  {
+    return bench_handlers(argc > 2 ? atoi(argv[2]) : 10000000);
+  }
+  else if (mode == "capture" && argc > 2)
+  {
+    return bench_capture(argv[2], argc > 3 ? atoi(argv[3]) : 100);
+  }
+  else if (mode == "replay" && argc > 2)
+  {
+    return bench_replay(argv[2], argc > 3 ? atof(argv[3]) : 0);
+  }
+  else if (mode == "latency")
+  {
+    return bench_latency(argc > 2 ? atoi(argv[2]) : 100000);
+  }
+  else if (mode == "serial")
+  {
+    return bench_serial(argc > 2 ? atof(argv[2]) : 10.0, argc > 3 ? atof(argv[3]) : 1000.0,
+                        argc > 4 ? atof(argv[4]) : 200.0, argc > 5 ? atof(argv[5]) : 100.0);
+  }
+  else if (mode == "baud")
+  {
+    return bench_baud(argc > 2 ? atof(argv[2]) : 6.0);
+  }
+  else if (mode == "links")
+  {
+    return bench_links(argc > 2 ? atoi(argv[2]) : 20, argc > 3 ? atof(argv[3]) : 5.0, argc > 4 ? atof(argv[4]) : 1000.0,
+                       argc > 5 ? atoi(argv[5]) : 2);
+  }
+
+  usage();
+  return 1;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file frame_scanner.cpp
+ */
+
+#include <rosflight/mavrosflight/frame_scanner.h>
+
+#include <string.h>
+
+namespace mavrosflight
+{
+
+namespace
+{
+
+const uint8_t CRC_EXTRA[256] = MAVLINK_MESSAGE_CRCS;
+
+/**
+ * \brief Lookup table for the X.25 CRC, one entry per input byte value
+ */
+struct CrcTable
+{
+  uint16_t entries[256];
+
+  CrcTable()
+  {
+    // same polynomial step as crc_accumulate(), evaluated once per possible byte value
+    for (int i = 0; i < 256; i++)
+    {
+      uint8_t tmp = (uint8_t) i;
+      tmp ^= (uint8_t) (tmp << 4);
+      entries[i] = ((uint16_t) tmp << 8) ^ ((uint16_t) tmp << 3) ^ (tmp >> 4);
+    }
+  }
+};
+
+const CrcTable crc_table;
+
+} // namespace
+
+FrameScanner::FrameScanner(size_t read_size) :
+  read_size_(0),
+  head_(0),
+  tail_(0),
+  frame_data_(NULL),
+  frame_len_(0),
+  frames_received_(0),
+  v2_frames_received_(0),
+  crc_errors_(0),
+  bytes_dropped_(0)
+{
+  resize(read_size);
+}
+
+void FrameScanner::resize(size_t read_size)
+{
+  // leave room for the tail of a partial frame in front of a full read
+  read_size_ = read_size;
+  buffer_.assign(read_size + MAVLINK2_MAX_PACKET_LEN, 0);
+  head_ = 0;
+  tail_ = 0;
+}
+
+boost::asio::mutable_buffers_1 FrameScanner::prepare()
+{
+  // move the partial frame left over from the last read to the front of the buffer
+  if (head_ > 0)
+  {
+    memmove(&buffer_[0], &buffer_[head_], tail_ - head_);
+    tail_ -= head_;
+    head_ = 0;
+  }
+
+  return boost::asio::buffer(&buffer_[tail_], std::min(read_size_, buffer_.size() - tail_));
+}
+
+void FrameScanner::commit(size_t bytes_transferred)
+{
+  tail_ += bytes_transferred;
+}
+
+bool FrameScanner::next_frame()
+{
+  while (head_ < tail_)
+  {
+    const uint8_t *start = &buffer_[head_];
+    const uint8_t *end = &buffer_[tail_];
+    const uint8_t *stx = start;
+    while (stx < end && *stx != MAVLINK_STX && *stx != MAVLINK2_STX)
+      stx++;
+
+    bytes_dropped_ += stx - start;
+    head_ += stx - start;
+    if (stx == end)
+      return false;
+
+    size_t available = tail_ - head_;
+    size_t header_len = mavlink2_header_len(stx[0]);
+    if (available < header_len)
+      return false;
+
+    size_t frame_len = mavlink2_frame_len(stx);
+    if (frame_len == 0)
+    {
+      // a v2 header we can't handle (signed, or a message ID outside the dialect), or not a header at all
+      bytes_dropped_++;
+      head_++;
+      continue;
+    }
+
+    if (available < frame_len)
+      return false;
+
+    uint8_t payload_len = stx[1];
+    uint8_t msgid = mavlink2_frame_msgid(stx);
+    uint16_t crc = crc_calculate(X25_INIT_CRC, stx + 1, header_len - 1 + payload_len);
+    crc = crc_calculate(crc, &CRC_EXTRA[msgid], 1);
+
+    const uint8_t *ck = stx + header_len + payload_len;
+    if (ck[0] != (crc & 0xFF) || ck[1] != (crc >> 8))
+    {
+      // not a frame, or a corrupted one; resynchronize on the next start byte
+      crc_errors_++;
+      bytes_dropped_++;
+      head_++;
+      continue;
+    }
+
+    frame_data_ = stx;
+    frame_len_ = frame_len;
+    frames_received_++;
+    if (stx[0] == MAVLINK2_STX)
+      v2_frames_received_++;
+
+    head_ += frame_len;
+    return true;
+  }
+
+  return false;
+}
+
+void FrameScanner::decode(mavlink_message_t *msg) const
+{
+  mavlink2_frame_decode(frame_data_, msg);
+}
+
+uint16_t FrameScanner::crc_calculate(uint16_t crc, const uint8_t *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    crc = (crc >> 8) ^ crc_table.entries[(crc ^ data[i]) & 0xFF];
+  }
+  return crc;
+}
+
+} // namespace mavrosflight
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file handoff_queue.cpp
+ */
+
+#include <rosflight/mavrosflight/handoff_queue.h>
+
+#include <boost/thread/lock_guard.hpp>
+
+namespace mavrosflight
+{
+
+// the NEVER_DROP messages (status, errors, acks) arrive at a few Hz at most, so this covers minutes of a stalled worker
+static const size_t PRIORITY_RING_SIZE = 1024;
+
+HandoffQueue::HandoffQueue(size_t capacity) :
+  ring_(capacity),
+  priority_ring_(PRIORITY_RING_SIZE),
+  mailboxes_full_(0),
+  consumer_waiting_(false),
+  high_water_(0),
+  pushed_(0),
+  dropped_(0),
+  replaced_(0),
+  lost_(0)
+{
+  for (uint32_t i = 0; i < NUM_IDS; i++)
+  {
+    policy_[i] = DROP_NEWEST;
+    mailboxes_[i] = NULL;
+  }
+}
+
+HandoffQueue::~HandoffQueue()
+{
+  for (uint32_t i = 0; i < NUM_IDS; i++)
+  {
+    delete mailboxes_[i];
+  }
+}
+
+void HandoffQueue::set_policy(uint32_t msgid, DropPolicy policy)
+{
+  if (msgid >= NUM_IDS)
+    return;
+
+  policy_[msgid] = policy;
+
+  if (policy == KEEP_LATEST && mailboxes_[msgid] == NULL)
+  {
+    mailboxes_[msgid] = new Mailbox();
+    mailbox_ids_.push_back(msgid);
+  }
+}
+
+HandoffQueue::DropPolicy HandoffQueue::get_policy(uint32_t msgid) const
+{
+  return msgid < NUM_IDS ? policy_[msgid] : DROP_NEWEST;
+}
+
+void HandoffQueue::push(const mavlink_message_t &msg, uint64_t rx_ns)
+{
+  pushed_.fetch_add(1, std::memory_order_relaxed);
+
+  switch (get_policy(msg.msgid))
+  {
+  case KEEP_LATEST:
+  {
+    Mailbox *mailbox = mailboxes_[msg.msgid];
+    while (mailbox->locked.exchange(true, std::memory_order_acquire)) {}
+    mailbox->entry.msg = msg;
+    mailbox->entry.rx_ns = rx_ns;
+    bool was_full = mailbox->full.exchange(true, std::memory_order_relaxed);
+    mailbox->locked.store(false, std::memory_order_release);
+
+    if (was_full)
+      replaced_.fetch_add(1, std::memory_order_relaxed);
+    else
+      mailboxes_full_.fetch_add(1, std::memory_order_relaxed);
+    break;
+  }
+  case NEVER_DROP:
+  {
+    Entry entry = { msg, rx_ns };
+    if (!priority_ring_.push(entry))
+    {
+      lost_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    break;
+  }
+  default:
+  {
+    Entry entry = { msg, rx_ns };
+    if (!ring_.push(entry))
+    {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    break;
+  }
+  }
+
+  size_t depth = ring_.size() + priority_ring_.size() + mailboxes_full_.load(std::memory_order_relaxed);
+  if (depth > high_water_.load(std::memory_order_relaxed))
+    high_water_.store(depth, std::memory_order_relaxed);
+
+  notify();
+}
+
+bool HandoffQueue::pop(mavlink_message_t *msg, uint32_t timeout_ms, uint64_t *rx_ns)
+{
+  Entry entry;
+  bool got = try_pop(&entry);
+  if (!got)
+  {
+    boost::unique_lock<boost::mutex> lock(wait_mutex_);
+
+    // announce that we are about to sleep, then look once more so that a push racing with us isn't missed
+    consumer_waiting_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    got = try_pop(&entry);
+    if (!got)
+    {
+      wait_cond_.timed_wait(lock, boost::posix_time::milliseconds(timeout_ms));
+      got = try_pop(&entry);
+    }
+
+    consumer_waiting_.store(false, std::memory_order_relaxed);
+  }
+
+  if (got)
+  {
+    *msg = entry.msg;
+    if (rx_ns != NULL)
+      *rx_ns = entry.rx_ns;
+  }
+  return got;
+}
+
+void HandoffQueue::wake()
+{
+  boost::lock_guard<boost::mutex> lock(wait_mutex_);
+  wait_cond_.notify_all();
+}
+
+HandoffQueue::Stats HandoffQueue::get_stats() const
+{
+  Stats stats;
+  stats.depth = ring_.size() + priority_ring_.size() + mailboxes_full_.load(std::memory_order_relaxed);
+  stats.high_water_mark = high_water_.load(std::memory_order_relaxed);
+  stats.pushed = pushed_.load(std::memory_order_relaxed);
+  stats.dropped = dropped_.load(std::memory_order_relaxed);
+  stats.replaced = replaced_.load(std::memory_order_relaxed);
+  stats.lost = lost_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+bool HandoffQueue::try_pop(Entry *entry)
+{
+  if (priority_ring_.pop(entry))
+    return true;
+
+  if (mailboxes_full_.load(std::memory_order_relaxed) > 0)
+  {
+    for (size_t i = 0; i < mailbox_ids_.size(); i++)
+    {
+      if (take_mailbox(mailboxes_[mailbox_ids_[i]], entry))
+        return true;
+    }
+  }
+
+  return ring_.pop(entry);
+}
+
+bool HandoffQueue::take_mailbox(Mailbox *mailbox, Entry *entry)
+{
+  if (!mailbox->full.load(std::memory_order_relaxed))
+    return false;
+
+  while (mailbox->locked.exchange(true, std::memory_order_acquire)) {}
+  bool full = mailbox->full.exchange(false, std::memory_order_relaxed);
+  if (full)
+    *entry = mailbox->entry;
+  mailbox->locked.store(false, std::memory_order_release);
+
+  if (full)
+    mailboxes_full_.fetch_sub(1, std::memory_order_relaxed);
+  return full;
+}
+
+void HandoffQueue::notify()
+{
+  // pairs with the fence in pop(): either the consumer sees our message, or we see that it is waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (consumer_waiting_.load(std::memory_order_relaxed))
+  {
+    boost::lock_guard<boost::mutex> lock(wait_mutex_);
+    wait_cond_.notify_one();
+  }
+}
+
+HandoffQueue::Ring::Ring(size_t capacity) :
+  slots_(NULL),
+  mask_(0),
+  head_(0),
+  tail_(0)
+{
+  size_t size = 2;
+  while (size < capacity)
+    size <<= 1;
+
+  slots_ = new Entry[size];
+  mask_ = size - 1;
+}
+
+HandoffQueue::Ring::~Ring()
+{
+  delete[] slots_;
+}
+
+bool HandoffQueue::Ring::push(const Entry &entry)
+{
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail - head_.load(std::memory_order_acquire) > mask_)
+    return false;
+
+  slots_[tail & mask_] = entry;
+  tail_.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+bool HandoffQueue::Ring::pop(Entry *entry)
+{
+  size_t head = head_.load(std::memory_order_relaxed);
+  if (head == tail_.load(std::memory_order_acquire))
+    return false;
+
+  *entry = slots_[head & mask_];
+  head_.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+size_t HandoffQueue::Ring::size() const
+{
+  // read head first; the consumer only moves it towards tail, so the difference can't go negative
+  size_t head = head_.load(std::memory_order_relaxed);
+  return tail_.load(std::memory_order_relaxed) - head;
+}
+
+} // namespace mavrosflight
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017 Daniel Koch, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file io_service_pool.cpp
+ */
+
+#include <rosflight/mavrosflight/io_service_pool.h>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+
+namespace mavrosflight
+{
+
+IoServicePool::IoServicePool(size_t size) :
+  next_(0),
+  running_(false)
+{
+  for (size_t i = 0; i < std::max(size, (size_t) 1); i++)
+  {
+    services_.push_back(boost::shared_ptr<boost::asio::io_service>(new boost::asio::io_service()));
+  }
+}
+
+IoServicePool::~IoServicePool()
+{
+  stop();
+}
+
+void IoServicePool::start(const MavlinkComm::IoThreadOptions &options)
+{
+  if (running_)
+    return;
+
+  for (size_t i = 0; i < services_.size(); i++)
+  {
+    services_[i]->reset();
+    work_.push_back(boost::shared_ptr<boost::asio::io_service::work>(
+                      new boost::asio::io_service::work(*services_[i])));
+    threads_.push_back(boost::shared_ptr<boost::thread>(
+                         new boost::thread(boost::bind(&boost::asio::io_service::run, services_[i].get()))));
+    MavlinkComm::apply_io_thread_options(*threads_.back(), options);
+  }
+  running_ = true;
+}
+
+void IoServicePool::stop()
+{
+  if (!running_)
+    return;
+
+  work_.clear();
+  for (size_t i = 0; i < services_.size(); i++)
+  {
+    services_[i]->stop();
+  }
+  for (size_t i = 0; i < threads_.size(); i++)
+  {
+    threads_[i]->join();
+  }
+  threads_.clear();
+  running_ = false;
+}
+
+boost::asio::io_service& IoServicePool::get_io_service()
+{
+  boost::asio::io_service &service = *services_[next_];
+  next_ = (next_ + 1) % services_.size();
+  return service;
+}
+
+} // namespace mavrosflight
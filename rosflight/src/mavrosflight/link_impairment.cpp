@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2017 Daniel Koch, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file link_impairment.cpp
+ */
+
+#include <rosflight/mavrosflight/link_impairment.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include <string.h>
+
+namespace mavrosflight
+{
+
+LinkImpairment::LinkImpairment() :
+  enabled_(false),
+  head_(0),
+  count_(0),
+  head_pos_(0),
+  link_free_ns_(0),
+  last_delivery_ns_(0),
+  burst_(false),
+  burst_start_probability_(0),
+  burst_end_probability_(1),
+  bits_to_error_(UINT64_MAX),
+  frames_(0),
+  lost_(0),
+  corrupted_(0),
+  dropped_(0)
+{
+}
+
+void LinkImpairment::configure(const Options &options)
+{
+  options_ = options;
+  enabled_ = options.enabled();
+
+  if (enabled_)
+    slots_.resize(LINK_IMPAIRMENT_MAX_FRAMES);
+  else
+    std::vector<Slot>().swap(slots_);
+  head_ = 0;
+  count_ = 0;
+  head_pos_ = 0;
+  link_free_ns_ = 0;
+  last_delivery_ns_ = 0;
+
+  random_.seed(options.seed);
+
+  // two-state (Gilbert) loss model: every frame in a burst is lost, and bursts last loss_burst_length frames on
+  // average; the start probability makes the long-run loss come out at loss_probability
+  double loss = std::min(std::max(options.loss_probability, 0.0), 1.0);
+  burst_ = false;
+  burst_end_probability_ = 1.0 / std::max(options.loss_burst_length, 1.0);
+  burst_start_probability_ = loss < 1 ? loss * burst_end_probability_ / (1 - loss) : 1;
+  if (loss >= 1)
+  {
+    burst_end_probability_ = 0;
+  }
+  else if (burst_start_probability_ > 1)
+  {
+    // even a burst starting after every gap can't reach that much loss with bursts this short; lengthen them instead
+    burst_start_probability_ = 1;
+    burst_end_probability_ = (1 - loss) / loss;
+    std::cerr << "Link impairment: bursts of " << options.loss_burst_length << " frames can't lose " << loss
+              << " of the frames; using bursts of " << 1 / burst_end_probability_ << " frames" << std::endl;
+  }
+
+  bits_to_error_ = UINT64_MAX;
+  if (options.bit_error_rate > 0)
+    bits_to_error_ = std::geometric_distribution<uint64_t>(std::min(options.bit_error_rate, 1.0))(random_);
+}
+
+bool LinkImpairment::submit(const uint8_t *data, size_t len, uint64_t now_ns)
+{
+  frames_.fetch_add(1, std::memory_order_relaxed);
+
+  if (count_ == slots_.size() || len > MAVLINK2_MAX_PACKET_LEN)
+  {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // frames wait for the ones ahead of them to be sent, and are dropped if too many bytes are waiting already
+  uint64_t start_ns = std::max(now_ns, link_free_ns_);
+  if (options_.bandwidth_bps > 0)
+  {
+    double queued_bytes = (start_ns - now_ns) * 1e-9 * options_.bandwidth_bps / 8;
+    if (start_ns > now_ns && queued_bytes + len > options_.queue_bytes)
+    {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    link_free_ns_ = start_ns + (uint64_t) (len * 8 * 1e9 / options_.bandwidth_bps);
+  }
+  else
+  {
+    link_free_ns_ = start_ns;
+  }
+
+  // a lost frame was still sent, so it has taken its share of the bandwidth
+  if (options_.loss_probability > 0)
+  {
+    double u = std::generate_canonical<double, 32>(random_);
+    burst_ = burst_ ? u >= burst_end_probability_ : u < burst_start_probability_;
+    if (burst_)
+    {
+      lost_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+
+  // jitter never reorders frames; a frame delayed by more holds up the ones behind it, as on a serial radio link
+  uint64_t delivery_ns = link_free_ns_ + (uint64_t) options_.delay_us * 1000 + jitter_ns();
+  delivery_ns = std::max(delivery_ns, last_delivery_ns_);
+  last_delivery_ns_ = delivery_ns;
+
+  Slot &slot = slots_[(head_ + count_) % slots_.size()];
+  slot.delivery_ns = delivery_ns;
+  slot.len = len;
+  memcpy(slot.data, data, len);
+  if (corrupt(slot.data, len))
+    corrupted_.fetch_add(1, std::memory_order_relaxed);
+  count_++;
+
+  return true;
+}
+
+uint64_t LinkImpairment::next_delivery_ns() const
+{
+  return count_ > 0 ? slots_[head_].delivery_ns : 0;
+}
+
+size_t LinkImpairment::read(uint64_t now_ns, uint8_t *data, size_t len)
+{
+  size_t copied = 0;
+  while (count_ > 0 && copied < len)
+  {
+    const Slot &slot = slots_[head_];
+    if (slot.delivery_ns > now_ns)
+      break;
+
+    size_t n = std::min(len - copied, slot.len - head_pos_);
+    memcpy(data + copied, slot.data + head_pos_, n);
+    copied += n;
+    head_pos_ += n;
+
+    if (head_pos_ == slot.len)
+    {
+      head_ = (head_ + 1) % slots_.size();
+      head_pos_ = 0;
+      count_--;
+    }
+  }
+  return copied;
+}
+
+LinkImpairment::Stats LinkImpairment::get_stats() const
+{
+  Stats stats;
+  stats.frames = frames_.load(std::memory_order_relaxed);
+  stats.lost = lost_.load(std::memory_order_relaxed);
+  stats.corrupted = corrupted_.load(std::memory_order_relaxed);
+  stats.dropped = dropped_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+uint64_t LinkImpairment::jitter_ns()
+{
+  if (options_.jitter_us == 0)
+    return 0;
+
+  double mean_ns = options_.jitter_us * 1000.0;
+  switch (options_.jitter_distribution)
+  {
+  case JITTER_EXPONENTIAL:
+    return (uint64_t) std::exponential_distribution<double>(1 / mean_ns)(random_);
+  case JITTER_PARETO:
+  {
+    // with shape 2 the mean equals the scale, while the variance is unbounded
+    double u = 1 - std::generate_canonical<double, 32>(random_);
+    return (uint64_t) std::min(mean_ns * (1 / std::sqrt(u) - 1), 1e12);
+  }
+  case JITTER_UNIFORM:
+  default:
+    return (uint64_t) std::uniform_real_distribution<double>(0, 2 * mean_ns)(random_);
+  }
+}
+
+bool LinkImpairment::corrupt(uint8_t *data, size_t len)
+{
+  if (options_.bit_error_rate <= 0)
+    return false;
+
+  // errors are drawn as the gaps between them, so a clean frame costs nothing but a subtraction
+  bool flipped = false;
+  uint64_t bits = len * 8;
+  uint64_t pos = 0;
+  while (bits_to_error_ < bits - pos)
+  {
+    pos += bits_to_error_;
+    data[pos / 8] ^= 1 << (pos % 8);
+    pos++;
+    flipped = true;
+    bits_to_error_ = std::geometric_distribution<uint64_t>(std::min(options_.bit_error_rate, 1.0))(random_);
+  }
+  bits_to_error_ -= bits - pos;
+  return flipped;
+}
+
+} // namespace mavrosflight
@@ -34,38 +34,233 @@
  * \author Daniel Koch <daniel.koch@byu.edu>
  */
 
+#include <rosflight/mavrosflight/io_service_pool.h>
 #include <rosflight/mavrosflight/mavlink_comm.h>
 
+#include <algorithm>
+#include <exception>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
 namespace mavrosflight
 {
 
 using boost::asio::serial_port_base;
 
-MavlinkComm::MavlinkComm() :
-  io_service_(),
-  write_in_progress_(false)
+MavlinkComm::MavlinkComm(IoServicePool *io_pool) :
+  own_io_service_(io_pool == NULL ? new boost::asio::io_service() : NULL),
+  io_service_(io_pool == NULL ? *own_io_service_ : io_pool->get_io_service()),
+  pending_ops_(0),
+  io_pool_(io_pool),
+  sysid_(1),
+  compid_(50),
+  scanner_(MAVLINK_SERIAL_READ_BUF_SIZE),
+  rx_byte_ns_(0),
+  read_handler_memory_(&pending_ops_),
+  write_handler_memory_(&pending_ops_),
+  write_hold_handler_memory_(&pending_ops_),
+  write_pace_handler_memory_(&pending_ops_),
+  reconnect_handler_memory_(&pending_ops_),
+  close_handler_memory_(&pending_ops_),
+  reconnect_enabled_(true),
+  reconnect_max_backoff_ms_(MAVLINK_RECONNECT_MAX_BACKOFF_MS),
+  reconnect_backoff_ms_(0),
+  reconnect_timer_(io_service_),
+  link_up_(false),
+  closing_(false),
+  link_recovering_(false),
+  link_lost_ns_(0),
+  link_reopened_ns_(0),
+  mavlink2_enabled_(true),
+  peer_mavlink2_(false),
+  mavlink2_probes_left_(0),
+  has_frame_callback_(false),
+  recorder_(NULL),
+  write_in_progress_(false),
+  write_scratch_ready_(0),
+  write_mailboxes_pending_(0),
+  background_write_limit_(MAVLINK_DEFAULT_WRITE_MTU),
+  write_mtu_(MAVLINK_DEFAULT_WRITE_MTU),
+  write_coalesce_delay_us_(0),
+  write_hold_timer_(io_service_),
+  write_hold_state_(WRITE_HOLD_NONE),
+  write_hold_waiting_(false),
+  write_pace_timer_(io_service_),
+  write_pace_start_ns_(0),
+  write_pace_allow_hold_(false),
+  rx_impairment_scanner_(MAVLINK_SERIAL_READ_BUF_SIZE),
+  rx_impairment_timer_(io_service_),
+  rx_impairment_waiting_(false),
+  rx_impairment_handler_memory_(&pending_ops_),
+  tx_impairment_timer_(io_service_),
+  tx_impairment_waiting_(false),
+  tx_impairment_writing_(false),
+  tx_impairment_blocked_(false),
+  tx_impairment_handler_memory_(&pending_ops_),
+  tx_impairment_write_memory_(&pending_ops_),
+  rx_bytes_(0),
+  rx_frames_(0),
+  rx_frames_v2_(0),
+  rx_bytes_saved_(0),
+  rx_crc_errors_(0),
+  rx_bytes_dropped_(0),
+  rx_reads_(0),
+  tx_bytes_(0),
+  tx_frames_v2_(0),
+  tx_bytes_saved_(0),
+  tx_pacing_waits_(0),
+  tx_pacing_wait_us_(0),
+  tx_pacing_wait_max_us_(0),
+  link_losses_(0),
+  reconnect_attempts_(0),
+  last_outage_us_(0),
+  last_recovery_us_(0),
+  max_outage_us_(0)
 {
+  for (int i = 0; i < NUM_WRITE_PRIORITIES; i++)
+  {
+    // bulk parameter traffic comes in bursts of hundreds of frames; the other classes only ever have a few queued
+    write_queues_[i] = new WriteQueue(i == WRITE_PRIORITY_BULK ? MAVLINK_WRITE_QUEUE_SIZE
+                                                               : MAVLINK_PRIORITY_WRITE_QUEUE_SIZE);
+    write_frames_[i] = 0;
+    write_replaced_[i] = 0;
+    write_delay_total_us_[i] = 0;
+    write_delay_max_us_[i] = 0;
+  }
+
+  for (int i = 0; i < 256; i++)
+  {
+    write_priority_[i] = WRITE_PRIORITY_BULK;
+    write_mailboxes_[i] = NULL;
+    rx_sysid_seen_[i] = false;
+    rx_seq_gaps_[i] = 0;
+    rx_last_seq_[i] = 0;
+  }
+
+  for (int i = 0; i < MAVLINK_WRITE_LATENCY_BUCKETS; i++)
+  {
+    write_latency_histogram_[i] = 0;
+  }
+
+  for (int i = 0; i < MAVLINK_DISPATCH_LATENCY_BUCKETS; i++)
+  {
+    dispatch_latency_histogram_[i] = 0;
+  }
+
+  write_priority_[MAVLINK_MSG_ID_OFFBOARD_CONTROL] = WRITE_PRIORITY_CONTROL;
+  write_priority_[MAVLINK_MSG_ID_ADDED_TORQUE] = WRITE_PRIORITY_CONTROL;
+  write_priority_[MAVLINK_MSG_ID_ROSFLIGHT_AUX_CMD] = WRITE_PRIORITY_CONTROL;
+  write_priority_[MAVLINK_MSG_ID_EXTERNAL_ATTITUDE] = WRITE_PRIORITY_CONTROL;
+  write_priority_[MAVLINK_MSG_ID_HEARTBEAT] = WRITE_PRIORITY_SAFETY;
+  write_priority_[MAVLINK_MSG_ID_ROSFLIGHT_CMD] = WRITE_PRIORITY_SAFETY;
+  write_priority_[MAVLINK_MSG_ID_TIMESYNC] = WRITE_PRIORITY_TIMESYNC;
+
+  // only the freshest setpoint is worth sending
+  set_write_replace(MAVLINK_MSG_ID_OFFBOARD_CONTROL, true);
+  set_write_replace(MAVLINK_MSG_ID_ADDED_TORQUE, true);
+  set_write_replace(MAVLINK_MSG_ID_ROSFLIGHT_AUX_CMD, true);
+  set_write_replace(MAVLINK_MSG_ID_EXTERNAL_ATTITUDE, true);
+
+  partial_write_.frame = NULL;
 }
 
 MavlinkComm::~MavlinkComm()
 {
+  for (int i = 0; i < NUM_WRITE_PRIORITIES; i++)
+  {
+    delete write_queues_[i];
+  }
+
+  for (int i = 0; i < 256; i++)
+  {
+    delete write_mailboxes_[i];
+  }
 }
 
-void MavlinkComm::open()
+void MavlinkComm::open(bool retry)
 {
+  // the firmware has to show again that it understands v2 framing
+  peer_mavlink2_ = false;
+  mavlink2_probes_left_ = mavlink2_enabled_ ? MAVLINK2_NEGOTIATION_PROBES : 0;
+
   // open the port
-  do_open();
+  bool opened = true;
+  try
+  {
+    do_open();
+  }
+  catch (const std::exception &e)
+  {
+    if (!retry)
+      throw;
 
-  // start reading from the port
-  async_read();
+    std::cerr << "Failed to open port: " << e.what() << ", trying again in the background" << std::endl;
+    do_close();
+    opened = false;
+  }
+  closing_ = false;
+  link_up_ = opened;
+  link_recovering_ = false;
+  reconnect_backoff_ms_ = 0;
+  link_lost_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  // a write that was in flight when the link was last closed never completed; its frame is sent again in full. Until
+  // a port that failed to open has been opened, the write sequence belongs to the reconnect attempts, as after a
+  // failure.
+  write_in_progress_ = !opened;
+  if (partial_write_.frame != NULL)
+    partial_write_.frame->pos = 0;
+
+  // start reading from the port, or trying to open it
+  if (io_pool_ != NULL)
+  {
+    // the pool's thread may already be running the other links' handlers
+    if (opened)
+      io_service_.post(make_alloc_handler(read_handler_memory_, boost::bind(&MavlinkComm::async_read, this)));
+    else
+      io_service_.post(make_alloc_handler(reconnect_handler_memory_,
+                                          boost::bind(&MavlinkComm::schedule_reconnect, this)));
+    return;
+  }
+
+  io_service_.reset();
+  io_work_.reset(new boost::asio::io_service::work(io_service_));
+  if (opened)
+    async_read();
+  else
+    schedule_reconnect();
   io_thread_ = boost::thread(boost::bind(&boost::asio::io_service::run, &this->io_service_));
+  apply_io_thread_options(io_thread_, io_thread_options_);
 }
 
 void MavlinkComm::close()
 {
   mutex_lock lock(mutex_);
 
+  if (io_pool_ != NULL)
+  {
+    if (io_pool_->running())
+    {
+      boost::promise<void> closed;
+      io_service_.post(boost::bind(&MavlinkComm::close_on_io_thread, this, &closed));
+      closed.get_future().wait();
+    }
+    else
+    {
+      // nothing can wait for the handlers that closing cancels; see IoServicePool on why this isn't safe
+      close_on_io_thread(NULL);
+    }
+    return;
+  }
+
   io_service_.stop();
+  io_work_.reset();
+  link_up_ = false;
   do_close();
 
   if (io_thread_.joinable())
@@ -74,23 +269,74 @@ void MavlinkComm::close()
   }
 }
 
+void MavlinkComm::close_on_io_thread(boost::promise<void> *closed)
+{
+  closing_ = true;
+  link_up_ = false;
+  reconnect_timer_.cancel();
+  write_hold_timer_.cancel();
+  write_pace_timer_.cancel();
+  rx_impairment_timer_.cancel();
+  tx_impairment_timer_.cancel();
+  do_close();
+
+  if (closed != NULL)
+    close_drained(closed);
+}
+
+void MavlinkComm::close_drained(boost::promise<void> *closed)
+{
+  // closing cancelled every operation, and none of the cancelled handlers starts another once closing_ is set; asio
+  // queues them behind whatever was posted before, so they are waited for by going round the queue
+  if (pending_ops_.load(std::memory_order_acquire) == 0)
+    closed->set_value();
+  else
+    io_service_.post(boost::bind(&MavlinkComm::close_drained, this, closed));
+}
+
+void MavlinkComm::set_reconnect(bool enabled, uint32_t max_backoff_ms)
+{
+  reconnect_enabled_ = enabled;
+  reconnect_max_backoff_ms_ = std::max<uint32_t>(max_backoff_ms, MAVLINK_RECONNECT_MIN_BACKOFF_MS);
+}
+
+void MavlinkComm::set_system_id(uint8_t sysid, uint8_t compid)
+{
+  sysid_ = sysid;
+  compid_ = compid;
+}
+
+void MavlinkComm::set_read_buffer_size(size_t size)
+{
+  // an empty read would complete right away and spin, and a UDP read shorter than a frame would truncate it
+  size = std::max<size_t>(size, MAVLINK2_MAX_PACKET_LEN);
+  scanner_.resize(size);
+  rx_impairment_scanner_.resize(size);
+}
+
+MavlinkDispatcher::SubscriptionId MavlinkComm::subscribe_raw(uint32_t msgid,
+                                                            const MavlinkDispatcher::RawCallback &callback)
+{
+  return dispatcher_.subscribe_raw(msgid, callback);
+}
+
+void MavlinkComm::unsubscribe(MavlinkDispatcher::SubscriptionId id)
+{
+  dispatcher_.unsubscribe(id);
+}
+
 void MavlinkComm::register_mavlink_listener(MavlinkListenerInterface * const listener)
 {
   if (listener == NULL)
     return;
 
-  bool already_registered = false;
-  for (int i = 0; i < listeners_.size(); i++)
+  mutex_lock lock(mutex_);
+
+  if (listeners_.find(listener) == listeners_.end())
   {
-    if (listener == listeners_[i])
-    {
-      already_registered = true;
-      break;
-    }
+    listeners_[listener] = dispatcher_.subscribe_all(
+          boost::bind(&MavlinkListenerInterface::handle_mavlink_message, listener, _1));
   }
-
-  if (!already_registered)
-    listeners_.push_back(listener);
 }
 
 void MavlinkComm::unregister_mavlink_listener(MavlinkListenerInterface * const listener)
@@ -98,12 +344,67 @@ void MavlinkComm::unregister_mavlink_listener(MavlinkListenerInterface * const l
   if (listener == NULL)
     return;
 
-  for (int i = 0; i < listeners_.size(); i++)
+  mutex_lock lock(mutex_);
+
+  std::map<MavlinkListenerInterface*, MavlinkDispatcher::SubscriptionId>::iterator it = listeners_.find(listener);
+  if (it != listeners_.end())
+  {
+    dispatcher_.unsubscribe(it->second);
+    listeners_.erase(it);
+  }
+}
+
+void MavlinkComm::set_rx_byte_time(uint32_t ns)
+{
+  rx_byte_ns_.store(ns, std::memory_order_relaxed);
+}
+
+void MavlinkComm::set_mavlink2(bool enabled)
+{
+  mavlink2_enabled_ = enabled;
+}
+
+void MavlinkComm::set_io_thread_options(const IoThreadOptions &options)
+{
+  io_thread_options_ = options;
+}
+
+void MavlinkComm::apply_io_thread_options(boost::thread &io_thread, const IoThreadOptions &options)
+{
+  if (options.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+  {
+    std::cerr << "Failed to lock memory: " << strerror(errno) << std::endl;
+  }
+
+  pthread_t thread = io_thread.native_handle();
+
+  if (!options.cpus.empty())
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (size_t i = 0; i < options.cpus.size(); i++)
+    {
+      if (options.cpus[i] >= 0 && options.cpus[i] < CPU_SETSIZE)
+        CPU_SET(options.cpus[i], &cpus);
+    }
+
+    int result = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (result != 0)
+    {
+      std::cerr << "Failed to set io thread CPU affinity: " << strerror(result) << std::endl;
+    }
+  }
+
+  if (options.sched_priority > 0)
   {
-    if (listener == listeners_[i])
+    sched_param param;
+    param.sched_priority = options.sched_priority;
+
+    int result = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if (result != 0)
     {
-      listeners_.erase(listeners_.begin() + i);
-      i--;
+      std::cerr << "Failed to set io thread to SCHED_FIFO priority " << param.sched_priority << ": "
+                << strerror(result) << std::endl;
     }
   }
 }
@@ -112,13 +413,9 @@ void MavlinkComm::async_read()
 {
   if (!is_open()) return;
 
-  do_async_read(
-        boost::asio::buffer(read_buf_raw_, MAVLINK_SERIAL_READ_BUF_SIZE),
-        boost::bind(
-          &MavlinkComm::async_read_end,
-          this,
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
+  IoCallback callback = { this, &MavlinkComm::async_read_end };
+  do_async_read(rx_impairment_.enabled() ? rx_impairment_scanner_.prepare() : scanner_.prepare(),
+                make_alloc_handler(read_handler_memory_, callback));
 }
 
 void MavlinkComm::async_read_end(const boost::system::error_code &error, size_t bytes_transferred)
@@ -127,87 +424,937 @@ void MavlinkComm::async_read_end(const boost::system::error_code &error, size_t
 
   if (error)
   {
-    close();
+    // a read cancelled by an earlier failure has nothing more to report
+    if (error != boost::asio::error::operation_aborted)
+      link_lost(error);
     return;
   }
 
-  for (int i = 0; i < bytes_transferred; i++)
+  rx_bytes_.fetch_add(bytes_transferred, std::memory_order_relaxed);
+  rx_reads_.fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t read_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  if (rx_impairment_.enabled())
+  {
+    // the frames are scanned again once the emulated link delivers them
+    rx_impairment_scanner_.commit(bytes_transferred);
+    while (rx_impairment_scanner_.next_frame())
+    {
+      rx_impairment_.submit(rx_impairment_scanner_.frame_data(), rx_impairment_scanner_.frame_len(), read_ns);
+    }
+    update_rx_error_counts();
+    schedule_rx_impairment();
+  }
+  else
+  {
+    scanner_.commit(bytes_transferred);
+    process_frames(read_ns);
+  }
+
+  async_read();
+}
+
+void MavlinkComm::process_frames(uint64_t read_ns)
+{
+  uint64_t byte_ns = rx_byte_ns_.load(std::memory_order_relaxed);
+
+  while (scanner_.next_frame())
   {
-    if (mavlink_parse_char(MAVLINK_COMM_0, read_buf_raw_[i], &msg_in_, &status_in_))
+    if (link_recovering_)
+      link_recovered();
+
+    track_sequence(scanner_.frame_sysid(), scanner_.frame_seq());
+    track_version();
+
+    if (recorder_ != NULL)
+      recorder_->record(MavlinkRecorder::DIRECTION_RX, read_ns, scanner_.frame_data(), scanner_.frame_len());
+
+    if (has_frame_callback_.load(std::memory_order_acquire))
     {
-      for (int i = 0; i < listeners_.size(); i++)
-      {
-        listeners_[i]->handle_mavlink_message(msg_in_);
-      }
+      boost::lock_guard<boost::mutex> lock(frame_callback_mutex_);
+      if (frame_callback_)
+        frame_callback_(scanner_.frame_data(), scanner_.frame_len());
     }
+
+    if (!dispatcher_.has_subscribers(scanner_.frame_msgid()))
+      continue;
+
+    // the last byte read arrived just before the read completed; the frame started arriving that many bytes earlier
+    uint64_t rx_ns = read_ns - (scanner_.bytes_after_frame() + scanner_.frame_len()) * byte_ns;
+
+    scanner_.decode(&msg_in_);
+    dispatcher_.dispatch(msg_in_, rx_ns);
+
+    uint64_t dispatched_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t latency_us = (dispatched_ns - read_ns) / 1000;
+    size_t bucket = 0;
+    while (bucket + 1 < MAVLINK_DISPATCH_LATENCY_BUCKETS && latency_us >= dispatch_latency_bucket_limit_us(bucket))
+      bucket++;
+    dispatch_latency_histogram_[bucket].fetch_add(1, std::memory_order_relaxed);
   }
 
+  rx_frames_.store(scanner_.frames_received(), std::memory_order_relaxed);
+  rx_frames_v2_.store(scanner_.v2_frames_received(), std::memory_order_relaxed);
+  update_rx_error_counts();
+}
+
+void MavlinkComm::update_rx_error_counts()
+{
+  // corruption on the wire is caught by the scanner in front of the impairment, and never reaches scanner_
+  rx_crc_errors_.store(scanner_.crc_errors() + rx_impairment_scanner_.crc_errors(), std::memory_order_relaxed);
+  rx_bytes_dropped_.store(scanner_.bytes_dropped() + rx_impairment_scanner_.bytes_dropped(),
+                          std::memory_order_relaxed);
+}
+
+void MavlinkComm::schedule_rx_impairment()
+{
+  uint64_t delivery_ns = rx_impairment_.next_delivery_ns();
+  if (rx_impairment_waiting_ || delivery_ns == 0 || closing_)
+    return;
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  rx_impairment_waiting_ = true;
+  rx_impairment_timer_.expires_from_now(std::chrono::nanoseconds(delivery_ns > now_ns ? delivery_ns - now_ns : 0));
+  rx_impairment_timer_.async_wait(
+        make_alloc_handler(rx_impairment_handler_memory_,
+                           boost::bind(&MavlinkComm::rx_impairment_end, this, boost::asio::placeholders::error)));
+}
+
+void MavlinkComm::rx_impairment_end(const boost::system::error_code &error)
+{
+  rx_impairment_waiting_ = false;
+  if (error == boost::asio::error::operation_aborted)
+    return;
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  for (;;)
+  {
+    boost::asio::mutable_buffers_1 buffer = scanner_.prepare();
+    size_t len = rx_impairment_.read(now_ns, boost::asio::buffer_cast<uint8_t*>(buffer),
+                                     boost::asio::buffer_size(buffer));
+    if (len == 0)
+      break;
+
+    scanner_.commit(len);
+    process_frames(now_ns);
+  }
+
+  schedule_rx_impairment();
+}
+
+void MavlinkComm::link_lost(const boost::system::error_code &error)
+{
+  if (!link_up_.exchange(false))
+    return;
+
+  link_lost_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  link_recovering_ = false;
+  link_losses_.fetch_add(1, std::memory_order_relaxed);
+  std::cerr << "Link failed: " << error.message() << (reconnect_enabled_ ? ", reconnecting" : "") << std::endl;
+
+  // a write may be in flight, or about to be started by another thread; closing the port under it isn't safe, so the
+  // port is closed by whoever owns the write sequence once it sees that the link is down
+  if (!write_in_progress_.exchange(true))
+    close_failed_port();
+}
+
+void MavlinkComm::close_failed_port()
+{
+  do_close();
+
+  // the start of a partly written frame went to the old port; send all of it on the new one
+  if (partial_write_.frame != NULL)
+  {
+    if (partial_write_.priority == WRITE_PRIORITY_TIMESYNC && partial_write_.mailbox == NULL)
+      partial_write_.frame = NULL;
+    else
+      partial_write_.frame->pos = 0;
+  }
+
+  // answers to old time sync requests would give a wrong offset
+  while (!write_queues_[WRITE_PRIORITY_TIMESYNC]->empty())
+  {
+    write_queues_[WRITE_PRIORITY_TIMESYNC]->pop();
+  }
+
+  if (reconnect_enabled_ && !closing_)
+  {
+    reconnect_backoff_ms_ = 0;
+    io_service_.post(make_alloc_handler(reconnect_handler_memory_,
+                                        boost::bind(&MavlinkComm::reconnect, this, boost::system::error_code())));
+  }
+}
+
+void MavlinkComm::reconnect(const boost::system::error_code &error)
+{
+  if (error == boost::asio::error::operation_aborted || closing_)
+    return;
+
+  reconnect_attempts_.fetch_add(1, std::memory_order_relaxed);
+  IoCallback callback = { this, &MavlinkComm::reconnect_end };
+  do_async_open(make_alloc_handler(reconnect_handler_memory_, callback));
+}
+
+void MavlinkComm::reconnect_end(const boost::system::error_code &error, size_t)
+{
+  if (error == boost::asio::error::operation_aborted || closing_)
+    return;
+
+  if (error)
+  {
+    // e.g. the device node isn't back yet, or the host name doesn't resolve; close whatever part of the port did open
+    do_close();
+    schedule_reconnect();
+    return;
+  }
+
+  link_reopened_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  link_recovering_ = true;
+
+  // the firmware may have been restarted, so framing is negotiated again
+  peer_mavlink2_ = false;
+  mavlink2_probes_left_ = mavlink2_enabled_ ? MAVLINK2_NEGOTIATION_PROBES : 0;
+
+  link_up_ = true;
   async_read();
+
+  // hand the write sequence back, and send whatever was queued while the port was closed
+  write_in_progress_ = false;
+  async_write(true);
+}
+
+void MavlinkComm::do_async_open(const IoHandler &handler)
+{
+  boost::system::error_code error;
+  try
+  {
+    do_open();
+  }
+  catch (const std::exception &)
+  {
+    error = boost::asio::error::not_connected;
+  }
+
+  IoHandler done(handler);
+  done(error, 0);
+}
+
+void MavlinkComm::schedule_reconnect()
+{
+  reconnect_backoff_ms_ = reconnect_backoff_ms_ == 0 ? MAVLINK_RECONNECT_MIN_BACKOFF_MS
+                                                     : std::min(2 * reconnect_backoff_ms_, reconnect_max_backoff_ms_);
+  reconnect_timer_.expires_from_now(std::chrono::milliseconds(reconnect_backoff_ms_));
+  reconnect_timer_.async_wait(make_alloc_handler(reconnect_handler_memory_,
+                                                 boost::bind(&MavlinkComm::reconnect, this,
+                                                             boost::asio::placeholders::error)));
+}
+
+void MavlinkComm::link_recovered()
+{
+  link_recovering_ = false;
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  uint64_t outage_us = (now_ns - link_lost_ns_) / 1000;
+  last_outage_us_.store(outage_us, std::memory_order_relaxed);
+  last_recovery_us_.store((now_ns - link_reopened_ns_) / 1000, std::memory_order_relaxed);
+  if (outage_us > max_outage_us_.load(std::memory_order_relaxed))
+    max_outage_us_.store(outage_us, std::memory_order_relaxed);
+
+  std::cerr << "Link recovered after " << outage_us / 1000 << " ms" << std::endl;
+}
+
+void MavlinkComm::track_version()
+{
+  rx_bytes_saved_.fetch_add((int) mavlink2_frame_v1_len(scanner_.frame_data()) - (int) scanner_.frame_len(),
+                            std::memory_order_relaxed);
+
+  if (!mavlink2_enabled_ || scanner_.frame_msgid() != MAVLINK_MSG_ID_HEARTBEAT)
+    return;
+
+  bool v2 = (scanner_.frame_version() == 2);
+  if (v2 != peer_mavlink2_.load(std::memory_order_relaxed))
+  {
+    peer_mavlink2_.store(v2, std::memory_order_relaxed);
+    if (!v2)
+      mavlink2_probes_left_.store(MAVLINK2_NEGOTIATION_PROBES, std::memory_order_relaxed);
+  }
+}
+
+void MavlinkComm::track_sequence(uint8_t sysid, uint8_t seq)
+{
+  if (rx_sysid_seen_[sysid].load(std::memory_order_relaxed))
+  {
+    uint8_t missed = seq - (uint8_t) (rx_last_seq_[sysid] + 1);
+    if (missed > 0)
+      rx_seq_gaps_[sysid].fetch_add(missed, std::memory_order_relaxed);
+  }
+  else
+  {
+    rx_sysid_seen_[sysid].store(true, std::memory_order_relaxed);
+  }
+  rx_last_seq_[sysid] = seq;
 }
 
 void MavlinkComm::send_message(const mavlink_message_t &msg)
 {
-  WriteBuffer *buffer = new WriteBuffer();
-  buffer->len = mavlink_msg_to_send_buffer(buffer->data, &msg);
-  assert(buffer->len <= MAVLINK_MAX_PACKET_LEN); //! \todo Do something less catastrophic here
+  send_message(msg, (WritePriority) write_priority_[msg.msgid]);
+}
+
+void MavlinkComm::send_message(const mavlink_message_t &msg, WritePriority priority)
+{
+  bool v2 = peer_mavlink2_.load(std::memory_order_relaxed);
+
+  uint8_t data[MAVLINK2_MAX_PACKET_LEN];
+  uint16_t len = mavlink2_encode(data, &msg, v2);
+  tx_bytes_saved_.fetch_add((int) msg.len + MAVLINK_NUM_NON_PAYLOAD_BYTES - len, std::memory_order_relaxed);
+  if (data[0] == MAVLINK2_STX)
+    tx_frames_v2_.fetch_add(1, std::memory_order_relaxed);
+  enqueue_frame(data, len, msg.msgid, priority);
+
+  // until the firmware answers in kind, follow some heartbeats with a v2 copy that a v1-only firmware ignores
+  if (!v2 && msg.msgid == MAVLINK_MSG_ID_HEARTBEAT && mavlink2_probes_left_.load(std::memory_order_relaxed) > 0)
+  {
+    mavlink2_probes_left_.fetch_sub(1, std::memory_order_relaxed);
+    len = mavlink2_msg_to_send_buffer(data, &msg);
+    tx_frames_v2_.fetch_add(1, std::memory_order_relaxed);
+    enqueue_frame(data, len, msg.msgid, priority);
+  }
+}
+
+bool MavlinkComm::send_frame(const uint8_t *frame, size_t len)
+{
+  // the length byte has to agree with the frame, or the firmware would lose sync
+  if (len < MAVLINK_NUM_HEADER_BYTES || len < mavlink2_header_len(frame[0]) || mavlink2_frame_len(frame) != len)
+    return false;
+
+  uint8_t msgid = mavlink2_frame_msgid(frame);
+  return enqueue_frame(frame, len, msgid, (WritePriority) write_priority_[msgid]);
+}
+
+void MavlinkComm::set_frame_callback(const FrameCallback &callback)
+{
+  boost::lock_guard<boost::mutex> lock(frame_callback_mutex_);
+  frame_callback_ = callback;
+  has_frame_callback_.store(!callback.empty(), std::memory_order_release);
+}
+
+bool MavlinkComm::enqueue_frame(const uint8_t *data, size_t len, uint32_t msgid, WritePriority priority)
+{
+  WriteMailbox *mailbox = write_mailboxes_[msgid];
+  if (mailbox != NULL)
+  {
+    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    while (mailbox->locked.exchange(true, std::memory_order_acquire)) {}
+    bool replaced = mailbox->pending;
+    memcpy(mailbox->frame.data, data, len);
+    mailbox->frame.len = len;
+    mailbox->frame.pos = 0;
+    mailbox->frame.msgid = msgid;
+    mailbox->frame.enqueue_ns = now_ns;
+    mailbox->pending = true;
+    if (!replaced)
+      write_mailboxes_pending_.fetch_add(1);
+    mailbox->locked.store(false, std::memory_order_release);
 
+    if (replaced)
+      write_replaced_[priority].fetch_add(1, std::memory_order_relaxed);
+  }
+  else if (!write_queues_[priority]->push(data, len, msgid))
   {
-    mutex_lock lock(mutex_);
-    write_queue_.push_back(buffer);
+    return false;
+  }
+
+  // a control frame ends any coalescing hold right away: one still being armed is ended by the owner of the write
+  // sequence, one in place by the io thread
+  if (priority == WRITE_PRIORITY_CONTROL)
+  {
+    int state = WRITE_HOLD_ARMING;
+    if (!write_hold_state_.compare_exchange_strong(state, WRITE_HOLD_RELEASED) && state == WRITE_HOLD_ACTIVE)
+    {
+      // several threads may queue at once, so this can't take a HandlerMemory block; it is counted by hand instead
+      pending_ops_.fetch_add(1, std::memory_order_relaxed);
+      io_service_.post(boost::bind(&MavlinkComm::write_hold_release, this));
+    }
   }
 
   async_write(true);
+  return true;
 }
 
-void MavlinkComm::async_write(bool check_write_state)
+void MavlinkComm::set_recorder(MavlinkRecorder *recorder)
 {
-  if (check_write_state && write_in_progress_)
+  recorder_ = recorder;
+}
+
+void MavlinkComm::set_write_priority(uint32_t msgid, WritePriority priority)
+{
+  if (msgid < 256 && priority < NUM_WRITE_PRIORITIES)
+    write_priority_[msgid] = priority;
+}
+
+void MavlinkComm::set_write_replace(uint32_t msgid, bool replace)
+{
+  if (msgid >= 256)
     return;
 
-  mutex_lock lock(mutex_);
-  if (write_queue_.empty())
+  if (replace && write_mailboxes_[msgid] == NULL)
+  {
+    write_mailboxes_[msgid] = new WriteMailbox();
+    write_mailbox_ids_.push_back(msgid);
+  }
+  else if (!replace && write_mailboxes_[msgid] != NULL)
+  {
+    delete write_mailboxes_[msgid];
+    write_mailboxes_[msgid] = NULL;
+    write_mailbox_ids_.erase(std::find(write_mailbox_ids_.begin(), write_mailbox_ids_.end(), msgid));
+  }
+}
+
+void MavlinkComm::set_background_write_limit(size_t bytes)
+{
+  background_write_limit_ = bytes;
+}
+
+void MavlinkComm::set_write_coalescing(size_t mtu, uint32_t max_delay_us)
+{
+  write_mtu_ = mtu;
+  write_coalesce_delay_us_ = max_delay_us;
+}
+
+void MavlinkComm::set_write_rate_limit(double bytes_per_sec, size_t burst_bytes)
+{
+  write_pacer_.configure(bytes_per_sec, burst_bytes);
+}
+
+void MavlinkComm::set_link_impairment(const LinkImpairment::Options &rx, const LinkImpairment::Options &tx)
+{
+  rx_impairment_.configure(rx);
+  tx_impairment_.configure(tx);
+}
+
+void MavlinkComm::get_link_impairment_stats(LinkImpairment::Stats *rx, LinkImpairment::Stats *tx) const
+{
+  *rx = rx_impairment_.get_stats();
+  *tx = tx_impairment_.get_stats();
+}
+
+MavlinkComm::WriteStats MavlinkComm::get_write_stats(WritePriority priority) const
+{
+  WriteStats stats;
+  stats.frames = write_frames_[priority].load(std::memory_order_relaxed);
+  stats.dropped = write_queues_[priority]->dropped();
+  stats.replaced = write_replaced_[priority].load(std::memory_order_relaxed);
+  stats.high_water_mark = write_queues_[priority]->high_water_mark();
+  stats.total_delay_us = write_delay_total_us_[priority].load(std::memory_order_relaxed);
+  stats.max_delay_us = write_delay_max_us_[priority].load(std::memory_order_relaxed);
+  return stats;
+}
+
+void MavlinkComm::get_link_stats(LinkStats *stats) const
+{
+  stats->rx_bytes = rx_bytes_.load(std::memory_order_relaxed);
+  stats->rx_frames = rx_frames_.load(std::memory_order_relaxed);
+  stats->rx_frames_v2 = rx_frames_v2_.load(std::memory_order_relaxed);
+  stats->rx_bytes_saved = rx_bytes_saved_.load(std::memory_order_relaxed);
+  stats->rx_crc_errors = rx_crc_errors_.load(std::memory_order_relaxed);
+  stats->rx_bytes_dropped = rx_bytes_dropped_.load(std::memory_order_relaxed);
+  stats->rx_reads = rx_reads_.load(std::memory_order_relaxed);
+  for (int i = 0; i < 256; i++)
+  {
+    stats->rx_sysid_seen[i] = rx_sysid_seen_[i].load(std::memory_order_relaxed);
+    stats->rx_seq_gaps[i] = rx_seq_gaps_[i].load(std::memory_order_relaxed);
+  }
+
+  stats->tx_bytes = tx_bytes_.load(std::memory_order_relaxed);
+  stats->tx_frames_v2 = tx_frames_v2_.load(std::memory_order_relaxed);
+  stats->tx_bytes_saved = tx_bytes_saved_.load(std::memory_order_relaxed);
+  stats->mavlink_version = peer_mavlink2_.load(std::memory_order_relaxed) ? 2 : 1;
+  stats->tx_frames = 0;
+  stats->tx_dropped = 0;
+  stats->tx_replaced = 0;
+  stats->write_queue_depth = 0;
+  for (int i = 0; i < NUM_WRITE_PRIORITIES; i++)
+  {
+    stats->tx_frames += write_frames_[i].load(std::memory_order_relaxed);
+    stats->tx_dropped += write_queues_[i]->dropped();
+    stats->tx_replaced += write_replaced_[i].load(std::memory_order_relaxed);
+    stats->write_queue_depth += write_queues_[i]->size();
+  }
+
+  for (int i = 0; i < MAVLINK_WRITE_LATENCY_BUCKETS; i++)
+  {
+    stats->write_latency_histogram[i] = write_latency_histogram_[i].load(std::memory_order_relaxed);
+  }
+
+  for (int i = 0; i < MAVLINK_DISPATCH_LATENCY_BUCKETS; i++)
+  {
+    stats->dispatch_latency_histogram[i] = dispatch_latency_histogram_[i].load(std::memory_order_relaxed);
+  }
+
+  stats->tx_pacing_waits = tx_pacing_waits_.load(std::memory_order_relaxed);
+  stats->tx_pacing_wait_us = tx_pacing_wait_us_.load(std::memory_order_relaxed);
+  stats->tx_pacing_wait_max_us = tx_pacing_wait_max_us_.load(std::memory_order_relaxed);
+
+  stats->link_up = link_up_.load(std::memory_order_relaxed);
+  stats->link_losses = link_losses_.load(std::memory_order_relaxed);
+  stats->reconnect_attempts = reconnect_attempts_.load(std::memory_order_relaxed);
+  stats->last_outage_us = last_outage_us_.load(std::memory_order_relaxed);
+  stats->last_recovery_us = last_recovery_us_.load(std::memory_order_relaxed);
+  stats->max_outage_us = max_outage_us_.load(std::memory_order_relaxed);
+}
+
+uint32_t MavlinkComm::write_latency_bucket_limit_us(size_t bucket)
+{
+  // powers of two from 16 us; the last bucket collects everything slower
+  if (bucket + 1 >= MAVLINK_WRITE_LATENCY_BUCKETS)
+    return 0;
+  return 16u << bucket;
+}
+
+uint32_t MavlinkComm::dispatch_latency_bucket_limit_us(size_t bucket)
+{
+  // powers of two from 1 us, since handing a message on normally takes only a few; the last bucket has no limit
+  if (bucket + 1 >= MAVLINK_DISPATCH_LATENCY_BUCKETS)
+    return 0;
+  return 1u << bucket;
+}
+
+size_t MavlinkComm::get_write_queue_high_water_mark() const
+{
+  size_t high_water = 0;
+  for (int i = 0; i < NUM_WRITE_PRIORITIES; i++)
+  {
+    high_water = std::max(high_water, write_queues_[i]->high_water_mark());
+  }
+  return high_water;
+}
+
+uint64_t MavlinkComm::get_write_queue_drops() const
+{
+  uint64_t dropped = 0;
+  for (int i = 0; i < NUM_WRITE_PRIORITIES; i++)
+  {
+    dropped += write_queues_[i]->dropped();
+  }
+  return dropped;
+}
+
+void MavlinkComm::async_write(bool check_write_state, bool allow_hold)
+{
+  if (check_write_state && write_in_progress_.exchange(true))
+    return;
+
+  if (!link_up_)
+  {
+    // the link failed while this thread owned the write sequence; frames stay queued until the port is reopened
+    if (!closing_)
+      io_service_.post(make_alloc_handler(close_handler_memory_, boost::bind(&MavlinkComm::close_failed_port, this)));
+    return;
+  }
+
+  while (write_queues_empty())
+  {
+    // give up the write sequence, then check again so that a frame queued while we still owned it isn't stranded
+    write_in_progress_ = false;
+    if (write_queues_empty() || write_in_progress_.exchange(true))
+      return;
+  }
+
+  if (write_pacer_.enabled())
+  {
+    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t wait_ns = write_pacer_.wait_ns(1, now_ns);
+    if (wait_ns > 0)
+    {
+      // wait before building the batch, so that frames queued in the meantime can still be sent ahead by priority
+      write_pace_start_ns_ = now_ns;
+      write_pace_allow_hold_ = allow_hold;
+      write_pace_timer_.expires_from_now(std::chrono::nanoseconds(wait_ns));
+      write_pace_timer_.async_wait(
+            make_alloc_handler(write_pace_handler_memory_,
+                               boost::bind(&MavlinkComm::write_pace_end, this, boost::asio::placeholders::error)));
+      return;
+    }
+  }
+
+  // start arming before looking at the queues, so that a control frame queued while the batch is built isn't held;
+  // the timer and its operation memory may only be reused by this thread once the handler of its last wait has run
+  bool may_hold = allow_hold && write_coalesce_delay_us_ > 0 && !write_hold_waiting_.load(std::memory_order_acquire);
+  if (may_hold)
+    write_hold_state_ = WRITE_HOLD_ARMING;
+
+  bool critical = build_write_batch();
+
+  if (may_hold && !critical && write_batch_.bytes < write_limit() && !write_batch_.full())
+  {
+    // keep ownership of the write sequence while holding, so producers only queue their frames
+    write_hold_waiting_ = true;
+    write_hold_timer_.expires_from_now(std::chrono::microseconds(write_coalesce_delay_us_));
+    write_hold_timer_.async_wait(
+          make_alloc_handler(write_hold_handler_memory_,
+                             boost::bind(&MavlinkComm::write_hold_end, this, boost::asio::placeholders::error)));
+
+    // from here on the timer or a control frame continues the write sequence, and this thread must not touch it
+    int state = WRITE_HOLD_ARMING;
+    if (write_hold_state_.compare_exchange_strong(state, WRITE_HOLD_ACTIVE))
+      return;
+
+    // a control frame was queued while arming; the timer finds no hold and leaves the write sequence alone
+    write_hold_state_ = WRITE_HOLD_NONE;
+    write_hold_timer_.cancel();
+    async_write(false, false);
+    return;
+  }
+
+  if (may_hold)
+    write_hold_state_ = WRITE_HOLD_NONE;
+
+  if (tx_impairment_.enabled())
+  {
+    // the emulated link is only touched by the io thread
+    io_service_.post(make_alloc_handler(write_handler_memory_, boost::bind(&MavlinkComm::impaired_write, this)));
     return;
+  }
+
+  IoCallback callback = { this, &MavlinkComm::async_write_end };
+  do_async_write(write_batch_, make_alloc_handler(write_handler_memory_, callback));
+}
+
+void MavlinkComm::impaired_write()
+{
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < write_batch_.count && !tx_impairment_.full(); i++)
+  {
+    const boost::asio::const_buffer &buffer = write_batch_.buffers[i];
+    tx_impairment_.submit(boost::asio::buffer_cast<const uint8_t*>(buffer), boost::asio::buffer_size(buffer), now_ns);
+    bytes += boost::asio::buffer_size(buffer);
+  }
+  schedule_tx_impairment();
 
-  write_in_progress_ = true;
-  WriteBuffer *buffer = write_queue_.front();
-  do_async_write(
-        boost::asio::buffer(buffer->dpos(), buffer->nbytes()),
-        boost::bind(
-          &MavlinkComm::async_write_end,
-          this,
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
+  // with every frame slot taken, the write sequence waits for the link to deliver a frame
+  if (bytes == 0 && write_batch_.count > 0)
+  {
+    tx_impairment_blocked_ = true;
+    return;
+  }
 
+  async_write_end(boost::system::error_code(), bytes);
 }
 
-void MavlinkComm::async_write_end(const boost::system::error_code &error, std::size_t bytes_transferred)
+void MavlinkComm::schedule_tx_impairment()
+{
+  uint64_t delivery_ns = tx_impairment_.next_delivery_ns();
+  if (tx_impairment_waiting_ || tx_impairment_writing_ || delivery_ns == 0 || closing_)
+    return;
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  tx_impairment_waiting_ = true;
+  tx_impairment_timer_.expires_from_now(std::chrono::nanoseconds(delivery_ns > now_ns ? delivery_ns - now_ns : 0));
+  tx_impairment_timer_.async_wait(
+        make_alloc_handler(tx_impairment_handler_memory_,
+                           boost::bind(&MavlinkComm::tx_impairment_end, this, boost::asio::placeholders::error)));
+}
+
+void MavlinkComm::tx_impairment_end(const boost::system::error_code &error)
+{
+  tx_impairment_waiting_ = false;
+  if (error == boost::asio::error::operation_aborted)
+    return;
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  size_t len = tx_impairment_.read(now_ns, tx_impairment_buffer_, sizeof(tx_impairment_buffer_));
+
+  // frames delivered while the port is closed are lost with it
+  if (len > 0 && link_up_)
+  {
+    tx_impairment_writing_ = true;
+    tx_impairment_write_.clear();
+    tx_impairment_write_.push_back(tx_impairment_buffer_, len);
+    IoCallback callback = { this, &MavlinkComm::tx_impairment_write_end };
+    do_async_write(tx_impairment_write_, make_alloc_handler(tx_impairment_write_memory_, callback));
+  }
+
+  if (tx_impairment_blocked_ && !tx_impairment_.full())
+  {
+    tx_impairment_blocked_ = false;
+    impaired_write();
+  }
+
+  schedule_tx_impairment();
+}
+
+void MavlinkComm::tx_impairment_write_end(const boost::system::error_code &error, size_t bytes_transferred)
 {
+  tx_impairment_writing_ = false;
+
   if (error)
   {
-    std::cerr << error.message() << std::endl;
-    close();
+    // a write cancelled by closing the port has nothing more to report
+    if (error != boost::asio::error::operation_aborted)
+      link_lost(error);
+  }
+  else if (bytes_transferred < tx_impairment_write_.bytes)
+  {
+    const uint8_t *rest = boost::asio::buffer_cast<const uint8_t*>(tx_impairment_write_.buffers[0]) + bytes_transferred;
+    size_t len = tx_impairment_write_.bytes - bytes_transferred;
+    tx_impairment_writing_ = true;
+    tx_impairment_write_.clear();
+    tx_impairment_write_.push_back(rest, len);
+    IoCallback callback = { this, &MavlinkComm::tx_impairment_write_end };
+    do_async_write(tx_impairment_write_, make_alloc_handler(tx_impairment_write_memory_, callback));
     return;
   }
 
-  mutex_lock lock(mutex_);
-  if (write_queue_.empty())
+  schedule_tx_impairment();
+}
+
+bool MavlinkComm::write_queues_empty() const
+{
+  if (write_mailboxes_pending_ > 0 || write_scratch_ready_ > 0)
+    return false;
+
+  for (int i = 0; i < NUM_WRITE_PRIORITIES; i++)
   {
-    write_in_progress_ = false;
+    if (!write_queues_[i]->empty())
+      return false;
+  }
+  return true;
+}
+
+bool MavlinkComm::build_write_batch()
+{
+  size_t taken[NUM_WRITE_PRIORITIES] = {0};
+  size_t background_bytes = 0;
+  bool critical = false;
+
+  write_batch_.clear();
+
+  // a frame that was only partly written has to be finished before anything else can go out
+  if (partial_write_.frame != NULL)
+  {
+    add_to_write_batch(partial_write_, &background_bytes);
+    if (partial_write_.mailbox == NULL)
+      taken[partial_write_.priority] = 1;
+    critical = partial_write_.priority == WRITE_PRIORITY_CONTROL;
+  }
+
+  for (int priority = 0; priority < NUM_WRITE_PRIORITIES; priority++)
+  {
+    // latest-value frames go ahead of the queued frames of their class
+    for (size_t i = 0; i < write_mailbox_ids_.size(); i++)
+    {
+      if (write_priority_[write_mailbox_ids_[i]] == priority)
+        add_mailbox_to_write_batch(write_mailboxes_[write_mailbox_ids_[i]], priority, &background_bytes);
+    }
+
+    for (;;)
+    {
+      WriteBuffer *buffer = write_queues_[priority]->peek(taken[priority]);
+      if (buffer == NULL || !write_batch_fits(priority, buffer->nbytes(), background_bytes))
+        break;
+
+      WriteBatchEntry entry = { buffer, (uint8_t) priority, NULL };
+      add_to_write_batch(entry, &background_bytes);
+      taken[priority]++;
+    }
+  }
+
+  for (size_t i = 0; i < write_batch_.count; i++)
+  {
+    if (write_batch_entries_[i].priority == WRITE_PRIORITY_CONTROL)
+      critical = true;
+  }
+  return critical;
+}
+
+bool MavlinkComm::write_batch_fits(int priority, size_t len, size_t background_bytes) const
+{
+  if (write_batch_.full())
+    return false;
+
+  // always send at least one frame, even if it is larger than the limits
+  if (write_batch_.count == 0)
+    return true;
+
+  if (write_batch_.bytes + len > write_limit())
+    return false;
+
+  return priority == WRITE_PRIORITY_CONTROL || background_bytes + len <= background_write_limit_;
+}
+
+void MavlinkComm::add_to_write_batch(const WriteBatchEntry &entry, size_t *background_bytes)
+{
+  write_batch_entries_[write_batch_.count] = entry;
+  write_batch_.push_back(entry.frame->dpos(), entry.frame->nbytes());
+  if (entry.priority != WRITE_PRIORITY_CONTROL)
+    *background_bytes += entry.frame->nbytes();
+}
+
+void MavlinkComm::add_mailbox_to_write_batch(WriteMailbox *mailbox, int priority, size_t *background_bytes)
+{
+  // a partly written frame is already at the front of the batch, even once a reopen has rewound it to its start
+  if (partial_write_.frame == &mailbox->scratch)
     return;
+
+  if (write_mailboxes_pending_ > 0)
+  {
+    while (mailbox->locked.exchange(true, std::memory_order_acquire)) {}
+    bool take = mailbox->pending && write_batch_fits(priority, mailbox->frame.len, *background_bytes);
+    if (take)
+    {
+      memcpy(mailbox->scratch.data, mailbox->frame.data, mailbox->frame.len);
+      mailbox->scratch.len = mailbox->frame.len;
+      mailbox->scratch.pos = 0;
+      mailbox->scratch.msgid = mailbox->frame.msgid;
+      mailbox->scratch.enqueue_ns = mailbox->frame.enqueue_ns;
+      mailbox->pending = false;
+      write_mailboxes_pending_.fetch_sub(1);
+    }
+    mailbox->locked.store(false, std::memory_order_release);
+
+    if (take)
+    {
+
+      // an unsent frame left over from a short write is superseded by the newer one
+      if (mailbox->ready)
+        write_replaced_[priority].fetch_add(1, std::memory_order_relaxed);
+      else
+        write_scratch_ready_++;
+      mailbox->ready = true;
+    }
   }
 
-  WriteBuffer *buffer = write_queue_.front();
-  buffer->pos += bytes_transferred;
-  if (buffer->nbytes() == 0)
+  if (mailbox->ready && write_batch_fits(priority, mailbox->scratch.nbytes(), *background_bytes))
   {
-    write_queue_.pop_front();
-    delete buffer;
+    WriteBatchEntry entry = { &mailbox->scratch, (uint8_t) priority, mailbox };
+    add_to_write_batch(entry, background_bytes);
   }
+}
 
-  if (write_queue_.empty())
-    write_in_progress_ = false;
-  else
+void MavlinkComm::write_hold_end(const boost::system::error_code &error)
+{
+  write_hold_waiting_.store(false, std::memory_order_release);
+  if (error == boost::asio::error::operation_aborted)
+    return;
+
+  // either the timer or a latency-critical frame ends the hold, whichever comes first
+  int state = WRITE_HOLD_ACTIVE;
+  if (!write_hold_state_.compare_exchange_strong(state, WRITE_HOLD_NONE))
+    return;
+
+  async_write(false, false);
+}
+
+void MavlinkComm::write_hold_release()
+{
+  pending_ops_.fetch_sub(1, std::memory_order_release);
+
+  int state = WRITE_HOLD_ACTIVE;
+  if (!write_hold_state_.compare_exchange_strong(state, WRITE_HOLD_NONE))
+    return;
+
+  // the timer's handler still has to run before the next hold can be armed
+  write_hold_timer_.cancel();
+  async_write(false, false);
+}
+
+void MavlinkComm::write_pace_end(const boost::system::error_code &error)
+{
+  if (error == boost::asio::error::operation_aborted)
+    return;
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  uint64_t wait_us = now_ns > write_pace_start_ns_ ? (now_ns - write_pace_start_ns_) / 1000 : 0;
+  tx_pacing_waits_.fetch_add(1, std::memory_order_relaxed);
+  tx_pacing_wait_us_.fetch_add(wait_us, std::memory_order_relaxed);
+  if (wait_us > tx_pacing_wait_max_us_.load(std::memory_order_relaxed))
+    tx_pacing_wait_max_us_.store(wait_us, std::memory_order_relaxed);
+
+  async_write(false, write_pace_allow_hold_);
+}
+
+size_t MavlinkComm::write_limit() const
+{
+  if (write_pacer_.enabled() && write_pacer_.capacity() < write_mtu_)
+    return std::max<size_t>(write_pacer_.capacity(), 1);
+  return write_mtu_;
+}
+
+void MavlinkComm::async_write_end(const boost::system::error_code &error, std::size_t bytes_transferred)
+{
+  if (error)
+  {
+    link_lost(error);
     async_write(false);
+    return;
+  }
+
+  uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  tx_bytes_.fetch_add(bytes_transferred, std::memory_order_relaxed);
+  write_pacer_.consume(bytes_transferred, now_ns);
+
+  // a gather write may complete several frames and end part way through another
+  partial_write_.frame = NULL;
+  for (size_t i = 0; i < write_batch_.count && bytes_transferred > 0; i++)
+  {
+    const WriteBatchEntry &entry = write_batch_entries_[i];
+    int priority = entry.priority;
+    WriteBuffer *buffer = entry.frame;
+    size_t n = std::min(bytes_transferred, buffer->nbytes());
+    buffer->pos += n;
+    bytes_transferred -= n;
+
+    if (buffer->nbytes() > 0)
+    {
+      partial_write_ = entry;
+      break;
+    }
+
+    uint64_t delay_us = now_ns > buffer->enqueue_ns ? (now_ns - buffer->enqueue_ns) / 1000 : 0;
+    write_frames_[priority].fetch_add(1, std::memory_order_relaxed);
+    write_delay_total_us_[priority].fetch_add(delay_us, std::memory_order_relaxed);
+    if (delay_us > write_delay_max_us_[priority].load(std::memory_order_relaxed))
+      write_delay_max_us_[priority].store(delay_us, std::memory_order_relaxed);
+
+    size_t bucket = 0;
+    while (bucket + 1 < MAVLINK_WRITE_LATENCY_BUCKETS && delay_us >= write_latency_bucket_limit_us(bucket))
+      bucket++;
+    write_latency_histogram_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    if (recorder_ != NULL)
+      recorder_->record(MavlinkRecorder::DIRECTION_TX, now_ns, buffer->data, buffer->len);
+
+    if (entry.mailbox != NULL)
+    {
+      entry.mailbox->ready = false;
+      write_scratch_ready_--;
+    }
+    else
+    {
+      write_queues_[priority]->pop();
+    }
+  }
+
+  async_write(false);
 }
 
 } // namespace mavrosflight
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_dispatcher.cpp
+ */
+
+#include <rosflight/mavrosflight/mavlink_dispatcher.h>
+
+#include <boost/thread/thread.hpp>
+
+namespace mavrosflight
+{
+
+thread_local MavlinkDispatcher::DispatchScope *MavlinkDispatcher::dispatching_ = NULL;
+
+MavlinkDispatcher::MavlinkDispatcher() :
+  dispatch_epoch_(0),
+  next_id_(1),
+  rx_ns_(0)
+{
+  for (uint32_t i = 0; i <= NUM_IDS; i++)
+  {
+    subscribed_[i].store(false, std::memory_order_relaxed);
+  }
+}
+
+MavlinkDispatcher::SubscriptionId MavlinkDispatcher::subscribe_raw(uint32_t msgid, const RawCallback &callback)
+{
+  if (msgid >= NUM_IDS)
+    return 0;
+
+  mutex_lock lock(mutex_);
+
+  Channel *channel = channels_[msgid] ? channels_[msgid]->clone() : new Channel();
+
+  SubscriptionId id = next_id_++;
+  channel->raw_.push_back(std::make_pair(id, callback));
+  subscriptions_[id] = msgid;
+  replace_channel(msgid, channel);
+
+  return id;
+}
+
+MavlinkDispatcher::SubscriptionId MavlinkDispatcher::subscribe_all(const RawCallback &callback)
+{
+  mutex_lock lock(mutex_);
+
+  Channel *channel = channels_[ALL_IDS] ? channels_[ALL_IDS]->clone() : new Channel();
+
+  SubscriptionId id = next_id_++;
+  channel->raw_.push_back(std::make_pair(id, callback));
+  subscriptions_[id] = ALL_IDS;
+  replace_channel(ALL_IDS, channel);
+
+  return id;
+}
+
+void MavlinkDispatcher::unsubscribe(SubscriptionId id)
+{
+  {
+    mutex_lock lock(mutex_);
+
+    std::map<SubscriptionId, uint32_t>::iterator it = subscriptions_.find(id);
+    if (it == subscriptions_.end())
+      return;
+
+    uint32_t msgid = it->second;
+    subscriptions_.erase(it);
+
+    Channel *channel = channels_[msgid]->clone();
+    channel->remove(id);
+    if (channel->empty())
+    {
+      delete channel;
+      channel = NULL;
+    }
+    replace_channel(msgid, channel);
+  }
+
+  wait_for_dispatch();
+}
+
+bool MavlinkDispatcher::has_subscribers(uint32_t msgid) const
+{
+  if (subscribed_[ALL_IDS].load(std::memory_order_acquire))
+    return true;
+
+  return msgid < NUM_IDS && subscribed_[msgid].load(std::memory_order_acquire);
+}
+
+void MavlinkDispatcher::dispatch(const mavlink_message_t &msg, uint64_t rx_ns) const
+{
+  rx_ns_ = rx_ns;
+
+  DispatchScope scope(this);
+
+  ChannelPtr all = boost::atomic_load(&channels_[ALL_IDS]);
+  ChannelPtr channel;
+  if (msg.msgid < NUM_IDS)
+    channel = boost::atomic_load(&channels_[msg.msgid]);
+
+  // callbacks run without any lock held, so they are free to subscribe or unsubscribe
+  if (all)
+    all->dispatch(msg);
+  if (channel)
+    channel->dispatch(msg);
+}
+
+void MavlinkDispatcher::replace_channel(uint32_t msgid, Channel *channel)
+{
+  boost::atomic_store(&channels_[msgid], ChannelPtr(channel));
+  subscribed_[msgid].store(channel != NULL, std::memory_order_release);
+}
+
+void MavlinkDispatcher::wait_for_dispatch() const
+{
+  // order the new table ahead of reading the epoch; a dispatch that starts after this point loads the new table
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t epoch = dispatch_epoch_.load();
+  if ((epoch & 1) == 0)
+    return;
+
+  // a callback can't wait for the dispatch it was called from
+  for (DispatchScope *scope = dispatching_; scope != NULL; scope = scope->outer)
+  {
+    if (scope->dispatcher == this)
+      return;
+  }
+
+  while (dispatch_epoch_.load() == epoch)
+  {
+    boost::this_thread::yield();
+  }
+}
+
+MavlinkDispatcher::DispatchScope::DispatchScope(const MavlinkDispatcher *dispatcher) :
+  dispatcher(dispatcher),
+  outer(dispatching_)
+{
+  dispatching_ = this;
+  dispatcher->dispatch_epoch_.fetch_add(1);
+}
+
+MavlinkDispatcher::DispatchScope::~DispatchScope()
+{
+  dispatcher->dispatch_epoch_.fetch_add(1);
+  dispatching_ = outer;
+}
+
+void MavlinkDispatcher::Channel::dispatch(const mavlink_message_t &msg) const
+{
+  for (size_t i = 0; i < raw_.size(); i++)
+  {
+    raw_[i].second(msg);
+  }
+}
+
+bool MavlinkDispatcher::Channel::remove(SubscriptionId id)
+{
+  for (size_t i = 0; i < raw_.size(); i++)
+  {
+    if (raw_[i].first == id)
+    {
+      raw_.erase(raw_.begin() + i);
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace mavrosflight
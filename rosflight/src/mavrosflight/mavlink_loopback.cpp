@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_loopback.cpp
+ */
+
+#include <rosflight/mavrosflight/mavlink_loopback.h>
+#include <rosflight/mavrosflight/serial_exception.h>
+
+#include <chrono>
+
+namespace mavrosflight
+{
+
+MavlinkLoopback::MavlinkLoopback(const std::string &name, IoServicePool *io_pool) :
+  MavlinkComm(io_pool),
+  name_(name),
+  read_buffer_(NULL, 0),
+  read_handler_(read_ready_memory_, IoCallback()),
+  read_ready_memory_(&pending_ops_),
+  write_handler_(write_retry_memory_, IoCallback()),
+  write_retry_timer_(io_service_),
+  write_retry_memory_(&pending_ops_),
+  read_armed_(false),
+  stop_(false)
+{
+  set_read_buffer_size(MAVLINK_LOOPBACK_READ_BUF_SIZE);
+}
+
+MavlinkLoopback::~MavlinkLoopback()
+{
+  // the wait thread posts to the io service, so both have to be stopped first
+  close();
+}
+
+bool MavlinkLoopback::is_open()
+{
+  return rx_ring_.is_open() && tx_ring_.is_open();
+}
+
+void MavlinkLoopback::do_open()
+{
+  try
+  {
+    rx_ring_.open(name_ + SHM_RING_FC_TO_HOST_SUFFIX);
+    tx_ring_.open(name_ + SHM_RING_HOST_TO_FC_SUFFIX);
+  }
+  catch (boost::system::system_error e)
+  {
+    rx_ring_.close();
+    throw SerialException(e);
+  }
+
+  read_armed_ = false;
+  stop_ = false;
+  wait_thread_ = boost::thread(boost::bind(&MavlinkLoopback::wait_thread, this));
+}
+
+void MavlinkLoopback::do_close()
+{
+  if (wait_thread_.joinable())
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(wait_mutex_);
+      stop_ = true;
+    }
+    wait_cond_.notify_one();
+    rx_ring_.wake();
+    wait_thread_.join();
+  }
+
+  write_retry_timer_.cancel();
+  rx_ring_.close();
+  tx_ring_.close();
+}
+
+void MavlinkLoopback::do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
+{
+  read_buffer_ = buffer;
+  read_handler_ = handler;
+  if (fill_read())
+    return;
+
+  // nothing to read yet; let the wait thread watch the ring
+  {
+    boost::lock_guard<boost::mutex> lock(wait_mutex_);
+    read_armed_ = true;
+  }
+  wait_cond_.notify_one();
+}
+
+void MavlinkLoopback::do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler)
+{
+  write_buffers_ = buffers;
+  write_handler_ = handler;
+  fill_write();
+}
+
+bool MavlinkLoopback::fill_read()
+{
+  size_t n = rx_ring_.read(boost::asio::buffer_cast<uint8_t*>(read_buffer_), boost::asio::buffer_size(read_buffer_));
+  if (n == 0)
+    return false;
+
+  io_service_.post(make_alloc_handler(read_handler_.memory(),
+                                      boost::bind<void>(read_handler_, boost::system::error_code(), n)));
+  return true;
+}
+
+void MavlinkLoopback::fill_write()
+{
+  // MavlinkComm carries on from a partial write, so copy whatever fits
+  size_t n = 0;
+  for (size_t i = 0; i < write_buffers_.count; i++)
+  {
+    size_t len = boost::asio::buffer_size(write_buffers_.buffers[i]);
+    size_t written = tx_ring_.write(boost::asio::buffer_cast<const uint8_t*>(write_buffers_.buffers[i]), len);
+    n += written;
+    if (written < len)
+      break;
+  }
+
+  if (n > 0)
+  {
+    io_service_.post(make_alloc_handler(write_handler_.memory(),
+                                        boost::bind<void>(write_handler_, boost::system::error_code(), n)));
+    return;
+  }
+
+  // the firmware hasn't read for a while, e.g. because the simulation is paused
+  write_retry_timer_.expires_from_now(std::chrono::microseconds(MAVLINK_LOOPBACK_WRITE_RETRY_US));
+  write_retry_timer_.async_wait(make_alloc_handler(write_retry_memory_,
+                                                   boost::bind(&MavlinkLoopback::write_retry_end, this,
+                                                               boost::asio::placeholders::error)));
+}
+
+void MavlinkLoopback::read_ready()
+{
+  // the wait thread may have posted this just before the rings were unmapped by closing the link
+  if (!is_open())
+    return;
+
+  if (!fill_read())
+  {
+    boost::lock_guard<boost::mutex> lock(wait_mutex_);
+    read_armed_ = true;
+    wait_cond_.notify_one();
+  }
+}
+
+void MavlinkLoopback::write_retry_end(const boost::system::error_code &error)
+{
+  if (error || !is_open())
+    return;
+
+  fill_write();
+}
+
+void MavlinkLoopback::wait_thread()
+{
+  boost::unique_lock<boost::mutex> lock(wait_mutex_);
+  while (!stop_)
+  {
+    if (!read_armed_)
+    {
+      wait_cond_.wait(lock);
+      continue;
+    }
+
+    lock.unlock();
+    bool ready = rx_ring_.wait_readable(MAVLINK_LOOPBACK_WAIT_TIMEOUT_US);
+    lock.lock();
+
+    if (ready && !stop_)
+    {
+      read_armed_ = false;
+      io_service_.post(make_alloc_handler(read_ready_memory_, boost::bind(&MavlinkLoopback::read_ready, this)));
+    }
+  }
+}
+
+} // namespace mavrosflight
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_recorder.cpp
+ */
+
+#include <rosflight/mavrosflight/mavlink_recorder.h>
+#include <rosflight/mavrosflight/serial_exception.h>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAVLINK_RECORDER_DRAIN_PERIOD_MS 10
+
+namespace mavrosflight
+{
+
+MavlinkRecorder::MavlinkRecorder(const std::string &filename, size_t buffer_size) :
+  fd_(-1),
+  buffer_(NULL),
+  buffer_size_(0),
+  head_(0),
+  tail_(0),
+  file_offset_(0),
+  allocated_(0),
+  stop_(false),
+  frames_(0),
+  dropped_(0)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  buffer_size_ = std::max(buffer_size, (size_t) 65536);
+  buffer_size_ = (buffer_size_ + page_size - 1) / page_size * page_size;
+
+  fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+    throw SerialException("Failed to create capture file " + filename + ": " + strerror(errno));
+
+  void *buffer = mmap(NULL, buffer_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (buffer == MAP_FAILED)
+  {
+    std::string error = strerror(errno);
+    ::close(fd_);
+    throw SerialException("Failed to allocate capture buffer: " + error);
+  }
+  buffer_ = (uint8_t*) buffer;
+
+  // MAP_POPULATE may map the zero page for reading only; take the write faults here, where they can't delay a frame
+  for (size_t i = 0; i < buffer_size_; i += page_size)
+  {
+    ((volatile uint8_t*) buffer_)[i] = 0;
+  }
+
+  CaptureFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAVLINK_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = MAVLINK_CAPTURE_VERSION;
+  header.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  if (pwrite(fd_, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+  {
+    std::string error = strerror(errno);
+    munmap(buffer_, buffer_size_);
+    ::close(fd_);
+    throw SerialException("Failed to write capture file " + filename + ": " + error);
+  }
+  file_offset_ = sizeof(header);
+
+  thread_ = boost::thread(boost::bind(&MavlinkRecorder::run, this));
+}
+
+MavlinkRecorder::~MavlinkRecorder()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+
+  // release the blocks that were allocated ahead but never written
+  if (ftruncate(fd_, file_offset_) != 0)
+    std::cerr << "Failed to truncate capture file: " << strerror(errno) << std::endl;
+  ::close(fd_);
+
+  munmap(buffer_, buffer_size_);
+}
+
+void MavlinkRecorder::record(Direction direction, uint64_t timestamp_ns, const uint8_t *frame, size_t len)
+{
+  size_t entry_len = sizeof(CaptureEntryHeader) + len;
+
+  uint64_t head = head_.load(std::memory_order_relaxed);
+  if (head + entry_len - tail_.load(std::memory_order_acquire) > buffer_size_)
+  {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  CaptureEntryHeader header;
+  header.timestamp_ns = timestamp_ns;
+  header.len = len;
+  header.direction = direction;
+  memset(header.reserved, 0, sizeof(header.reserved));
+
+  copy_in(head, &header, sizeof(header));
+  copy_in(head + sizeof(header), frame, len);
+
+  head_.store(head + entry_len, std::memory_order_release);
+  frames_.fetch_add(1, std::memory_order_relaxed);
+}
+
+MavlinkRecorder::Stats MavlinkRecorder::get_stats() const
+{
+  Stats stats;
+  stats.frames = frames_.load(std::memory_order_relaxed);
+  stats.bytes = head_.load(std::memory_order_relaxed);
+  stats.dropped = dropped_.load(std::memory_order_relaxed);
+  stats.written = tail_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void MavlinkRecorder::copy_in(uint64_t pos, const void *data, size_t len)
+{
+  size_t offset = pos % buffer_size_;
+  size_t first = std::min(len, buffer_size_ - offset);
+  memcpy(buffer_ + offset, data, first);
+  if (first < len)
+    memcpy(buffer_, (const uint8_t*) data + first, len - first);
+}
+
+bool MavlinkRecorder::drain()
+{
+  uint64_t head = head_.load(std::memory_order_acquire);
+  uint64_t tail = tail_.load(std::memory_order_relaxed);
+
+  while (tail < head)
+  {
+    size_t offset = tail % buffer_size_;
+    size_t len = std::min((uint64_t) (buffer_size_ - offset), head - tail);
+
+    // keep the file's blocks allocated ahead of the writes, so it stays contiguous; failing that is harmless
+    if (file_offset_ + len > allocated_)
+    {
+      if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, MAVLINK_RECORDER_PREALLOCATE_SIZE) == 0)
+        allocated_ += MAVLINK_RECORDER_PREALLOCATE_SIZE;
+      else
+        allocated_ = UINT64_MAX;
+    }
+
+    ssize_t written = pwrite(fd_, buffer_ + offset, len, file_offset_);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "Failed to write capture file: " << strerror(errno) << std::endl;
+      return false;
+    }
+
+    file_offset_ += written;
+    tail += written;
+    tail_.store(tail, std::memory_order_release);
+  }
+
+  return true;
+}
+
+void MavlinkRecorder::run()
+{
+  bool failed = false;
+
+  for (;;)
+  {
+    // once writing has failed (most likely the disk is full), the ring fills up and record() drops every frame
+    if (!failed)
+      failed = !drain();
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    if (stop_)
+      break;
+    cond_.timed_wait(lock, boost::posix_time::milliseconds(MAVLINK_RECORDER_DRAIN_PERIOD_MS));
+    if (stop_)
+      break;
+  }
+
+  // catch the frames recorded since the last pass; the io thread has stopped by now
+  if (!failed)
+    drain();
+}
+
+} // namespace mavrosflight
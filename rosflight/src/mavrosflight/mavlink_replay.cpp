@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_replay.cpp
+ */
+
+#include <rosflight/mavrosflight/mavlink_replay.h>
+#include <rosflight/mavrosflight/serial_exception.h>
+
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mavrosflight
+{
+
+namespace
+{
+
+uint64_t steady_now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+MavlinkReplay::MavlinkReplay(const std::string &filename, double speed) :
+  MavlinkComm(),
+  filename_(filename),
+  speed_(speed),
+  data_(NULL),
+  size_(0),
+  pos_(0),
+  open_(false),
+  first_timestamp_ns_(0),
+  start_ns_(0),
+  read_buffer_(NULL, 0),
+  read_handler_(replay_timer_memory_, IoCallback()),
+  replay_timer_(io_service_),
+  replay_timer_memory_(&pending_ops_),
+  finished_(false),
+  frames_played_(0)
+{
+  set_read_buffer_size(MAVLINK_REPLAY_READ_BUF_SIZE);
+}
+
+MavlinkReplay::~MavlinkReplay()
+{
+  // the io thread reads from the mapping, so it has to be stopped first
+  close();
+
+  if (data_ != NULL)
+    munmap((void*) data_, size_);
+}
+
+bool MavlinkReplay::is_open()
+{
+  return open_;
+}
+
+void MavlinkReplay::do_open()
+{
+  if (data_ == NULL)
+  {
+    int fd = ::open(filename_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw SerialException("Failed to open capture file " + filename_ + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CaptureFileHeader))
+    {
+      ::close(fd);
+      throw SerialException("Capture file " + filename_ + " is empty");
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      throw SerialException("Failed to map capture file " + filename_ + ": " + strerror(errno));
+
+    data_ = (const uint8_t*) data;
+    size_ = st.st_size;
+  }
+
+  CaptureFileHeader header;
+  memcpy(&header, data_, sizeof(header));
+  if (memcmp(header.magic, MAVLINK_CAPTURE_MAGIC, sizeof(header.magic)) != 0
+      || header.version != MAVLINK_CAPTURE_VERSION)
+    throw SerialException(filename_ + " is not a capture file written by this version");
+
+  pos_ = sizeof(header);
+  finished_ = false;
+  frames_played_ = 0;
+
+  // playback times are relative to the first received frame
+  CaptureEntryHeader entry;
+  if (next_entry(&entry))
+    first_timestamp_ns_ = entry.timestamp_ns;
+  start_ns_ = steady_now_ns();
+
+  open_ = true;
+}
+
+void MavlinkReplay::do_close()
+{
+  open_ = false;
+  replay_timer_.cancel();
+}
+
+void MavlinkReplay::do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
+{
+  read_buffer_ = buffer;
+  read_handler_ = handler;
+  fill_read();
+}
+
+void MavlinkReplay::do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler)
+{
+  // there is nobody to send to; complete the write straight away
+  io_service_.post(make_alloc_handler(handler.memory(),
+                                      boost::bind<void>(handler, boost::system::error_code(), buffers.bytes)));
+}
+
+void MavlinkReplay::fill_read()
+{
+  uint8_t *out = boost::asio::buffer_cast<uint8_t*>(read_buffer_);
+  size_t capacity = boost::asio::buffer_size(read_buffer_);
+  size_t n = 0;
+  uint64_t now_ns = steady_now_ns();
+
+  CaptureEntryHeader header;
+  while (next_entry(&header))
+  {
+    if (speed_ > 0)
+    {
+      uint64_t offset_ns = header.timestamp_ns > first_timestamp_ns_ ? header.timestamp_ns - first_timestamp_ns_ : 0;
+      uint64_t due_ns = start_ns_ + (uint64_t) (offset_ns / speed_);
+      if (due_ns > now_ns)
+      {
+        if (n == 0)
+        {
+          replay_timer_.expires_from_now(std::chrono::nanoseconds(due_ns - now_ns));
+          replay_timer_.async_wait(make_alloc_handler(replay_timer_memory_,
+                                                      boost::bind(&MavlinkReplay::replay_timer_end, this,
+                                                                  boost::asio::placeholders::error)));
+          return;
+        }
+        break;
+      }
+    }
+
+    if (n + header.len > capacity)
+      break;
+
+    memcpy(out + n, data_ + pos_ + sizeof(header), header.len);
+    n += header.len;
+    pos_ += sizeof(header) + header.len;
+    frames_played_++;
+  }
+
+  if (n > 0)
+  {
+    io_service_.post(make_alloc_handler(read_handler_.memory(),
+                                        boost::bind<void>(read_handler_, boost::system::error_code(), n)));
+  }
+  else
+  {
+    // leave the read pending; the link stays up with nothing more to receive
+    finished_ = true;
+  }
+}
+
+void MavlinkReplay::replay_timer_end(const boost::system::error_code &error)
+{
+  if (error || !open_)
+    return;
+
+  fill_read();
+}
+
+bool MavlinkReplay::next_entry(CaptureEntryHeader *header)
+{
+  while (pos_ + sizeof(CaptureEntryHeader) <= size_)
+  {
+    memcpy(header, data_ + pos_, sizeof(*header));
+
+    if (pos_ + sizeof(*header) + header->len > size_)
+      return false; // cut off, e.g. by a crash during recording
+
+    if (header->direction == MavlinkRecorder::DIRECTION_RX)
+      return true;
+
+    pos_ += sizeof(*header) + header->len;
+  }
+
+  return false;
+}
+
+} // namespace mavrosflight
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_router.cpp
+ */
+
+#include <rosflight/mavrosflight/mavlink_router.h>
+#include <rosflight/mavrosflight/serial_exception.h>
+
+#include <chrono>
+
+#include <sys/socket.h>
+
+using boost::asio::ip::udp;
+
+namespace mavrosflight
+{
+
+namespace
+{
+
+uint64_t steady_now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void fill_id_filter(const std::vector<uint32_t> &ids, std::bitset<256> *filter)
+{
+  if (ids.empty())
+  {
+    filter->set();
+    return;
+  }
+
+  filter->reset();
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    if (ids[i] < filter->size())
+      filter->set(ids[i]);
+  }
+}
+
+} // namespace
+
+MavlinkRouter::Endpoint::Endpoint(boost::asio::io_service &io_service, const EndpointConfig &config) :
+  config(config),
+  socket(io_service),
+  forward_bucket(config.forward_rate, config.forward_burst),
+  accept_bucket(config.accept_rate, config.accept_burst),
+  scanner(MAVLINK_ROUTER_READ_BUF_SIZE),
+  forwarded(0),
+  forward_filtered(0),
+  forward_limited(0),
+  forward_errors(0),
+  received(0),
+  injected(0),
+  accept_filtered(0),
+  accept_limited(0),
+  inject_dropped(0),
+  crc_errors(0)
+{
+  fill_id_filter(config.forward_ids, &forward_ids);
+  fill_id_filter(config.accept_ids, &accept_ids);
+}
+
+MavlinkRouter::MavlinkRouter(MavlinkComm &comm) :
+  comm_(comm),
+  started_(false)
+{
+}
+
+MavlinkRouter::~MavlinkRouter()
+{
+  stop();
+
+  for (size_t i = 0; i < endpoints_.size(); i++)
+  {
+    delete endpoints_[i];
+  }
+}
+
+void MavlinkRouter::add_endpoint(const EndpointConfig &config)
+{
+  Endpoint *endpoint = new Endpoint(io_service_, config);
+
+  try
+  {
+    udp::resolver resolver(io_service_);
+
+    udp::endpoint bind_endpoint = *resolver.resolve({udp::v4(), config.bind_host, ""});
+    bind_endpoint.port(config.bind_port);
+
+    endpoint->remote = *resolver.resolve({udp::v4(), config.remote_host, ""});
+    endpoint->remote.port(config.remote_port);
+
+    endpoint->socket.open(udp::v4());
+    endpoint->socket.set_option(udp::socket::reuse_address(true));
+    endpoint->socket.bind(bind_endpoint);
+  }
+  catch (boost::system::system_error e)
+  {
+    delete endpoint;
+    throw SerialException(e);
+  }
+
+  endpoints_.push_back(endpoint);
+}
+
+void MavlinkRouter::start()
+{
+  if (started_ || endpoints_.empty())
+    return;
+
+  for (size_t i = 0; i < endpoints_.size(); i++)
+  {
+    async_read(endpoints_[i]);
+  }
+  thread_ = boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+
+  comm_.set_frame_callback(boost::bind(&MavlinkRouter::handle_frame, this, _1, _2));
+  started_ = true;
+}
+
+void MavlinkRouter::stop()
+{
+  if (!started_)
+    return;
+
+  // once this returns the link's io thread is done calling handle_frame()
+  comm_.set_frame_callback(MavlinkComm::FrameCallback());
+
+  io_service_.stop();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+
+  for (size_t i = 0; i < endpoints_.size(); i++)
+  {
+    boost::system::error_code error;
+    endpoints_[i]->socket.close(error);
+  }
+  started_ = false;
+}
+
+MavlinkRouter::EndpointStats MavlinkRouter::get_stats(size_t endpoint) const
+{
+  const Endpoint *e = endpoints_[endpoint];
+
+  EndpointStats stats;
+  stats.forwarded = e->forwarded.load(std::memory_order_relaxed);
+  stats.forward_filtered = e->forward_filtered.load(std::memory_order_relaxed);
+  stats.forward_limited = e->forward_limited.load(std::memory_order_relaxed);
+  stats.forward_errors = e->forward_errors.load(std::memory_order_relaxed);
+  stats.received = e->received.load(std::memory_order_relaxed);
+  stats.injected = e->injected.load(std::memory_order_relaxed);
+  stats.accept_filtered = e->accept_filtered.load(std::memory_order_relaxed);
+  stats.accept_limited = e->accept_limited.load(std::memory_order_relaxed);
+  stats.inject_dropped = e->inject_dropped.load(std::memory_order_relaxed);
+  stats.crc_errors = e->crc_errors.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void MavlinkRouter::handle_frame(const uint8_t *frame, size_t len)
+{
+  uint8_t msgid = mavlink2_frame_msgid(frame);
+  uint64_t now_ns = steady_now_ns();
+
+  for (size_t i = 0; i < endpoints_.size(); i++)
+  {
+    Endpoint *endpoint = endpoints_[i];
+
+    if (!endpoint->forward_ids[msgid])
+    {
+      endpoint->forward_filtered.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    if (!endpoint->forward_bucket.try_consume(len, now_ns))
+    {
+      endpoint->forward_limited.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    // a non-blocking send straight from the io thread; the socket itself is owned by the router thread, so go
+    // through the descriptor rather than the asio object
+    ssize_t sent = ::sendto(endpoint->socket.native_handle(), frame, len, MSG_DONTWAIT,
+                            endpoint->remote.data(), endpoint->remote.size());
+    if (sent == (ssize_t) len)
+      endpoint->forwarded.fetch_add(1, std::memory_order_relaxed);
+    else
+      endpoint->forward_errors.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void MavlinkRouter::async_read(Endpoint *endpoint)
+{
+  endpoint->socket.async_receive_from(
+        endpoint->scanner.prepare(),
+        endpoint->sender,
+        make_alloc_handler(endpoint->read_handler_memory,
+                           boost::bind(&MavlinkRouter::async_read_end, this, endpoint,
+                                       boost::asio::placeholders::error,
+                                       boost::asio::placeholders::bytes_transferred)));
+}
+
+void MavlinkRouter::async_read_end(Endpoint *endpoint, const boost::system::error_code &error, size_t bytes_transferred)
+{
+  if (error == boost::asio::error::operation_aborted)
+    return;
+
+  if (!error)
+  {
+    uint64_t now_ns = steady_now_ns();
+
+    endpoint->scanner.commit(bytes_transferred);
+    while (endpoint->scanner.next_frame())
+    {
+      endpoint->received.fetch_add(1, std::memory_order_relaxed);
+
+      if (!endpoint->accept_ids[endpoint->scanner.frame_msgid()])
+      {
+        endpoint->accept_filtered.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      if (!endpoint->accept_bucket.try_consume(endpoint->scanner.frame_len(), now_ns))
+      {
+        endpoint->accept_limited.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      if (comm_.send_frame(endpoint->scanner.frame_data(), endpoint->scanner.frame_len()))
+        endpoint->injected.fetch_add(1, std::memory_order_relaxed);
+      else
+        endpoint->inject_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    endpoint->crc_errors.store(endpoint->scanner.crc_errors(), std::memory_order_relaxed);
+  }
+
+  // errors such as ICMP port unreachable while the ground station isn't running are expected; keep reading
+  async_read(endpoint);
+}
+
+} // namespace mavrosflight
@@ -36,23 +36,91 @@
 
 #include <rosflight/mavrosflight/mavlink_serial.h>
 #include <rosflight/mavrosflight/serial_exception.h>
+#include <rosflight/mavlink/baud_rate.h>
+
+#include <boost/bind.hpp>
+
+#include <chrono>
+#include <iostream>
+
+#include <errno.h>
+#include <linux/serial.h>
+#include <string.h>
+#include <sys/ioctl.h>
 
 namespace mavrosflight
 {
 
 using boost::asio::serial_port_base;
 
-MavlinkSerial::MavlinkSerial(std::string port, int baud_rate) :
-  MavlinkComm(),
+MavlinkSerial::MavlinkSerial(std::string port, int baud_rate, IoServicePool *io_pool) :
+  MavlinkComm(io_pool),
   serial_port_(io_service_),
   port_(port),
-  baud_rate_(baud_rate)
+  baud_rate_(baud_rate),
+  low_latency_(false),
+  wake_timer_(io_service_),
+  wake_handler_memory_{{&pending_ops_}, {&pending_ops_}},
+  read_sequence_(0),
+  wake_lowered_(false),
+  max_baud_rate_(0),
+  current_baud_rate_(baud_rate),
+  baud_state_(BAUD_UPGRADE_OFF),
+  baud_limit_(0),
+  proposed_baud_rate_(0),
+  baud_proposals_left_(0),
+  heartbeat_sub_(0),
+  named_value_sub_(0),
+  baud_timer_(io_service_),
+  baud_handler_memory_{{&pending_ops_}, {&pending_ops_}},
+  baud_timer_sequence_(0)
 {
 }
 
 MavlinkSerial::~MavlinkSerial()
 {
-  do_close();
+  if (max_baud_rate_ > baud_rate_)
+  {
+    unsubscribe(heartbeat_sub_);
+    unsubscribe(named_value_sub_);
+  }
+  close();
+}
+
+void MavlinkSerial::set_tx_pacing(double utilization, size_t burst_bytes)
+{
+  set_write_rate_limit(baud_rate_ / 10.0 * utilization, burst_bytes);
+}
+
+void MavlinkSerial::set_low_latency(const LowLatencyOptions &options)
+{
+  low_latency_ = true;
+  low_latency_options_ = options;
+  if (low_latency_options_.wake_bytes < 1)
+    low_latency_options_.wake_bytes = 1;
+}
+
+void MavlinkSerial::set_baud_upgrade(int max_baud_rate)
+{
+  if (max_baud_rate_ > baud_rate_)
+  {
+    unsubscribe(heartbeat_sub_);
+    unsubscribe(named_value_sub_);
+  }
+
+  max_baud_rate_ = max_baud_rate;
+  if (max_baud_rate_ > baud_rate_)
+  {
+    heartbeat_sub_ = subscribe_raw(MAVLINK_MSG_ID_HEARTBEAT,
+                                   boost::bind(&MavlinkSerial::handle_baud_heartbeat, this, _1));
+    named_value_sub_ = subscribe_raw(MAVLINK_MSG_ID_NAMED_VALUE_INT,
+                                     boost::bind(&MavlinkSerial::handle_baud_answer, this, _1));
+  }
+}
+
+int MavlinkSerial::get_baud_rate() const
+{
+  return current_baud_rate_;
 }
 
 bool MavlinkSerial::is_open()
@@ -69,27 +137,245 @@ void MavlinkSerial::do_open()
     serial_port_.set_option(serial_port_base::character_size(8));
     serial_port_.set_option(serial_port_base::parity(serial_port_base::parity::none));
     serial_port_.set_option(serial_port_base::stop_bits(serial_port_base::stop_bits::one));
-    serial_port_.set_option(serial_port_base::flow_control(serial_port_base::flow_control::none));
+    serial_port_.set_option(serial_port_base::flow_control(
+                              low_latency_ && low_latency_options_.hardware_flow_control
+                              ? serial_port_base::flow_control::hardware : serial_port_base::flow_control::none));
   }
   catch (boost::system::system_error e)
   {
     throw SerialException(e);
   }
+
+  if (low_latency_)
+    configure_low_latency();
+
+  // 8N1 takes 10 bits per byte
+  set_rx_byte_time(10000000000ULL / baud_rate_);
+
+  // the firmware may have been reset as well, so the handshake starts over from the configured rate
+  current_baud_rate_ = baud_rate_;
+  baud_state_ = max_baud_rate_ > baud_rate_ ? BAUD_UPGRADE_WAITING : BAUD_UPGRADE_OFF;
+  baud_limit_ = max_baud_rate_;
+  baud_proposals_left_ = MAVLINK_SERIAL_BAUD_PROPOSALS;
+}
+
+void MavlinkSerial::configure_low_latency()
+{
+  int fd = serial_port_.native_handle();
+
+  struct serial_struct serial;
+  if (ioctl(fd, TIOCGSERIAL, &serial) == 0)
+  {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) != 0)
+      std::cerr << "Failed to set ASYNC_LOW_LATENCY on " << port_ << ": " << strerror(errno) << std::endl;
+  }
+  else
+  {
+    std::cerr << "Serial port " << port_ << " doesn't support ASYNC_LOW_LATENCY, leaving the driver's latency as it is"
+              << std::endl;
+  }
+
+  if (tcgetattr(fd, &tty_) != 0)
+  {
+    do_close();
+    throw SerialException(std::string("Failed to read the tty settings: ") + strerror(errno));
+  }
+
+  // with VTIME at 0, the kernel only reports the port readable once VMIN bytes are waiting
+  tty_.c_cc[VTIME] = 0;
+  wake_lowered_ = false;
+  if (!set_wake_bytes(low_latency_options_.wake_bytes))
+  {
+    do_close();
+    throw SerialException(std::string("Failed to set the wake-up policy: ") + strerror(errno));
+  }
+}
+
+bool MavlinkSerial::set_wake_bytes(uint8_t bytes)
+{
+  tty_.c_cc[VMIN] = bytes;
+  return tcsetattr(serial_port_.native_handle(), TCSANOW, &tty_) == 0;
 }
 
 void MavlinkSerial::do_close()
 {
+  wake_timer_.cancel();
+  baud_timer_.cancel();
   serial_port_.close();
 }
 
-void MavlinkSerial::do_async_read(const boost::asio::mutable_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler)
+void MavlinkSerial::do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
 {
+  if (low_latency_ && low_latency_options_.wake_bytes > 1)
+  {
+    if (wake_lowered_)
+    {
+      set_wake_bytes(low_latency_options_.wake_bytes);
+      wake_lowered_ = false;
+    }
+
+    // rearming cancels the wait for the previous read, which has completed
+    read_sequence_++;
+    wake_timer_.expires_from_now(std::chrono::microseconds(low_latency_options_.wake_timeout_us));
+    wake_timer_.async_wait(make_alloc_handler(wake_handler_memory_[read_sequence_ & 1],
+                                              boost::bind(&MavlinkSerial::wake_timeout, this,
+                                                          boost::asio::placeholders::error, read_sequence_)));
+  }
+
   serial_port_.async_read_some(buffer, handler);
 }
 
-void MavlinkSerial::do_async_write(const boost::asio::const_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler)
+void MavlinkSerial::wake_timeout(const boost::system::error_code &error, uint64_t read_sequence)
+{
+  if (error || read_sequence != read_sequence_ || !is_open())
+    return;
+
+  // changing the settings makes the kernel check the waiting bytes against the new VMIN, completing the read
+  if (set_wake_bytes(1))
+    wake_lowered_ = true;
+}
+
+void MavlinkSerial::handle_baud_heartbeat(const mavlink_message_t &msg)
+{
+  (void) msg;
+
+  switch (baud_state_)
+  {
+  case BAUD_UPGRADE_WAITING:
+    propose_baud_rate();
+    break;
+  case BAUD_UPGRADE_VERIFYING:
+    baud_state_ = BAUD_UPGRADE_UPGRADED;
+    std::cerr << "Serial port " << port_ << " upgraded to " << proposed_baud_rate_ << " baud" << std::endl;
+    start_baud_timer(MAVLINK_BAUD_RATE_TIMEOUT_MS);
+    break;
+  case BAUD_UPGRADE_UPGRADED:
+    start_baud_timer(MAVLINK_BAUD_RATE_TIMEOUT_MS);
+    break;
+  default:
+    break;
+  }
+}
+
+void MavlinkSerial::handle_baud_answer(const mavlink_message_t &msg)
+{
+  mavlink_named_value_int_t named_value;
+  mavlink_msg_named_value_int_decode(&msg, &named_value);
+  if (baud_state_ != BAUD_UPGRADE_PROPOSED
+      || strncmp(named_value.name, MAVLINK_BAUD_RATE_NAME, sizeof(named_value.name)) != 0)
+    return;
+
+  if (named_value.value <= baud_rate_ || named_value.value > proposed_baud_rate_)
+  {
+    baud_state_ = BAUD_UPGRADE_OFF;
+    baud_timer_.cancel();
+    return;
+  }
+
+  // the firmware has switched already; a heartbeat at the new rate tells it that this end has followed
+  proposed_baud_rate_ = named_value.value;
+  set_port_baud_rate(proposed_baud_rate_);
+  baud_state_ = BAUD_UPGRADE_VERIFYING;
+  start_baud_timer(MAVLINK_BAUD_RATE_TIMEOUT_MS);
+
+  mavlink_message_t heartbeat;
+  mavlink_msg_heartbeat_pack(get_sysid(), get_compid(), &heartbeat, 0, 0, 0, 0, 0);
+  send_message(heartbeat, WRITE_PRIORITY_SAFETY);
+}
+
+void MavlinkSerial::propose_baud_rate()
+{
+  proposed_baud_rate_ = mavlink_baud_rate_select(baud_limit_, baud_rate_);
+  if (proposed_baud_rate_ == baud_rate_)
+  {
+    baud_state_ = BAUD_UPGRADE_OFF;
+    return;
+  }
+
+  mavlink_message_t msg;
+  mavlink_msg_named_value_int_pack(get_sysid(), get_compid(), &msg, 0, MAVLINK_BAUD_RATE_NAME, proposed_baud_rate_);
+  send_message(msg, WRITE_PRIORITY_SAFETY);
+  baud_state_ = BAUD_UPGRADE_PROPOSED;
+  start_baud_timer(MAVLINK_SERIAL_BAUD_PROPOSAL_TIMEOUT_MS);
+}
+
+void MavlinkSerial::baud_timeout(const boost::system::error_code &error, uint64_t timer_sequence)
+{
+  if (error || timer_sequence != baud_timer_sequence_ || !is_open())
+    return;
+
+  switch (baud_state_)
+  {
+  case BAUD_UPGRADE_PROPOSED:
+    if (--baud_proposals_left_ > 0)
+    {
+      propose_baud_rate();
+    }
+    else
+    {
+      // most likely firmware that predates the handshake
+      baud_state_ = BAUD_UPGRADE_OFF;
+      std::cerr << "No answer to baud rate proposals on " << port_ << ", staying at " << baud_rate_ << " baud"
+                << std::endl;
+    }
+    break;
+  case BAUD_UPGRADE_VERIFYING:
+    std::cerr << "No heartbeat at " << proposed_baud_rate_ << " baud on " << port_ << ", falling back to "
+              << baud_rate_ << " baud" << std::endl;
+    baud_limit_ = proposed_baud_rate_ - 1;
+    fall_back_baud_rate();
+    break;
+  case BAUD_UPGRADE_UPGRADED:
+    std::cerr << "Heartbeats lost at " << proposed_baud_rate_ << " baud on " << port_ << ", falling back to "
+              << baud_rate_ << " baud" << std::endl;
+    fall_back_baud_rate();
+    break;
+  default:
+    break;
+  }
+}
+
+void MavlinkSerial::fall_back_baud_rate()
+{
+  // the firmware falls back by itself once it stops hearing heartbeats, and the next one at this rate starts over
+  set_port_baud_rate(baud_rate_);
+  baud_state_ = BAUD_UPGRADE_WAITING;
+  baud_proposals_left_ = MAVLINK_SERIAL_BAUD_PROPOSALS;
+}
+
+void MavlinkSerial::set_port_baud_rate(int baud_rate)
+{
+  try
+  {
+    serial_port_.set_option(serial_port_base::baud_rate(baud_rate));
+  }
+  catch (const boost::system::system_error &e)
+  {
+    std::cerr << "Failed to set " << port_ << " to " << baud_rate << " baud: " << e.what() << std::endl;
+    return;
+  }
+  current_baud_rate_ = baud_rate;
+  set_rx_byte_time(10000000000ULL / baud_rate);
+
+  // set_wake_bytes() writes back the saved settings, which have to carry the new rate
+  if (low_latency_)
+    tcgetattr(serial_port_.native_handle(), &tty_);
+}
+
+void MavlinkSerial::start_baud_timer(uint32_t ms)
+{
+  // rearming cancels the previous wait
+  baud_timer_sequence_++;
+  baud_timer_.expires_from_now(std::chrono::milliseconds(ms));
+  baud_timer_.async_wait(make_alloc_handler(baud_handler_memory_[baud_timer_sequence_ & 1],
+                                            boost::bind(&MavlinkSerial::baud_timeout, this,
+                                                        boost::asio::placeholders::error, baud_timer_sequence_)));
+}
+
+void MavlinkSerial::do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler)
 {
-  serial_port_.async_write_some(buffer, handler);
+  serial_port_.async_write_some(buffers, handler);
 }
 
 } // namespace mavrosflight
@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_tcp.cpp
+ */
+
+#include <rosflight/mavrosflight/mavlink_tcp.h>
+#include <rosflight/mavrosflight/serial_exception.h>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <chrono>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+using boost::asio::ip::tcp;
+
+namespace mavrosflight
+{
+
+MavlinkTCP::MavlinkTCP(std::string host, uint16_t port, bool server, const Options &options,
+                       IoServicePool *io_pool) :
+  MavlinkComm(io_pool),
+  host_(host),
+  port_(port),
+  server_(server),
+  options_(options),
+  socket_(io_service_),
+  acceptor_(io_service_),
+  resolver_(io_service_),
+  connect_timer_(io_service_),
+  connecting_(false),
+  connect_timed_out_(false),
+  open_handler_memory_(&pending_ops_),
+  connect_timer_memory_(&pending_ops_)
+{
+  // a stream can deliver many frames at once, unlike a serial port
+  set_read_buffer_size(MAVLINK_TCP_READ_BUF_SIZE);
+}
+
+MavlinkTCP::~MavlinkTCP()
+{
+  close();
+
+  boost::system::error_code error;
+  acceptor_.close(error);
+}
+
+bool MavlinkTCP::is_open()
+{
+  return socket_.is_open();
+}
+
+void MavlinkTCP::do_open()
+{
+  try
+  {
+    if (server_)
+      accept();
+    else
+      connect();
+
+    set_socket_options();
+  }
+  catch (boost::system::system_error e)
+  {
+    do_close();
+    throw SerialException(e);
+  }
+}
+
+void MavlinkTCP::do_close()
+{
+  // the listening socket stays open, but a pending accept is given up like any other step of reopening
+  boost::system::error_code error;
+  resolver_.cancel();
+  connect_timer_.cancel(error);
+  connecting_ = false;
+  acceptor_.cancel(error);
+  socket_.shutdown(tcp::socket::shutdown_both, error);
+  socket_.close(error);
+}
+
+void MavlinkTCP::do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
+{
+  socket_.async_read_some(buffer, handler);
+}
+
+void MavlinkTCP::do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler)
+{
+  // a short write is carried on by MavlinkComm, between frames of higher priority if any have been queued meanwhile
+  socket_.async_write_some(buffers, handler);
+}
+
+void MavlinkTCP::do_async_open(const IoHandler &handler)
+{
+  // a server's listening socket normally survives the failure, so it only has to wait for the next client
+  if (server_ && acceptor_.is_open())
+  {
+    async_accept(handler);
+    return;
+  }
+
+  tcp::resolver::query query(tcp::v4(), host_, std::to_string(port_));
+  resolver_.async_resolve(query, make_alloc_handler(open_handler_memory_,
+                                                    boost::bind(&MavlinkTCP::async_resolve_end, this,
+                                                                boost::asio::placeholders::error,
+                                                                boost::asio::placeholders::iterator, handler)));
+}
+
+void MavlinkTCP::async_resolve_end(const boost::system::error_code &error, tcp::resolver::iterator endpoint,
+                                   IoHandler handler)
+{
+  if (error)
+  {
+    handler(error, 0);
+    return;
+  }
+
+  if (server_)
+  {
+    try
+    {
+      listen(*endpoint);
+    }
+    catch (const boost::system::system_error &e)
+    {
+      handler(e.code(), 0);
+      return;
+    }
+
+    async_accept(handler);
+    return;
+  }
+
+  connecting_ = true;
+  connect_timed_out_ = false;
+  connect_timer_.expires_from_now(std::chrono::milliseconds(options_.connect_timeout_ms));
+  connect_timer_.async_wait(make_alloc_handler(connect_timer_memory_,
+                                               boost::bind(&MavlinkTCP::async_connect_timeout, this,
+                                                           boost::asio::placeholders::error)));
+  socket_.async_connect(*endpoint, make_alloc_handler(open_handler_memory_,
+                                                      boost::bind(&MavlinkTCP::async_connect_end, this,
+                                                                  boost::asio::placeholders::error, handler)));
+}
+
+void MavlinkTCP::async_accept(const IoHandler &handler)
+{
+  acceptor_.async_accept(socket_, make_alloc_handler(open_handler_memory_,
+                                                     boost::bind(&MavlinkTCP::async_open_end, this,
+                                                                 boost::asio::placeholders::error, handler)));
+}
+
+void MavlinkTCP::async_connect_end(const boost::system::error_code &error, IoHandler handler)
+{
+  connecting_ = false;
+  connect_timer_.cancel();
+
+  // a connect cut short by the timeout has failed, and the port is reopened again; operation_aborted would read as
+  // the link being closed
+  if (connect_timed_out_ && error == boost::asio::error::operation_aborted)
+  {
+    async_open_end(boost::asio::error::timed_out, handler);
+    return;
+  }
+  async_open_end(error, handler);
+}
+
+void MavlinkTCP::async_connect_timeout(const boost::system::error_code &error)
+{
+  // closing the socket ends the connect with operation_aborted, which is reported as timed_out
+  if (error != boost::asio::error::operation_aborted && connecting_)
+  {
+    connect_timed_out_ = true;
+    boost::system::error_code close_error;
+    socket_.close(close_error);
+  }
+}
+
+void MavlinkTCP::async_open_end(const boost::system::error_code &error, IoHandler handler)
+{
+  boost::system::error_code result = error;
+  if (!result)
+  {
+    try
+    {
+      set_socket_options();
+    }
+    catch (const boost::system::system_error &e)
+    {
+      result = e.code();
+    }
+  }
+
+  handler(result, 0);
+}
+
+void MavlinkTCP::connect()
+{
+  tcp::resolver resolver(io_service_);
+  tcp::resolver::iterator endpoint = resolver.resolve({tcp::v4(), host_, std::to_string(port_)});
+
+  socket_.open(endpoint->endpoint().protocol());
+  socket_.non_blocking(true);
+
+  // a blocking connect to an unreachable host takes minutes to fail, and asio's synchronous connect waits for it
+  // whatever the socket's mode, so the connect is started directly
+  boost::system::error_code error;
+  const tcp::endpoint &remote = endpoint->endpoint();
+  if (::connect(socket_.native_handle(), remote.data(), remote.size()) != 0)
+    error = boost::system::error_code(errno, boost::system::system_category());
+  if (error == boost::asio::error::in_progress || error == boost::asio::error::would_block)
+  {
+    if (!wait_ready(socket_.native_handle(), POLLOUT))
+      throw boost::system::system_error(boost::asio::error::timed_out, "connecting to " + host_);
+
+    int result = 0;
+    socklen_t len = sizeof(result);
+    getsockopt(socket_.native_handle(), SOL_SOCKET, SO_ERROR, &result, &len);
+    error = boost::system::error_code(result, boost::system::system_category());
+  }
+  if (error)
+    throw boost::system::system_error(error, "connecting to " + host_);
+}
+
+void MavlinkTCP::accept()
+{
+  if (!acceptor_.is_open())
+  {
+    tcp::resolver resolver(io_service_);
+    listen(*resolver.resolve({tcp::v4(), host_, std::to_string(port_)}));
+  }
+
+  if (!wait_ready(acceptor_.native_handle(), POLLIN))
+    throw boost::system::system_error(boost::asio::error::timed_out, "waiting for a client on port "
+                                      + std::to_string(port_));
+
+  acceptor_.accept(socket_);
+}
+
+void MavlinkTCP::listen(const tcp::endpoint &endpoint)
+{
+  try
+  {
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen(1);
+    acceptor_.non_blocking(true);
+  }
+  catch (const boost::system::system_error &)
+  {
+    // a socket left open but not listening would be taken for one that is
+    boost::system::error_code error;
+    acceptor_.close(error);
+    throw;
+  }
+}
+
+bool MavlinkTCP::wait_ready(int fd, short events)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = events;
+  pfd.revents = 0;
+
+  int result;
+  do
+  {
+    result = poll(&pfd, 1, options_.connect_timeout_ms);
+  } while (result < 0 && errno == EINTR);
+
+  return result > 0;
+}
+
+void MavlinkTCP::set_socket_options()
+{
+  socket_.set_option(tcp::no_delay(true));
+
+  if (options_.send_buffer_size > 0)
+    socket_.set_option(tcp::socket::send_buffer_size(options_.send_buffer_size));
+  if (options_.receive_buffer_size > 0)
+    socket_.set_option(tcp::socket::receive_buffer_size(options_.receive_buffer_size));
+
+  if (options_.dead_peer_timeout_ms > 0)
+  {
+    // probe an idle connection every second, and give up on one whose sent bytes stay unacknowledged for too long
+    int fd = socket_.native_handle();
+    int idle = 1;
+    int interval = 1;
+    int count = std::max<int>(options_.dead_peer_timeout_ms / 1000, 1);
+    unsigned int user_timeout = options_.dead_peer_timeout_ms;
+    socket_.set_option(tcp::socket::keep_alive(true));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+  }
+}
+
+} // namespace mavrosflight
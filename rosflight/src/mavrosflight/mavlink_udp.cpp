@@ -37,6 +37,14 @@
 #include <rosflight/mavrosflight/mavlink_udp.h>
 #include <rosflight/mavrosflight/serial_exception.h>
 
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <iostream>
+
+#include <errno.h>
+#include <string.h>
+
 using boost::asio::ip::udp;
 
 namespace mavrosflight
@@ -44,19 +52,29 @@ namespace mavrosflight
 
 using boost::asio::serial_port_base;
 
-MavlinkUDP::MavlinkUDP(std::string bind_host, uint16_t bind_port, std::string remote_host, uint16_t remote_port) :
-  MavlinkComm(),
+MavlinkUDP::MavlinkUDP(std::string bind_host, uint16_t bind_port, std::string remote_host, uint16_t remote_port,
+                       const Options &options, IoServicePool *io_pool) :
+  MavlinkComm(io_pool),
   socket_(io_service_),
   bind_host_(bind_host),
   bind_port_(bind_port),
   remote_host_(remote_host),
-  remote_port_(remote_port)
+  remote_port_(remote_port),
+  resolved_(false),
+  options_(options),
+  rx_truncation_reported_(false),
+  read_wait_memory_(&pending_ops_),
+  read_post_memory_(&pending_ops_)
 {
+  options_.receive_batch = std::min(std::max(options_.receive_batch, (size_t) 1), (size_t) MAVLINK_UDP_MAX_RECEIVE_BATCH);
+
+  // a datagram must fit in a single read, or the frames at its end are lost
+  set_read_buffer_size(MAVLINK_UDP_READ_BUF_SIZE);
 }
 
 MavlinkUDP::~MavlinkUDP()
 {
-  do_close();
+  close();
 }
 
 bool MavlinkUDP::is_open()
@@ -68,20 +86,31 @@ void MavlinkUDP::do_open()
 {
   try
   {
-    udp::resolver resolver(io_service_);
+    // resolve once, so a reopen on a shared pool thread never waits on the resolver
+    if (!resolved_)
+    {
+      udp::resolver resolver(io_service_);
+
+      bind_endpoint_ = *resolver.resolve({udp::v4(), bind_host_, ""});
+      bind_endpoint_.port(bind_port_);
 
-    bind_endpoint_ = *resolver.resolve({udp::v4(), bind_host_, ""});
-    bind_endpoint_.port(bind_port_);
+      remote_endpoint_ = *resolver.resolve({udp::v4(), remote_host_, ""});
+      remote_endpoint_.port(remote_port_);
 
-    remote_endpoint_ = *resolver.resolve({udp::v4(), remote_host_, ""});
-    remote_endpoint_.port(remote_port_);
+      resolved_ = true;
+    }
 
     socket_.open(udp::v4());
     socket_.bind(bind_endpoint_);
 
     socket_.set_option(udp::socket::reuse_address(true));
-    socket_.set_option(udp::socket::send_buffer_size(1000*MAVLINK_MAX_PACKET_LEN));
-    socket_.set_option(udp::socket::receive_buffer_size(1000*MAVLINK_SERIAL_READ_BUF_SIZE));
+    if (options_.send_buffer_size > 0)
+      socket_.set_option(udp::socket::send_buffer_size(options_.send_buffer_size));
+    if (options_.receive_buffer_size > 0)
+      socket_.set_option(udp::socket::receive_buffer_size(options_.receive_buffer_size));
+
+    // reads call recvmmsg directly, which must never block the io thread
+    socket_.non_blocking(true);
   }
   catch (boost::system::system_error e)
   {
@@ -94,14 +123,113 @@ void MavlinkUDP::do_close()
   socket_.close();
 }
 
-void MavlinkUDP::do_async_read(const boost::asio::mutable_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler)
+void MavlinkUDP::do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
+{
+  // datagrams that are already waiting are taken right away, without another trip through epoll
+  size_t bytes_transferred = 0;
+  boost::system::error_code error;
+  if (receive_batch(buffer, &bytes_transferred, &error))
+  {
+    io_service_.post(make_alloc_handler(read_post_memory_, boost::bind<void>(handler, error, bytes_transferred)));
+    return;
+  }
+
+  wait_readable(buffer, handler);
+}
+
+void MavlinkUDP::wait_readable(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
+{
+  // only safe once a receive has come back empty: asio's epoll registration is edge-triggered
+  socket_.async_wait(udp::socket::wait_read,
+                     make_alloc_handler(read_wait_memory_,
+                                        boost::bind(&MavlinkUDP::read_ready, this, boost::asio::placeholders::error,
+                                                    buffer, handler)));
+}
+
+void MavlinkUDP::read_ready(const boost::system::error_code &error, const boost::asio::mutable_buffers_1 &buffer,
+                            const IoHandler &handler)
+{
+  IoHandler read_handler(handler);
+
+  if (error)
+  {
+    read_handler(error, 0);
+    return;
+  }
+
+  size_t bytes_transferred = 0;
+  boost::system::error_code receive_error;
+  if (receive_batch(buffer, &bytes_transferred, &receive_error))
+    read_handler(receive_error, bytes_transferred);
+  else
+    wait_readable(buffer, handler);
+}
+
+bool MavlinkUDP::receive_batch(const boost::asio::mutable_buffers_1 &buffer, size_t *bytes_transferred,
+                               boost::system::error_code *error)
 {
-  socket_.async_receive_from(buffer, remote_endpoint_, handler);
+  uint8_t *data = boost::asio::buffer_cast<uint8_t*>(buffer);
+  size_t size = boost::asio::buffer_size(buffer);
+
+  // every datagram needs a slot of its own, large enough for the biggest one expected
+  size_t batch = std::max(std::min(options_.receive_batch, size / MAVLINK_UDP_MIN_DATAGRAM_SLOT), (size_t) 1);
+  size_t slot = size / batch;
+
+  for (size_t i = 0; i < batch; i++)
+  {
+    rx_iov_[i].iov_base = data + i * slot;
+    rx_iov_[i].iov_len = slot;
+    memset(&rx_msgs_[i].msg_hdr, 0, sizeof(rx_msgs_[i].msg_hdr));
+    rx_msgs_[i].msg_hdr.msg_iov = &rx_iov_[i];
+    rx_msgs_[i].msg_hdr.msg_iovlen = 1;
+    rx_msgs_[i].msg_hdr.msg_name = &rx_sender_;
+    rx_msgs_[i].msg_hdr.msg_namelen = sizeof(rx_sender_);
+  }
+
+  int received;
+  do
+  {
+    received = recvmmsg(socket_.native_handle(), rx_msgs_, batch, MSG_DONTWAIT, NULL);
+  } while (received < 0 && errno == EINTR);
+
+  if (received < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return false;
+    *error = boost::system::error_code(errno, boost::system::system_category());
+    *bytes_transferred = 0;
+    return true;
+  }
+
+  // close the gaps between the slots, so the frame scanner sees one contiguous stream
+  size_t total = 0;
+  for (int i = 0; i < received; i++)
+  {
+    size_t len = rx_msgs_[i].msg_len;
+    if ((rx_msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) && !rx_truncation_reported_)
+    {
+      std::cerr << "Received a UDP datagram larger than " << slot << " bytes; the frames at its end were lost"
+                << std::endl;
+      rx_truncation_reported_ = true;
+    }
+
+    if (total != i * slot)
+      memmove(data + total, data + i * slot, len);
+    total += len;
+  }
+
+  // replies go to whoever sent last, as they did when each datagram was received on its own
+  if (received > 0 && rx_sender_.sin_family == AF_INET)
+    remote_endpoint_ = udp::endpoint(boost::asio::ip::address_v4(ntohl(rx_sender_.sin_addr.s_addr)),
+                                     ntohs(rx_sender_.sin_port));
+
+  *bytes_transferred = total;
+  return true;
 }
 
-void MavlinkUDP::do_async_write(const boost::asio::const_buffers_1 &buffer, boost::function<void(const boost::system::error_code&, size_t)> handler)
+void MavlinkUDP::do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler)
 {
-  socket_.async_send_to(buffer, remote_endpoint_, handler);
+  socket_.async_send_to(buffers, remote_endpoint_, handler);
 }
 
 } // namespace mavrosflight
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2017 Daniel Koch, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file mavlink_unix.cpp
+ */
+
+#include <rosflight/mavrosflight/mavlink_unix.h>
+#include <rosflight/mavrosflight/serial_exception.h>
+#include <rosflight/mavrosflight/unix_socket.h>
+
+#include <boost/bind.hpp>
+
+namespace mavrosflight
+{
+
+MavlinkUnix::MavlinkUnix(std::string path, IoServicePool *io_pool) :
+  MavlinkComm(io_pool),
+  path_(path),
+  socket_(io_service_),
+  read_flags_(0),
+  read_memory_(&pending_ops_)
+{
+  // a packet must fit in a single read, or the frames at its end are lost
+  set_read_buffer_size(MAVLINK_UNIX_READ_BUF_SIZE);
+}
+
+MavlinkUnix::~MavlinkUnix()
+{
+  close();
+}
+
+bool MavlinkUnix::is_open()
+{
+  return socket_.is_open();
+}
+
+void MavlinkUnix::do_open()
+{
+  boost::asio::generic::seq_packet_protocol::endpoint endpoint;
+  if (!unix_socket_endpoint(path_, &endpoint))
+    throw SerialException("Invalid unix socket path \"" + path_ + "\"");
+
+  try
+  {
+    socket_.connect(endpoint);
+  }
+  catch (boost::system::system_error e)
+  {
+    do_close();
+    throw SerialException(e);
+  }
+}
+
+void MavlinkUnix::do_close()
+{
+  boost::system::error_code error;
+  socket_.close(error);
+}
+
+void MavlinkUnix::do_async_read(const boost::asio::mutable_buffers_1 &buffer, const IoHandler &handler)
+{
+  socket_.async_receive(buffer, read_flags_,
+                        make_alloc_handler(read_memory_,
+                                           boost::bind(&MavlinkUnix::read_end, this, boost::asio::placeholders::error,
+                                                       boost::asio::placeholders::bytes_transferred, handler)));
+}
+
+void MavlinkUnix::read_end(const boost::system::error_code &error, size_t bytes_transferred, const IoHandler &handler)
+{
+  IoHandler read_handler(handler);
+
+  // asio only reports the end of a stream as eof; for packets, the peer closing shows up as an empty one
+  if (!error && bytes_transferred == 0)
+    read_handler(boost::asio::error::eof, 0);
+  else
+    read_handler(error, bytes_transferred);
+}
+
+void MavlinkUnix::do_async_write(const WriteBufferSequence &buffers, const IoHandler &handler)
+{
+  // the whole batch goes out as one packet, which the firmware splits into frames again
+  socket_.async_send(buffers, 0, handler);
+}
+
+} // namespace mavrosflight
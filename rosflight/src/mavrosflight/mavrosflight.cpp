@@ -45,8 +45,8 @@ using boost::asio::serial_port_base;
 
 MavROSflight::MavROSflight(MavlinkComm &mavlink_comm, uint8_t sysid /* = 1 */, uint8_t compid /* = 50 */) :
   comm(mavlink_comm),
-  param(&comm),
-  time(&comm),
+  param(&comm, sysid, compid),
+  time(&comm, sysid, compid),
   sysid_(sysid),
   compid_(compid)
 {
@@ -81,15 +81,15 @@ double Param::getValue() const
   return value_;
 }
 
-void Param::requestSet(double value, mavlink_message_t *msg)
+void Param::requestSet(double value, uint8_t sysid, uint8_t compid, mavlink_message_t *msg)
 {
   if (value != value_)
   {
     new_value_ = getCastValue(value);
     expected_raw_value_ = getRawValue(new_value_);
 
-    mavlink_msg_param_set_pack(1, 50, msg,
-                               1, MAV_COMP_ID_ALL, name_.c_str(), expected_raw_value_, type_);
+    mavlink_msg_param_set_pack(sysid, compid, msg,
+                               sysid, MAV_COMP_ID_ALL, name_.c_str(), expected_raw_value_, type_);
 
     set_in_progress_ = true;
   }
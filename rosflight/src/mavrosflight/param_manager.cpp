@@ -43,8 +43,10 @@
 namespace mavrosflight
 {
 
-ParamManager::ParamManager(MavlinkComm * const comm) :
+ParamManager::ParamManager(MavlinkComm * const comm, uint8_t sysid, uint8_t compid) :
   comm_(comm),
+  sysid_(sysid),
+  compid_(compid),
   unsaved_changes_(false),
   write_request_in_progress_(false),
   first_param_received_(false),
@@ -52,7 +54,10 @@ ParamManager::ParamManager(MavlinkComm * const comm) :
   got_all_params_(false),
   param_set_in_progress_(false)
 {
-  comm_->register_mavlink_listener(this);
+  param_value_sub_ = comm_->subscribe<mavlink_param_value_t>(
+        boost::bind(&ParamManager::handle_param_value_msg, this, _1));
+  command_ack_sub_ = comm_->subscribe<mavlink_rosflight_cmd_ack_t>(
+        boost::bind(&ParamManager::handle_command_ack_msg, this, _1));
 
   param_set_timer_ = nh_.createTimer(ros::Duration(ros::Rate(100)),
                                      &ParamManager::param_set_timer_callback, this,
@@ -62,25 +67,15 @@ ParamManager::ParamManager(MavlinkComm * const comm) :
 
 ParamManager::~ParamManager()
 {
+  comm_->unsubscribe(param_value_sub_);
+  comm_->unsubscribe(command_ack_sub_);
+
   if (first_param_received_)
   {
     delete[] received_;
   }
 }
 
-void ParamManager::handle_mavlink_message(const mavlink_message_t &msg)
-{
-  switch (msg.msgid)
-  {
-  case MAVLINK_MSG_ID_PARAM_VALUE:
-    handle_param_value_msg(msg);
-    break;
-  case MAVLINK_MSG_ID_ROSFLIGHT_CMD_ACK:
-    handle_command_ack_msg(msg);
-    break;
-  }
-}
-
 bool ParamManager::unsaved_changes()
 {
   return unsaved_changes_;
@@ -105,7 +100,7 @@ bool ParamManager::set_param_value(std::string name, double value)
   if (is_param_id(name))
   {
     mavlink_message_t msg;
-    params_[name].requestSet(value, &msg);
+    params_[name].requestSet(value, sysid_, compid_, &msg);
 
     param_set_queue_.push_back(msg);
     if (!param_set_in_progress_)
@@ -127,9 +122,7 @@ bool ParamManager::write_params()
   if (!write_request_in_progress_)
   {
     mavlink_message_t msg;
-    uint8_t sysid = 1;
-    uint8_t compid = 1;
-    mavlink_msg_rosflight_cmd_pack(sysid, compid, &msg, ROSFLIGHT_CMD_WRITE_PARAMS);
+    mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_WRITE_PARAMS);
     comm_->send_message(msg);
 
     write_request_in_progress_ = true;
@@ -259,7 +252,7 @@ void ParamManager::request_params()
 void ParamManager::request_param_list()
 {
   mavlink_message_t param_list_msg;
-  mavlink_msg_param_request_list_pack(1, 50, &param_list_msg, 1, MAV_COMP_ID_ALL);
+  mavlink_msg_param_request_list_pack(sysid_, compid_, &param_list_msg, sysid_, MAV_COMP_ID_ALL);
   comm_->send_message(param_list_msg);
 }
 
@@ -267,15 +260,13 @@ void ParamManager::request_param(int index)
 {
   mavlink_message_t param_request_msg;
   char empty[MAVLINK_MSG_PARAM_VALUE_FIELD_PARAM_ID_LEN];
-  mavlink_msg_param_request_read_pack(1, 50, &param_request_msg, 1, MAV_COMP_ID_ALL, empty, (int16_t) index);
+  mavlink_msg_param_request_read_pack(sysid_, compid_, &param_request_msg, sysid_, MAV_COMP_ID_ALL, empty,
+                                      (int16_t) index);
   comm_->send_message(param_request_msg);
 }
 
-void ParamManager::handle_param_value_msg(const mavlink_message_t &msg)
+void ParamManager::handle_param_value_msg(const mavlink_param_value_t &param)
 {
-  mavlink_param_value_t param;
-  mavlink_msg_param_value_decode(&msg, &param);
-
   if (!first_param_received_)
   {
     first_param_received_ = true;
@@ -323,13 +314,10 @@ void ParamManager::handle_param_value_msg(const mavlink_message_t &msg)
   }
 }
 
-void ParamManager::handle_command_ack_msg(const mavlink_message_t &msg)
+void ParamManager::handle_command_ack_msg(const mavlink_rosflight_cmd_ack_t &ack)
 {
   if (write_request_in_progress_)
   {
-    mavlink_rosflight_cmd_ack_t ack;
-    mavlink_msg_rosflight_cmd_ack_decode(&msg, &ack);
-
     if (ack.command == ROSFLIGHT_CMD_WRITE_PARAMS)
     {
       write_request_in_progress_ = false;
@@ -36,62 +36,68 @@
 
 #include <rosflight/mavrosflight/time_manager.h>
 
+#include <chrono>
+
 namespace mavrosflight
 {
 
-TimeManager::TimeManager(MavlinkComm *comm) :
+TimeManager::TimeManager(MavlinkComm *comm, uint8_t sysid, uint8_t compid) :
   comm_(comm),
+  sysid_(sysid),
+  compid_(compid),
   offset_alpha_(0.95),
   offset_ns_(0),
   offset_(0.0),
   initialized_(false)
 {
-  comm_->register_mavlink_listener(this);
+  timesync_sub_ = comm_->subscribe<mavlink_timesync_t>(boost::bind(&TimeManager::handle_timesync_msg, this, _1));
 
   ros::NodeHandle nh;
   time_sync_timer_ = nh.createTimer(ros::Duration(ros::Rate(10)), &TimeManager::timer_callback, this);
 }
 
-void TimeManager::handle_mavlink_message(const mavlink_message_t &msg)
+TimeManager::~TimeManager()
 {
-  int64_t now_ns = ros::Time::now().toNSec();
+  comm_->unsubscribe(timesync_sub_);
+}
 
-  if (msg.msgid == MAVLINK_MSG_ID_TIMESYNC)
+void TimeManager::handle_timesync_msg(const mavlink_timesync_t &tsync)
+{
+  // time at which the response arrived, rather than the time it got through to here
+  int64_t now_ns = get_ros_time_rx(comm_->rx_time_ns()).toNSec();
+
+  if (tsync.tc1 > 0) // check that this is a response, not a request
   {
-    mavlink_timesync_t tsync;
-    mavlink_msg_timesync_decode(&msg, &tsync);
+    int64_t offset_ns = (tsync.ts1 + now_ns - 2*tsync.tc1) / 2;
 
-    if (tsync.tc1 > 0) // check that this is a response, not a request
+    int64_t old_offset_ns = offset_ns_.load(std::memory_order_relaxed);
+    if (!initialized_ || std::abs(old_offset_ns - offset_ns) > 1e7) // if difference > 10ms, use it directly
     {
-      int64_t offset_ns = (tsync.ts1 + now_ns - 2*tsync.tc1) / 2;
-
-      if (!initialized_ || std::abs(offset_ns_ - offset_ns) > 1e7) // if difference > 10ms, use it directly
-      {
-        offset_ns_ = offset_ns;
-        ROS_INFO("Detected time offset of %0.3f s.", offset_ns/1e9);
-        ROS_DEBUG("FCU time: %0.3f, System time: %0.3f", tsync.tc1*1e-9, tsync.ts1*1e-9);
-        initialized_ = true;
-      }
-      else // otherwise low-pass filter the offset
-      {
-        offset_ns_ = offset_alpha_*offset_ns + (1.0 - offset_alpha_)*offset_ns_;
-      }
+      offset_ns_.store(offset_ns, std::memory_order_relaxed);
+      ROS_INFO("Detected time offset of %0.3f s.", offset_ns/1e9);
+      ROS_DEBUG("FCU time: %0.3f, System time: %0.3f", tsync.tc1*1e-9, tsync.ts1*1e-9);
+      initialized_.store(true, std::memory_order_release);
+    }
+    else // otherwise low-pass filter the offset
+    {
+      offset_ns_.store(offset_alpha_*offset_ns + (1.0 - offset_alpha_)*old_offset_ns, std::memory_order_relaxed);
     }
   }
 }
 
 ros::Time TimeManager::get_ros_time_ms(uint32_t boot_ms)
 {
-  if (!initialized_)
+  if (!initialized_.load(std::memory_order_acquire))
     return ros::Time::now();
 
   int64_t boot_ns = (int64_t)boot_ms*1000000;
 
-  int64_t ns = boot_ns + offset_ns_;
+  int64_t offset_ns = offset_ns_.load(std::memory_order_relaxed);
+  int64_t ns = boot_ns + offset_ns;
   if (ns < 0)
   {
     ROS_ERROR_THROTTLE(1, "negative time calculated from FCU: boot_ns=%ld, offset_ns=%ld.  Using system time",
-              boot_ns, offset_ns_);
+              boot_ns, offset_ns);
     return ros::Time::now();
   }
   ros::Time now;
@@ -101,16 +107,17 @@ ros::Time TimeManager::get_ros_time_ms(uint32_t boot_ms)
 
 ros::Time TimeManager::get_ros_time_us(uint64_t boot_us)
 {
-  if (!initialized_)
+  if (!initialized_.load(std::memory_order_acquire))
     return ros::Time::now();
 
   int64_t boot_ns = (int64_t) boot_us * 1000;
 
-  int64_t ns = boot_ns + offset_ns_;
+  int64_t offset_ns = offset_ns_.load(std::memory_order_relaxed);
+  int64_t ns = boot_ns + offset_ns;
   if (ns < 0)
   {
     ROS_ERROR_THROTTLE(1, "negative time calculated from FCU: boot_ns=%ld, offset_ns=%ld.  Using system time",
-              boot_ns, offset_ns_);
+              boot_ns, offset_ns);
     return ros::Time::now();
   }
   ros::Time now;
@@ -118,10 +125,27 @@ ros::Time TimeManager::get_ros_time_us(uint64_t boot_us)
   return now;
 }
 
+ros::Time TimeManager::get_ros_time_rx(uint64_t rx_ns)
+{
+  // an age on the steady clock means nothing on a simulated clock, which may be paused or run at any rate
+  ros::Time now = ros::Time::now();
+  if (ros::Time::isSimTime())
+    return now;
+
+  uint64_t steady_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  if (rx_ns == 0 || rx_ns > steady_ns)
+    return now;
+
+  ros::Duration age;
+  age.fromNSec(steady_ns - rx_ns);
+  return age < now - ros::Time() ? now - age : now;
+}
+
 void TimeManager::timer_callback(const ros::TimerEvent &event)
 {
   mavlink_message_t msg;
-  mavlink_msg_timesync_pack(1, 50, &msg, 0, ros::Time::now().toNSec());
+  mavlink_msg_timesync_pack(sysid_, compid_, &msg, 0, ros::Time::now().toNSec());
   comm_->send_message(msg);
 }
 
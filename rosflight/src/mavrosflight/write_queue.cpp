@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2017 Daniel Koch and James Jackson, BYU MAGICC Lab.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * \file write_queue.cpp
+ */
+
+#include <rosflight/mavrosflight/write_queue.h>
+
+#include <chrono>
+
+namespace mavrosflight
+{
+
+// Bounded queue after D. Vyukov: each slot carries a sequence number that tells producers and the consumer whether
+// the slot is free, being filled, or holds a complete frame, so the only contended operation is one CAS on enqueue.
+
+WriteQueue::WriteQueue(size_t capacity) :
+  slots_(NULL),
+  mask_(0),
+  enqueue_pos_(0),
+  dequeue_pos_(0),
+  high_water_(0),
+  dropped_(0)
+{
+  size_t size = 2;
+  while (size < capacity)
+    size <<= 1;
+
+  slots_ = new Slot[size];
+  mask_ = size - 1;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+WriteQueue::~WriteQueue()
+{
+  delete[] slots_;
+}
+
+bool WriteQueue::push(const uint8_t *data, size_t len, uint32_t msgid)
+{
+  if (len > MAVLINK2_MAX_PACKET_LEN)
+  {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  Slot *slot;
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    slot = &slots_[pos & mask_];
+    size_t seq = slot->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0)
+    {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      // the consumer hasn't released this slot yet, so the queue is full
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    else
+    {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+
+  memcpy(slot->buffer.data, data, len);
+  slot->buffer.len = len;
+  slot->buffer.pos = 0;
+  slot->buffer.msgid = msgid;
+  slot->buffer.enqueue_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  slot->sequence.store(pos + 1, std::memory_order_release);
+
+  // the consumer may already have moved past this frame, in which case the depth isn't meaningful
+  size_t dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+  size_t depth = pos + 1 > dequeue ? pos + 1 - dequeue : 0;
+  size_t high_water = high_water_.load(std::memory_order_relaxed);
+  while (depth > high_water && !high_water_.compare_exchange_weak(high_water, depth, std::memory_order_relaxed))
+  {
+  }
+
+  return true;
+}
+
+WriteBuffer* WriteQueue::peek(size_t index)
+{
+  if (index > mask_)
+    return NULL;
+
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed) + index;
+  Slot *slot = &slots_[pos & mask_];
+  if (slot->sequence.load(std::memory_order_acquire) != pos + 1)
+    return NULL;
+
+  return &slot->buffer;
+}
+
+void WriteQueue::pop()
+{
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  slots_[pos & mask_].sequence.store(pos + mask_ + 1, std::memory_order_release);
+  dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+}
+
+bool WriteQueue::empty() const
+{
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  return slots_[pos & mask_].sequence.load(std::memory_order_acquire) != pos + 1;
+}
+
+size_t WriteQueue::size() const
+{
+  size_t enqueue = enqueue_pos_.load(std::memory_order_relaxed);
+  size_t dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+  return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+} // namespace mavrosflight
@@ -34,9 +34,16 @@
  * \author Daniel Koch <daniel.koch@byu.edu>
  */
 
+#include <rosflight/mavlink/baud_rate.h>
+#include <rosflight/mavrosflight/mavlink_loopback.h>
+#include <rosflight/mavrosflight/mavlink_replay.h>
 #include <rosflight/mavrosflight/mavlink_serial.h>
+#include <rosflight/mavrosflight/mavlink_tcp.h>
 #include <rosflight/mavrosflight/mavlink_udp.h>
+#include <rosflight/mavrosflight/mavlink_unix.h>
 #include <rosflight/mavrosflight/serial_exception.h>
+#include <algorithm>
+#include <sstream>
 #include <string>
 #include <stdint.h>
 #include <eigen3/Eigen/Core>
@@ -47,7 +54,12 @@
 
 namespace rosflight_io
 {
-rosflightIO::rosflightIO()
+rosflightIO::rosflightIO(ros::NodeHandle nh, ros::NodeHandle nh_private, mavrosflight::IoServicePool *io_pool) :
+  nh_(nh),
+  handoff_(NULL),
+  router_(NULL),
+  recorder_(NULL),
+  dispatch_running_(false)
 {
   command_sub_ = nh_.subscribe("command", 1, &rosflightIO::commandCallback, this);
   aux_command_sub_ = nh_.subscribe("aux_command", 1, &rosflightIO::auxCommandCallback, this);
@@ -69,18 +81,71 @@ rosflightIO::rosflightIO()
   reboot_srv_ = nh_.advertiseService("reboot", &rosflightIO::rebootSrvCallback, this);
   reboot_bootloader_srv_ = nh_.advertiseService("reboot_to_bootloader", &rosflightIO::rebootToBootloaderSrvCallback, this);
 
-  ros::NodeHandle nh_private("~");
+  // each vehicle of a swarm has a system ID of its own, which its commands and parameter requests must carry
+  sysid_ = (uint8_t) nh_private.param<int>("sysid", 1);
+  compid_ = (uint8_t) nh_private.param<int>("compid", 50);
 
-  if (nh_private.param<bool>("udp", false))
+  std::string replay_file = nh_private.param<std::string>("replay_file", "");
+  std::string loopback = nh_private.param<std::string>("loopback", "");
+  std::string unix_socket = nh_private.param<std::string>("unix_socket", "");
+  bool wait_for_port = false;
+  if (!replay_file.empty())
+  {
+    double replay_speed = nh_private.param<double>("replay_speed", 1.0);
+
+    ROS_INFO("Replaying capture \"%s\" at %s", replay_file.c_str(),
+             replay_speed > 0 ? (std::to_string(replay_speed) + "x").c_str() : "full speed");
+
+    mavlink_comm_ = new mavrosflight::MavlinkReplay(replay_file, replay_speed);
+  }
+  else if (!loopback.empty())
+  {
+    ROS_INFO("Connecting through loopback \"%s\"", loopback.c_str());
+
+    mavlink_comm_ = new mavrosflight::MavlinkLoopback(loopback, io_pool);
+  }
+  else if (!unix_socket.empty())
+  {
+    ROS_INFO("Connecting to unix socket \"%s\"", unix_socket.c_str());
+
+    mavlink_comm_ = new mavrosflight::MavlinkUnix(unix_socket, io_pool);
+  }
+  else if (nh_private.param<bool>("tcp", false))
+  {
+    std::string host = nh_private.param<std::string>("tcp_host", "localhost");
+    uint16_t port = (uint16_t) nh_private.param<int>("tcp_port", 5760);
+    bool server = nh_private.param<bool>("tcp_server", false);
+
+    mavrosflight::MavlinkTCP::Options options;
+    options.send_buffer_size = nh_private.param<int>("tcp_send_buffer_size", options.send_buffer_size);
+    options.receive_buffer_size = nh_private.param<int>("tcp_receive_buffer_size", options.receive_buffer_size);
+    options.connect_timeout_ms = nh_private.param<int>("tcp_connect_timeout_ms", options.connect_timeout_ms);
+    options.dead_peer_timeout_ms = nh_private.param<int>("tcp_dead_peer_timeout_ms", options.dead_peer_timeout_ms);
+
+    // the firmware may connect long after launch; until it does, the link waits for it like a link that failed
+    wait_for_port = server;
+    if (server)
+      ROS_INFO("Waiting for a TCP connection on \"%s:%d\"", host.c_str(), port);
+    else
+      ROS_INFO("Connecting over TCP to \"%s:%d\"", host.c_str(), port);
+
+    mavlink_comm_ = new mavrosflight::MavlinkTCP(host, port, server, options, io_pool);
+  }
+  else if (nh_private.param<bool>("udp", false))
   {
     std::string bind_host = nh_private.param<std::string>("bind_host", "localhost");
     uint16_t bind_port = (uint16_t) nh_private.param<int>("bind_port", 14520);
     std::string remote_host = nh_private.param<std::string>("remote_host", bind_host);
     uint16_t remote_port = (uint16_t) nh_private.param<int>("remote_port", 14525);
 
+    mavrosflight::MavlinkUDP::Options options;
+    options.send_buffer_size = nh_private.param<int>("udp_send_buffer_size", options.send_buffer_size);
+    options.receive_buffer_size = nh_private.param<int>("udp_receive_buffer_size", options.receive_buffer_size);
+    options.receive_batch = nh_private.param<int>("udp_receive_batch", options.receive_batch);
+
     ROS_INFO("Connecting over UDP to \"%s:%d\", from \"%s:%d\"", remote_host.c_str(), remote_port, bind_host.c_str(), bind_port);
 
-    mavlink_comm_ = new mavrosflight::MavlinkUDP(bind_host, bind_port, remote_host, remote_port);
+    mavlink_comm_ = new mavrosflight::MavlinkUDP(bind_host, bind_port, remote_host, remote_port, options, io_pool);
   }
   else
   {
@@ -89,21 +154,171 @@ rosflightIO::rosflightIO()
 
     ROS_INFO("Connecting to serial port \"%s\", at %d baud", port.c_str(), baud_rate);
 
-    mavlink_comm_ = new mavrosflight::MavlinkSerial(port, baud_rate);
+    mavrosflight::MavlinkSerial *serial = new mavrosflight::MavlinkSerial(port, baud_rate, io_pool);
+
+    // keep bursts from piling up in the adapter's buffer, where they would delay everything behind them; off unless set
+    double tx_utilization = nh_private.param<double>("tx_pacing_utilization", 0.0);
+    if (tx_utilization > 0)
+    {
+      serial->set_tx_pacing(tx_utilization, nh_private.param<int>("tx_pacing_burst", 128));
+    }
+
+    if (nh_private.param<bool>("serial_low_latency", false))
+    {
+      mavrosflight::MavlinkSerial::LowLatencyOptions options;
+      options.hardware_flow_control = nh_private.param<bool>("serial_hardware_flow_control", false);
+      options.wake_bytes = (uint8_t) std::min(std::max(nh_private.param<int>("serial_wake_bytes", 1), 1), 255);
+      options.wake_timeout_us = nh_private.param<int>("serial_wake_timeout_us", MAVLINK_SERIAL_WAKE_TIMEOUT_US);
+      serial->set_low_latency(options);
+    }
+
+    // switch to a faster rate if the firmware and adapter can take it; max_baud_rate:=0 stays at baud_rate
+    serial->set_baud_upgrade(nh_private.param<int>("max_baud_rate", 3000000));
+    mavlink_comm_ = serial;
   }
 
+  int read_buffer_size;
+  if (nh_private.getParam("read_buffer_size", read_buffer_size))
+  {
+    mavlink_comm_->set_read_buffer_size(read_buffer_size);
+  }
+  mavlink_comm_->set_system_id(sysid_, compid_);
+  mavlink_comm_->set_mavlink2(nh_private.param<bool>("mavlink2", true));
+  mavlink_comm_->set_reconnect(nh_private.param<bool>("reconnect", true),
+                               nh_private.param<int>("reconnect_max_backoff_ms", MAVLINK_RECONNECT_MAX_BACKOFF_MS));
+  mavlink_comm_->set_write_coalescing(nh_private.param<int>("write_mtu", MAVLINK_DEFAULT_WRITE_MTU),
+                                      nh_private.param<int>("write_coalesce_delay_us", 0));
+
+  // optional emulation of a degraded link, to try the system against radio-like delay, loss and corruption at the desk
+  mavrosflight::LinkImpairment::Options impairment;
+  impairment.delay_us = nh_private.param<int>("impairment_delay_us", 0);
+  impairment.jitter_us = nh_private.param<int>("impairment_jitter_us", 0);
+  std::string jitter_distribution = nh_private.param<std::string>("impairment_jitter_distribution", "uniform");
+  if (jitter_distribution == "exponential")
+    impairment.jitter_distribution = mavrosflight::LinkImpairment::JITTER_EXPONENTIAL;
+  else if (jitter_distribution == "pareto")
+    impairment.jitter_distribution = mavrosflight::LinkImpairment::JITTER_PARETO;
+  else if (jitter_distribution != "uniform")
+    ROS_WARN("Unknown impairment_jitter_distribution \"%s\", using uniform", jitter_distribution.c_str());
+  impairment.loss_probability = nh_private.param<double>("impairment_loss", 0.0);
+  impairment.loss_burst_length = nh_private.param<double>("impairment_loss_burst_length", 1.0);
+  impairment.bit_error_rate = nh_private.param<double>("impairment_bit_error_rate", 0.0);
+  impairment.bandwidth_bps = nh_private.param<double>("impairment_bandwidth_bps", 0.0);
+  impairment.queue_bytes = nh_private.param<int>("impairment_queue_bytes", impairment.queue_bytes);
+  impairment.seed = nh_private.param<int>("impairment_seed", 1);
+  if (impairment.enabled())
+  {
+    ROS_WARN("Emulating an impaired link: %u us delay, %u us jitter, %g loss, %g bit error rate, %g bit/s",
+             impairment.delay_us, impairment.jitter_us, impairment.loss_probability, impairment.bit_error_rate,
+             impairment.bandwidth_bps);
+  }
+
+  // the two directions draw their impairments independently
+  mavrosflight::LinkImpairment::Options tx_impairment = impairment;
+  tx_impairment.seed = impairment.seed + 1;
+  mavlink_comm_->set_link_impairment(impairment, tx_impairment);
+
+  // optional real-time scheduling for the io thread, so that a loaded system doesn't delay reads and writes; a shared
+  // pool's threads are set up by its owner instead
+  if (io_pool == NULL)
+  {
+    mavlink_comm_->set_io_thread_options(io_thread_options(nh_private));
+  }
+
+  std::string capture_file = nh_private.param<std::string>("capture_file", "");
+  if (!capture_file.empty())
+  {
+    try
+    {
+      recorder_ = new mavrosflight::MavlinkRecorder(capture_file,
+                                                    nh_private.param<int>("capture_buffer_mb", 4) * 1024 * 1024);
+      mavlink_comm_->set_recorder(recorder_);
+      ROS_INFO("Recording all frames to \"%s\"", capture_file.c_str());
+    }
+    catch (mavrosflight::SerialException e)
+    {
+      // one vehicle's capture isn't worth shutting down the others on a shared pool for
+      if (io_pool == NULL)
+      {
+        ROS_FATAL("%s", e.what());
+        ros::shutdown();
+      }
+      else
+      {
+        ROS_ERROR("%s; not recording", e.what());
+      }
+    }
+  }
+
+  // likewise, a vehicle on a shared pool whose port can't be opened yet keeps trying in the background, as after a
+  // failure, rather than taking the whole swarm down
   try
   {
-    mavlink_comm_->open(); //! \todo move this into the MavROSflight constructor
-    mavrosflight_ = new mavrosflight::MavROSflight(*mavlink_comm_);
+    mavlink_comm_->open(wait_for_port || io_pool != NULL); //! \todo move this into the MavROSflight constructor
   }
   catch (mavrosflight::SerialException e)
   {
     ROS_FATAL("%s", e.what());
     ros::shutdown();
   }
+  mavrosflight_ = new mavrosflight::MavROSflight(*mavlink_comm_, sysid_, compid_);
+
+  // handle messages on a dispatch thread, so that publishing never holds up reading from the port; on a shared pool the
+  // handlers run on the pool's threads by default, rather than adding a thread per vehicle
+  int dispatch_threads = nh_private.param<int>("dispatch_threads", io_pool == NULL ? 1 : 0);
+  if (dispatch_threads > 1)
+  {
+    ROS_WARN("Only one dispatch thread is supported, since the message handlers share state");
+  }
+  if (dispatch_threads > 0)
+  {
+    handoff_ = new mavrosflight::HandoffQueue(nh_private.param<int>("dispatch_queue_size", 256));
+
+    // only the latest value of these streams matters
+    handoff_->set_policy(MAVLINK_MSG_ID_ATTITUDE_QUATERNION, mavrosflight::HandoffQueue::KEEP_LATEST);
+    handoff_->set_policy(MAVLINK_MSG_ID_ROSFLIGHT_OUTPUT_RAW, mavrosflight::HandoffQueue::KEEP_LATEST);
+    handoff_->set_policy(MAVLINK_MSG_ID_RC_CHANNELS, mavrosflight::HandoffQueue::KEEP_LATEST);
+    handoff_->set_policy(MAVLINK_MSG_ID_TOTAL_TORQUE, mavrosflight::HandoffQueue::KEEP_LATEST);
+    handoff_->set_policy(MAVLINK_MSG_ID_PID_TORQUE, mavrosflight::HandoffQueue::KEEP_LATEST);
+
+    // state changes and errors must never be lost
+    handoff_->set_policy(MAVLINK_MSG_ID_ROSFLIGHT_STATUS, mavrosflight::HandoffQueue::NEVER_DROP);
+    handoff_->set_policy(MAVLINK_MSG_ID_ROSFLIGHT_CMD_ACK, mavrosflight::HandoffQueue::NEVER_DROP);
+    handoff_->set_policy(MAVLINK_MSG_ID_STATUSTEXT, mavrosflight::HandoffQueue::NEVER_DROP);
+    handoff_->set_policy(MAVLINK_MSG_ID_ROSFLIGHT_HARD_ERROR, mavrosflight::HandoffQueue::NEVER_DROP);
+    handoff_->set_policy(MAVLINK_MSG_ID_ROSFLIGHT_VERSION, mavrosflight::HandoffQueue::NEVER_DROP);
+
+    prev_handoff_stats_ = handoff_->get_stats();
+  }
+
+  subscribe(&rosflightIO::handle_heartbeat_msg);
+  subscribe(&rosflightIO::handle_status_msg);
+  subscribe(&rosflightIO::handle_command_ack_msg);
+  subscribe(&rosflightIO::handle_statustext_msg);
+  subscribe(&rosflightIO::handle_attitude_quaternion_msg);
+  subscribe(&rosflightIO::handle_small_imu_msg);
+  subscribe(&rosflightIO::handle_small_mag_msg);
+  subscribe(&rosflightIO::handle_rosflight_output_raw_msg); // todo make this handle_total_torque_msg
+  subscribe(&rosflightIO::handle_rc_channels_msg);
+  subscribe(&rosflightIO::handle_diff_pressure_msg);
+  subscribe(&rosflightIO::handle_named_value_int_msg);
+  subscribe(&rosflightIO::handle_named_value_float_msg);
+  subscribe(&rosflightIO::handle_named_command_struct_msg);
+  subscribe(&rosflightIO::handle_small_baro_msg);
+  subscribe(&rosflightIO::handle_small_range_msg);
+  subscribe(&rosflightIO::handle_rosflight_gnss_msg);
+  subscribe(&rosflightIO::handle_rosflight_gnss_raw_msg);
+  subscribe(&rosflightIO::handle_version_msg);
+  subscribe(&rosflightIO::handle_hard_error_msg);
+  subscribe(&rosflightIO::handle_total_torque_msg);
+  subscribe(&rosflightIO::handle_pid_torque_msg);
+
+  if (handoff_ != NULL)
+  {
+    dispatch_running_ = true;
+    dispatch_thread_ = boost::thread(&rosflightIO::dispatch_loop, this);
+  }
 
-  mavrosflight_->comm.register_mavlink_listener(this);
   mavrosflight_->param.register_param_listener(this);
 
   // request the param list
@@ -131,88 +346,46 @@ rosflightIO::rosflightIO()
 
   //Start the heartbeat
   heartbeat_timer_ = nh_.createTimer(ros::Duration(HEARTBEAT_PERIOD), &rosflightIO::heartbeatTimerCallback, this);
+
+  // publish link health counters
+  double link_stats_period = nh_private.param<double>("link_stats_period", 1.0);
+  if (link_stats_period > 0)
+  {
+    link_stats_pub_ = nh_.advertise<rosflight_msgs::LinkStats>("link_stats", 1);
+    mavrosflight_->comm.get_link_stats(&prev_link_stats_);
+    prev_link_stats_time_ = ros::Time::now();
+    link_stats_timer_ = nh_.createTimer(ros::Duration(link_stats_period), &rosflightIO::linkStatsTimerCallback, this);
+  }
+
+  init_router(nh_private);
 }
 
 rosflightIO::~rosflightIO()
 {
-  delete mavrosflight_;
-  delete mavlink_comm_;
-}
+  delete router_;
 
-void rosflightIO::handle_mavlink_message(const mavlink_message_t &msg)
-{
-  switch (msg.msgid)
+  // stop reading first, so that nothing is handed off while the queue is torn down
+  mavlink_comm_->close();
+
+  for (size_t i = 0; i < mavlink_subscriptions_.size(); i++)
   {
-    case MAVLINK_MSG_ID_HEARTBEAT:
-      handle_heartbeat_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_ROSFLIGHT_STATUS:
-      handle_status_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_ROSFLIGHT_CMD_ACK:
-      handle_command_ack_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_STATUSTEXT:
-      handle_statustext_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_ATTITUDE_QUATERNION:
-      handle_attitude_quaternion_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_SMALL_IMU:
-      handle_small_imu_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_SMALL_MAG:
-      handle_small_mag_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_ROSFLIGHT_OUTPUT_RAW:
-      handle_rosflight_output_raw_msg(msg); // todo make this handle_total_torque_msg
-      break;
-    case MAVLINK_MSG_ID_RC_CHANNELS:
-      handle_rc_channels_raw_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_DIFF_PRESSURE:
-      handle_diff_pressure_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_NAMED_VALUE_INT:
-      handle_named_value_int_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_NAMED_VALUE_FLOAT:
-      handle_named_value_float_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_NAMED_COMMAND_STRUCT:
-      handle_named_command_struct_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_SMALL_BARO:
-      handle_small_baro_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_SMALL_RANGE:
-      handle_small_range_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_ROSFLIGHT_GNSS:
-      handle_rosflight_gnss_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_ROSFLIGHT_GNSS_RAW:
-      handle_rosflight_gnss_raw_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_ROSFLIGHT_VERSION:
-      handle_version_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_PARAM_VALUE:
-    case MAVLINK_MSG_ID_TIMESYNC:
-      // silently ignore (handled elsewhere)
-      break;
-    case MAVLINK_MSG_ID_ROSFLIGHT_HARD_ERROR:
-      handle_hard_error_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_TOTAL_TORQUE:
-      handle_total_torque_msg(msg);
-      break;
-    case MAVLINK_MSG_ID_PID_TORQUE:
-      handle_pid_torque_msg(msg);
-    default:
-      ROS_DEBUG("rosflight_io: Got unhandled mavlink message ID %d", msg.msgid);
-      break;
+    mavrosflight_->comm.unsubscribe(mavlink_subscriptions_[i]);
+  }
+
+  if (handoff_ != NULL)
+  {
+    dispatch_running_ = false;
+    handoff_->wake();
+    if (dispatch_thread_.joinable())
+    {
+      dispatch_thread_.join();
+    }
+    delete handoff_;
   }
+
+  delete mavrosflight_;
+  delete mavlink_comm_;
+  delete recorder_;
 }
 
 void rosflightIO::on_new_param_received(std::string name, double value)
@@ -241,16 +414,13 @@ void rosflightIO::on_params_saved_change(bool unsaved_changes)
   }
 }
 
-void rosflightIO::handle_heartbeat_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_heartbeat_msg(const mavlink_heartbeat_t &heartbeat)
 {
   ROS_INFO_ONCE("Got HEARTBEAT, connected.");
 }
 
-void rosflightIO::handle_status_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_status_msg(const mavlink_rosflight_status_t &status_msg)
 {
-  mavlink_rosflight_status_t status_msg;
-  mavlink_msg_rosflight_status_decode(&msg, &status_msg);
-
   // armed state check
   if (prev_status_.armed != status_msg.armed)
   {
@@ -326,7 +496,7 @@ void rosflightIO::handle_status_msg(const mavlink_message_t &msg)
 
   // Build the status message and send it
   rosflight_msgs::Status out_status;
-  out_status.header.stamp = ros::Time::now();
+  out_status.header.stamp = rx_stamp();
   out_status.armed = status_msg.armed;
   out_status.failsafe = status_msg.failsafe;
   out_status.rc_override = status_msg.rc_override;
@@ -342,11 +512,8 @@ void rosflightIO::handle_status_msg(const mavlink_message_t &msg)
   status_pub_.publish(out_status);
 }
 
-void rosflightIO::handle_command_ack_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_command_ack_msg(const mavlink_rosflight_cmd_ack_t &ack)
 {
-  mavlink_rosflight_cmd_ack_t ack;
-  mavlink_msg_rosflight_cmd_ack_decode(&msg, &ack);
-
   if (ack.success == ROSFLIGHT_CMD_SUCCESS)
   {
     ROS_DEBUG("MAVLink command %d Acknowledged", ack.command);
@@ -357,11 +524,8 @@ void rosflightIO::handle_command_ack_msg(const mavlink_message_t &msg)
   }
 }
 
-void rosflightIO::handle_statustext_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_statustext_msg(const mavlink_statustext_t &status)
 {
-  mavlink_statustext_t status;
-  mavlink_msg_statustext_decode(&msg, &status);
-
   // ensure null termination
   char c_str[MAVLINK_MSG_STATUSTEXT_FIELD_TEXT_LEN + 1];
   memcpy(c_str, status.text, MAVLINK_MSG_STATUSTEXT_FIELD_TEXT_LEN);
@@ -388,11 +552,8 @@ void rosflightIO::handle_statustext_msg(const mavlink_message_t &msg)
   }
 }
 
-void rosflightIO::handle_attitude_quaternion_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_attitude_quaternion_msg(const mavlink_attitude_quaternion_t &attitude)
 {
-  mavlink_attitude_quaternion_t attitude;
-  mavlink_msg_attitude_quaternion_decode(&msg, &attitude);
-
   rosflight_msgs::Attitude attitude_msg;
   attitude_msg.header.stamp = mavrosflight_->time.get_ros_time_ms(attitude.time_boot_ms);
   attitude_msg.attitude.w = attitude.q1;
@@ -424,11 +585,8 @@ void rosflightIO::handle_attitude_quaternion_msg(const mavlink_message_t &msg)
   euler_pub_.publish(euler_msg);
 }
 
-void rosflightIO::handle_small_imu_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_small_imu_msg(const mavlink_small_imu_t &imu)
 {
-  mavlink_small_imu_t imu;
-  mavlink_msg_small_imu_decode(&msg, &imu);
-
   sensor_msgs::Imu imu_msg;
   imu_msg.header.stamp = mavrosflight_->time.get_ros_time_us(imu.time_boot_us);
   imu_msg.header.frame_id = frame_id_;
@@ -458,11 +616,8 @@ void rosflightIO::handle_small_imu_msg(const mavlink_message_t &msg)
   imu_temp_pub_.publish(temp_msg);
 }
 
-void rosflightIO::handle_rosflight_output_raw_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_rosflight_output_raw_msg(const mavlink_rosflight_output_raw_t &servo)
 {
-  mavlink_rosflight_output_raw_t servo;
-  mavlink_msg_rosflight_output_raw_decode(&msg, &servo);
-
   rosflight_msgs::OutputRaw out_msg;
   out_msg.header.stamp = mavrosflight_->time.get_ros_time_us(servo.stamp);
   for (int i = 0; i < 14; i++)
@@ -477,11 +632,8 @@ void rosflightIO::handle_rosflight_output_raw_msg(const mavlink_message_t &msg)
   output_raw_pub_.publish(out_msg);
 }
 
-void rosflightIO::handle_rc_channels_raw_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_rc_channels_msg(const mavlink_rc_channels_t &rc)
 {
-  mavlink_rc_channels_raw_t rc;
-  mavlink_msg_rc_channels_raw_decode(&msg, &rc);
-
   rosflight_msgs::RCRaw out_msg;
   out_msg.header.stamp = mavrosflight_->time.get_ros_time_ms(rc.time_boot_ms);
 
@@ -501,13 +653,10 @@ void rosflightIO::handle_rc_channels_raw_msg(const mavlink_message_t &msg)
   rc_raw_pub_.publish(out_msg);
 }
 
-void rosflightIO::handle_diff_pressure_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_diff_pressure_msg(const mavlink_diff_pressure_t &diff)
 {
-  mavlink_diff_pressure_t diff;
-  mavlink_msg_diff_pressure_decode(&msg, &diff);
-
   rosflight_msgs::Airspeed airspeed_msg;
-  airspeed_msg.header.stamp = ros::Time::now();
+  airspeed_msg.header.stamp = rx_stamp();
   airspeed_msg.velocity = diff.velocity;
   airspeed_msg.differential_pressure = diff.diff_pressure;
   airspeed_msg.temperature = diff.temperature;
@@ -524,21 +673,21 @@ void rosflightIO::handle_diff_pressure_msg(const mavlink_message_t &msg)
   diff_pressure_pub_.publish(airspeed_msg);
 }
 
-void rosflightIO::handle_named_value_int_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_named_value_int_msg(const mavlink_named_value_int_t &val)
 {
-  mavlink_named_value_int_t val;
-  mavlink_msg_named_value_int_decode(&msg, &val);
-
   // ensure null termination of name
   char c_name[MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN + 1];
   memcpy(c_name, val.name, MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN);
   c_name[MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN] = '\0';
   std::string name(c_name);
 
+  // the firmware's answer to a baud rate proposal is handled by MavlinkSerial, not published
+  if (name == MAVLINK_BAUD_RATE_NAME)
+    return;
+
   if (named_value_int_pubs_.find(name) == named_value_int_pubs_.end())
   {
-    ros::NodeHandle nh;
-    named_value_int_pubs_[name] = nh.advertise<std_msgs::Int32>("named_value/int/" + name, 1);
+    named_value_int_pubs_[name] = nh_.advertise<std_msgs::Int32>("named_value/int/" + name, 1);
   }
 
   std_msgs::Int32 out_msg;
@@ -547,11 +696,8 @@ void rosflightIO::handle_named_value_int_msg(const mavlink_message_t &msg)
   named_value_int_pubs_[name].publish(out_msg);
 }
 
-void rosflightIO::handle_named_value_float_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_named_value_float_msg(const mavlink_named_value_float_t &val)
 {
-  mavlink_named_value_float_t val;
-  mavlink_msg_named_value_float_decode(&msg, &val);
-
   // ensure null termination of name
   char c_name[MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN + 1];
   memcpy(c_name, val.name, MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN);
@@ -560,8 +706,7 @@ void rosflightIO::handle_named_value_float_msg(const mavlink_message_t &msg)
 
   if (named_value_float_pubs_.find(name) == named_value_float_pubs_.end())
   {
-    ros::NodeHandle nh;
-    named_value_float_pubs_[name] = nh.advertise<std_msgs::Float32>("named_value/float/" + name, 1);
+    named_value_float_pubs_[name] = nh_.advertise<std_msgs::Float32>("named_value/float/" + name, 1);
   }
 
   std_msgs::Float32 out_msg;
@@ -570,11 +715,8 @@ void rosflightIO::handle_named_value_float_msg(const mavlink_message_t &msg)
   named_value_float_pubs_[name].publish(out_msg);
 }
 
-void rosflightIO::handle_named_command_struct_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_named_command_struct_msg(const mavlink_named_command_struct_t &command)
 {
-  mavlink_named_command_struct_t command;
-  mavlink_msg_named_command_struct_decode(&msg, &command);
-
   // ensure null termination of name
   char c_name[MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN + 1];
   memcpy(c_name, command.name, MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN);
@@ -583,8 +725,7 @@ void rosflightIO::handle_named_command_struct_msg(const mavlink_message_t &msg)
 
   if (named_command_struct_pubs_.find(name) == named_command_struct_pubs_.end())
   {
-    ros::NodeHandle nh;
-    named_command_struct_pubs_[name] = nh.advertise<rosflight_msgs::Command>("named_value/command_struct/" + name, 1);
+    named_command_struct_pubs_[name] = nh_.advertise<rosflight_msgs::Command>("named_value/command_struct/" + name, 1);
   }
 
   rosflight_msgs::Command command_msg;
@@ -605,13 +746,10 @@ void rosflightIO::handle_named_command_struct_msg(const mavlink_message_t &msg)
   named_command_struct_pubs_[name].publish(command_msg);
 }
 
-void rosflightIO::handle_small_baro_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_small_baro_msg(const mavlink_small_baro_t &baro)
 {
-  mavlink_small_baro_t baro;
-  mavlink_msg_small_baro_decode(&msg, &baro);
-
   rosflight_msgs::Barometer baro_msg;
-  baro_msg.header.stamp = ros::Time::now();
+  baro_msg.header.stamp = rx_stamp();
   baro_msg.altitude = baro.altitude;
   baro_msg.pressure = baro.pressure;
   baro_msg.temperature = baro.temperature;
@@ -629,14 +767,11 @@ void rosflightIO::handle_small_baro_msg(const mavlink_message_t &msg)
   baro_pub_.publish(baro_msg);
 }
 
-void rosflightIO::handle_small_mag_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_small_mag_msg(const mavlink_small_mag_t &mag)
 {
-  mavlink_small_mag_t mag;
-  mavlink_msg_small_mag_decode(&msg, &mag);
-
   //! \todo calibration, correct units, floating point message type
   sensor_msgs::MagneticField mag_msg;
-  mag_msg.header.stamp = ros::Time::now();//mavrosflight_->time.get_ros_time_us(mag.time_boot_us);
+  mag_msg.header.stamp = rx_stamp();
   mag_msg.header.frame_id = frame_id_;
 
   mag_msg.magnetic_field.x = mag.xmag;
@@ -650,13 +785,10 @@ void rosflightIO::handle_small_mag_msg(const mavlink_message_t &msg)
   mag_pub_.publish(mag_msg);
 }
 
-void rosflightIO::handle_small_range_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_small_range_msg(const mavlink_small_range_t &range)
 {
-  mavlink_small_range_t range;
-  mavlink_msg_small_range_decode(&msg, &range);
-
   sensor_msgs::Range alt_msg;
-  alt_msg.header.stamp = ros::Time::now();
+  alt_msg.header.stamp = rx_stamp();
   alt_msg.max_range = range.max_range;
   alt_msg.min_range = range.min_range;
   alt_msg.range = range.range;
@@ -688,13 +820,10 @@ void rosflightIO::handle_small_range_msg(const mavlink_message_t &msg)
 
 }
 
-void rosflightIO::handle_version_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_version_msg(const mavlink_rosflight_version_t &version)
 {
   version_timer_.stop();
 
-  mavlink_rosflight_version_t version;
-  mavlink_msg_rosflight_version_decode(&msg, &version);
-
   std_msgs::String version_msg;
   version_msg.data = version.version;
 
@@ -707,30 +836,24 @@ void rosflightIO::handle_version_msg(const mavlink_message_t &msg)
   ROS_INFO("Firmware version: %s", version.version);
 }
 
-void rosflightIO::handle_total_torque_msg(const mavlink_message_t &msg) {
-  mavlink_total_torque_t outTotalTorqueMsg;
-  mavlink_msg_total_torque_decode(&msg, &outTotalTorqueMsg);
-
+void rosflightIO::handle_total_torque_msg(const mavlink_total_torque_t &outTotalTorqueMsg) {
   geometry_msgs::Vector3Stamped outputVector;
   outputVector.vector.x = outTotalTorqueMsg.x;
   outputVector.vector.y = outTotalTorqueMsg.y;
   outputVector.vector.z = outTotalTorqueMsg.z;
-  outputVector.header.stamp = ros::Time::now();
+  outputVector.header.stamp = rx_stamp();
 
   if (torque_pub_.getTopic().empty())
     torque_pub_ = nh_.advertise<geometry_msgs::Vector3Stamped>("total_torque", 1);
   torque_pub_.publish(outputVector);
 }
 
-void rosflightIO::handle_pid_torque_msg(const mavlink_message_t &msg) {
-  mavlink_pid_torque_t outPIDTorqueMsg;
-  mavlink_msg_pid_torque_decode(&msg, &outPIDTorqueMsg);
-
+void rosflightIO::handle_pid_torque_msg(const mavlink_pid_torque_t &outPIDTorqueMsg) {
   geometry_msgs::Vector3Stamped outputVector;
   outputVector.vector.x = outPIDTorqueMsg.x;
   outputVector.vector.y = outPIDTorqueMsg.y;
   outputVector.vector.z = outPIDTorqueMsg.z;
-  outputVector.header.stamp = ros::Time::now();
+  outputVector.header.stamp = rx_stamp();
 
   if (pid_torque_pub_.getTopic().empty())
     pid_torque_pub_ = nh_.advertise<geometry_msgs::Vector3Stamped>("pid_torque", 1);
@@ -738,10 +861,8 @@ void rosflightIO::handle_pid_torque_msg(const mavlink_message_t &msg) {
 }
 
 
-void rosflightIO::handle_hard_error_msg(const mavlink_message_t &msg)
+void rosflightIO::handle_hard_error_msg(const mavlink_rosflight_hard_error_t &error)
 {
-  mavlink_rosflight_hard_error_t error;
-  mavlink_msg_rosflight_hard_error_decode(&msg,&error);
   ROS_ERROR("Hard fault detected, with error code %u. The flight controller has rebooted.",error.error_code);
   ROS_ERROR("Hard fault was at: 0x%x",error.pc);
   if(error.doRearm)
@@ -758,10 +879,7 @@ void rosflightIO::handle_hard_error_msg(const mavlink_message_t &msg)
   error_pub_.publish(error_msg);
 }
 
-void rosflightIO::handle_rosflight_gnss_msg(const mavlink_message_t &msg) {
-  mavlink_rosflight_gnss_t gnss;
-  mavlink_msg_rosflight_gnss_decode(&msg, &gnss);
-
+void rosflightIO::handle_rosflight_gnss_msg(const mavlink_rosflight_gnss_t &gnss) {
   ros::Time stamp = mavrosflight_->time.get_ros_time_us(gnss.rosflight_timestamp);
 
   rosflight_msgs::GNSS gnss_msg;
@@ -831,10 +949,7 @@ void rosflightIO::handle_rosflight_gnss_msg(const mavlink_message_t &msg) {
 }
 
 
-void rosflightIO::handle_rosflight_gnss_raw_msg(const mavlink_message_t &msg) {
-  mavlink_rosflight_gnss_raw_t raw;
-  mavlink_msg_rosflight_gnss_raw_decode(&msg, &raw);
-
+void rosflightIO::handle_rosflight_gnss_raw_msg(const mavlink_rosflight_gnss_raw_t &raw) {
   rosflight_msgs::GNSSRaw msg_out;
   msg_out.header.stamp = ros::Time::now();
   msg_out.time_of_week = raw.time_of_week;
@@ -897,7 +1012,7 @@ void rosflightIO::commandCallback(rosflight_msgs::Command::ConstPtr msg)
   }
 
   mavlink_message_t mavlink_msg;
-  mavlink_msg_offboard_control_pack(1, 50, &mavlink_msg, mode, ignore, x, y, z, F);
+  mavlink_msg_offboard_control_pack(sysid_, compid_, &mavlink_msg, mode, ignore, x, y, z, F);
   mavrosflight_->comm.send_message(mavlink_msg);
 }
 
@@ -908,7 +1023,7 @@ void rosflightIO::addedTorqueCallback(rosflight_msgs::AddedTorque::ConstPtr msg)
   float z = msg->z;
 
   mavlink_message_t mavlink_msg;
-  mavlink_msg_added_torque_pack(1, 50, &mavlink_msg, x, y, z);
+  mavlink_msg_added_torque_pack(sysid_, compid_, &mavlink_msg, x, y, z);
   mavrosflight_->comm.send_message(mavlink_msg);
 }
 
@@ -922,14 +1037,14 @@ void rosflightIO::auxCommandCallback(rosflight_msgs::AuxCommand::ConstPtr msg)
     values[i] = msg->values[i];
   }
   mavlink_message_t mavlink_msg;
-  mavlink_msg_rosflight_aux_cmd_pack(1, 50, &mavlink_msg, types, values);
+  mavlink_msg_rosflight_aux_cmd_pack(sysid_, compid_, &mavlink_msg, types, values);
   mavrosflight_->comm.send_message(mavlink_msg);
 }
 
 void rosflightIO::externalAttitudeCallback(geometry_msgs::Quaternion::ConstPtr msg)
 {
   mavlink_message_t mavlink_msg;
-  mavlink_msg_external_attitude_pack(1, 50, &mavlink_msg, msg->w, msg->x, msg->y, msg->z);
+  mavlink_msg_external_attitude_pack(sysid_, compid_, &mavlink_msg, msg->w, msg->x, msg->y, msg->z);
   mavrosflight_->comm.send_message(mavlink_msg);
 }
 
@@ -971,7 +1086,7 @@ bool rosflightIO::paramLoadFromFileCallback(rosflight_msgs::ParamFile::Request &
 bool rosflightIO::calibrateImuBiasSrvCallback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res)
 {
   mavlink_message_t msg;
-  mavlink_msg_rosflight_cmd_pack(1, 50, &msg, ROSFLIGHT_CMD_ACCEL_CALIBRATION);
+  mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_ACCEL_CALIBRATION);
   mavrosflight_->comm.send_message(msg);
 
   res.success = true;
@@ -981,7 +1096,7 @@ bool rosflightIO::calibrateImuBiasSrvCallback(std_srvs::Trigger::Request &req, s
 bool rosflightIO::calibrateRCTrimSrvCallback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res)
 {
   mavlink_message_t msg;
-  mavlink_msg_rosflight_cmd_pack(1, 50, &msg, ROSFLIGHT_CMD_RC_CALIBRATION);
+  mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_RC_CALIBRATION);
   mavrosflight_->comm.send_message(msg);
   res.success = true;
   return true;
@@ -1010,18 +1125,277 @@ void rosflightIO::versionTimerCallback(const ros::TimerEvent &e)
 void rosflightIO::heartbeatTimerCallback(const ros::TimerEvent &e)
 {
   send_heartbeat();
+
+  if (handoff_ != NULL)
+  {
+    mavrosflight::HandoffQueue::Stats stats = handoff_->get_stats();
+    if (stats.dropped > prev_handoff_stats_.dropped)
+    {
+      ROS_WARN("Dispatch queue full, dropped %lu messages (%lu total, peak depth %zu)",
+               (unsigned long) (stats.dropped - prev_handoff_stats_.dropped), (unsigned long) stats.dropped,
+               stats.high_water_mark);
+    }
+    if (stats.lost > prev_handoff_stats_.lost)
+    {
+      ROS_ERROR("Dispatch thread stalled, lost %lu status messages (%lu total)",
+                (unsigned long) (stats.lost - prev_handoff_stats_.lost), (unsigned long) stats.lost);
+    }
+    ROS_DEBUG("Dispatch queue depth %zu, %lu replaced", stats.depth, (unsigned long) stats.replaced);
+    prev_handoff_stats_ = stats;
+  }
+}
+
+void rosflightIO::linkStatsTimerCallback(const ros::TimerEvent &e)
+{
+  mavrosflight::MavlinkComm::LinkStats stats;
+  mavrosflight_->comm.get_link_stats(&stats);
+
+  ros::Time now = ros::Time::now();
+  double dt = (now - prev_link_stats_time_).toSec();
+  if (dt <= 0)
+    return;
+
+  rosflight_msgs::LinkStats msg;
+  msg.header.stamp = now;
+
+  msg.rx_bytes = stats.rx_bytes;
+  msg.rx_frames = stats.rx_frames;
+  msg.rx_bytes_per_sec = (stats.rx_bytes - prev_link_stats_.rx_bytes) / dt;
+  msg.rx_frames_per_sec = (stats.rx_frames - prev_link_stats_.rx_frames) / dt;
+  msg.crc_errors = stats.rx_crc_errors;
+  msg.bytes_dropped = stats.rx_bytes_dropped;
+  for (int i = 0; i < 256; i++)
+  {
+    if (stats.rx_sysid_seen[i])
+    {
+      msg.sysids.push_back(i);
+      msg.seq_gaps.push_back(stats.rx_seq_gaps[i]);
+    }
+  }
+
+  msg.tx_bytes = stats.tx_bytes;
+  msg.tx_frames = stats.tx_frames;
+  msg.tx_bytes_per_sec = (stats.tx_bytes - prev_link_stats_.tx_bytes) / dt;
+  msg.tx_frames_per_sec = (stats.tx_frames - prev_link_stats_.tx_frames) / dt;
+  msg.tx_dropped = stats.tx_dropped;
+  msg.tx_replaced = stats.tx_replaced;
+  msg.write_queue_depth = stats.write_queue_depth;
+  msg.tx_pacing_waits = stats.tx_pacing_waits;
+  msg.tx_pacing_wait_us = stats.tx_pacing_wait_us;
+  msg.tx_pacing_wait_max_us = stats.tx_pacing_wait_max_us;
+  msg.mavlink_version = stats.mavlink_version;
+  msg.rx_frames_v2 = stats.rx_frames_v2;
+  msg.tx_frames_v2 = stats.tx_frames_v2;
+  msg.rx_bytes_saved = stats.rx_bytes_saved;
+  msg.tx_bytes_saved = stats.tx_bytes_saved;
+  uint64_t rx_frames = stats.rx_frames - prev_link_stats_.rx_frames;
+  if (rx_frames > 0)
+  {
+    double rx_frame_bytes = (stats.rx_bytes - stats.rx_bytes_dropped)
+        - (prev_link_stats_.rx_bytes - prev_link_stats_.rx_bytes_dropped);
+    msg.rx_bytes_per_frame = rx_frame_bytes / rx_frames;
+    msg.rx_v1_bytes_per_frame = (rx_frame_bytes + stats.rx_bytes_saved - prev_link_stats_.rx_bytes_saved) / rx_frames;
+  }
+  uint64_t tx_frames = stats.tx_frames - prev_link_stats_.tx_frames;
+  if (tx_frames > 0)
+  {
+    double tx_frame_bytes = stats.tx_bytes - prev_link_stats_.tx_bytes;
+    msg.tx_bytes_per_frame = tx_frame_bytes / tx_frames;
+    msg.tx_v1_bytes_per_frame = (tx_frame_bytes + stats.tx_bytes_saved - prev_link_stats_.tx_bytes_saved) / tx_frames;
+  }
+  for (int i = 0; i < MAVLINK_WRITE_LATENCY_BUCKETS; i++)
+  {
+    msg.write_latency_limit_us.push_back(mavrosflight::MavlinkComm::write_latency_bucket_limit_us(i));
+    msg.write_latency_count.push_back(stats.write_latency_histogram[i]);
+  }
+  msg.rx_reads = stats.rx_reads;
+  uint64_t rx_reads = stats.rx_reads - prev_link_stats_.rx_reads;
+  if (rx_reads > 0)
+  {
+    msg.rx_bytes_per_read = (double) (stats.rx_bytes - prev_link_stats_.rx_bytes) / rx_reads;
+  }
+  for (int i = 0; i < MAVLINK_DISPATCH_LATENCY_BUCKETS; i++)
+  {
+    msg.dispatch_latency_limit_us.push_back(mavrosflight::MavlinkComm::dispatch_latency_bucket_limit_us(i));
+    msg.dispatch_latency_count.push_back(stats.dispatch_latency_histogram[i]);
+  }
+
+  msg.link_up = stats.link_up;
+  msg.link_losses = stats.link_losses;
+  msg.reconnect_attempts = stats.reconnect_attempts;
+  msg.last_outage_ms = stats.last_outage_us / 1e3;
+  msg.last_recovery_ms = stats.last_recovery_us / 1e3;
+  msg.max_outage_ms = stats.max_outage_us / 1e3;
+
+  mavrosflight::LinkImpairment::Stats rx_impairment, tx_impairment;
+  mavrosflight_->comm.get_link_impairment_stats(&rx_impairment, &tx_impairment);
+  msg.rx_impaired_lost = rx_impairment.lost;
+  msg.rx_impaired_corrupted = rx_impairment.corrupted;
+  msg.rx_impaired_dropped = rx_impairment.dropped;
+  msg.tx_impaired_lost = tx_impairment.lost;
+  msg.tx_impaired_corrupted = tx_impairment.corrupted;
+  msg.tx_impaired_dropped = tx_impairment.dropped;
+
+  if (handoff_ != NULL)
+  {
+    mavrosflight::HandoffQueue::Stats handoff_stats = handoff_->get_stats();
+    msg.dispatch_queue_depth = handoff_stats.depth;
+    msg.dispatch_dropped = handoff_stats.dropped + handoff_stats.lost;
+    msg.dispatch_replaced = handoff_stats.replaced;
+  }
+
+  link_stats_pub_.publish(msg);
+
+  prev_link_stats_ = stats;
+  prev_link_stats_time_ = now;
+}
+
+namespace
+{
+
+double xmlrpc_number(XmlRpc::XmlRpcValue &value, const char *key, double default_value)
+{
+  if (!value.hasMember(key))
+    return default_value;
+  if (value[key].getType() == XmlRpc::XmlRpcValue::TypeInt)
+    return (int) value[key];
+  if (value[key].getType() == XmlRpc::XmlRpcValue::TypeDouble)
+    return (double) value[key];
+
+  ROS_WARN("router_endpoints: %s should be a number", key);
+  return default_value;
+}
+
+std::string xmlrpc_string(XmlRpc::XmlRpcValue &value, const char *key, const std::string &default_value)
+{
+  if (!value.hasMember(key))
+    return default_value;
+  if (value[key].getType() == XmlRpc::XmlRpcValue::TypeString)
+    return (std::string) value[key];
+
+  ROS_WARN("router_endpoints: %s should be a string", key);
+  return default_value;
+}
+
+std::vector<uint32_t> xmlrpc_id_list(XmlRpc::XmlRpcValue &value, const char *key)
+{
+  std::vector<uint32_t> ids;
+  if (!value.hasMember(key))
+    return ids;
+
+  XmlRpc::XmlRpcValue &list = value[key];
+  if (list.getType() != XmlRpc::XmlRpcValue::TypeArray)
+  {
+    ROS_WARN("router_endpoints: %s should be a list of message IDs", key);
+    return ids;
+  }
+
+  for (int i = 0; i < list.size(); i++)
+  {
+    if (list[i].getType() == XmlRpc::XmlRpcValue::TypeInt)
+      ids.push_back((int) list[i]);
+    else
+      ROS_WARN("router_endpoints: %s should be a list of message IDs", key);
+  }
+  return ids;
+}
+
+} // namespace
+
+mavrosflight::MavlinkComm::IoThreadOptions rosflightIO::io_thread_options(ros::NodeHandle &nh_private)
+{
+  mavrosflight::MavlinkComm::IoThreadOptions options;
+  options.sched_priority = nh_private.param<int>("io_thread_priority", 0);
+  nh_private.getParam("io_thread_cpus", options.cpus);
+  options.lock_memory = nh_private.param<bool>("lock_memory", false);
+  return options;
+}
+
+void rosflightIO::init_router(ros::NodeHandle &nh_private)
+{
+  XmlRpc::XmlRpcValue endpoints;
+  if (!nh_private.getParam("router_endpoints", endpoints))
+    return;
+
+  if (endpoints.getType() != XmlRpc::XmlRpcValue::TypeArray)
+  {
+    ROS_ERROR("router_endpoints should be a list of endpoints");
+    return;
+  }
+
+  router_ = new mavrosflight::MavlinkRouter(mavrosflight_->comm);
+  for (int i = 0; i < endpoints.size(); i++)
+  {
+    if (endpoints[i].getType() != XmlRpc::XmlRpcValue::TypeStruct)
+    {
+      ROS_ERROR("router_endpoints[%d] should be a dictionary", i);
+      continue;
+    }
+
+    mavrosflight::MavlinkRouter::EndpointConfig config;
+    std::stringstream name;
+    name << "router_endpoints[" << i << "]";
+    config.name = xmlrpc_string(endpoints[i], "name", name.str());
+    config.bind_host = xmlrpc_string(endpoints[i], "bind_host", config.bind_host);
+    config.bind_port = (uint16_t) xmlrpc_number(endpoints[i], "bind_port", config.bind_port);
+    config.remote_host = xmlrpc_string(endpoints[i], "remote_host", config.remote_host);
+    config.remote_port = (uint16_t) xmlrpc_number(endpoints[i], "remote_port", config.remote_port);
+    config.forward_ids = xmlrpc_id_list(endpoints[i], "forward_ids");
+    config.accept_ids = xmlrpc_id_list(endpoints[i], "accept_ids");
+    config.forward_rate = xmlrpc_number(endpoints[i], "forward_rate", config.forward_rate);
+    config.forward_burst = (size_t) xmlrpc_number(endpoints[i], "forward_burst", config.forward_burst);
+    config.accept_rate = xmlrpc_number(endpoints[i], "accept_rate", config.accept_rate);
+    config.accept_burst = (size_t) xmlrpc_number(endpoints[i], "accept_burst", config.accept_burst);
+
+    try
+    {
+      router_->add_endpoint(config);
+      ROS_INFO("Routing MAVLink to %s at \"%s:%d\"", config.name.c_str(), config.remote_host.c_str(),
+               config.remote_port);
+    }
+    catch (mavrosflight::SerialException e)
+    {
+      ROS_ERROR("Failed to open %s: %s", config.name.c_str(), e.what());
+    }
+  }
+
+  router_->start();
+}
+
+void rosflightIO::hand_off(const mavlink_message_t &msg)
+{
+  handoff_->push(msg, mavrosflight_->comm.rx_time_ns());
+}
+
+void rosflightIO::dispatch_loop()
+{
+  mavlink_message_t msg;
+  uint64_t rx_ns;
+  while (dispatch_running_)
+  {
+    if (handoff_->pop(&msg, 100, &rx_ns))
+    {
+      dispatcher_.dispatch(msg, rx_ns);
+    }
+  }
+}
+
+ros::Time rosflightIO::rx_stamp() const
+{
+  uint64_t rx_ns = handoff_ != NULL ? dispatcher_.rx_time_ns() : mavrosflight_->comm.rx_time_ns();
+  return mavrosflight_->time.get_ros_time_rx(rx_ns);
 }
 
 void rosflightIO::request_version()
 {
   mavlink_message_t msg;
-  mavlink_msg_rosflight_cmd_pack(1, 50, &msg, ROSFLIGHT_CMD_SEND_VERSION);
+  mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_SEND_VERSION);
   mavrosflight_->comm.send_message(msg);
 }
 void rosflightIO::send_heartbeat()
 {
   mavlink_message_t msg;
-  mavlink_msg_heartbeat_pack(1, 50, &msg, 0,0,0,0,0);
+  mavlink_msg_heartbeat_pack(sysid_, compid_, &msg, 0,0,0,0,0);
   mavrosflight_->comm.send_message(msg);
 }
 
@@ -1039,7 +1413,7 @@ void rosflightIO::check_error_code(uint8_t current, uint8_t previous, ROSFLIGHT_
 bool rosflightIO::calibrateAirspeedSrvCallback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res)
 {
   mavlink_message_t msg;
-  mavlink_msg_rosflight_cmd_pack(1, 50, &msg, ROSFLIGHT_CMD_AIRSPEED_CALIBRATION);
+  mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_AIRSPEED_CALIBRATION);
   mavrosflight_->comm.send_message(msg);
   res.success = true;
   return true;
@@ -1048,7 +1422,7 @@ bool rosflightIO::calibrateAirspeedSrvCallback(std_srvs::Trigger::Request &req,
 bool rosflightIO::calibrateBaroSrvCallback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res)
 {
   mavlink_message_t msg;
-  mavlink_msg_rosflight_cmd_pack(1, 50, &msg, ROSFLIGHT_CMD_BARO_CALIBRATION);
+  mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_BARO_CALIBRATION);
   mavrosflight_->comm.send_message(msg);
   res.success = true;
   return true;
@@ -1057,7 +1431,7 @@ bool rosflightIO::calibrateBaroSrvCallback(std_srvs::Trigger::Request &req, std_
 bool rosflightIO::rebootSrvCallback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res)
 {
   mavlink_message_t msg;
-  mavlink_msg_rosflight_cmd_pack(1, 50, &msg, ROSFLIGHT_CMD_REBOOT);
+  mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_REBOOT);
   mavrosflight_->comm.send_message(msg);
   res.success = true;
   return true;
@@ -1066,7 +1440,7 @@ bool rosflightIO::rebootSrvCallback(std_srvs::Trigger::Request &req, std_srvs::T
 bool rosflightIO::rebootToBootloaderSrvCallback(std_srvs::Trigger::Request &req, std_srvs::Trigger::Response &res)
 {
   mavlink_message_t msg;
-  mavlink_msg_rosflight_cmd_pack(1, 50, &msg, ROSFLIGHT_CMD_REBOOT_TO_BOOTLOADER);
+  mavlink_msg_rosflight_cmd_pack(sysid_, compid_, &msg, ROSFLIGHT_CMD_REBOOT_TO_BOOTLOADER);
   mavrosflight_->comm.send_message(msg);
   res.success = true;
   return true;
@@ -38,10 +38,46 @@
 
 #include <ros/ros.h>
 #include <rosflight/rosflight_io.h>
+#include <rosflight/mavrosflight/io_service_pool.h>
+
+#include <string>
+#include <vector>
 
 int main(int argc, char **argv)
 {
   ros::init(argc, argv, "rosflight_io");
-  rosflight_io::rosflightIO rosflight_io;
+  ros::NodeHandle nh_private("~");
+
+  std::vector<std::string> vehicles;
+  if (!nh_private.getParam("vehicles", vehicles) || vehicles.empty())
+  {
+    rosflight_io::rosflightIO rosflight_io;
+    ros::spin();
+    return 0;
+  }
+
+  // several flight controllers, e.g. a simulated swarm: each vehicle has its topics in its own namespace and its
+  // parameters in that namespace under ~, its links share a few io threads, and ROS callbacks all run on this thread
+  int io_threads = nh_private.param<int>("io_threads", (vehicles.size() + 7) / 8);
+  ROS_INFO("Serving %d vehicles on %d io threads", (int) vehicles.size(), io_threads);
+
+  mavrosflight::IoServicePool io_pool(io_threads);
+  io_pool.start(rosflight_io::rosflightIO::io_thread_options(nh_private));
+
+  std::vector<rosflight_io::rosflightIO*> instances;
+  for (size_t i = 0; i < vehicles.size() && ros::ok(); i++)
+  {
+    ROS_INFO("Starting vehicle \"%s\"", vehicles[i].c_str());
+    instances.push_back(new rosflight_io::rosflightIO(ros::NodeHandle(vehicles[i]),
+                                                      ros::NodeHandle(nh_private, vehicles[i]), &io_pool));
+  }
+
   ros::spin();
+
+  // the links have to be closed while the pool still runs
+  for (size_t i = 0; i < instances.size(); i++)
+  {
+    delete instances[i];
+  }
+  io_pool.stop();
 }
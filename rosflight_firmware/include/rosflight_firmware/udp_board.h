@@ -41,11 +41,23 @@
 #include <string>
 
 #include <boost/asio.hpp>
+#include <boost/asio/generic/seq_packet_protocol.hpp>
+#include <boost/noncopyable.hpp>
 #include <boost/thread.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <rosflight/mavrosflight/shm_ring.h>
+#include <rosflight/mavrosflight/unix_socket.h>
 
 #include "board.h"
 #include "mavlink/mavlink.h"
 
+#define UDP_BOARD_READ_BUF_SIZE 65536
+#define UDP_BOARD_BATCH 16 //!< most datagrams received or sent per system call
+
 namespace rosflight_firmware
 {
 
@@ -65,6 +77,32 @@ public:
   void serial_flush() override;
 
   void set_ports(std::string bind_host, uint16_t bind_port, std::string remote_host, uint16_t remote_port);
+
+  /**
+   * \brief Set SO_SNDBUF and SO_RCVBUF of the socket (call before serial_init())
+   * \param send_buffer_size Send buffer size in bytes, or 0 for the system default
+   * \param receive_buffer_size Receive buffer size in bytes, or 0 for the system default
+   */
+  void set_socket_buffer_sizes(int send_buffer_size, int receive_buffer_size);
+
+  /**
+   * \brief Talk to a co-located mavrosflight::MavlinkLoopback through shared memory rings instead of the UDP socket
+   * \param name Name of the loopback link, e.g. "/rosflight"; an empty name goes back to UDP
+   *
+   * Must be called before serial_init(). No io thread is started in this mode; the serial functions copy straight to
+   * and from the rings.
+   */
+  void set_loopback(const std::string &name);
+
+  /**
+   * \brief Talk to a co-located mavrosflight::MavlinkUnix through a SOCK_SEQPACKET unix domain socket instead of UDP
+   * \param path Path of the socket to listen on, or a name starting with '@' in the abstract namespace; an empty path
+   * goes back to UDP
+   *
+   * Must be called before serial_init(). The board listens and takes one connection at a time; frames written while
+   * nobody is connected are dropped, as a UART would with nothing attached.
+   */
+  void set_unix_socket(const std::string &path);
 private:
 
   struct Buffer
@@ -83,26 +121,194 @@ private:
 
     const uint8_t * dpos() const { return data + pos; }
     size_t nbytes() const { return len - pos; }
+    void assign(const uint8_t *src, size_t length)
+    {
+      assert(length <= MAVLINK_MAX_PACKET_LEN);
+      memcpy(data, src, length);
+      len = length;
+      pos = 0;
+    }
+
     void add_byte(uint8_t byte) { data[len++] = byte; }
     uint8_t consume_byte() { return data[pos++]; }
     bool empty() const { return pos >= len; }
     bool full() const { return len >= MAVLINK_MAX_PACKET_LEN; }
   };
 
+  /**
+   * \brief Storage for the state asio keeps while a read or write is in flight, reused from one operation to the next
+   */
+  class HandlerMemory : private boost::noncopyable
+  {
+  public:
+    HandlerMemory() : in_use_(false) {}
+
+    void* allocate(size_t size)
+    {
+      if (!in_use_ && size <= sizeof(storage_))
+      {
+        in_use_ = true;
+        return &storage_;
+      }
+      return ::operator new(size);
+    }
+
+    void deallocate(void *pointer)
+    {
+      if (pointer == &storage_)
+        in_use_ = false;
+      else
+        ::operator delete(pointer);
+    }
+
+  private:
+    boost::aligned_storage<512>::type storage_;
+    bool in_use_;
+  };
+
+  /**
+   * \brief Allocator handing out a HandlerMemory block, used as the associated allocator of an IoHandler
+   */
+  template <typename T>
+  class HandlerAllocator
+  {
+  public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory &memory) : memory_(&memory) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) : memory_(&other.memory()) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(memory_->allocate(sizeof(T) * n)); }
+    void deallocate(T *pointer, size_t n) { memory_->deallocate(pointer); }
+
+    HandlerMemory& memory() const { return *memory_; }
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U> &other) const { return memory_ == &other.memory(); }
+
+    template <typename U>
+    bool operator!=(const HandlerAllocator<U> &other) const { return memory_ != &other.memory(); }
+
+  private:
+    HandlerMemory *memory_;
+  };
+
+  /**
+   * \brief Completion handler calling back into the board, with its operation memory taken from a HandlerMemory
+   *
+   * Also serves as a wait handler and as a posted handler, which report no byte count.
+   */
+  class IoHandler
+  {
+  public:
+    typedef void (UDPBoard::*Function)(const boost::system::error_code&, size_t);
+    typedef HandlerAllocator<void> allocator_type;
+
+    IoHandler(UDPBoard *board, Function function, HandlerMemory &memory) :
+      board_(board), function_(function), memory_(&memory) {}
+
+    void operator()(const boost::system::error_code &error, size_t bytes_transferred)
+    {
+      (board_->*function_)(error, bytes_transferred);
+    }
+
+    void operator()(const boost::system::error_code &error)
+    {
+      (board_->*function_)(error, 0);
+    }
+
+    void operator()()
+    {
+      (board_->*function_)(boost::system::error_code(), 0);
+    }
+
+    allocator_type get_allocator() const { return allocator_type(*memory_); }
+
+  private:
+    UDPBoard *board_;
+    Function function_;
+    HandlerMemory *memory_;
+  };
+
   typedef boost::lock_guard<boost::recursive_mutex> MutexLock;
 
   void async_read();
   void async_read_end(const boost::system::error_code& error, size_t bytes_transferred);
 
-  void async_write(bool check_write_state);
+  /**
+   * \brief Wait for rosflight_io to connect to the unix domain socket
+   *
+   * The connection is accepted once the listening socket is readable, under write_mutex_, since taking it replaces
+   * unix_socket_, which the firmware thread sends on.
+   */
+  void async_accept();
+  void async_accept_end(const boost::system::error_code& error, size_t bytes_transferred);
+
+  /**
+   * \brief Drop the unix domain socket connection and wait for the next one
+   */
+  void disconnect();
+
+  /**
+   * \brief Get the socket that frames are exchanged on: the UDP socket, or the unix domain socket connection
+   */
+  int data_socket_fd();
+  bool data_socket_open();
+
+  /**
+   * \brief Wait for the data socket to become readable or writable
+   */
+  void wait_data_socket(boost::asio::socket_base::wait_type type, const IoHandler &handler);
+
+  /**
+   * \brief Take every waiting datagram with recvmmsg, splitting each into read buffers
+   * \return False if the host has gone from the unix domain socket
+   */
+  bool receive_batch();
+
+  /**
+   * \brief Send the queued frames with sendmmsg, one datagram each, until the queue is empty or the socket is full
+   *
+   * Called with write_mutex_ held, from the firmware thread on serial_flush() or from the io thread otherwise.
+   */
+  void send_queued();
+
+  /**
+   * \brief Handler for a send scheduled by serial_write()
+   */
+  void write_scheduled_end(const boost::system::error_code& error, size_t bytes_transferred);
+
+  /**
+   * \brief Handler for the end of a wait for room in the socket's send buffer
+   */
   void async_write_end(const boost::system::error_code& error, size_t bytes_transferred);
 
+  /**
+   * \brief Append a copy of the data to a queue, reusing a spent buffer if there is one
+   */
+  void enqueue_buffer(std::list<Buffer*> &queue, std::list<Buffer*> &free_buffers, const uint8_t *src, size_t len);
+
+  /**
+   * \brief Move the buffer at the front of a queue to the free list
+   */
+  void release_buffer(std::list<Buffer*> &queue, std::list<Buffer*> &free_buffers);
+
+  static void delete_buffers(std::list<Buffer*> &buffers);
+
   std::string bind_host_;
   uint16_t bind_port_;
 
   std::string remote_host_;
   uint16_t remote_port_;
 
+  std::string loopback_name_;
+  mavrosflight::ShmRing loopback_rx_; //!< bytes from the host, in loopback mode
+  mavrosflight::ShmRing loopback_tx_; //!< bytes to the host, in loopback mode
+
+  std::string unix_path_;
+
   boost::thread io_thread_;
   boost::recursive_mutex write_mutex_;
   boost::recursive_mutex read_mutex_;
@@ -113,11 +319,30 @@ private:
   boost::asio::ip::udp::endpoint bind_endpoint_;
   boost::asio::ip::udp::endpoint remote_endpoint_;
 
-  uint8_t read_buffer_[MAVLINK_MAX_PACKET_LEN];
+  boost::asio::basic_socket_acceptor<boost::asio::generic::seq_packet_protocol> unix_acceptor_;
+  boost::asio::generic::seq_packet_protocol::socket unix_socket_; //!< connection from rosflight_io, in unix mode; changed under write_mutex_
+
+  int send_buffer_size_;
+  int receive_buffer_size_;
+
+  uint8_t read_buffer_[UDP_BOARD_READ_BUF_SIZE]; //!< split into one slot per datagram of a batch
+  struct mmsghdr read_msgs_[UDP_BOARD_BATCH];
+  struct iovec read_iov_[UDP_BOARD_BATCH];
   std::list<Buffer*> read_queue_;
 
+  struct mmsghdr write_msgs_[UDP_BOARD_BATCH];
+  struct iovec write_iov_[UDP_BOARD_BATCH];
+
   std::list<Buffer*> write_queue_;
-  bool write_in_progress_;
+  std::list<Buffer*> free_read_buffers_; //!< spent read buffers, kept with their list nodes for reuse
+  std::list<Buffer*> free_write_buffers_; //!< spent write buffers, kept with their list nodes for reuse
+
+  HandlerMemory read_handler_memory_;
+  HandlerMemory accept_handler_memory_;
+  HandlerMemory write_handler_memory_;
+  HandlerMemory write_scheduled_memory_;
+  bool write_scheduled_; //!< a send of the queued frames has been posted to the io thread (write_mutex_)
+  bool write_waiting_; //!< the socket's send buffer is full and a wait for room is pending (write_mutex_)
 };
 
 } // namespace rosflight_firmware
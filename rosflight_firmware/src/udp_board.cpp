@@ -35,8 +35,12 @@
  */
 
 #include <rosflight_firmware/udp_board.h>
+#include <algorithm>
 #include <iostream>
 
+#include <errno.h>
+#include <string.h>
+
 using boost::asio::ip::udp;
 
 namespace rosflight_firmware
@@ -49,7 +53,12 @@ UDPBoard::UDPBoard(std::string bind_host, uint16_t bind_port, std::string remote
   remote_port_(remote_port),
   io_service_(),
   socket_(io_service_),
-  write_in_progress_(false)
+  unix_acceptor_(io_service_),
+  unix_socket_(io_service_),
+  send_buffer_size_(1000*MAVLINK_MAX_PACKET_LEN),
+  receive_buffer_size_(1000*MAVLINK_MAX_PACKET_LEN),
+  write_scheduled_(false),
+  write_waiting_(false)
 {
 }
 
@@ -61,8 +70,22 @@ UDPBoard::~UDPBoard()
   io_service_.stop();
   socket_.close();
 
+  boost::system::error_code error;
+  unix_socket_.close(error);
+  if (unix_acceptor_.is_open())
+  {
+    unix_acceptor_.close(error);
+    if (unix_path_[0] != '@')
+      unlink(unix_path_.c_str());
+  }
+
   if (io_thread_.joinable())
     io_thread_.join();
+
+  delete_buffers(read_queue_);
+  delete_buffers(write_queue_);
+  delete_buffers(free_read_buffers_);
+  delete_buffers(free_write_buffers_);
 }
 
 void UDPBoard::set_ports(std::string bind_host, uint16_t bind_port, std::string remote_host, uint16_t remote_port)
@@ -73,11 +96,54 @@ void UDPBoard::set_ports(std::string bind_host, uint16_t bind_port, std::string
   remote_port_ = remote_port;
 }
 
+void UDPBoard::set_socket_buffer_sizes(int send_buffer_size, int receive_buffer_size)
+{
+  send_buffer_size_ = send_buffer_size;
+  receive_buffer_size_ = receive_buffer_size;
+}
+
+void UDPBoard::set_loopback(const std::string &name)
+{
+  loopback_name_ = name;
+}
+
+void UDPBoard::set_unix_socket(const std::string &path)
+{
+  unix_path_ = path;
+}
+
 void UDPBoard::serial_init(uint32_t baud_rate, uint32_t dev)
 {
   // can throw an uncaught boost::system::system_error exception
   (void) dev;
 
+  if (!loopback_name_.empty())
+  {
+    loopback_rx_.open(loopback_name_ + SHM_RING_HOST_TO_FC_SUFFIX);
+    loopback_tx_.open(loopback_name_ + SHM_RING_FC_TO_HOST_SUFFIX);
+    return;
+  }
+
+  if (!unix_path_.empty())
+  {
+    boost::asio::generic::seq_packet_protocol::endpoint endpoint;
+    if (!mavrosflight::unix_socket_endpoint(unix_path_, &endpoint))
+      throw boost::system::system_error(boost::asio::error::invalid_argument, "Invalid unix socket path " + unix_path_);
+
+    // a socket file left behind by an earlier run would make bind() fail
+    if (unix_path_[0] != '@')
+      unlink(unix_path_.c_str());
+
+    unix_acceptor_.open(endpoint.protocol());
+    unix_acceptor_.bind(endpoint);
+    unix_acceptor_.listen(1);
+    unix_acceptor_.non_blocking(true);
+
+    async_accept();
+    io_thread_ = boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+    return;
+  }
+
   udp::resolver resolver(io_service_);
 
   bind_endpoint_ = *resolver.resolve({udp::v4(), bind_host_, ""});
@@ -90,36 +156,67 @@ void UDPBoard::serial_init(uint32_t baud_rate, uint32_t dev)
   socket_.bind(bind_endpoint_);
 
   socket_.set_option(udp::socket::reuse_address(true));
-  socket_.set_option(udp::socket::send_buffer_size(1000*MAVLINK_MAX_PACKET_LEN));
-  socket_.set_option(udp::socket::receive_buffer_size(1000*MAVLINK_MAX_PACKET_LEN));
+  if (send_buffer_size_ > 0)
+    socket_.set_option(udp::socket::send_buffer_size(send_buffer_size_));
+  if (receive_buffer_size_ > 0)
+    socket_.set_option(udp::socket::receive_buffer_size(receive_buffer_size_));
 
-  async_read();
+  // datagrams are received and sent with recvmmsg and sendmmsg directly, which must never block
+  socket_.non_blocking(true);
+
+  // take anything that arrived before the io thread starts waiting, then wait for more
+  async_read_end(boost::system::error_code(), 0);
   io_thread_ = boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_));
 }
 
 void UDPBoard::serial_flush()
-{}
+{
+  if (loopback_tx_.is_open())
+    return;
+
+  // the frames of a streaming pass go out together, without waiting for the io thread
+  MutexLock lock(write_mutex_);
+  send_queued();
+}
 
 void UDPBoard::serial_write(const uint8_t *src, size_t len)
 {
-  Buffer *buffer = new Buffer(src, len);
-
+  if (loopback_tx_.is_open())
   {
-    MutexLock lock(write_mutex_);
-    write_queue_.push_back(buffer);
+    // like a UART whose transmit buffer is full, drop the message if the host isn't keeping up
+    loopback_tx_.write_all(src, len);
+    return;
   }
 
-  async_write(true);
+  MutexLock lock(write_mutex_);
+  enqueue_buffer(write_queue_, free_write_buffers_, src, len);
+
+  // the io thread sends everything queued by the time it gets to it, so back-to-back frames share a system call
+  if (!write_scheduled_ && !write_waiting_)
+  {
+    write_scheduled_ = true;
+    io_service_.post(IoHandler(this, &UDPBoard::write_scheduled_end, write_scheduled_memory_));
+  }
 }
 
 uint16_t UDPBoard::serial_bytes_available()
 {
+  if (loopback_rx_.is_open())
+    return std::min(loopback_rx_.readable(), (size_t) UINT16_MAX);
+
   MutexLock lock(read_mutex_);
   return !read_queue_.empty(); //! \todo This should return a number, not a bool
 }
 
 uint8_t UDPBoard::serial_read()
 {
+  if (loopback_rx_.is_open())
+  {
+    uint8_t byte = 0;
+    loopback_rx_.read(&byte, 1);
+    return byte;
+  }
+
   MutexLock lock(read_mutex_);
 
   if (read_queue_.empty())
@@ -130,79 +227,299 @@ uint8_t UDPBoard::serial_read()
 
   if (buffer->empty())
   {
-    read_queue_.pop_front();
-    delete buffer;
+    release_buffer(read_queue_, free_read_buffers_);
   }
   return byte;
 }
 
 void UDPBoard::async_read()
 {
-  if (!socket_.is_open()) return;
+  if (!data_socket_open()) return;
 
-  MutexLock lock(read_mutex_);
-  socket_.async_receive_from(boost::asio::buffer(read_buffer_, MAVLINK_MAX_PACKET_LEN),
-                             remote_endpoint_,
-                             boost::bind(&UDPBoard::async_read_end,
-                                         this,
-                                         boost::asio::placeholders::error,
-                                         boost::asio::placeholders::bytes_transferred));
+  // only once the socket has been drained: asio's epoll registration is edge-triggered
+  wait_data_socket(udp::socket::wait_read, IoHandler(this, &UDPBoard::async_read_end, read_handler_memory_));
 }
 
 void UDPBoard::async_read_end(const boost::system::error_code &error, size_t bytes_transferred)
 {
-  if (!error)
+  (void) bytes_transferred;
+
+  if (error == boost::asio::error::operation_aborted)
+    return;
+
+  // e.g. a signal interrupting the wait; the socket is still good, so keep reading from it
+  if (error)
   {
-    MutexLock lock(read_mutex_);
-    read_queue_.push_back(new Buffer(read_buffer_, bytes_transferred));
+    std::cerr << "Failed to wait for data: " << error.message() << std::endl;
+    async_read();
+    return;
   }
+
+  if (!receive_batch())
+  {
+    if (!unix_path_.empty())
+      disconnect();
+    return;
+  }
+
   async_read();
 }
 
-void UDPBoard::async_write(bool check_write_state)
+void UDPBoard::async_accept()
 {
-  if (check_write_state && write_in_progress_)
+  unix_acceptor_.async_wait(boost::asio::socket_base::wait_read,
+                            IoHandler(this, &UDPBoard::async_accept_end, accept_handler_memory_));
+}
+
+void UDPBoard::async_accept_end(const boost::system::error_code &error, size_t bytes_transferred)
+{
+  (void) bytes_transferred;
+
+  if (error == boost::asio::error::operation_aborted)
     return;
 
-  MutexLock lock(write_mutex_);
-  if (write_queue_.empty())
+  boost::system::error_code accept_error = error;
+  if (!accept_error)
+  {
+    MutexLock lock(write_mutex_);
+    unix_acceptor_.accept(unix_socket_, accept_error);
+    if (!accept_error)
+    {
+      if (send_buffer_size_ > 0)
+        unix_socket_.set_option(boost::asio::socket_base::send_buffer_size(send_buffer_size_));
+      if (receive_buffer_size_ > 0)
+        unix_socket_.set_option(boost::asio::socket_base::receive_buffer_size(receive_buffer_size_));
+      unix_socket_.non_blocking(true);
+    }
+  }
+
+  if (accept_error)
+  {
+    // a connection that went away again before it was taken leaves nothing to accept; wait for the next one
+    if (accept_error != boost::asio::error::would_block)
+      std::cerr << "Failed to accept a connection on " << unix_path_ << ": " << accept_error.message() << std::endl;
+    async_accept();
     return;
+  }
 
-  write_in_progress_ = true;
-  Buffer *buffer = write_queue_.front();
-  socket_.async_send_to(boost::asio::buffer(buffer->dpos(), buffer->nbytes()),
-                        remote_endpoint_,
-                        boost::bind(&UDPBoard::async_write_end,
-                                    this,
-                                    boost::asio::placeholders::error,
-                                    boost::asio::placeholders::bytes_transferred));
+  async_read_end(boost::system::error_code(), 0);
 }
 
-void UDPBoard::async_write_end(const boost::system::error_code &error, size_t bytes_transferred)
+void UDPBoard::disconnect()
 {
-  if (!error)
   {
     MutexLock lock(write_mutex_);
+    boost::system::error_code error;
+    unix_socket_.close(error);
 
-    if (write_queue_.empty())
+    // nobody is listening any more; the next connection starts from fresh frames
+    while (!write_queue_.empty())
     {
-      write_in_progress_ = false;
-      return;
+      release_buffer(write_queue_, free_write_buffers_);
     }
+  }
+
+  async_accept();
+}
 
-    Buffer *buffer = write_queue_.front();
-    buffer->pos += bytes_transferred;
-    if (buffer->empty())
+int UDPBoard::data_socket_fd()
+{
+  return unix_path_.empty() ? socket_.native_handle() : unix_socket_.native_handle();
+}
+
+bool UDPBoard::data_socket_open()
+{
+  return unix_path_.empty() ? socket_.is_open() : unix_socket_.is_open();
+}
+
+void UDPBoard::wait_data_socket(boost::asio::socket_base::wait_type type, const IoHandler &handler)
+{
+  if (unix_path_.empty())
+    socket_.async_wait(type, handler);
+  else
+    unix_socket_.async_wait(type, handler);
+}
+
+bool UDPBoard::receive_batch()
+{
+  const size_t slot = UDP_BOARD_READ_BUF_SIZE / UDP_BOARD_BATCH;
+  struct sockaddr_in sender;
+
+  for (;;)
+  {
+    for (size_t i = 0; i < UDP_BOARD_BATCH; i++)
+    {
+      read_iov_[i].iov_base = read_buffer_ + i * slot;
+      read_iov_[i].iov_len = slot;
+      memset(&read_msgs_[i].msg_hdr, 0, sizeof(read_msgs_[i].msg_hdr));
+      read_msgs_[i].msg_hdr.msg_iov = &read_iov_[i];
+      read_msgs_[i].msg_hdr.msg_iovlen = 1;
+      if (unix_path_.empty())
+      {
+        read_msgs_[i].msg_hdr.msg_name = &sender;
+        read_msgs_[i].msg_hdr.msg_namelen = sizeof(sender);
+      }
+    }
+    sender.sin_family = AF_UNSPEC;
+
+    int received = recvmmsg(data_socket_fd(), read_msgs_, UDP_BOARD_BATCH, MSG_DONTWAIT, NULL);
+    if (received < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+
+      // on UDP this is usually the ICMP error of an earlier send, e.g. the host isn't listening yet; that datagram is
+      // lost, but the socket can still receive. On the unix domain socket it means the connection is gone.
+      std::cerr << "Failed to receive: " << strerror(errno) << std::endl;
+      return unix_path_.empty();
+    }
+
+    // frames are never empty, so an empty packet on the unix domain socket means the other end has gone
+    bool closed = false;
+    for (int i = 0; i < received && !unix_path_.empty(); i++)
     {
-      write_queue_.pop_front();
-      delete buffer;
+      if (read_msgs_[i].msg_len == 0)
+      {
+        received = i;
+        closed = true;
+        break;
+      }
     }
 
-    if (write_queue_.empty())
-      write_in_progress_ = false;
-    else
-      async_write(false);
+    {
+      MutexLock lock(read_mutex_);
+      for (int i = 0; i < received; i++)
+      {
+        // a datagram may hold several frames; the read buffers only have to carry the bytes in order
+        const uint8_t *data = read_buffer_ + i * slot;
+        size_t len = read_msgs_[i].msg_len;
+        for (size_t pos = 0; pos < len; pos += MAVLINK_MAX_PACKET_LEN)
+        {
+          enqueue_buffer(read_queue_, free_read_buffers_, data + pos, std::min(len - pos, (size_t) MAVLINK_MAX_PACKET_LEN));
+        }
+      }
+    }
+
+    // replies go to whoever sent last
+    if (received > 0 && sender.sin_family == AF_INET)
+    {
+      MutexLock lock(write_mutex_);
+      remote_endpoint_ = udp::endpoint(boost::asio::ip::address_v4(ntohl(sender.sin_addr.s_addr)),
+                                       ntohs(sender.sin_port));
+    }
+
+    if (closed)
+      return false;
+
+    // a short batch means the socket is empty
+    if (received < UDP_BOARD_BATCH)
+      return true;
+  }
+}
+
+void UDPBoard::send_queued()
+{
+  if (write_waiting_)
+    return;
+
+  bool connected = data_socket_open();
+  while (!write_queue_.empty())
+  {
+    if (!connected)
+    {
+      release_buffer(write_queue_, free_write_buffers_);
+      continue;
+    }
+
+    size_t count = 0;
+    for (std::list<Buffer*>::iterator it = write_queue_.begin();
+         it != write_queue_.end() && count < UDP_BOARD_BATCH; ++it, ++count)
+    {
+      write_iov_[count].iov_base = (void*) (*it)->dpos();
+      write_iov_[count].iov_len = (*it)->nbytes();
+      memset(&write_msgs_[count].msg_hdr, 0, sizeof(write_msgs_[count].msg_hdr));
+      write_msgs_[count].msg_hdr.msg_iov = &write_iov_[count];
+      write_msgs_[count].msg_hdr.msg_iovlen = 1;
+      if (unix_path_.empty())
+      {
+        write_msgs_[count].msg_hdr.msg_name = remote_endpoint_.data();
+        write_msgs_[count].msg_hdr.msg_namelen = remote_endpoint_.size();
+      }
+    }
+
+    // a connection closed by the other end must not raise SIGPIPE
+    int sent = sendmmsg(data_socket_fd(), write_msgs_, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        write_waiting_ = true;
+        wait_data_socket(udp::socket::wait_write, IoHandler(this, &UDPBoard::async_write_end, write_handler_memory_));
+        return;
+      }
+
+      // like a UART with nobody listening, the frame is lost
+      sent = 1;
+    }
+
+    for (int i = 0; i < sent; i++)
+    {
+      release_buffer(write_queue_, free_write_buffers_);
+    }
+  }
+}
+
+void UDPBoard::write_scheduled_end(const boost::system::error_code &error, size_t bytes_transferred)
+{
+  (void) bytes_transferred;
+
+  MutexLock lock(write_mutex_);
+  write_scheduled_ = false;
+  if (!error)
+    send_queued();
+}
+
+void UDPBoard::async_write_end(const boost::system::error_code &error, size_t bytes_transferred)
+{
+  (void) bytes_transferred;
+
+  MutexLock lock(write_mutex_);
+  write_waiting_ = false;
+  if (!error)
+    send_queued();
+}
+
+void UDPBoard::enqueue_buffer(std::list<Buffer*> &queue, std::list<Buffer*> &free_buffers, const uint8_t *src, size_t len)
+{
+  if (free_buffers.empty())
+  {
+    queue.push_back(new Buffer(src, len));
+  }
+  else
+  {
+    // splicing moves the list node as well, so neither the buffer nor the node is allocated
+    queue.splice(queue.end(), free_buffers, free_buffers.begin());
+    queue.back()->assign(src, len);
+  }
+}
+
+void UDPBoard::release_buffer(std::list<Buffer*> &queue, std::list<Buffer*> &free_buffers)
+{
+  free_buffers.splice(free_buffers.begin(), queue, queue.begin());
+}
+
+void UDPBoard::delete_buffers(std::list<Buffer*> &buffers)
+{
+  for (std::list<Buffer*>::iterator it = buffers.begin(); it != buffers.end(); ++it)
+  {
+    delete *it;
   }
+  buffers.clear();
 }
 
 } // namespace rosflight_firmware
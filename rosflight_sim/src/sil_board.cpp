@@ -62,7 +62,23 @@ void SIL_Board::gazebo_setup(gazebo::physics::LinkPtr link, gazebo::physics::Wor
   int remote_port = nh->param<int>("ROS_port", 14520);
 
   set_ports(bind_host, bind_port, remote_host, remote_port);
-  gzmsg << "ROSflight SIL Conneced to " << remote_host << ":" << remote_port << " from " << bind_host << ":" << bind_port << "\n";
+  set_socket_buffer_sizes(nh->param<int>("udp_send_buffer_size", 1000*MAVLINK_MAX_PACKET_LEN),
+                          nh->param<int>("udp_receive_buffer_size", 1000*MAVLINK_MAX_PACKET_LEN));
+
+  // a shared memory link to a rosflight_io started with the same loopback name, instead of UDP
+  std::string loopback = nh->param<std::string>("loopback", "");
+  set_loopback(loopback);
+
+  // a unix domain socket that a rosflight_io started with the same unix_socket path connects to, instead of UDP
+  std::string unix_socket = nh->param<std::string>("unix_socket", "");
+  set_unix_socket(unix_socket);
+
+  if (!loopback.empty())
+    gzmsg << "ROSflight SIL Connected through loopback " << loopback << "\n";
+  else if (!unix_socket.empty())
+    gzmsg << "ROSflight SIL Listening on unix socket " << unix_socket << "\n";
+  else
+    gzmsg << "ROSflight SIL Conneced to " << remote_host << ":" << remote_port << " from " << bind_host << ":" << bind_port << "\n";
 
   // Get Sensor Parameters
   gyro_stdev_ = nh->param<double>("gyro_stdev", 0.13);